@@ -0,0 +1,358 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include "async_http.h"
+#include "util.h"
+
+// epoll 事件的 data.u64：高 32 位是类型，低 32 位是描述符或调用方监视的下标
+#define WATCH_CURL 1ULL
+#define WATCH_TIMER 2ULL
+#define WATCH_USER 3ULL
+#define WATCH_DATA(kind, value) ((kind) << 32 | (uint32_t)(value))
+
+// curl 告诉我们每个套接字要关心哪些事件
+static int socket_cb(CURL *easy, curl_socket_t s, int what, void *userp, void *socketp)
+{
+    async_http *loop = userp;
+    struct epoll_event ev;
+    (void)easy;
+    (void)socketp;
+
+    if (what == CURL_POLL_REMOVE)
+    {
+        epoll_ctl(loop->epfd, EPOLL_CTL_DEL, s, NULL); // 套接字可能已经关闭，忽略错误
+        return 0;
+    }
+    memset(&ev, 0, sizeof(ev));
+    ev.events = ((what & CURL_POLL_IN) ? EPOLLIN : 0) | ((what & CURL_POLL_OUT) ? EPOLLOUT : 0);
+    ev.data.u64 = WATCH_DATA(WATCH_CURL, s);
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_MOD, s, &ev) != 0 && errno == ENOENT)
+    {
+        epoll_ctl(loop->epfd, EPOLL_CTL_ADD, s, &ev);
+    }
+    return 0;
+}
+
+// curl 要求的下一次超时；-1 表示取消定时器，0 表示尽快
+static int timer_cb(CURLM *multi, long timeout_ms, void *userp)
+{
+    async_http *loop = userp;
+    struct itimerspec its;
+    (void)multi;
+
+    memset(&its, 0, sizeof(its));
+    if (timeout_ms > 0)
+    {
+        its.it_value.tv_sec = timeout_ms / 1000;
+        its.it_value.tv_nsec = (timeout_ms % 1000) * 1000000;
+    }
+    else if (timeout_ms == 0)
+    {
+        its.it_value.tv_nsec = 1;
+    }
+    timerfd_settime(loop->timerfd, 0, &its, NULL);
+    return 0;
+}
+
+int async_http_init(async_http *loop, http_client *client)
+{
+    struct epoll_event ev;
+
+    memset(loop, 0, sizeof(*loop));
+    loop->client = client;
+    loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+    loop->timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    loop->multi = curl_multi_init();
+    if (loop->epfd < 0 || loop->timerfd < 0 || loop->multi == NULL)
+    {
+        fprintf(stderr, "Failed to create event loop\n");
+        async_http_cleanup(loop);
+        return -1;
+    }
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.u64 = WATCH_DATA(WATCH_TIMER, loop->timerfd);
+    epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->timerfd, &ev);
+
+    curl_multi_setopt(loop->multi, CURLMOPT_SOCKETFUNCTION, socket_cb);
+    curl_multi_setopt(loop->multi, CURLMOPT_SOCKETDATA, loop);
+    curl_multi_setopt(loop->multi, CURLMOPT_TIMERFUNCTION, timer_cb);
+    curl_multi_setopt(loop->multi, CURLMOPT_TIMERDATA, loop);
+    return 0;
+}
+
+static void unlink_request(async_http *loop, async_request *req)
+{
+    for (async_request **p = &loop->active; *p != NULL; p = &(*p)->next)
+    {
+        if (*p == req)
+        {
+            *p = req->next;
+            loop->active_count--;
+            return;
+        }
+    }
+}
+
+static void free_request(async_request *req)
+{
+    curl_easy_cleanup(req->easy);
+    response_free(&req->resp);
+    http_body_free(&req->body);
+    free(req->payload);
+    free(req);
+}
+
+// 压缩的请求体被拒绝（415）时的响应体直接丢掉：不占 resp 的上限，
+// 超过上限时 curl 会中止传输并关掉连接，重发就得新建连接
+static size_t guarded_write(char *data, size_t size, size_t nmemb, void *userdata)
+{
+    async_request *req = userdata;
+    long http_code = 0;
+    curl_easy_getinfo(req->easy, CURLINFO_RESPONSE_CODE, &http_code);
+    if (http_code == 415)
+        return size * nmemb;
+    return response_write(data, size, nmemb, &req->resp);
+}
+
+// 服务端不接受压缩的请求体（415）：记下这个服务端，以后发给它的都是明文；
+// 这个请求换成明文请求体原样重发（连接已经还回连接池，重发时复用），调用方看不到这次失败
+static int retry_uncompressed(async_http *loop, async_request *req, CURLcode result)
+{
+    long http_code = 0;
+    char *url = NULL;
+    if (req->cancelled || result != CURLE_OK || !req->body.gzip)
+        return 0;
+    curl_easy_getinfo(req->easy, CURLINFO_RESPONSE_CODE, &http_code);
+    curl_easy_getinfo(req->easy, CURLINFO_EFFECTIVE_URL, &url);
+    if (http_code != 415 || url == NULL)
+        return 0;
+    http_client_reject_gzip(loop->client, url);
+    response_reset(&req->resp);
+    http_client_set_body(loop->client, req->easy, url, req->payload, &req->body, 1);
+    curl_easy_setopt(req->easy, CURLOPT_WRITEFUNCTION, response_write);
+    curl_easy_setopt(req->easy, CURLOPT_WRITEDATA, &req->resp);
+    return curl_multi_add_handle(loop->multi, req->easy) == CURLM_OK;
+}
+
+// 请求结束：先从在途列表摘下，再回调，回调里可以放心地取消别的请求或发起新请求
+static void finish_request(async_http *loop, async_request *req, CURLcode result)
+{
+    curl_multi_remove_handle(loop->multi, req->easy);
+    if (retry_uncompressed(loop, req, result))
+        return;
+    unlink_request(loop, req);
+    http_timing_collect(req->easy, &req->timing);
+    req->http_code = req->timing.http_code;
+
+    if (req->cancelled)
+        loop->cancelled++;
+    else if (result == CURLE_OPERATION_TIMEDOUT)
+        loop->timed_out++;
+    else if (result != CURLE_OK)
+        loop->failed++;
+    else
+        loop->completed++;
+
+    if (req->done != NULL)
+    {
+        req->done(req, result, req->userdata);
+    }
+    free_request(req);
+}
+
+void async_http_cleanup(async_http *loop)
+{
+    while (loop->active != NULL)
+    {
+        async_cancel(loop, loop->active);
+    }
+    if (loop->multi != NULL)
+    {
+        curl_multi_cleanup(loop->multi);
+    }
+    if (loop->timerfd >= 0)
+    {
+        close(loop->timerfd);
+    }
+    if (loop->epfd >= 0)
+    {
+        close(loop->epfd);
+    }
+    memset(loop, 0, sizeof(*loop));
+    loop->epfd = -1;
+    loop->timerfd = -1;
+}
+
+int async_watch_fd(async_http *loop, int fd, int tag)
+{
+    struct epoll_event ev;
+    if (loop->user_watch_count == ASYNC_MAX_WATCHES)
+    {
+        return -1;
+    }
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.u64 = WATCH_DATA(WATCH_USER, loop->user_watch_count);
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &ev) != 0)
+    {
+        perror("epoll_ctl");
+        return -1;
+    }
+    loop->user_tags[loop->user_watch_count++] = tag;
+    return 0;
+}
+
+void async_unwatch_fd(async_http *loop, int fd)
+{
+    epoll_ctl(loop->epfd, EPOLL_CTL_DEL, fd, NULL);
+}
+
+// payload 为 NULL 时发 GET
+static async_request *start_request(async_http *loop, const char *url, const char *payload, long timeout_ms,
+                                    async_done_fn done, void *userdata)
+{
+    async_request *req = calloc(1, sizeof(async_request));
+    if (req == NULL)
+    {
+        fprintf(stderr, "Memory allocation failed\n");
+        return NULL;
+    }
+    req->easy = http_client_new_handle(loop->client);
+    req->payload = payload != NULL ? strdup(payload) : NULL;
+    if (req->easy == NULL || (payload != NULL && req->payload == NULL))
+    {
+        if (req->easy != NULL)
+            curl_easy_cleanup(req->easy);
+        free(req->payload);
+        free(req);
+        return NULL;
+    }
+    response_init(&req->resp);
+    req->resp.limit = loop->response_limit;
+    req->done = done;
+    req->userdata = userdata;
+    req->id = ++loop->next_id;
+    req->started_ms = now_ms();
+
+    curl_easy_setopt(req->easy, CURLOPT_URL, url);
+    if (payload != NULL)
+    {
+        http_client_set_body(loop->client, req->easy, url, req->payload, &req->body, 0);
+    }
+    curl_easy_setopt(req->easy, CURLOPT_WRITEFUNCTION, req->body.gzip ? guarded_write : response_write);
+    curl_easy_setopt(req->easy, CURLOPT_WRITEDATA, req->body.gzip ? (void *)req : (void *)&req->resp);
+    curl_easy_setopt(req->easy, CURLOPT_PRIVATE, req);
+    curl_easy_setopt(req->easy, CURLOPT_TIMEOUT_MS, timeout_ms);
+
+    if (curl_multi_add_handle(loop->multi, req->easy) != CURLM_OK)
+    {
+        fprintf(stderr, "curl_multi_add_handle() failed\n");
+        free_request(req);
+        return NULL;
+    }
+
+    // 追加到末尾，保持按编号排序
+    async_request **tail = &loop->active;
+    while (*tail != NULL)
+        tail = &(*tail)->next;
+    *tail = req;
+    loop->active_count++;
+    return req;
+}
+
+async_request *async_post_json(async_http *loop, const char *path, const char *payload, long timeout_ms,
+                               async_done_fn done, void *userdata)
+{
+    char url[512];
+    return start_request(loop, http_client_url(loop->client, path, url, sizeof(url)), payload, timeout_ms, done,
+                         userdata);
+}
+
+async_request *async_get(async_http *loop, const char *url, long timeout_ms, async_done_fn done, void *userdata)
+{
+    return start_request(loop, url, NULL, timeout_ms, done, userdata);
+}
+
+void async_set_writer(async_request *req, curl_write_callback write_cb, void *write_userdata)
+{
+    curl_easy_setopt(req->easy, CURLOPT_WRITEFUNCTION, write_cb);
+    curl_easy_setopt(req->easy, CURLOPT_WRITEDATA, write_userdata);
+}
+
+void async_cancel(async_http *loop, async_request *req)
+{
+    for (async_request *p = loop->active; p != NULL; p = p->next)
+    {
+        if (p == req)
+        {
+            req->cancelled = 1;
+            finish_request(loop, req, CURLE_ABORTED_BY_CALLBACK);
+            return;
+        }
+    }
+}
+
+static void check_finished(async_http *loop)
+{
+    CURLMsg *msg;
+    int left;
+    // 每次只取一条：回调里取消的请求，其待处理的消息会被 curl 一起移除
+    while ((msg = curl_multi_info_read(loop->multi, &left)) != NULL)
+    {
+        if (msg->msg == CURLMSG_DONE)
+        {
+            async_request *req;
+            CURLcode result = msg->data.result;
+            curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char **)&req);
+            finish_request(loop, req, result);
+        }
+    }
+}
+
+int async_poll(async_http *loop, int timeout_ms, int *tags, int max_tags)
+{
+    struct epoll_event events[16];
+    int running;
+    int count = 0;
+
+    int n = epoll_wait(loop->epfd, events, 16, timeout_ms);
+    if (n < 0)
+    {
+        if (errno != EINTR)
+            perror("epoll_wait");
+        return 0;
+    }
+    for (int i = 0; i < n; i++)
+    {
+        uint64_t kind = events[i].data.u64 >> 32;
+        int value = (int)(uint32_t)events[i].data.u64;
+        if (kind == WATCH_CURL)
+        {
+            int flags = ((events[i].events & EPOLLIN) ? CURL_CSELECT_IN : 0) |
+                        ((events[i].events & EPOLLOUT) ? CURL_CSELECT_OUT : 0) |
+                        ((events[i].events & (EPOLLERR | EPOLLHUP)) ? CURL_CSELECT_ERR : 0);
+            curl_multi_socket_action(loop->multi, value, flags, &running);
+        }
+        else if (kind == WATCH_TIMER)
+        {
+            uint64_t expirations;
+            if (read(loop->timerfd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+                perror("read timerfd");
+            curl_multi_socket_action(loop->multi, CURL_SOCKET_TIMEOUT, 0, &running);
+        }
+        else if (kind == WATCH_USER && count < max_tags)
+        {
+            tags[count++] = loop->user_tags[value];
+        }
+    }
+    check_finished(loop);
+    return count;
+}
@@ -0,0 +1,79 @@
+#ifndef ASYNC_HTTP_H
+#define ASYNC_HTTP_H
+#include <stddef.h>
+#include <curl/curl.h>
+#include "http_client.h"
+#include "response.h"
+
+// 基于 curl_multi + epoll 的事件循环
+// 多个请求可以同时在途，每个请求有自己的截止时间，也可以随时取消。
+// 调用方还可以把自己的文件描述符（标准输入、线程池的完成通知等）加进同一个 epoll，
+// async_poll 一次等待所有事件：网络事件在内部处理，完成的请求通过回调交给调用方，
+// 调用方自己的描述符就绪时把对应的 tag 返回。
+
+typedef struct async_request async_request;
+// 请求结束（完成、失败、超时或取消）时调用一次；回调返回后请求被释放
+typedef void (*async_done_fn)(async_request *req, CURLcode result, void *userdata);
+
+struct async_request
+{
+    CURL *easy;
+    int id;                 // 递增的请求编号，越大越新
+    response_buffer resp;
+    char *payload;          // 请求体副本，传输期间必须有效
+    http_body body;         // 压缩后的请求体
+    double started_ms;
+    long http_code;
+    int cancelled;
+    http_timing timing;
+    async_done_fn done;
+    void *userdata;
+    struct async_request *next;
+};
+
+#define ASYNC_MAX_WATCHES 8 // 调用方最多监视的描述符数
+
+typedef struct async_http
+{
+    http_client *client;
+    CURLM *multi;
+    int epfd;
+    int timerfd;            // curl 要求的超时，用 timerfd 接进 epoll
+    int user_tags[ASYNC_MAX_WATCHES];
+    int user_watch_count;
+    async_request *active;  // 在途请求，按编号从小到大
+    int active_count;
+    int next_id;
+    size_t response_limit;  // 每个回复的字节上限，0 表示不限
+
+    // 统计
+    unsigned long completed;
+    unsigned long failed;
+    unsigned long timed_out;
+    unsigned long cancelled;
+} async_http;
+
+// 失败返回 -1
+int async_http_init(async_http *loop, http_client *client);
+// 取消所有在途请求并释放资源
+void async_http_cleanup(async_http *loop);
+
+// 监视调用方的描述符（只关心可读），就绪时 async_poll 返回 tag
+int async_watch_fd(async_http *loop, int fd, int tag);
+void async_unwatch_fd(async_http *loop, int fd);
+
+// 发起 POST 请求，payload 会被复制；timeout_ms 为这次请求的截止时间，0 表示不限
+async_request *async_post_json(async_http *loop, const char *path, const char *payload, long timeout_ms,
+                               async_done_fn done, void *userdata);
+// 发起 GET 请求（不带鉴权头），用于下载图片等资源
+async_request *async_get(async_http *loop, const char *url, long timeout_ms, async_done_fn done, void *userdata);
+// 响应不放进 req->resp，改交给 write_cb（例如直接写文件）；要在发起后、下一次 async_poll 之前设置
+void async_set_writer(async_request *req, curl_write_callback write_cb, void *write_userdata);
+// 取消请求，回调收到 CURLE_ABORTED_BY_CALLBACK 且 req->cancelled 为 1
+void async_cancel(async_http *loop, async_request *req);
+
+// 等待事件，最多 timeout_ms（-1 表示一直等）。处理完网络事件后，
+// 把就绪的调用方描述符的 tag 写入 tags，返回个数
+int async_poll(async_http *loop, int timeout_ms, int *tags, int max_tags);
+
+#endif
@@ -0,0 +1,1790 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <malloc.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <elf.h>
+#include <curl/curl.h>
+#include <cJSON.h>
+#include "mock_server.h"
+#include "http_client.h"
+#include "async_http.h"
+#include "race.h"
+#include "chat_stream.h"
+#include "history.h"
+#include "payload.h"
+#include "response.h"
+#include "dispatch.h"
+#include "gateway.h"
+#include "catalog.h"
+#include "image_batch.h"
+#include "scratch.h"
+#include "session.h"
+#include "turn.h"
+#include "util.h"
+// gcc -O2 -o bench bench.c mock_server.c http_client.c async_http.c image_batch.c md5.c race.c chat_stream.c history.c payload.c response.c dispatch.c gateway.c catalog.c cache.c config.c scratch.c session.c turn.c workers.c shadow.c metrics.c log.c $(curl-config --cflags) $(curl-config --libs) -lcjson -lpthread -lm -lz -I/usr/include/cjson/
+// ./bench    在本地起一个模拟接口服务，依次跑所有场景，不需要网络和密钥
+// ./bench --only turns --turns 5000    只跑一个场景：payload growth startup parse turns tools stream async race images
+//     download gateway catalog transport memory
+// ./bench --only gateway --sessions 1000 --latency 50    1000 个设备会话同时通过网关对话，
+//     --gateway-inflight 64 为网关到上游的在途请求上限
+// ./bench --only memory    另外报告当前目录下 chat 和 chat_emb（嵌入式配置，-o chat_emb）的 text / data / bss 大小
+// ./bench --latency 20 --jitter 5 --chunk 64 --chunk-delay 200    模拟慢速、分片到达的服务
+// ./bench --errors 0.05    5% 的请求返回 503
+// ./bench --concurrency 16    async 场景同时在途的请求数
+// ./bench --max-allocs 40    turns 场景每轮分配次数超过 40 时返回非 0，用来卡住性能回退
+// ./bench --tool-rounds 3    tools 场景每轮用户输入先调用几次工具（默认 2）；--serve 时给 chat --tools 用
+// ./bench --serve 8080 --cut-bytes 65536    图片下载只发 64 KiB 就断开，给 image 手动测试续传
+// ./bench --serve 8080    只启动模拟服务，给 chat、image 手动测试：OPENAI_BASE_URL=http://127.0.0.1:8080/v1 ./chat
+// 需要在有 dev_ctrl.json 和 Prompt.txt 的目录下运行
+
+#define BENCH_HISTORY_TURNS 10 // 和对话一样限制历史轮数，请求体大小保持稳定
+#define BENCH_MODEL "gpt-4-turbo-preview"
+
+// 统计本线程的内存分配次数和占用：替换 malloc 系列，转给 glibc 的实现。
+// 计数是线程局部的，模拟服务线程里的分配不算在内。ASan 自己接管了 malloc，这时不统计
+static __thread unsigned long thread_allocs;
+static __thread long thread_heap;      // 本线程分配减去释放的字节数（按 malloc_usable_size）
+static __thread long thread_heap_peak;
+
+#ifndef __SANITIZE_ADDRESS__
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+static void *count_alloc(void *ptr)
+{
+    thread_allocs++;
+    if (ptr != NULL)
+    {
+        thread_heap += malloc_usable_size(ptr);
+        if (thread_heap > thread_heap_peak)
+            thread_heap_peak = thread_heap;
+    }
+    return ptr;
+}
+
+void *malloc(size_t size)
+{
+    return count_alloc(__libc_malloc(size));
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+    return count_alloc(__libc_calloc(nmemb, size));
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    size_t old = ptr != NULL ? malloc_usable_size(ptr) : 0;
+    void *result = __libc_realloc(ptr, size);
+    if (result != NULL || size == 0)
+        thread_heap -= old;
+    return count_alloc(result);
+}
+
+void free(void *ptr)
+{
+    if (ptr != NULL)
+        thread_heap -= malloc_usable_size(ptr);
+    __libc_free(ptr);
+}
+#endif
+
+// 一个场景的耗时样本，单位毫秒
+typedef struct bench_samples
+{
+    double *values;
+    size_t count;
+    size_t cap;
+    unsigned long allocs;
+    unsigned long errors;
+    double started;
+} bench_samples;
+
+static void samples_begin(bench_samples *s, size_t expected)
+{
+    memset(s, 0, sizeof(*s));
+    s->cap = expected > 0 ? expected : 1;
+    s->values = malloc(s->cap * sizeof(double));
+    s->started = now_ms();
+}
+
+static void samples_add(bench_samples *s, double ms)
+{
+    if (s->count == s->cap)
+    {
+        double *values = realloc(s->values, s->cap * 2 * sizeof(double));
+        if (values == NULL)
+            return;
+        s->values = values;
+        s->cap *= 2;
+    }
+    s->values[s->count++] = ms;
+}
+
+static int compare_double(const void *a, const void *b)
+{
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static double percentile(const bench_samples *s, double q)
+{
+    if (s->count == 0)
+        return 0;
+    size_t i = (size_t)(q * (s->count - 1) + 0.5);
+    return s->values[i];
+}
+
+// 输出一行结果，返回每次操作的平均分配次数
+static double samples_report(bench_samples *s, const char *name)
+{
+    double elapsed = now_ms() - s->started;
+    double per_op = s->count > 0 ? (double)s->allocs / s->count : 0;
+
+    qsort(s->values, s->count, sizeof(double), compare_double);
+    printf("[bench] %-11s %7zu ops %10.0f ops/s  p50 %8.3f  p90 %8.3f  p99 %8.3f  max %8.3f ms",
+           name, s->count, elapsed > 0 ? s->count * 1000.0 / elapsed : 0, percentile(s, 0.5),
+           percentile(s, 0.9), percentile(s, 0.99), s->count > 0 ? s->values[s->count - 1] : 0);
+#ifndef __SANITIZE_ADDRESS__
+    printf("  %7.1f allocs/op", per_op);
+#endif
+    if (s->errors > 0)
+        printf("  %lu errors", s->errors);
+    printf("\n");
+    free(s->values);
+    s->values = NULL;
+    return per_op;
+}
+
+// 回复分发：处理函数只计数，不输出，量的是分发路径本身
+static struct
+{
+    unsigned long dialogs;
+    atomic_ulong commands;  // 走 turn.c 的指令在线程池里执行
+    unsigned long rejected; // 未知或参数不对的回复
+    unsigned long broken;   // 没通过的功能检查
+} outcome;
+
+// parse、async 等场景只量解析和分发，指令在当前线程直接执行
+static void count_control_command(const cJSON *json, void *userdata)
+{
+    if (dispatch_command(userdata, json) != DISPATCH_OK)
+        outcome.rejected++;
+}
+
+static void process_dialog(const cJSON *json, void *userdata)
+{
+    if (cJSON_IsString(cJSON_GetObjectItemCaseSensitive(json, "message")))
+        outcome.dialogs++;
+    else
+        outcome.rejected++;
+}
+
+static void count_command(const cJSON *json, void *userdata)
+{
+    outcome.commands++;
+}
+
+static int register_handlers(dispatcher *d)
+{
+    if (dispatcher_init(d, "./dev_ctrl.json") != 0)
+    {
+        fprintf(stderr, "No operations loaded from ./dev_ctrl.json\n");
+        return -1;
+    }
+    dispatcher_register_type(d, "控制指令", count_control_command, d);
+    dispatcher_register_type(d, "对话", process_dialog, d);
+    dispatcher_set_fallback(d, count_command, NULL);
+    return 0;
+}
+
+// turns、stream、gateway 场景走和 chat 相同的一轮处理（turn.c）：回复按 type 分发，
+// 控制指令经过状态影子（只去重，不开合并窗口）作为批次交给线程池
+static dispatcher chat_commands;
+static worker_pool workers;
+static device_shadow shadow;
+static metrics turn_metrics;
+static scratch_arena turn_scratch;
+static turn_engine engine;
+
+static int setup_engine(void)
+{
+    if (dispatcher_init(&chat_commands, "./dev_ctrl.json") != 0)
+        return -1;
+    turn_init(&engine, &chat_commands, &workers, &shadow, &turn_metrics, &turn_scratch);
+    dispatcher_register_type(&chat_commands, "控制指令", process_control_command, &engine);
+    dispatcher_register_type(&chat_commands, "对话", process_dialog, NULL);
+    dispatcher_set_fallback(&chat_commands, count_command, NULL);
+    metrics_init(&turn_metrics);
+    if (scratch_init(&turn_scratch, NULL, 64 * 1024, 0) != 0 || worker_pool_init(&workers, 4, 1) != 0)
+        return -1;
+    if (shadow_init(&shadow, chat_commands.controls, 0, execute_held_command, &engine) != 0)
+        return -1;
+    build_request_fields(&engine, 0, 0);
+    return 0;
+}
+
+static void teardown_engine(void)
+{
+    turn_free(&engine);
+    shadow_free(&shadow);
+    worker_pool_shutdown(&workers);
+    dispatcher_free(&chat_commands);
+    scratch_free(&turn_scratch);
+}
+
+// 一轮回复处理完，取出最新的助手消息；回复没有记入历史（解析失败等）返回 NULL。
+// 执行完的指令批次顺便回收
+static const Message *turn_reply(History *history, const Message *before)
+{
+    collect_command_results(&engine, NULL, 0, NULL);
+    if (history->tail == before || history->tail->role != ROLE_ASSISTANT)
+        return NULL;
+    return history->tail;
+}
+
+// 和 chat 处理非流式回复的路径相同：原地取出内容、去掉 ```json 包裹、解析、分发
+static int handle_body(dispatcher *d, char *body, size_t size)
+{
+    size_t len;
+    long prompt_tokens, completion_tokens;
+
+    response_usage(body, size, &prompt_tokens, &completion_tokens);
+    char *content = response_content(body, size, &len);
+    if (content == NULL)
+        return -1;
+    char *json_text = response_unfence(content, &len);
+    if (json_text == NULL)
+        json_text = content;
+    cJSON *json = cJSON_ParseWithLength(json_text, len);
+    if (json == NULL)
+        return -1;
+    dispatch_result result = dispatch_reply(d, json);
+    cJSON_Delete(json);
+    return result == DISPATCH_OK ? 0 : -1;
+}
+
+static char *read_file(const char *path, size_t *size)
+{
+    FILE *f = fopen(path, "rb");
+    if (f == NULL)
+    {
+        fprintf(stderr, "Error opening file %s\n", path);
+        return NULL;
+    }
+    fseek(f, 0, SEEK_END);
+    long len = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    char *data = malloc((size_t)len + 1);
+    if (data != NULL)
+    {
+        *size = fread(data, 1, (size_t)len, f);
+        data[*size] = '\0';
+    }
+    fclose(f);
+    return data;
+}
+
+// 知识库和提示词作为固定消息，和 chat 启动时一样
+static void setup_history(History *history, const char *knowledge, size_t knowledge_size, const char *prompt,
+                          size_t prompt_size)
+{
+    history_init(history, BENCH_HISTORY_TURNS, 0);
+    add_pinned_text(history, ROLE_USER, knowledge, knowledge_size);
+    add_pinned_text(history, ROLE_USER, prompt, prompt_size);
+}
+
+static const char *user_inputs[] = {"打开灯光", "你是谁？", "启动核聚变反应堆", "现在能源核心状态怎么样"};
+#define USER_INPUT_COUNT (sizeof(user_inputs) / sizeof(user_inputs[0]))
+
+struct bench_context
+{
+    mock_server *server;
+    http_client *client;
+    dispatcher *d;
+    const char *knowledge;
+    size_t knowledge_size;
+    const char *prompt;
+    size_t prompt_size;
+    int turns;
+    int concurrency;
+    int sessions;
+    int gateway_inflight;
+    int tool_rounds;
+};
+
+// 请求体增量构建：每轮追加一问一答，只量 payload_build
+static double bench_payload(struct bench_context *ctx)
+{
+    History history;
+    payload_builder payload;
+    bench_samples s;
+
+    setup_history(&history, ctx->knowledge, ctx->knowledge_size, ctx->prompt, ctx->prompt_size);
+    payload_init(&payload, BENCH_MODEL);
+    samples_begin(&s, (size_t)ctx->turns);
+    for (int i = 0; i < ctx->turns; i++)
+    {
+        add_message(&history, ROLE_USER, user_inputs[i % USER_INPUT_COUNT]);
+        unsigned long allocs = thread_allocs;
+        double start = now_ms();
+        if (payload_build(&payload, &history, NULL) == NULL)
+            s.errors++;
+        samples_add(&s, now_ms() - start);
+        s.allocs += thread_allocs - allocs;
+        add_message(&history, ROLE_ASSISTANT, "{\"type\":\"对话\",\"message\":\"好的\"}");
+    }
+    double per_op = samples_report(&s, "payload");
+    payload_free(&payload);
+    free_messages(&history);
+    return per_op;
+}
+
+// 历史不设上限时请求体随对话增长：每轮追加一问一答，至少跑到几千条消息。
+// 增量构建只转义新消息；对照组每轮用新的构建器把全部消息重新序列化，两者的结果必须一致。
+// 每跑完四分之一报一次当时的请求体大小和单轮耗时。两组交替跑，ops/s 一样，只看延迟
+#define GROWTH_MIN_TURNS 2000
+
+static double bench_growth(struct bench_context *ctx)
+{
+    History history;
+    payload_builder payload;
+    bench_samples incremental, full;
+    int turns = ctx->turns > GROWTH_MIN_TURNS ? ctx->turns : GROWTH_MIN_TURNS;
+
+    history_init(&history, 0, 0);
+    add_pinned_text(&history, ROLE_USER, ctx->knowledge, ctx->knowledge_size);
+    add_pinned_text(&history, ROLE_USER, ctx->prompt, ctx->prompt_size);
+    payload_init(&payload, BENCH_MODEL);
+    samples_begin(&incremental, (size_t)turns);
+    samples_begin(&full, (size_t)turns);
+    for (int i = 0; i < turns; i++)
+    {
+        add_message(&history, ROLE_USER, user_inputs[i % USER_INPUT_COUNT]);
+        unsigned long allocs = thread_allocs;
+        double start = now_ms();
+        const char *built = payload_build(&payload, &history, NULL);
+        double incremental_ms = now_ms() - start;
+        samples_add(&incremental, incremental_ms);
+        incremental.allocs += thread_allocs - allocs;
+
+        payload_builder fresh;
+        payload_init(&fresh, BENCH_MODEL);
+        allocs = thread_allocs;
+        start = now_ms();
+        const char *rebuilt = payload_build(&fresh, &history, NULL);
+        double full_ms = now_ms() - start;
+        samples_add(&full, full_ms);
+        full.allocs += thread_allocs - allocs;
+        if (built == NULL || rebuilt == NULL || strcmp(built, rebuilt) != 0)
+            incremental.errors++;
+        if ((i + 1) % (turns / 4) == 0)
+            printf("[bench] growth: %zu messages, request %zu KB, incremental %.3fms, full rebuild %.3fms\n",
+                   history.count, built != NULL ? strlen(built) / 1024 : 0, incremental_ms, full_ms);
+        payload_free(&fresh);
+        add_message(&history, ROLE_ASSISTANT, "{\"type\":\"对话\",\"message\":\"好的\"}");
+    }
+    double per_op = samples_report(&incremental, "growth incr");
+    samples_report(&full, "growth full");
+    payload_free(&payload);
+    free_messages(&history);
+    return per_op;
+}
+
+// 启动到可以输入：冷启动要发一次初始化请求（只有知识库和提示词）并处理回复；
+// chat --session 恢复时从会话日志读回历史，初始化那一轮的回复也在里面，不发请求。
+// 日志事先写好初始化那一轮和 STARTUP_LOG_TURNS 轮对话
+#define STARTUP_LOG_TURNS 200
+
+static double bench_startup(struct bench_context *ctx)
+{
+    char path[64];
+    session_log log;
+    History history;
+    payload_builder payload;
+    response_buffer resp;
+    bench_samples cold, resume;
+    int runs = ctx->turns < 200 ? ctx->turns : 200;
+    long restored = 0;
+
+    snprintf(path, sizeof(path), "/tmp/bench-session-%d.log", (int)getpid());
+    unlink(path);
+    response_init(&resp);
+    scratch_install(&turn_scratch, 0);
+    samples_begin(&cold, (size_t)runs);
+    for (int i = 0; i <= runs; i++)
+    {
+        unsigned long allocs = thread_allocs;
+        double start = now_ms();
+        http_timing timing;
+
+        setup_history(&history, ctx->knowledge, ctx->knowledge_size, ctx->prompt, ctx->prompt_size);
+        payload_init(&payload, BENCH_MODEL);
+        if (i == runs) // 最后一次不计时，顺便把日志写出来
+        {
+            session_log_open(&log, path, history_fingerprint(&history, BENCH_MODEL), &history);
+            history.on_append = session_log_on_append;
+            history.on_append_userdata = &log;
+        }
+        response_reset(&resp);
+        http_post_json(ctx->client, "chat/completions", create_json_payload(&engine, &payload, &history, 0),
+                       response_write, &resp, &timing);
+        size_t len;
+        char *content = timing.http_code == 200 && resp.data != NULL ? response_content(resp.data, resp.size, &len)
+                                                                      : NULL;
+        const Message *before = history.tail;
+        if (content != NULL)
+            handle_reply(&engine, &history, NULL, 0, content, len);
+        const Message *reply = turn_reply(&history, before);
+        if (i < runs)
+        {
+            if (reply == NULL)
+                cold.errors++;
+            samples_add(&cold, now_ms() - start);
+            cold.allocs += thread_allocs - allocs;
+        }
+        else
+        {
+            for (int t = 0; t < STARTUP_LOG_TURNS; t++)
+            {
+                add_message(&history, ROLE_USER, user_inputs[t % USER_INPUT_COUNT]);
+                add_message(&history, ROLE_ASSISTANT, "{\"type\":\"对话\",\"message\":\"好的\"}");
+            }
+            session_log_close(&log);
+        }
+        payload_free(&payload);
+        free_messages(&history);
+    }
+    scratch_install(NULL, 0);
+    samples_report(&cold, "start cold");
+
+    struct stat st;
+    samples_begin(&resume, (size_t)runs);
+    for (int i = 0; i < runs; i++)
+    {
+        unsigned long allocs = thread_allocs;
+        double start = now_ms();
+        setup_history(&history, ctx->knowledge, ctx->knowledge_size, ctx->prompt, ctx->prompt_size);
+        payload_init(&payload, BENCH_MODEL);
+        restored = session_log_open(&log, path, history_fingerprint(&history, BENCH_MODEL), &history);
+        if (restored <= 0)
+            resume.errors++;
+        session_log_close(&log);
+        samples_add(&resume, now_ms() - start);
+        resume.allocs += thread_allocs - allocs;
+        payload_free(&payload);
+        free_messages(&history);
+    }
+    double per_op = samples_report(&resume, "start resume");
+    printf("[bench] startup: resume restores %ld messages from a %ld KB log instead of sending the bootstrap request\n",
+           restored, stat(path, &st) == 0 ? (long)st.st_size / 1024 : 0L);
+    unlink(path);
+    response_free(&resp);
+    return per_op;
+}
+
+#define PARSE_BODIES 3
+
+// 从模拟服务取回几种回复
+static void fetch_bodies(struct bench_context *ctx, response_buffer *bodies)
+{
+    const char *request = "{\"model\":\"" BENCH_MODEL "\",\"messages\":[]}";
+
+    for (int i = 0; i < PARSE_BODIES; i++)
+    {
+        response_init(&bodies[i]);
+        // 注入的 503 不算，重取
+        for (int attempt = 0; attempt < 100; attempt++)
+        {
+            http_timing timing;
+            response_reset(&bodies[i]);
+            http_post_json(ctx->client, "chat/completions", request, response_write, &bodies[i], &timing);
+            if (timing.http_code == 200)
+                break;
+        }
+    }
+}
+
+// 回复解析和分发：先从模拟服务取回几种回复，再反复在内存里处理
+static double bench_parse(struct bench_context *ctx)
+{
+    response_buffer bodies[PARSE_BODIES];
+    response_buffer work;
+    bench_samples s;
+
+    response_init(&work);
+    fetch_bodies(ctx, bodies);
+
+    samples_begin(&s, (size_t)ctx->turns);
+    for (int i = 0; i < ctx->turns; i++)
+    {
+        const response_buffer *body = &bodies[i % PARSE_BODIES];
+        response_reset(&work);
+        response_write(body->data, 1, body->size, &work);
+        unsigned long allocs = thread_allocs;
+        double start = now_ms();
+        if (handle_body(ctx->d, work.data, work.size) != 0)
+            s.errors++;
+        samples_add(&s, now_ms() - start);
+        s.allocs += thread_allocs - allocs;
+    }
+    double per_op = samples_report(&s, "parse");
+    for (int i = 0; i < PARSE_BODIES; i++)
+        response_free(&bodies[i]);
+    response_free(&work);
+    return per_op;
+}
+
+// 完整的一轮对话，和 chat 同步模式的一轮相同（create_json_payload、复用连接发送、handle_reply）：
+// 追加用户输入、增量生成请求体、原地解析、分发、指令交给线程池、回复记入历史
+static double bench_turns(struct bench_context *ctx)
+{
+    History history;
+    payload_builder payload;
+    response_buffer resp;
+    bench_samples s;
+
+    setup_history(&history, ctx->knowledge, ctx->knowledge_size, ctx->prompt, ctx->prompt_size);
+    payload_init(&payload, BENCH_MODEL);
+    response_init(&resp);
+    scratch_install(&turn_scratch, 0);
+    samples_begin(&s, (size_t)ctx->turns);
+    for (int i = 0; i < ctx->turns; i++)
+    {
+        http_timing timing;
+        unsigned long allocs = thread_allocs;
+        double start = now_ms();
+
+        add_message(&history, ROLE_USER, user_inputs[i % USER_INPUT_COUNT]);
+        const Message *before = history.tail;
+        const char *json_payload = create_json_payload(&engine, &payload, &history, 0);
+        response_reset(&resp);
+        http_post_json(ctx->client, "chat/completions", json_payload, response_write, &resp, &timing);
+        size_t len;
+        char *content = timing.http_code == 200 && resp.data != NULL ? response_content(resp.data, resp.size, &len)
+                                                                      : NULL;
+        if (content != NULL)
+            handle_reply(&engine, &history, NULL, 0, content, len);
+        if (content == NULL || turn_reply(&history, before) == NULL)
+            s.errors++;
+
+        samples_add(&s, now_ms() - start);
+        s.allocs += thread_allocs - allocs;
+    }
+    double per_op = samples_report(&s, "turns");
+    scratch_install(NULL, 0);
+    response_free(&resp);
+    payload_free(&payload);
+    free_messages(&history);
+    return per_op;
+}
+
+// 工具调用：模拟服务按脚本回 tool_calls，执行结果记入历史再发回去，直到它给出正常回复（最多 TOOL_MAX_ROUNDS 次），
+// 和 chat --tools 的循环一样。每个样本是一轮用户输入，包括其中所有的往返
+static double bench_tools(struct bench_context *ctx)
+{
+    History history;
+    payload_builder payload;
+    response_buffer resp;
+    bench_samples s;
+    int rounds = ctx->tool_rounds > 0 ? ctx->tool_rounds : 2;
+    turn_stats before = engine.stats;
+    unsigned long requests = 0;
+
+    setup_history(&history, ctx->knowledge, ctx->knowledge_size, ctx->prompt, ctx->prompt_size);
+    payload_init(&payload, BENCH_MODEL);
+    response_init(&resp);
+    build_request_fields(&engine, 0, 1);
+    ctx->server->options.tool_rounds = rounds;
+    scratch_install(&turn_scratch, 0);
+    samples_begin(&s, (size_t)ctx->turns);
+    for (int i = 0; i < ctx->turns; i++)
+    {
+        http_timing timing;
+        unsigned long allocs = thread_allocs;
+        double start = now_ms();
+
+        add_message(&history, ROLE_USER, user_inputs[i % USER_INPUT_COUNT]);
+        const char *json_payload = create_json_payload(&engine, &payload, &history, 0);
+        response_reset(&resp);
+        http_post_json(ctx->client, "chat/completions", json_payload, response_write, &resp, &timing);
+        requests++;
+        int round = 0;
+        for (; round < TOOL_MAX_ROUNDS && timing.http_code == 200; round++)
+        {
+            size_t calls_len;
+            const char *calls = resp.data != NULL ? response_tool_calls(resp.data, resp.size, &calls_len) : NULL;
+            if (calls == NULL || run_tool_calls(&engine, &history, calls, calls_len, 0) <= 0)
+                break;
+            response_reset(&resp);
+            http_post_json(ctx->client, "chat/completions", create_json_payload(&engine, &payload, &history, 0),
+                           response_write, &resp, &timing);
+            requests++;
+        }
+        // 脚本的次数超过上限时，到上限就停，这一轮没有正常回复
+        const Message *before_reply = history.tail;
+        size_t len;
+        char *content = timing.http_code == 200 && resp.data != NULL ? response_content(resp.data, resp.size, &len)
+                                                                      : NULL;
+        if (content != NULL)
+            handle_reply(&engine, &history, NULL, 0, content, len);
+        const Message *reply = turn_reply(&history, before_reply);
+        int expected = rounds < TOOL_MAX_ROUNDS ? rounds : TOOL_MAX_ROUNDS;
+        if (round != expected || (rounds <= TOOL_MAX_ROUNDS) != (reply != NULL))
+            s.errors++;
+
+        samples_add(&s, now_ms() - start);
+        s.allocs += thread_allocs - allocs;
+    }
+    double per_op = samples_report(&s, "tools");
+    printf("[bench] tools: %d rounds per turn, %.1f requests per turn, %lu calls executed, %lu rejected\n", rounds,
+           ctx->turns > 0 ? (double)requests / ctx->turns : 0, engine.stats.tool_calls - before.tool_calls,
+           engine.stats.tool_rejected - before.tool_rejected);
+    scratch_install(NULL, 0);
+    ctx->server->options.tool_rounds = 0;
+    build_request_fields(&engine, 0, 0);
+    response_free(&resp);
+    payload_free(&payload);
+    free_messages(&history);
+    return per_op;
+}
+
+struct stream_turn
+{
+    int objects;
+};
+
+static void on_stream_text(const char *text, size_t len, void *userdata)
+{
+}
+
+// 和 chat 的流式模式一样，对象一闭合就解析、分发
+static void on_stream_object(const char *json_text, size_t len, void *userdata)
+{
+    struct stream_turn *turn = userdata;
+    scratch_begin(engine.scratch);
+    cJSON *json = cJSON_ParseWithLength(json_text, len);
+    if (json != NULL)
+    {
+        process_reply(&engine, json);
+        turn->objects++;
+    }
+    cJSON_Delete(json);
+    scratch_end(engine.scratch);
+}
+
+// 流式对话：除了整轮耗时，还统计第一个内容分片到达的时间
+static double bench_stream(struct bench_context *ctx)
+{
+    History history;
+    payload_builder payload;
+    bench_samples s;
+    bench_samples first;
+
+    setup_history(&history, ctx->knowledge, ctx->knowledge_size, ctx->prompt, ctx->prompt_size);
+    payload_init(&payload, BENCH_MODEL);
+    scratch_install(&turn_scratch, 0);
+    samples_begin(&s, (size_t)ctx->turns);
+    samples_begin(&first, (size_t)ctx->turns);
+    for (int i = 0; i < ctx->turns; i++)
+    {
+        chat_stream stream;
+        struct stream_turn turn = {0};
+        http_timing timing;
+        unsigned long allocs = thread_allocs;
+
+        add_message(&history, ROLE_USER, user_inputs[i % USER_INPUT_COUNT]);
+        const char *json_payload = create_json_payload(&engine, &payload, &history, 1);
+        chat_stream_init(&stream, on_stream_text, on_stream_object, &turn);
+        http_post_json(ctx->client, "chat/completions", json_payload, chat_stream_write, &stream, &timing);
+        char *reply = timing.http_code == 200 && turn.objects == 1 ? chat_stream_result(&stream) : NULL;
+        if (reply != NULL)
+        {
+            add_message(&history, ROLE_ASSISTANT, reply);
+            samples_add(&first, stream.first_token_ms - stream.start_ms);
+        }
+        else
+        {
+            s.errors++;
+        }
+        free(reply);
+        samples_add(&s, now_ms() - stream.start_ms);
+        chat_stream_free(&stream);
+        collect_command_results(&engine, NULL, 0, NULL);
+        s.allocs += thread_allocs - allocs;
+    }
+    double per_op = samples_report(&s, "stream");
+    samples_report(&first, "first-token");
+    scratch_install(NULL, 0);
+    payload_free(&payload);
+    free_messages(&history);
+    return per_op;
+}
+
+struct async_bench
+{
+    async_http *loop;
+    dispatcher *d;
+    const char *payload;
+    int submitted;
+    int target;
+    bench_samples samples;
+};
+
+static void on_async_done(async_request *req, CURLcode result, void *userdata);
+
+static void submit_async(struct async_bench *b)
+{
+    if (async_post_json(b->loop, "chat/completions", b->payload, 0, on_async_done, b) == NULL)
+        b->samples.errors++;
+    b->submitted++;
+}
+
+static void on_async_done(async_request *req, CURLcode result, void *userdata)
+{
+    struct async_bench *b = userdata;
+    samples_add(&b->samples, now_ms() - req->started_ms);
+    if (result != CURLE_OK || req->http_code != 200 || handle_body(b->d, req->resp.data, req->resp.size) != 0)
+        b->samples.errors++;
+    if (b->submitted < b->target)
+        submit_async(b);
+}
+
+// 事件循环里同时保持 concurrency 个请求在途
+static double bench_async(struct bench_context *ctx)
+{
+    async_http loop;
+    History history;
+    payload_builder payload;
+    int tags[1];
+
+    if (async_http_init(&loop, ctx->client) != 0)
+        return 0;
+    setup_history(&history, ctx->knowledge, ctx->knowledge_size, ctx->prompt, ctx->prompt_size);
+    payload_init(&payload, BENCH_MODEL);
+    add_message(&history, ROLE_USER, user_inputs[0]);
+
+    struct async_bench b = {&loop, ctx->d, payload_build(&payload, &history, NULL), 0, ctx->turns};
+    unsigned long allocs = thread_allocs;
+    samples_begin(&b.samples, (size_t)ctx->turns);
+    for (int i = 0; i < ctx->concurrency && b.submitted < b.target; i++)
+        submit_async(&b);
+    while (loop.active_count > 0)
+        async_poll(&loop, 1000, tags, 1);
+    b.samples.allocs = thread_allocs - allocs;
+
+    char name[32];
+    snprintf(name, sizeof(name), "async x%d", ctx->concurrency);
+    double per_op = samples_report(&b.samples, name);
+    async_http_cleanup(&loop);
+    payload_free(&payload);
+    free_messages(&history);
+    return per_op;
+}
+
+// 推测式并行请求的尾延迟：模拟服务有随机延迟和 503（没有用 --latency、--jitter、--errors 指定时用 20ms ±15ms、5%），
+// 同样的请求分别只重试、同时发两路、晚 hedge 毫秒再发第二路，比较 p50 和 p99
+static double bench_race(struct bench_context *ctx)
+{
+    mock_options saved = ctx->server->options;
+    History history;
+    payload_builder payload;
+    async_http loop;
+    double per_op = 0;
+
+    if (saved.latency_ms == 0 && saved.jitter_ms == 0)
+    {
+        ctx->server->options.latency_ms = 20;
+        ctx->server->options.jitter_ms = 15;
+    }
+    if (saved.error_rate == 0)
+        ctx->server->options.error_rate = 0.05;
+    long hedge_ms = ctx->server->options.latency_ms > 0 ? ctx->server->options.latency_ms : 10;
+    const struct
+    {
+        int width;
+        long hedge_ms;
+    } modes[] = {{1, 0}, {2, 0}, {2, hedge_ms}};
+    int turns = ctx->turns < 200 ? ctx->turns : 200; // 每轮至少一个延迟，样本够算 p99 就行
+
+    if (async_http_init(&loop, ctx->client) != 0)
+        return 0;
+    setup_history(&history, ctx->knowledge, ctx->knowledge_size, ctx->prompt, ctx->prompt_size);
+    payload_init(&payload, BENCH_MODEL);
+    add_message(&history, ROLE_USER, user_inputs[0]);
+    const char *json_payload = payload_build(&payload, &history, NULL);
+    for (size_t m = 0; json_payload != NULL && m < sizeof(modes) / sizeof(modes[0]); m++)
+    {
+        race_options options;
+        race_stats stats = {0};
+        bench_samples s;
+
+        race_options_default(&options, modes[m].width);
+        options.hedge_ms = modes[m].hedge_ms;
+        samples_begin(&s, (size_t)turns);
+        for (int i = 0; i < turns; i++)
+        {
+            race_result result;
+            unsigned long allocs = thread_allocs;
+            double start = now_ms();
+            if (race_post_json(&loop, "chat/completions", &json_payload, 1, &options, &stats, &result) == 0)
+                race_result_free(&result);
+            else
+                s.errors++;
+            samples_add(&s, now_ms() - start);
+            s.allocs += thread_allocs - allocs;
+        }
+        char name[32];
+        if (modes[m].width == 1)
+            snprintf(name, sizeof(name), "race retry");
+        else if (modes[m].hedge_ms == 0)
+            snprintf(name, sizeof(name), "race x%d", modes[m].width);
+        else
+            snprintf(name, sizeof(name), "race x%d +%ldms", modes[m].width, modes[m].hedge_ms);
+        per_op = samples_report(&s, name);
+        printf("[bench]                %.2f requests per turn, %lu backoffs, %lu losers cancelled\n",
+               turns > 0 ? (double)stats.attempts / turns : 0, stats.backoffs, stats.losers);
+    }
+    ctx->server->options = saved;
+    async_http_cleanup(&loop);
+    payload_free(&payload);
+    free_messages(&history);
+    return per_op;
+}
+
+// 传输方式对比：同样的请求（带 10 轮历史）用 HTTP/1.1 和 h2c、明文和压缩各跑一遍，
+// 线路字节数和连接数从模拟服务一侧统计。最后一项让服务端拒绝压缩的请求体，检查回退到明文
+static double bench_transport(struct bench_context *ctx)
+{
+    static const struct
+    {
+        const char *name;
+        int http2;
+        int compress;
+        int reject;
+    } modes[] = {
+        {"http/1.1", 0, 0, 0}, {"http/1.1 gzip", 0, 1, 0}, {"h2c", 1, 0, 0},
+        {"h2c gzip", 1, 1, 0}, {"gzip 415", 0, 1, 1},
+    };
+    static const char reply[] = "{\"type\":\"对话\",\"message\":\"我是贾维斯，很高兴为您服务。\"}";
+    History history;
+    payload_builder payload;
+    double per_op = 0;
+    int tags[1];
+
+    setup_history(&history, ctx->knowledge, ctx->knowledge_size, ctx->prompt, ctx->prompt_size);
+    payload_init(&payload, BENCH_MODEL);
+    for (int i = 0; i < 20; i++)
+        add_message(&history, i % 2 == 0 ? ROLE_USER : ROLE_ASSISTANT,
+                    i % 2 == 0 ? user_inputs[i / 2 % USER_INPUT_COUNT] : reply);
+    const char *json_payload = payload_build(&payload, &history, NULL);
+
+    for (size_t m = 0; m < sizeof(modes) / sizeof(modes[0]); m++)
+    {
+        http_client client;
+        async_http loop;
+        mock_server *server = ctx->server;
+        if (http_client_init(&client) != 0)
+            break;
+        http_client_set_transport(&client, modes[m].http2, modes[m].compress);
+        if (async_http_init(&loop, &client) != 0)
+        {
+            http_client_cleanup(&client);
+            break;
+        }
+        server->options.reject_gzip = modes[m].reject;
+        unsigned long received = server->bytes_received;
+        unsigned long sent = server->bytes_sent;
+        unsigned long accepted = server->accepted;
+        unsigned long gzip_requests = server->gzip_requests;
+        unsigned long gzip_rejected = server->gzip_rejected;
+
+        struct async_bench b = {&loop, ctx->d, json_payload, 0, ctx->turns};
+        unsigned long allocs = thread_allocs;
+        samples_begin(&b.samples, (size_t)ctx->turns);
+        for (int i = 0; i < ctx->concurrency && b.submitted < b.target; i++)
+            submit_async(&b);
+        while (loop.active_count > 0)
+            async_poll(&loop, 1000, tags, 1);
+        b.samples.allocs = thread_allocs - allocs;
+
+        char name[32];
+        snprintf(name, sizeof(name), "%s x%d", modes[m].name, ctx->concurrency);
+        double result = samples_report(&b.samples, name);
+        if (m == 0)
+            per_op = result;
+        unsigned long connections = server->accepted - accepted;
+        gzip_rejected = server->gzip_rejected - gzip_rejected;
+        printf("[bench] %-11s %7.0f bytes up, %6.0f bytes down per turn (request body %zu bytes), %lu connections, "
+               "%lu gzip bodies, %lu rejected\n",
+               "", (double)(server->bytes_received - received) / ctx->turns,
+               (double)(server->bytes_sent - sent) / ctx->turns, strlen(json_payload), connections,
+               (unsigned long)server->gzip_requests - gzip_requests, gzip_rejected);
+
+        // HTTP/1.1 每个在途请求一个连接，HTTP/2 全部复用一个，压缩和 415 之后的重发都不能多开连接；
+        // 415 只出现在记住服务端之前已经发出的第一波请求上，记住的只是这个服务端
+        char url[512], other[64];
+        http_client_url(&client, "chat/completions", url, sizeof(url));
+        snprintf(other, sizeof(other), "http://localhost:%d/v1/chat/completions", server->port);
+        unsigned long limit = modes[m].http2 ? 1 : (unsigned long)ctx->concurrency;
+        // 很长的 origin 也要记得住，而且不能和只在后面不同的 origin 混淆
+        char long_url[256], long_other[256];
+        snprintf(long_url, sizeof(long_url), "https://%0180d.a.example/v1/chat/completions", 0);
+        snprintf(long_other, sizeof(long_other), "https://%0180d.b.example/v1/chat/completions", 0);
+        if (modes[m].reject)
+        {
+            http_client_reject_gzip(&client, long_url);
+            if (http_client_gzip_allowed(&client, long_url) || !http_client_gzip_allowed(&client, long_other))
+            {
+                fprintf(stderr, "[bench] %s: gzip state of long origins mixed up\n", modes[m].name);
+                outcome.broken++;
+            }
+        }
+        if (connections > limit || gzip_rejected > (unsigned long)ctx->concurrency ||
+            (modes[m].reject && (http_client_gzip_allowed(&client, url) || !http_client_gzip_allowed(&client, other))))
+        {
+            fprintf(stderr, "[bench] %s: %lu connections (limit %lu), %lu rejected, gzip to %s %s\n", modes[m].name,
+                    connections, limit, gzip_rejected, other,
+                    http_client_gzip_allowed(&client, other) ? "allowed" : "refused");
+            outcome.broken++;
+        }
+        async_http_cleanup(&loop);
+        http_client_cleanup(&client);
+        server->options.reject_gzip = 0;
+    }
+    payload_free(&payload);
+    free_messages(&history);
+    return per_op;
+}
+
+// 图片生成：走 image 的批量流水线，b64_json 边收边解码写文件，url 模式生成完再下载；
+// 每张图写完读回来和模拟服务的图比较，再删掉
+struct image_check
+{
+    mock_server *server;
+    bench_samples *samples;
+    int expect_ok; // 0 表示这张图应该失败
+};
+
+static int same_image(const char *path, const unsigned char *image, size_t size)
+{
+    unsigned char buf[65536];
+    size_t offset = 0;
+    ssize_t n;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return 0;
+    while ((n = read(fd, buf, sizeof(buf))) > 0)
+    {
+        if (offset + (size_t)n > size || memcmp(image + offset, buf, (size_t)n) != 0)
+            break;
+        offset += (size_t)n;
+    }
+    close(fd);
+    return n == 0 && offset == size;
+}
+
+static void image_done(int index, int ok, const char *path, double elapsed_ms, void *userdata)
+{
+    struct image_check *check = userdata;
+    if (ok != check->expect_ok || (ok && !same_image(path, check->server->image, check->server->options.image_bytes)))
+        check->samples->errors++;
+    samples_add(check->samples, elapsed_ms);
+    if (path != NULL)
+        unlink(path);
+}
+
+static double bench_images(struct bench_context *ctx)
+{
+    static const char *prompts[] = {"钢铁侠的能源核心", "a white siamese cat", "城市夜景，赛博朋克风格"};
+    char *batch_prompts[256];
+    char dir[] = "/tmp/bench-images-XXXXXX";
+    int count = ctx->turns / 10 > 0 ? ctx->turns / 10 : 1; // 每张图要传几百 KB，少跑一些
+    double per_op = 0;
+
+    if (count > (int)(sizeof(batch_prompts) / sizeof(batch_prompts[0])))
+        count = (int)(sizeof(batch_prompts) / sizeof(batch_prompts[0]));
+    for (int i = 0; i < count; i++)
+        batch_prompts[i] = (char *)prompts[i % 3];
+    if (mkdtemp(dir) == NULL)
+    {
+        perror(dir);
+        return 0;
+    }
+    for (int b64 = 1; b64 >= 0; b64--)
+    {
+        image_batch batch;
+        bench_samples s;
+        struct image_check check = {ctx->server, &s, 1};
+
+        image_batch_init(&batch);
+        if (async_http_init(&batch.loop, ctx->client) != 0)
+            break;
+        batch.prompts = batch_prompts;
+        batch.count = count;
+        batch.parallel = ctx->concurrency;
+        batch.b64 = b64;
+        batch.out_dir = dir;
+        batch.quiet = 1;
+        batch.done = image_done;
+        batch.userdata = &check;
+        samples_begin(&s, (size_t)count);
+        unsigned long allocs = thread_allocs;
+        image_batch_run(&batch);
+        s.allocs += thread_allocs - allocs;
+        s.errors += (unsigned long)(count - (batch.saved + batch.failed)); // 没开始就失败的不经过 image_done
+        double result = samples_report(&s, b64 ? "images b64" : "images url");
+        if (b64)
+            per_op = result;
+        printf("[bench] %-11s %7.0f bytes written, %6.0f bytes copied in user space per image\n", "",
+               (double)batch.written / count, (double)batch.copied / count);
+        async_http_cleanup(&batch.loop);
+    }
+    rmdir(dir);
+    return per_op;
+}
+
+// 图片下载续传：模拟服务把每个下载在一半处断开，客户端用 CURLOPT_RANGE 加 If-Range 续传，最后按 Content-MD5 核对
+//   resume   206 接上，每张图续传一次，下载的字节数等于图的大小
+//   stale    If-Range 对不上（图变了），服务端整个重发，客户端从头写
+//   corrupt  续传的数据被改了，Content-MD5 对不上，每张图都要失败，目录里不能留下任何文件
+static double bench_download(struct bench_context *ctx)
+{
+    static const struct
+    {
+        const char *name;
+        int stale;
+        int corrupt;
+    } modes[] = {{"dl resume", 0, 0}, {"dl stale", 1, 0}, {"dl corrupt", 0, 1}};
+    mock_server *server = ctx->server;
+    char *batch_prompts[64];
+    int count = ctx->turns / 10 > 0 ? ctx->turns / 10 : 1;
+    size_t size = server->options.image_bytes;
+    size_t cut = size / 2;
+    double error_rate = server->options.error_rate;
+    double per_op = 0;
+
+    if (count > (int)(sizeof(batch_prompts) / sizeof(batch_prompts[0])))
+        count = (int)(sizeof(batch_prompts) / sizeof(batch_prompts[0]));
+    for (int i = 0; i < count; i++)
+        batch_prompts[i] = "a white siamese cat";
+    server->options.error_rate = 0; // 注入的 503 会打乱下面对续传次数的核对
+    for (size_t m = 0; m < sizeof(modes) / sizeof(modes[0]); m++)
+    {
+        image_batch batch;
+        bench_samples s;
+        struct image_check check = {server, &s, !modes[m].corrupt};
+        char dir[] = "/tmp/bench-download-XXXXXX";
+
+        if (mkdtemp(dir) == NULL)
+        {
+            perror(dir);
+            break;
+        }
+        image_batch_init(&batch);
+        if (async_http_init(&batch.loop, ctx->client) != 0)
+        {
+            rmdir(dir);
+            break;
+        }
+        batch.prompts = batch_prompts;
+        batch.count = count;
+        batch.parallel = ctx->concurrency;
+        batch.out_dir = dir;
+        batch.quiet = 1;
+        batch.done = image_done;
+        batch.userdata = &check;
+        server->options.cut_bytes = cut;
+        server->options.stale_etag = modes[m].stale;
+        server->options.corrupt_range = modes[m].corrupt;
+        unsigned long cuts = server->cut_downloads, ranges = server->range_requests;
+
+        samples_begin(&s, (size_t)count);
+        unsigned long allocs = thread_allocs;
+        image_batch_run(&batch);
+        s.allocs += thread_allocs - allocs;
+        s.errors += (unsigned long)(count - (batch.saved + batch.failed));
+        double result = samples_report(&s, modes[m].name);
+        if (m == 0)
+            per_op = result;
+        cuts = server->cut_downloads - cuts;
+        ranges = server->range_requests - ranges;
+        printf("[bench] %-11s %lu cut, %lu ranged, %d resumed, %.0f bytes downloaded per saved image\n", "", cuts,
+               ranges, batch.resumes, batch.saved > 0 ? (double)batch.fetched / batch.saved : 0);
+
+        // 每张图断一次；stale 时续传拿到的是完整的 200，其余是 206；失败的图不计入 fetched
+        size_t fetched = modes[m].stale ? cut + size : size;
+        if (s.errors > 0 || cuts != (unsigned long)count ||
+            ranges != (modes[m].stale ? 0 : (unsigned long)count) ||
+            batch.resumes != (modes[m].corrupt ? 0 : count) || batch.fetched != (size_t)batch.saved * fetched)
+        {
+            fprintf(stderr, "[bench] %s: %lu errors, %lu cut, %lu ranged, %d resumed, %zu bytes fetched\n",
+                    modes[m].name, s.errors, cuts, ranges, batch.resumes, batch.fetched);
+            outcome.broken++;
+        }
+        if (rmdir(dir) != 0) // 保存的图在 image_done 里删掉了，剩下的是没清理的 .part
+        {
+            fprintf(stderr, "[bench] %s: files left in %s\n", modes[m].name, dir);
+            outcome.broken++;
+        }
+        async_http_cleanup(&batch.loop);
+    }
+    server->options.cut_bytes = 0;
+    server->options.stale_etag = 0;
+    server->options.corrupt_range = 0;
+    server->options.error_rate = error_rate;
+    return per_op;
+}
+
+// 网关：和 chat --gateway 一样，每个会话自己的历史，回复经 handle_reply 处理后原样发回
+static void gateway_open(gateway_session *g, void *userdata)
+{
+    struct bench_context *ctx = userdata;
+    add_pinned_text(&g->history, ROLE_USER, ctx->knowledge, ctx->knowledge_size);
+    add_pinned_text(&g->history, ROLE_USER, ctx->prompt, ctx->prompt_size);
+}
+
+static const char *gateway_build(gateway_session *g, const char *input, void *userdata)
+{
+    if (add_message(&g->history, ROLE_USER, input) == NULL)
+        return NULL;
+    const char *json_payload = create_json_payload(&engine, &g->payload, &g->history, 0);
+    if (json_payload == NULL)
+        history_drop_last(&g->history);
+    return json_payload;
+}
+
+static void gateway_done(gateway_session *g, async_request *req, CURLcode result, double latency_ms, void *userdata)
+{
+    size_t len;
+    char *content = result == CURLE_OK && req->http_code == 200 && req->resp.data != NULL
+                        ? response_content(req->resp.data, req->resp.size, &len)
+                        : NULL;
+    const Message *before = g->history.tail;
+    if (content != NULL)
+    {
+        engine.session = g->id;
+        handle_reply(&engine, &g->history, NULL, 0, content, len);
+        engine.session = 0;
+    }
+    const Message *reply = turn_reply(&g->history, before);
+    if (reply != NULL)
+        gateway_send(g, GATEWAY_FRAME_REPLY, reply->content, reply->length);
+    else
+        gateway_send(g, GATEWAY_FRAME_ERROR, "upstream failed", 15);
+}
+
+static void gateway_close(gateway_session *g, void *userdata)
+{
+    shadow_forget(&shadow, g->id);
+}
+
+// 设备一侧：每个会话发一条输入，收到回复（或错误）后再发下一条，直到总轮数用完
+struct gateway_client
+{
+    int fd;
+    double sent_ms;
+    char buf[4096];
+    size_t len;
+};
+
+struct gateway_load
+{
+    const char *path;
+    int sessions;
+    int turns;
+    atomic_int finished;
+    int connected;
+    bench_samples samples;
+};
+
+static int client_send(struct gateway_client *c, const char *text)
+{
+    size_t len = strlen(text);
+    unsigned char frame[256];
+    uint32_t frame_len = (uint32_t)len + 1;
+    frame[0] = frame_len >> 24;
+    frame[1] = frame_len >> 16;
+    frame[2] = frame_len >> 8;
+    frame[3] = frame_len;
+    frame[4] = GATEWAY_FRAME_INPUT;
+    memcpy(frame + 5, text, len);
+    c->sent_ms = now_ms();
+    return send(c->fd, frame, len + 5, MSG_NOSIGNAL) == (ssize_t)(len + 5) ? 0 : -1;
+}
+
+static void *gateway_load_thread(void *arg)
+{
+    struct gateway_load *load = arg;
+    struct gateway_client *clients = calloc((size_t)load->sessions, sizeof(*clients));
+    struct sockaddr_un addr = {AF_UNIX};
+    int epfd = epoll_create1(EPOLL_CLOEXEC);
+    int sent = 0;
+    int done = 0;
+
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", load->path);
+    for (int i = 0; clients != NULL && i < load->sessions; i++)
+    {
+        clients[i].fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (connect(clients[i].fd, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+        {
+            perror("connect gateway");
+            close(clients[i].fd);
+            break;
+        }
+        struct epoll_event ev = {EPOLLIN, {.ptr = &clients[i]}};
+        epoll_ctl(epfd, EPOLL_CTL_ADD, clients[i].fd, &ev);
+        load->connected++;
+    }
+    for (int i = 0; i < load->connected && sent < load->turns; i++, sent++)
+        client_send(&clients[i], user_inputs[sent % USER_INPUT_COUNT]);
+
+    while (done < sent)
+    {
+        struct epoll_event events[256];
+        int n = epoll_wait(epfd, events, 256, 10000);
+        if (n <= 0)
+        {
+            fprintf(stderr, "[bench] gateway: no reply for 10s, %d of %d turns done\n", done, sent);
+            break;
+        }
+        for (int i = 0; i < n; i++)
+        {
+            struct gateway_client *c = events[i].data.ptr;
+            ssize_t r = read(c->fd, c->buf + c->len, sizeof(c->buf) - c->len);
+            if (r <= 0)
+            {
+                epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd, NULL);
+                continue;
+            }
+            c->len += (size_t)r;
+            while (c->len >= 5)
+            {
+                const unsigned char *p = (const unsigned char *)c->buf;
+                size_t frame_len = (size_t)p[0] << 24 | (size_t)p[1] << 16 | (size_t)p[2] << 8 | p[3];
+                if (c->len < 4 + frame_len)
+                    break;
+                samples_add(&load->samples, now_ms() - c->sent_ms);
+                if (p[4] != GATEWAY_FRAME_REPLY)
+                    load->samples.errors++;
+                done++;
+                c->len -= 4 + frame_len;
+                memmove(c->buf, c->buf + 4 + frame_len, c->len);
+                if (sent < load->turns)
+                    client_send(c, user_inputs[sent++ % USER_INPUT_COUNT]);
+            }
+        }
+    }
+    for (int i = 0; i < load->connected; i++)
+        close(clients[i].fd);
+    close(epfd);
+    free(clients);
+    atomic_store(&load->finished, 1);
+    return NULL;
+}
+
+// 两个新会话先后发同一条指令：设备状态按会话记，两条都要执行，不能当成重复丢掉。
+// 模拟服务的回复按请求序号轮换，序号清零后下一个回复是 switchLight。失败返回 -1
+static int gateway_check_sessions(struct bench_context *ctx, async_http *loop, gateway *gw, const char *path)
+{
+    struct sockaddr_un addr = {AF_UNIX};
+    struct gateway_client clients[2];
+    int replies = 0;
+
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+    unsigned long executed = shadow.executed;
+    unsigned long duplicates = shadow.duplicates;
+    for (int i = 0; i < 2; i++)
+    {
+        clients[i].fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (connect(clients[i].fd, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+        {
+            perror("connect gateway");
+            close(clients[i].fd);
+            clients[i].fd = -1;
+            continue;
+        }
+        atomic_store(&ctx->server->sequence, 0);
+        client_send(&clients[i], user_inputs[0]);
+        struct pollfd pfd = {clients[i].fd, POLLIN, 0};
+        while (poll(&pfd, 1, 0) == 0 && now_ms() - clients[i].sent_ms < 5000)
+        {
+            int tags[1];
+            if (async_poll(loop, 10, tags, 1) > 0)
+                gateway_process(gw);
+        }
+        unsigned char header[5];
+        if (pfd.revents & POLLIN && read(clients[i].fd, header, sizeof(header)) == sizeof(header) &&
+            header[4] == GATEWAY_FRAME_REPLY)
+            replies++;
+    }
+    for (int i = 0; i < 2; i++)
+    {
+        if (clients[i].fd >= 0)
+            close(clients[i].fd);
+    }
+    int tags[1];
+    if (async_poll(loop, 10, tags, 1) > 0)
+        gateway_process(gw); // 断开的会话在这里释放，影子里它们的项随之删除
+
+    executed = shadow.executed - executed;
+    duplicates = shadow.duplicates - duplicates;
+    printf("[bench] gateway: 2 sessions sent the same command, %d replied, %lu executed, %lu dropped as duplicates\n",
+           replies, executed, duplicates);
+    return replies == 2 && executed == 2 && duplicates == 0 ? 0 : -1;
+}
+
+// 网关在本线程跑，设备在另一个线程；每核会话数按本线程的 CPU 时间折算
+static double bench_gateway(struct bench_context *ctx)
+{
+    async_http loop;
+    gateway gw;
+    gateway_options options;
+    gateway_handlers handlers = {gateway_open, gateway_build, gateway_done, gateway_close, ctx};
+    char path[64];
+    struct rlimit limit;
+    pthread_t thread;
+    struct timespec cpu_start, cpu_end;
+
+    // 每个会话两端各一个描述符
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max)
+    {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+    gateway_options_default(&options);
+    options.max_sessions = ctx->sessions;
+    options.max_inflight = ctx->gateway_inflight;
+    options.rate = 1e9; // 设备一侧是闭环的，不限流
+    options.burst = 1e9;
+    options.history_turns = BENCH_HISTORY_TURNS;
+    options.model = BENCH_MODEL;
+    snprintf(path, sizeof(path), "/tmp/bench-gateway-%d.sock", (int)getpid());
+    if (async_http_init(&loop, ctx->client) != 0)
+        return 0;
+    if (gateway_init(&gw, &loop, path, &options, &handlers, 0) != 0)
+    {
+        async_http_cleanup(&loop);
+        return 0;
+    }
+
+    // 每个会话至少对话五轮
+    struct gateway_load load = {path, ctx->sessions, ctx->turns > ctx->sessions * 5 ? ctx->turns : ctx->sessions * 5};
+    samples_begin(&load.samples, (size_t)load.turns);
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu_start);
+    scratch_install(&turn_scratch, 0);
+    unsigned long allocs = thread_allocs;
+    pthread_create(&thread, NULL, gateway_load_thread, &load);
+    while (!atomic_load(&load.finished))
+    {
+        int tags[1];
+        if (async_poll(&loop, 100, tags, 1) > 0)
+            gateway_process(&gw);
+    }
+    pthread_join(thread, NULL);
+    load.samples.allocs = thread_allocs - allocs;
+    scratch_install(NULL, 0);
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu_end);
+    double wall = (now_ms() - load.samples.started) / 1000.0;
+    double cpu = (cpu_end.tv_sec - cpu_start.tv_sec) + (cpu_end.tv_nsec - cpu_start.tv_nsec) / 1e9;
+
+    char name[32];
+    snprintf(name, sizeof(name), "gateway x%d", load.connected);
+    double per_op = samples_report(&load.samples, name);
+    printf("[bench] gateway: peak %d sessions, peak %d upstream in flight, cpu %.0f%%, %.0f sessions per core\n",
+           gw.peak_sessions, gw.peak_in_flight, wall > 0 ? cpu * 100 / wall : 0,
+           cpu > 0 ? load.connected / (cpu / wall) : 0);
+    if (gateway_check_sessions(ctx, &loop, &gw, path) != 0)
+        outcome.broken++;
+    gateway_cleanup(&gw);
+    async_http_cleanup(&loop);
+    return per_op;
+}
+
+// 合成的设备目录：房间 × 设备种类，每项带注释，格式同 dev_ctrl.json
+static const struct
+{
+    const char *name;
+    const char *label;
+} rooms[] = {
+    {"LivingRoom", "客厅"}, {"Bedroom", "卧室"},     {"Kitchen", "厨房"}, {"Garage", "车库"},
+    {"Lab", "实验室"},      {"Study", "书房"},       {"Hall", "走廊"},    {"Roof", "屋顶"},
+    {"Armory", "装甲库"},   {"Workshop", "工作间"},
+};
+
+static const struct
+{
+    const char *name;
+    const char *label;
+    const char *parameter;
+} kinds[] = {
+    {"Light", "灯光", "\"status\": \"on\" // \"on\" 为开启，\"off\" 为关闭"},
+    {"AirConditioner", "空调", "\"temperature\": 26 // 目标温度，摄氏度"},
+    {"Curtain", "窗帘", "\"position\": 100 // 打开的百分比"},
+    {"DoorLock", "门锁", "\"status\": \"lock\" // \"lock\" 上锁，\"unlock\" 开锁"},
+    {"Camera", "摄像头", "\"recording\": true // 是否录像"},
+    {"Speaker", "音响", "\"volume\": 30 // 音量，0 到 100"},
+    {"Fan", "风扇", "\"speed\": 2 // 档位"},
+    {"Heater", "热水器", "\"temperature\": 45 // 水温，摄氏度"},
+};
+
+#define ROOM_COUNT (sizeof(rooms) / sizeof(rooms[0]))
+#define KIND_COUNT (sizeof(kinds) / sizeof(kinds[0]))
+
+static char *synthetic_catalog(size_t count, size_t *len)
+{
+    char *text = NULL;
+    FILE *out = open_memstream(&text, len);
+    if (out == NULL)
+        return NULL;
+    fprintf(out, "{\n  \"controls\": {\n");
+    for (size_t i = 0; i < count; i++)
+    {
+        size_t room = i % ROOM_COUNT, kind = i / ROOM_COUNT % KIND_COUNT, unit = i / (ROOM_COUNT * KIND_COUNT) + 1;
+        fprintf(out,
+                "    // \"%s%s%zu\" 控制%s的%s（%zu 号）\n"
+                "    \"%s%s%zu\": {\n"
+                "      \"operation\": \"set%s%s%zu\", // 调整%s%s\n"
+                "      \"parameters\": {\n"
+                "        %s\n"
+                "      }\n"
+                "    }%s\n",
+                rooms[room].name, kinds[kind].name, unit, rooms[room].label, kinds[kind].label, unit,
+                rooms[room].name, kinds[kind].name, unit, rooms[room].name, kinds[kind].name, unit,
+                rooms[room].label, kinds[kind].label, kinds[kind].parameter, i + 1 < count ? "," : "");
+    }
+    fprintf(out, "  }\n}\n");
+    fclose(out);
+    return text;
+}
+
+// 整个目录作为固定消息 vs 每轮只附上检索到的定义：比较每轮请求体的平均大小
+static double catalog_request_bytes(struct bench_context *ctx, catalog *c, const char *text, size_t len, int retrieve)
+{
+    enum { CATALOG_TURNS = 20 };
+    History history;
+    payload_builder payload;
+    char *input = NULL;
+    size_t input_cap = 0;
+    double total = 0;
+    char query[128];
+
+    history_init(&history, BENCH_HISTORY_TURNS, 0);
+    if (retrieve)
+        add_pinned_message(&history, ROLE_USER, "设备定义不全部上传，每条用户消息后面会附上和它相关的设备定义。");
+    else
+        add_pinned_text(&history, ROLE_USER, text, len);
+    add_pinned_text(&history, ROLE_USER, ctx->prompt, ctx->prompt_size);
+    payload_init(&payload, BENCH_MODEL);
+    for (int i = 0; i < CATALOG_TURNS; i++)
+    {
+        snprintf(query, sizeof(query), "打开%s的%s", rooms[i % ROOM_COUNT].label, kinds[i / 2 % KIND_COUNT].label);
+        if (retrieve && catalog_format(c, query, CATALOG_TOP_K, &input, &input_cap) > 0)
+            add_message(&history, ROLE_USER, input);
+        else
+            add_message(&history, ROLE_USER, query);
+        const char *json_payload = payload_build(&payload, &history, NULL);
+        total += json_payload != NULL ? strlen(json_payload) : 0;
+        add_message(&history, ROLE_ASSISTANT, "{\"type\":\"对话\",\"message\":\"好的\"}");
+    }
+    free(input);
+    payload_free(&payload);
+    free_messages(&history);
+    return total / CATALOG_TURNS;
+}
+
+// 设备目录检索：10、1000、10000 项的建索引时间、每轮查询耗时和请求体大小
+static double bench_catalog(struct bench_context *ctx)
+{
+    static const size_t sizes[] = {10, 1000, 10000};
+    double per_op = 0;
+
+    for (size_t n = 0; n < sizeof(sizes) / sizeof(sizes[0]); n++)
+    {
+        catalog c;
+        size_t len;
+        char *text = synthetic_catalog(sizes[n], &len);
+        double start = now_ms();
+        if (text == NULL || catalog_build(&c, text, len) != 0)
+        {
+            free(text);
+            return 0;
+        }
+        double build_ms = now_ms() - start;
+
+        char *input = NULL;
+        size_t input_cap = 0;
+        char query[128];
+        bench_samples s;
+        samples_begin(&s, (size_t)ctx->turns);
+        for (int i = 0; i < ctx->turns; i++)
+        {
+            snprintf(query, sizeof(query), "把%s的%s打开", rooms[i % ROOM_COUNT].label,
+                     kinds[i / ROOM_COUNT % KIND_COUNT].label);
+            unsigned long allocs = thread_allocs;
+            double query_start = now_ms();
+            if (catalog_format(&c, query, CATALOG_TOP_K, &input, &input_cap) == 0)
+                s.errors++;
+            samples_add(&s, now_ms() - query_start);
+            s.allocs += thread_allocs - allocs;
+        }
+        free(input);
+        char name[32];
+        snprintf(name, sizeof(name), "catalog %zu", sizes[n]);
+        per_op = samples_report(&s, name);
+
+        double full = catalog_request_bytes(ctx, &c, text, len, 0);
+        double retrieved = catalog_request_bytes(ctx, &c, text, len, 1);
+        printf("[bench] catalog %zu: %zu KB, index built in %.1fms (%zu postings), request %.0f bytes/turn "
+               "with the whole catalog, %.0f with top %d retrieval\n",
+               sizes[n], len / 1024, build_ms, c.posting_count, full, retrieved, CATALOG_TOP_K);
+        catalog_free(&c);
+        free(text);
+    }
+    return per_op;
+}
+
+// 每轮的临时内存：同样的回复解析和分发，cJSON 先用默认的 malloc / free，
+// 再从每轮清空的临时内存分配（和 chat 的嵌入式配置一样是静态数组、用完即失败），比较分配次数和堆的峰值
+#define BENCH_SCRATCH_BYTES (16 * 1024)
+static unsigned char bench_scratch_buf[BENCH_SCRATCH_BYTES] __attribute__((aligned(16)));
+
+// 按程序头统计一个 ELF 可执行文件的大小，和 size 的 text / data / bss 一样分：
+// 只读的 PT_LOAD 段算 text，可写段的文件部分算 data，多出的内存部分算 bss。不是 64 位 ELF 返回 -1
+static int elf_sizes(const char *path, size_t *text, size_t *data, size_t *bss)
+{
+    Elf64_Ehdr ehdr;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    int ok = fd >= 0 && pread(fd, &ehdr, sizeof(ehdr), 0) == (ssize_t)sizeof(ehdr) &&
+             memcmp(ehdr.e_ident, ELFMAG, SELFMAG) == 0 && ehdr.e_ident[EI_CLASS] == ELFCLASS64 &&
+             ehdr.e_phentsize == sizeof(Elf64_Phdr);
+    *text = *data = *bss = 0;
+    for (int i = 0; ok && i < ehdr.e_phnum; i++)
+    {
+        Elf64_Phdr phdr;
+        if (pread(fd, &phdr, sizeof(phdr), (off_t)(ehdr.e_phoff + (size_t)i * sizeof(phdr))) != (ssize_t)sizeof(phdr))
+            ok = 0;
+        else if (phdr.p_type == PT_LOAD && (phdr.p_flags & PF_W))
+        {
+            *data += phdr.p_filesz;
+            *bss += phdr.p_memsz - phdr.p_filesz;
+        }
+        else if (phdr.p_type == PT_LOAD)
+            *text += phdr.p_filesz;
+    }
+    if (fd >= 0)
+        close(fd);
+    return ok ? 0 : -1;
+}
+
+static double bench_memory(struct bench_context *ctx)
+{
+    response_buffer bodies[PARSE_BODIES];
+    response_buffer work;
+    scratch_arena arena;
+    long heap_peak[2];
+    double per_op = 0;
+
+    response_init(&work);
+    fetch_bodies(ctx, bodies);
+    // 接收缓冲区先长到最大，两轮测量都不再扩容
+    for (int i = 0; i < PARSE_BODIES; i++)
+    {
+        response_reset(&work);
+        response_write(bodies[i].data, 1, bodies[i].size, &work);
+    }
+    scratch_init(&arena, bench_scratch_buf, sizeof(bench_scratch_buf), 1);
+
+    for (int pass = 0; pass < 2; pass++)
+    {
+        bench_samples s;
+        scratch_install(pass ? &arena : NULL, 0);
+        samples_begin(&s, (size_t)ctx->turns);
+        long heap_base = thread_heap;
+        thread_heap_peak = thread_heap;
+        for (int i = 0; i < ctx->turns; i++)
+        {
+            const response_buffer *body = &bodies[i % PARSE_BODIES];
+            response_reset(&work);
+            response_write(body->data, 1, body->size, &work);
+            unsigned long allocs = thread_allocs;
+            double start = now_ms();
+            if (pass)
+                scratch_begin(&arena);
+            if (handle_body(ctx->d, work.data, work.size) != 0)
+                s.errors++;
+            if (pass)
+                scratch_end(&arena);
+            samples_add(&s, now_ms() - start);
+            s.allocs += thread_allocs - allocs;
+        }
+        heap_peak[pass] = thread_heap_peak - heap_base;
+        per_op = samples_report(&s, pass ? "mem scratch" : "mem heap");
+    }
+    scratch_install(NULL, 0);
+#ifndef __SANITIZE_ADDRESS__
+    printf("[bench] memory: heap peak %ld bytes with malloc, %ld with scratch; scratch peak %zu of %zu bytes, "
+           "%lu failed\n",
+           heap_peak[0], heap_peak[1], arena.peak, arena.size, arena.failures);
+#endif
+    // 当前目录下编好的 chat（默认配置）和 chat_emb（-DCHAT_EMBEDDED -Os）
+    static const char *binaries[] = {"./chat", "./chat_emb"};
+    for (size_t i = 0; i < sizeof(binaries) / sizeof(binaries[0]); i++)
+    {
+        size_t text, data, bss;
+        if (elf_sizes(binaries[i], &text, &data, &bss) == 0)
+            printf("[bench] %-11s %s: text %zu, data %zu, bss %zu bytes\n", "", binaries[i], text, data, bss);
+        else
+            printf("[bench] %-11s %s: not built, no size\n", "", binaries[i]);
+    }
+    for (int i = 0; i < PARSE_BODIES; i++)
+        response_free(&bodies[i]);
+    response_free(&work);
+    scratch_free(&arena);
+    return per_op;
+}
+
+static const struct
+{
+    const char *name;
+    double (*run)(struct bench_context *ctx);
+} scenarios[] = {
+    {"payload", bench_payload}, {"growth", bench_growth},   {"startup", bench_startup},
+    {"parse", bench_parse},     {"turns", bench_turns},     {"tools", bench_tools},
+    {"stream", bench_stream},   {"async", bench_async},     {"race", bench_race},
+    {"images", bench_images},   {"download", bench_download}, {"gateway", bench_gateway},
+    {"catalog", bench_catalog}, {"transport", bench_transport}, {"memory", bench_memory},
+};
+
+int main(int argc, char *argv[])
+{
+    mock_options options;
+    mock_server server;
+    http_client client;
+    dispatcher d;
+    struct bench_context ctx = {&server, &client, &d};
+    const char *only = NULL;
+    double max_allocs = 0;
+    int serve = 0;
+    int status = 0;
+
+    mock_options_default(&options);
+    ctx.turns = 2000;
+    ctx.concurrency = 8;
+    ctx.sessions = 100;
+    ctx.gateway_inflight = 64;
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--turns") == 0 && i + 1 < argc)
+            ctx.turns = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--latency") == 0 && i + 1 < argc)
+            options.latency_ms = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--jitter") == 0 && i + 1 < argc)
+            options.jitter_ms = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--chunk") == 0 && i + 1 < argc)
+            options.chunk_bytes = strtoul(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "--chunk-delay") == 0 && i + 1 < argc)
+            options.chunk_delay_us = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--piece") == 0 && i + 1 < argc)
+            options.stream_piece = strtoul(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "--errors") == 0 && i + 1 < argc)
+            options.error_rate = atof(argv[++i]);
+        else if (strcmp(argv[i], "--image-bytes") == 0 && i + 1 < argc)
+            options.image_bytes = strtoul(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "--cut-bytes") == 0 && i + 1 < argc)
+            options.cut_bytes = strtoul(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "--tool-rounds") == 0 && i + 1 < argc)
+            ctx.tool_rounds = options.tool_rounds = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--concurrency") == 0 && i + 1 < argc)
+            ctx.concurrency = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--sessions") == 0 && i + 1 < argc)
+            ctx.sessions = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--gateway-inflight") == 0 && i + 1 < argc)
+            ctx.gateway_inflight = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--only") == 0 && i + 1 < argc)
+            only = argv[++i];
+        else if (strcmp(argv[i], "--max-allocs") == 0 && i + 1 < argc)
+            max_allocs = atof(argv[++i]);
+        else if (strcmp(argv[i], "--serve") == 0 && i + 1 < argc)
+        {
+            serve = 1;
+            options.port = atoi(argv[++i]);
+        }
+        else
+        {
+            fprintf(stderr, "Unknown option %s\n", argv[i]);
+            return 2;
+        }
+    }
+    if (ctx.turns < 1)
+        ctx.turns = 1;
+    if (ctx.concurrency < 1)
+        ctx.concurrency = 1;
+    if (ctx.sessions < 1)
+        ctx.sessions = 1;
+
+    if (mock_server_start(&server, &options) != 0)
+        return 1;
+    if (serve)
+    {
+        printf("Mock server listening on http://127.0.0.1:%d/v1\n", server.port);
+        pause();
+        return 0;
+    }
+
+    // 所有请求都发给本地的模拟服务
+    char base_url[64];
+    snprintf(base_url, sizeof(base_url), "http://127.0.0.1:%d/v1", server.port);
+    setenv("OPENAI_BASE_URL", base_url, 1);
+    setenv("no_proxy", "127.0.0.1", 1);
+    if (http_client_init(&client) != 0 || register_handlers(&d) != 0 || setup_engine() != 0)
+        return 1;
+    ctx.knowledge = read_file("./dev_ctrl.json", &ctx.knowledge_size);
+    ctx.prompt = read_file("./Prompt.txt", &ctx.prompt_size);
+    if (ctx.knowledge == NULL || ctx.prompt == NULL)
+        return 1;
+
+    printf("[bench] mock server on port %d: latency %dms ±%dms, chunk %zu bytes / %dus, SSE piece %zu bytes, "
+           "errors %.1f%%\n",
+           server.port, options.latency_ms, options.jitter_ms, options.chunk_bytes, options.chunk_delay_us,
+           options.stream_piece, options.error_rate * 100);
+    for (size_t i = 0; i < sizeof(scenarios) / sizeof(scenarios[0]); i++)
+    {
+        if (only != NULL && strcmp(only, scenarios[i].name) != 0)
+            continue;
+        double per_op = scenarios[i].run(&ctx);
+        if (max_allocs > 0 && strcmp(scenarios[i].name, "turns") == 0 && per_op > max_allocs)
+        {
+            fprintf(stderr, "[bench] turns: %.1f allocs/op exceeds the limit of %.1f\n", per_op, max_allocs);
+            status = 1;
+        }
+    }
+    printf("[bench] dispatched %lu dialogs, %lu commands, %lu rejected; server saw %lu requests, "
+           "%lu injected errors, %lu bytes\n",
+           outcome.dialogs, (unsigned long)outcome.commands, outcome.rejected, (unsigned long)server.requests,
+           (unsigned long)server.errors, (unsigned long)server.bytes_sent);
+    if (outcome.rejected > 0 || outcome.broken > 0)
+        status = 1;
+
+    teardown_engine();
+    http_client_cleanup(&client);
+    dispatcher_free(&d);
+    mock_server_stop(&server);
+    free((char *)ctx.knowledge);
+    free((char *)ctx.prompt);
+    return status;
+}
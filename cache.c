@@ -0,0 +1,317 @@
+#define _GNU_SOURCE // qsort_r
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "cache.h"
+#include "util.h"
+
+#define CACHE_MAGIC "CHATCCH"
+#define CACHE_VERSION 1
+#define INDEX_EMPTY (-1)
+#define INDEX_DELETED (-2)
+
+// 结尾这些标点不影响意思，规范化时去掉
+static const char *trailing_punctuation[] = {"。", "！", "？", "～", "…", ".", "!", "?", "~", NULL};
+
+void cache_set_fingerprint(response_cache *cache, uint64_t fingerprint)
+{
+    cache->fingerprint = fingerprint;
+}
+
+uint64_t cache_key(const response_cache *cache, const char *input)
+{
+    char normalized[2048];
+    size_t len = 0;
+    int space = 0;
+
+    while (*input == ' ' || *input == '\t' || *input == '\r' || *input == '\n')
+        input++;
+    for (; *input && len < sizeof(normalized) - 1; input++)
+    {
+        char c = *input;
+        if (c == ' ' || c == '\t' || c == '\r' || c == '\n')
+        {
+            space = 1;
+            continue;
+        }
+        if (space && len < sizeof(normalized) - 1)
+            normalized[len++] = ' ';
+        space = 0;
+        normalized[len++] = (c >= 'A' && c <= 'Z') ? c - 'A' + 'a' : c;
+    }
+
+    // 反复去掉结尾的标点
+    for (int stripped = 1; stripped && len > 0;)
+    {
+        stripped = 0;
+        for (int i = 0; trailing_punctuation[i] != NULL; i++)
+        {
+            size_t n = strlen(trailing_punctuation[i]);
+            if (len >= n && memcmp(normalized + len - n, trailing_punctuation[i], n) == 0)
+            {
+                len -= n;
+                stripped = 1;
+                break;
+            }
+        }
+        while (len > 0 && normalized[len - 1] == ' ')
+            len--;
+    }
+
+    uint64_t key = hash_bytes(HASH_INIT ^ cache->fingerprint, normalized, len);
+    return key != 0 ? key : 1; // 0 留给空槽
+}
+
+static size_t index_probe_start(const response_cache *cache, uint64_t key)
+{
+    return (size_t)(key ^ (key >> 29)) & (cache->index_size - 1);
+}
+
+static long index_find(const response_cache *cache, uint64_t key)
+{
+    size_t mask = cache->index_size - 1;
+    for (size_t pos = index_probe_start(cache, key);; pos = (pos + 1) & mask)
+    {
+        int slot = cache->index[pos];
+        if (slot == INDEX_EMPTY)
+            return -1;
+        if (slot >= 0 && cache->entries[slot].key == key)
+            return (long)pos;
+    }
+}
+
+static void index_insert(response_cache *cache, uint64_t key, int slot)
+{
+    size_t mask = cache->index_size - 1;
+    size_t pos = index_probe_start(cache, key);
+    while (cache->index[pos] >= 0)
+        pos = (pos + 1) & mask;
+    cache->index[pos] = slot;
+}
+
+static void lru_unlink(response_cache *cache, int slot)
+{
+    if (cache->prev[slot] != -1)
+        cache->next[cache->prev[slot]] = cache->next[slot];
+    else
+        cache->lru_head = cache->next[slot];
+    if (cache->next[slot] != -1)
+        cache->prev[cache->next[slot]] = cache->prev[slot];
+    else
+        cache->lru_tail = cache->prev[slot];
+    cache->prev[slot] = cache->next[slot] = -1;
+}
+
+static void lru_push_front(response_cache *cache, int slot)
+{
+    cache->prev[slot] = -1;
+    cache->next[slot] = cache->lru_head;
+    if (cache->lru_head != -1)
+        cache->prev[cache->lru_head] = slot;
+    cache->lru_head = slot;
+    if (cache->lru_tail == -1)
+        cache->lru_tail = slot;
+}
+
+// 重建内存中的索引（启动时，或删除标记太多时）
+static void rebuild_index(response_cache *cache)
+{
+    for (size_t i = 0; i < cache->index_size; i++)
+        cache->index[i] = INDEX_EMPTY;
+    for (size_t i = 0; i < cache->capacity; i++)
+    {
+        if (cache->entries[i].key != 0)
+            index_insert(cache, cache->entries[i].key, (int)i);
+    }
+}
+
+static void remove_entry(response_cache *cache, long pos)
+{
+    int slot = cache->index[pos];
+    cache->index[pos] = INDEX_DELETED;
+    cache->entries[slot].key = 0;
+    lru_unlink(cache, slot);
+    cache->free_count++;
+}
+
+static int compare_last_used(const void *a, const void *b, void *arg)
+{
+    const cache_entry *entries = arg;
+    uint64_t x = entries[*(const int *)a].last_used;
+    uint64_t y = entries[*(const int *)b].last_used;
+    return x < y ? 1 : x > y ? -1 : 0; // 最近使用的排前面
+}
+
+int cache_init(response_cache *cache, const char *path, size_t capacity, int ttl)
+{
+    memset(cache, 0, sizeof(*cache));
+    cache->capacity = capacity;
+    cache->ttl = ttl;
+    cache->map_size = sizeof(cache_header) + capacity * sizeof(cache_entry);
+
+    int fresh = 1;
+    if (path != NULL)
+    {
+        int fd = open(path, O_RDWR | O_CREAT, 0644);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) != 0)
+        {
+            perror("Error opening cache file");
+            if (fd >= 0)
+                close(fd);
+            return -1;
+        }
+        if ((size_t)st.st_size != cache->map_size && ftruncate(fd, cache->map_size) != 0)
+        {
+            perror("Error resizing cache file");
+            close(fd);
+            return -1;
+        }
+        cache->map = mmap(NULL, cache->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        fresh = (size_t)st.st_size != cache->map_size;
+    }
+    else
+    {
+        cache->map = mmap(NULL, cache->map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    }
+    if (cache->map == MAP_FAILED)
+    {
+        perror("mmap");
+        cache->map = NULL;
+        return -1;
+    }
+    cache->header = cache->map;
+    cache->entries = (cache_entry *)(cache->header + 1);
+
+    // 文件格式不对就清空重来
+    if (fresh || memcmp(cache->header->magic, CACHE_MAGIC, sizeof(CACHE_MAGIC)) != 0 ||
+        cache->header->version != CACHE_VERSION || cache->header->capacity != capacity)
+    {
+        memset(cache->map, 0, cache->map_size);
+        memcpy(cache->header->magic, CACHE_MAGIC, sizeof(CACHE_MAGIC));
+        cache->header->version = CACHE_VERSION;
+        cache->header->capacity = (uint32_t)capacity;
+    }
+
+    cache->index_size = 16;
+    while (cache->index_size < capacity * 2)
+        cache->index_size *= 2;
+    cache->index = malloc(cache->index_size * sizeof(int));
+    cache->prev = malloc(capacity * sizeof(int));
+    cache->next = malloc(capacity * sizeof(int));
+    int *order = malloc(capacity * sizeof(int));
+    if (cache->index == NULL || cache->prev == NULL || cache->next == NULL || order == NULL)
+    {
+        fprintf(stderr, "Memory allocation failed\n");
+        free(order);
+        cache_free(cache);
+        return -1;
+    }
+
+    // 丢掉已过期的条目，剩下的按上次使用时间恢复 LRU 顺序
+    time_t now = time(NULL);
+    size_t used = 0;
+    for (size_t i = 0; i < capacity; i++)
+    {
+        cache->prev[i] = cache->next[i] = -1;
+        if (cache->entries[i].key != 0 && cache->entries[i].expires <= now)
+            cache->entries[i].key = 0;
+        if (cache->entries[i].key != 0)
+            order[used++] = (int)i;
+    }
+    qsort_r(order, used, sizeof(int), compare_last_used, cache->entries);
+    cache->lru_head = cache->lru_tail = -1;
+    for (size_t i = used; i > 0; i--)
+        lru_push_front(cache, order[i - 1]);
+    free(order);
+    cache->free_count = (int)(capacity - used);
+    rebuild_index(cache);
+    return 0;
+}
+
+void cache_free(response_cache *cache)
+{
+    if (cache->map != NULL)
+    {
+        munmap(cache->map, cache->map_size);
+    }
+    free(cache->index);
+    free(cache->prev);
+    free(cache->next);
+    memset(cache, 0, sizeof(*cache));
+}
+
+const char *cache_lookup(response_cache *cache, uint64_t key)
+{
+    if (cache->map == NULL)
+        return NULL;
+    long pos = index_find(cache, key);
+    if (pos < 0)
+    {
+        cache->misses++;
+        return NULL;
+    }
+    int slot = cache->index[pos];
+    cache_entry *entry = &cache->entries[slot];
+    if (entry->expires <= time(NULL))
+    {
+        remove_entry(cache, pos);
+        cache->expired++;
+        cache->misses++;
+        return NULL;
+    }
+    entry->last_used = ++cache->header->tick;
+    lru_unlink(cache, slot);
+    lru_push_front(cache, slot);
+    cache->hits++;
+    return entry->value;
+}
+
+void cache_store(response_cache *cache, uint64_t key, const char *value)
+{
+    size_t len = strlen(value);
+    if (cache->map == NULL || len >= CACHE_VALUE_MAX)
+        return;
+
+    int slot;
+    long pos = index_find(cache, key);
+    if (pos >= 0)
+    {
+        slot = cache->index[pos];
+        lru_unlink(cache, slot);
+    }
+    else
+    {
+        if (cache->free_count == 0)
+        {
+            // 淘汰最久未使用的条目
+            remove_entry(cache, index_find(cache, cache->entries[cache->lru_tail].key));
+            cache->evictions++;
+        }
+        for (slot = 0; cache->entries[slot].key != 0; slot++)
+            ;
+        cache->free_count--;
+        cache->entries[slot].key = key;
+        index_insert(cache, key, slot);
+    }
+
+    cache_entry *entry = &cache->entries[slot];
+    entry->expires = time(NULL) + cache->ttl;
+    entry->last_used = ++cache->header->tick;
+    entry->len = (uint32_t)len;
+    memcpy(entry->value, value, len + 1);
+    lru_push_front(cache, slot);
+    cache->stores++;
+
+    // 删除标记占满索引会让探测变慢，定期清理
+    size_t deleted = 0;
+    for (size_t i = 0; i < cache->index_size && deleted <= cache->index_size / 4; i++)
+        deleted += cache->index[i] == INDEX_DELETED;
+    if (deleted > cache->index_size / 4)
+        rebuild_index(cache);
+}
@@ -0,0 +1,72 @@
+#ifndef CACHE_H
+#define CACHE_H
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+// 回复缓存
+// 键是 规范化后的用户输入 的哈希再混入 固定提示词和知识库 的指纹，提示词或设备定义一变，旧缓存自动失效。
+// 值是当时记入历史的回复文本（控制指令的 JSON 或对话），命中时直接重放，不走网络。
+// 条目存放在 mmap 的定长数组里：给了文件路径就持久化到文件，否则用匿名映射只在进程内有效。
+// 哈希索引和 LRU 链表只在内存中，启动时从条目重建。
+
+#define CACHE_VALUE_MAX 1024 // 单条回复的上限，更长的回复不缓存
+
+typedef struct cache_entry
+{
+    uint64_t key;       // 0 表示空槽
+    int64_t expires;    // 过期时间（time(NULL)）
+    uint64_t last_used; // LRU 计数
+    uint32_t len;
+    char value[CACHE_VALUE_MAX];
+} cache_entry;
+
+typedef struct cache_header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t capacity;
+    uint64_t tick;
+} cache_header;
+
+typedef struct response_cache
+{
+    cache_header *header;
+    cache_entry *entries;
+    size_t capacity;
+    void *map;
+    size_t map_size;
+
+    int *index;         // 开放寻址：-1 空，-2 已删除，其余为 entries 下标
+    size_t index_size;
+    int *prev;          // LRU 双向链表，头部是最近使用
+    int *next;
+    int lru_head;
+    int lru_tail;
+    int free_count;
+
+    uint64_t fingerprint;
+    int ttl;            // 秒
+
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long stores;
+    unsigned long expired;
+    unsigned long evictions;
+} response_cache;
+
+// path 为 NULL 时只在内存中缓存；失败返回 -1
+int cache_init(response_cache *cache, const char *path, size_t capacity, int ttl);
+void cache_free(response_cache *cache);
+
+// 设置提示词和知识库的指纹（对固定消息内容做哈希）
+void cache_set_fingerprint(response_cache *cache, uint64_t fingerprint);
+
+// 规范化输入并计算键：去掉首尾空白和结尾标点、合并连续空白、ASCII 转小写
+uint64_t cache_key(const response_cache *cache, const char *input);
+
+// 命中返回缓存的回复（指向缓存内部，下一次写入前有效），否则返回 NULL
+const char *cache_lookup(response_cache *cache, uint64_t key);
+void cache_store(response_cache *cache, uint64_t key, const char *value);
+
+#endif
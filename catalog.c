@@ -0,0 +1,519 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "util.h"
+#include "config.h"
+#include "catalog.h"
+
+#define BM25_K1 1.2
+#define BM25_B 0.75
+#define CATALOG_MIN_RATIO 0.25 // 得分不到第一名四分之一的不附上
+#define CATALOG_WORD_MAX 64
+
+typedef struct term_list
+{
+    uint64_t *items;
+    size_t count;
+    size_t cap;
+} term_list;
+
+static int push_term(term_list *list, uint64_t hash)
+{
+    if (list->count == list->cap)
+    {
+        size_t cap = list->cap ? list->cap * 2 : 256;
+        uint64_t *items = realloc(list->items, cap * sizeof(*items));
+        if (items == NULL)
+            return -1;
+        list->items = items;
+        list->cap = cap;
+    }
+    list->items[list->count++] = hash != 0 ? hash : 1; // 0 留给空槽
+    return 0;
+}
+
+static int is_alnum(unsigned char c)
+{
+    return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+}
+
+static size_t utf8_length(unsigned char c)
+{
+    if (c >= 0xF0)
+        return 4;
+    if (c >= 0xE0)
+        return 3;
+    if (c >= 0xC0)
+        return 2;
+    return 1;
+}
+
+// 中文标点（U+3000-U+303F）和全角符号（U+FF00-U+FF0F 等）不算字
+static int is_separator(const unsigned char *p, size_t n)
+{
+    if (n != 3)
+        return 0;
+    if (p[0] == 0xE3 && p[1] == 0x80)
+        return 1;
+    return p[0] == 0xEF && (p[1] == 0xBC || p[1] == 0xBD) && !(p[1] == 0xBC && p[2] >= 0x90 && p[2] <= 0x99);
+}
+
+// 一个 ASCII 单词：整个词一项，驼峰拆开的每一段再各一项
+static int add_word(term_list *list, const char *text, size_t len)
+{
+    char word[CATALOG_WORD_MAX];
+    size_t n = len < sizeof(word) ? len : sizeof(word);
+    size_t start = 0;
+    int parts = 0;
+
+    for (size_t i = 0; i < n; i++)
+    {
+        char c = text[i];
+        if (i > 0 && c >= 'A' && c <= 'Z' && !(text[i - 1] >= 'A' && text[i - 1] <= 'Z'))
+        {
+            if (push_term(list, hash_bytes(HASH_INIT, word + start, i - start)) != 0)
+                return -1;
+            start = i;
+            parts++;
+        }
+        word[i] = c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c;
+    }
+    if (parts > 0 && push_term(list, hash_bytes(HASH_INIT, word + start, n - start)) != 0)
+        return -1;
+    return push_term(list, hash_bytes(HASH_INIT, word, n));
+}
+
+static int tokenize(term_list *list, const char *text, size_t len)
+{
+    const char *prev = NULL; // 上一个中文字，用来组成两字词项
+    size_t prev_len = 0;
+
+    for (size_t i = 0; i < len;)
+    {
+        unsigned char c = (unsigned char)text[i];
+        if (is_alnum(c))
+        {
+            size_t start = i;
+            while (i < len && is_alnum((unsigned char)text[i]))
+                i++;
+            if (add_word(list, text + start, i - start) != 0)
+                return -1;
+            prev = NULL;
+            continue;
+        }
+        size_t n = utf8_length(c);
+        if (c < 0x80 || i + n > len || is_separator((const unsigned char *)text + i, n))
+        {
+            i += c < 0x80 || i + n > len ? 1 : n;
+            prev = NULL;
+            continue;
+        }
+        if (push_term(list, hash_bytes(HASH_INIT, text + i, n)) != 0)
+            return -1;
+        if (prev != NULL && push_term(list, hash_bytes(hash_bytes(HASH_INIT, prev, prev_len), text + i, n)) != 0)
+            return -1;
+        prev = text + i;
+        prev_len = n;
+        i += n;
+    }
+    return 0;
+}
+
+static int compare_hash(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+// 跳过 text[i] 开始的一个 JSON 值（注释已经换成空格），返回值之后的位置
+static size_t skip_value(const char *text, size_t len, size_t i)
+{
+    int depth = 0;
+    for (; i < len; i++)
+    {
+        char c = text[i];
+        if (c == '"')
+        {
+            for (i++; i < len && text[i] != '"'; i++)
+            {
+                if (text[i] == '\\')
+                    i++;
+            }
+            if (depth == 0)
+                return i + 1;
+        }
+        else if (c == '{' || c == '[')
+        {
+            depth++;
+        }
+        else if (c == '}' || c == ']')
+        {
+            if (depth == 0)
+                return i; // 数字、true 之类的标量后面紧跟着外层的结束符
+            if (--depth == 0)
+                return i + 1;
+        }
+        else if (depth == 0 && (c == ',' || c == ' ' || c == '\t' || c == '\r' || c == '\n'))
+        {
+            return i;
+        }
+    }
+    return i;
+}
+
+static size_t skip_space(const char *text, size_t len, size_t i)
+{
+    while (i < len && (text[i] == ' ' || text[i] == '\t' || text[i] == '\r' || text[i] == '\n'))
+        i++;
+    return i;
+}
+
+// 读一个字符串键，返回结束引号之后的位置；不是字符串返回 0
+static size_t read_key(const char *text, size_t len, size_t i, size_t *key_start, size_t *key_len)
+{
+    if (i >= len || text[i] != '"')
+        return 0;
+    size_t end = skip_value(text, len, i);
+    *key_start = i + 1;
+    *key_len = end - i - 2;
+    return end;
+}
+
+// 在去掉注释的文本里找到 controls 对象，返回 '{' 之后的位置；找不到返回 0
+static size_t find_controls(const char *text, size_t len)
+{
+    size_t i = skip_space(text, len, 0);
+    if (i >= len || text[i] != '{')
+        return 0;
+    for (i++;;)
+    {
+        size_t key, key_len;
+        i = skip_space(text, len, i);
+        size_t end = read_key(text, len, i, &key, &key_len);
+        if (end == 0)
+            return 0;
+        i = skip_space(text, len, end);
+        if (i >= len || text[i] != ':')
+            return 0;
+        i = skip_space(text, len, i + 1);
+        if (key_len == 8 && memcmp(text + key, "controls", 8) == 0)
+            return i < len && text[i] == '{' ? i + 1 : 0;
+        i = skip_space(text, len, skip_value(text, len, i));
+        if (i >= len || text[i] != ',')
+            return 0;
+        i++;
+    }
+}
+
+static int add_device(catalog *c, size_t *cap, size_t start, size_t end, size_t name, size_t name_len,
+                      size_t *names_len)
+{
+    if (c->count == *cap)
+    {
+        size_t new_cap = *cap ? *cap * 2 : 64;
+        catalog_device *devices = realloc(c->devices, new_cap * sizeof(*devices));
+        if (devices == NULL)
+            return -1;
+        c->devices = devices;
+        *cap = new_cap;
+    }
+    catalog_device *device = &c->devices[c->count++];
+    device->text = c->source + start;
+    device->len = end - start;
+    device->name = c->names + *names_len;
+    memcpy(c->names + *names_len, c->source + name, name_len);
+    c->names[*names_len + name_len] = '\0';
+    *names_len += name_len + 1;
+    return 0;
+}
+
+// 把 controls 的每一项切出来：从上一项的逗号之后（跳过上一项行尾的注释）到这一项的值结束。
+// 值后面同一行的注释不要：拼接时后面还要接逗号
+static int split_devices(catalog *c, const char *stripped, size_t len)
+{
+    size_t cap = 0;
+    size_t names_len = 0;
+    size_t i = find_controls(stripped, len);
+    if (i == 0)
+        return -1;
+    for (;;)
+    {
+        size_t start = i;
+        size_t line_end = start;
+        while (line_end < len && stripped[line_end] == ' ')
+            line_end++;
+        if (line_end < len && stripped[line_end] == '\n')
+            start = line_end + 1; // 这一行剩下的是上一项的行尾注释
+        i = skip_space(stripped, len, i);
+        if (i < len && stripped[i] == '}')
+            break;
+        size_t key, key_len;
+        size_t end = read_key(stripped, len, i, &key, &key_len);
+        if (end == 0)
+            return -1;
+        i = skip_space(stripped, len, end);
+        if (i >= len || stripped[i] != ':')
+            return -1;
+        end = skip_value(stripped, len, skip_space(stripped, len, i + 1));
+        if (add_device(c, &cap, skip_space(c->source, len, start), end, key, key_len, &names_len) != 0)
+            return -1;
+        i = skip_space(stripped, len, end);
+        if (i < len && stripped[i] == ',')
+            i++;
+        else if (i >= len || stripped[i] != '}')
+            return -1;
+    }
+    return 0;
+}
+
+struct term_doc
+{
+    uint64_t hash;
+    uint32_t doc;
+    uint32_t tf;
+};
+
+static int compare_term_doc(const void *a, const void *b)
+{
+    const struct term_doc *x = a;
+    const struct term_doc *y = b;
+    if (x->hash != y->hash)
+        return (x->hash > y->hash) - (x->hash < y->hash);
+    return (x->doc > y->doc) - (x->doc < y->doc);
+}
+
+static catalog_term *find_term(const catalog *c, uint64_t hash)
+{
+    for (size_t i = hash & (c->term_slots - 1);; i = (i + 1) & (c->term_slots - 1))
+    {
+        if (c->terms[i].hash == hash || c->terms[i].hash == 0)
+            return &c->terms[i];
+    }
+}
+
+// 每个文档分词、去重计数，全部 (词项, 文档, 次数) 排序后连续存放，词项表指向各自的一段
+static int build_index(catalog *c)
+{
+    term_list list = {0};
+    struct term_doc *pairs = NULL;
+    size_t pair_count = 0, pair_cap = 0;
+    double total_terms = 0;
+
+    for (size_t d = 0; d < c->count; d++)
+    {
+        list.count = 0;
+        if (tokenize(&list, c->devices[d].text, c->devices[d].len) != 0)
+            goto fail;
+        c->devices[d].terms = (uint32_t)list.count;
+        total_terms += list.count;
+        qsort(list.items, list.count, sizeof(uint64_t), compare_hash);
+        for (size_t i = 0; i < list.count;)
+        {
+            size_t j = i;
+            while (j < list.count && list.items[j] == list.items[i])
+                j++;
+            if (pair_count == pair_cap)
+            {
+                size_t cap = pair_cap ? pair_cap * 2 : 1024;
+                struct term_doc *grown = realloc(pairs, cap * sizeof(*grown));
+                if (grown == NULL)
+                    goto fail;
+                pairs = grown;
+                pair_cap = cap;
+            }
+            pairs[pair_count++] = (struct term_doc){list.items[i], (uint32_t)d, (uint32_t)(j - i)};
+            i = j;
+        }
+    }
+    c->avg_terms = c->count > 0 ? total_terms / c->count : 0;
+    qsort(pairs, pair_count, sizeof(*pairs), compare_term_doc);
+
+    size_t unique = 0;
+    for (size_t i = 0; i < pair_count; i++)
+        unique += i == 0 || pairs[i].hash != pairs[i - 1].hash;
+    c->term_slots = 16;
+    while (c->term_slots < unique * 2)
+        c->term_slots *= 2;
+    c->terms = calloc(c->term_slots, sizeof(*c->terms));
+    c->postings = malloc((pair_count ? pair_count : 1) * sizeof(*c->postings));
+    if (c->terms == NULL || c->postings == NULL)
+        goto fail;
+    for (size_t i = 0; i < pair_count; i++)
+    {
+        if (i == 0 || pairs[i].hash != pairs[i - 1].hash)
+        {
+            catalog_term *term = find_term(c, pairs[i].hash);
+            term->hash = pairs[i].hash;
+            term->first = (uint32_t)i;
+        }
+        find_term(c, pairs[i].hash)->count++;
+        c->postings[i] = (catalog_posting){pairs[i].doc, pairs[i].tf};
+    }
+    c->posting_count = pair_count;
+    free(pairs);
+    free(list.items);
+    return 0;
+
+fail:
+    free(pairs);
+    free(list.items);
+    return -1;
+}
+
+int catalog_build(catalog *c, const char *text, size_t len)
+{
+    memset(c, 0, sizeof(*c));
+    char *stripped = config_strip_comments(text, len);
+    c->source = malloc(len + 1);
+    c->names = malloc(len + 1); // 名字总长不会超过原文
+    if (stripped == NULL || c->source == NULL || c->names == NULL)
+    {
+        fprintf(stderr, "Memory allocation failed\n");
+        free(stripped);
+        catalog_free(c);
+        return -1;
+    }
+    memcpy(c->source, text, len);
+    c->source[len] = '\0';
+
+    int result = split_devices(c, stripped, len);
+    free(stripped);
+    if (result != 0)
+    {
+        fprintf(stderr, "No controls object found in the device catalog\n");
+        catalog_free(c);
+        return -1;
+    }
+    c->scores = calloc(c->count ? c->count : 1, sizeof(*c->scores));
+    c->touched = malloc((c->count ? c->count : 1) * sizeof(*c->touched));
+    if (c->scores == NULL || c->touched == NULL || build_index(c) != 0)
+    {
+        fprintf(stderr, "Memory allocation failed\n");
+        catalog_free(c);
+        return -1;
+    }
+    return 0;
+}
+
+void catalog_free(catalog *c)
+{
+    free(c->source);
+    free(c->names);
+    free(c->devices);
+    free(c->postings);
+    free(c->terms);
+    free(c->scores);
+    free(c->touched);
+    free(c->query_terms);
+    memset(c, 0, sizeof(*c));
+}
+
+size_t catalog_search(catalog *c, const char *query, const catalog_device **results, size_t k)
+{
+    term_list list = {c->query_terms, 0, c->query_cap};
+    size_t touched = 0;
+    size_t found = 0;
+    float best[k > 0 ? k : 1];
+    uint32_t best_doc[k > 0 ? k : 1];
+
+    c->queries++;
+    if (c->count == 0 || k == 0)
+        return 0;
+    int failed = tokenize(&list, query, strlen(query));
+    c->query_terms = list.items;
+    c->query_cap = list.cap;
+    if (failed != 0)
+        return 0;
+    qsort(list.items, list.count, sizeof(uint64_t), compare_hash);
+
+    for (size_t i = 0; i < list.count; i++)
+    {
+        if (i > 0 && list.items[i] == list.items[i - 1])
+            continue;
+        const catalog_term *term = find_term(c, list.items[i]);
+        if (term->hash == 0)
+            continue;
+        double idf = log(1.0 + (c->count - term->count + 0.5) / (term->count + 0.5));
+        for (uint32_t p = term->first; p < term->first + term->count; p++)
+        {
+            const catalog_posting *posting = &c->postings[p];
+            double tf = posting->tf;
+            double norm = BM25_K1 * (1 - BM25_B + BM25_B * c->devices[posting->doc].terms / c->avg_terms);
+            if (c->scores[posting->doc] == 0)
+                c->touched[touched++] = posting->doc;
+            c->scores[posting->doc] += (float)(idf * tf * (BM25_K1 + 1) / (tf + norm));
+        }
+    }
+
+    // 取前 k 项：k 很小，插入排序即可；同分时定义在前的优先
+    for (size_t t = 0; t < touched; t++)
+    {
+        uint32_t doc = c->touched[t];
+        float score = c->scores[doc];
+        c->scores[doc] = 0;
+        if (found == k && (score < best[k - 1] || (score == best[k - 1] && doc > best_doc[k - 1])))
+            continue;
+        size_t pos = found < k ? found++ : k - 1;
+        while (pos > 0 && (best[pos - 1] < score || (best[pos - 1] == score && best_doc[pos - 1] > doc)))
+        {
+            best[pos] = best[pos - 1];
+            best_doc[pos] = best_doc[pos - 1];
+            pos--;
+        }
+        best[pos] = score;
+        best_doc[pos] = doc;
+    }
+    while (found > 1 && best[found - 1] < best[0] * CATALOG_MIN_RATIO)
+        found--;
+    for (size_t i = 0; i < found; i++)
+        results[i] = &c->devices[best_doc[i]];
+    if (found == 0)
+        c->empty++;
+    return found;
+}
+
+static int append(char **buf, size_t *len, size_t *cap, const char *text, size_t n)
+{
+    if (*len + n + 1 > *cap)
+    {
+        size_t new_cap = *cap ? *cap : 1024;
+        while (new_cap < *len + n + 1)
+            new_cap *= 2;
+        char *grown = realloc(*buf, new_cap);
+        if (grown == NULL)
+            return -1;
+        *buf = grown;
+        *cap = new_cap;
+    }
+    memcpy(*buf + *len, text, n);
+    *len += n;
+    (*buf)[*len] = '\0';
+    return 0;
+}
+
+size_t catalog_format(catalog *c, const char *input, size_t k, char **buf, size_t *cap)
+{
+    static const char header[] = "\n\n相关设备定义（只能使用这里的 operation 和参数）：\n{\n  \"controls\": {\n";
+    static const char footer[] = "\n  }\n}";
+    const catalog_device *results[k > 0 ? k : 1];
+    size_t len = 0;
+
+    size_t found = catalog_search(c, input, results, k);
+    if (append(buf, &len, cap, input, strlen(input)) != 0)
+        return 0;
+    if (found == 0)
+        return len;
+    if (append(buf, &len, cap, header, sizeof(header) - 1) != 0)
+        return 0;
+    for (size_t i = 0; i < found; i++)
+    {
+        if ((i > 0 && append(buf, &len, cap, ",\n", 2) != 0) || append(buf, &len, cap, "    ", 4) != 0 ||
+            append(buf, &len, cap, results[i]->text, results[i]->len) != 0)
+            return 0;
+    }
+    if (append(buf, &len, cap, footer, sizeof(footer) - 1) != 0)
+        return 0;
+    return len;
+}
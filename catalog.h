@@ -0,0 +1,71 @@
+#ifndef CATALOG_H
+#define CATALOG_H
+#include <stddef.h>
+#include <stdint.h>
+
+// 设备目录检索
+// 设备很多时不再把整个 dev_ctrl.json 作为固定消息发给模型，而是每轮只附上和用户输入相关的几项定义，
+// 请求体大小不随设备数增长。
+// 启动时把 controls 里的每一项（连同它前面和里面的注释）切成一个文档，建倒排索引：
+// ASCII 单词按小写和驼峰拆分，中文按单字和相邻两字（字符 n-gram）切分，词项用 FNV-1a 哈希表示。
+// 查询时按 BM25 打分，取前 k 项。
+
+#define CATALOG_TOP_K 4         // 每轮附上的设备定义数
+#define CATALOG_INLINE_MAX 32   // 设备数不超过这个值时仍然整个文件作为固定消息发送
+
+typedef struct catalog_device
+{
+    const char *name;   // 控制项名，指向 names，以 '\0' 结尾
+    const char *text;   // 定义原文（含注释），指向 source，不以 '\0' 结尾
+    size_t len;
+    uint32_t terms;     // 文档长度（词项数）
+} catalog_device;
+
+typedef struct catalog_posting
+{
+    uint32_t doc;
+    uint32_t tf;
+} catalog_posting;
+
+typedef struct catalog_term
+{
+    uint64_t hash;      // 0 表示空槽
+    uint32_t first;     // 在 postings 中的起点
+    uint32_t count;     // 文档频率
+} catalog_term;
+
+typedef struct catalog
+{
+    char *source;       // dev_ctrl.json 原文的副本
+    char *names;
+    catalog_device *devices;
+    size_t count;
+    catalog_posting *postings; // 按词项排列，同一词项内按文档排列
+    size_t posting_count;
+    catalog_term *terms;       // 开放寻址，大小为 2 的幂
+    size_t term_slots;
+    double avg_terms;
+
+    // 查询用的临时空间，每次查询复用
+    float *scores;
+    uint32_t *touched;
+    uint64_t *query_terms;
+    size_t query_cap;
+
+    // 统计
+    unsigned long queries;
+    unsigned long empty;       // 没有找到相关设备的查询
+} catalog;
+
+// 从 dev_ctrl.json 的内容（可以带注释，不需要以 '\0' 结尾）建索引；格式不对返回 -1
+int catalog_build(catalog *c, const char *text, size_t len);
+void catalog_free(catalog *c);
+
+// 找出和 query 最相关的至多 k 项，按相关度从高到低写入 results，返回个数
+size_t catalog_search(catalog *c, const char *query, const catalog_device **results, size_t k);
+
+// 生成本轮的用户消息：输入后面附上相关的设备定义（格式同 dev_ctrl.json，保留注释）。
+// 写入 *buf（按需增长，多轮之间复用），返回长度；失败返回 0
+size_t catalog_format(catalog *c, const char *input, size_t k, char **buf, size_t *cap);
+
+#endif
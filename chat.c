@@ -1,372 +1,1620 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/resource.h>
+#include <sys/signalfd.h>
 #include <curl/curl.h>
 #include <cJSON.h>
+#include "http_client.h"
+#include "chat_stream.h"
+#include "history.h"
+#include "payload.h"
+#include "context.h"
+#include "intent.h"
+#include "cache.h"
+#include "dispatch.h"
+#include "response.h"
+#include "workers.h"
+#include "async_http.h"
+#include "race.h"
+#include "session.h"
+#include "config.h"
+#include "log.h"
+#include "metrics.h"
+#include "gateway.h"
+#include "catalog.h"
+#include "shadow.h"
+#include "scratch.h"
+#include "turn.h"
+#include "util.h"
 // apt-get install libcurl4-openssl-dev
 // apt-get install libcjson-dev
-// gcc -o chat chat.c $(curl-config --cflags) $(curl-config --libs) -lcjson -I/usr/include/cjson/
-#if 1
-#define debug(fmt, args...) printf(fmt, ##args)
+// gcc -o chat chat.c http_client.c chat_stream.c history.c payload.c context.c intent.c cache.c dispatch.c response.c workers.c async_http.c race.c session.c config.c log.c metrics.c gateway.c catalog.c shadow.c scratch.c turn.c $(curl-config --cflags) $(curl-config --libs) -lcjson -lpthread -lm -lz -I/usr/include/cjson/
+// 嵌入式配置：同一条命令加 -DCHAT_EMBEDDED -Os（bench 按 -o chat_emb 找它报告大小），内存上限在编译时确定（见下面的 CHAT_MEMORY_BUDGET）
+// OPENAI_BASE_URL=http://127.0.0.1:8080/v1 OPENAI_API_KEY=sk-... ./chat
+// ./chat --stream    流式接收回复，逐字显示，控制指令一生成完就执行
+// ./chat --gateway /tmp/chat.sock    网关模式：在 Unix 域套接字上同时服务多个设备，每个连接一个会话
+// ./chat --http2    用 HTTP/2（http 地址通过 Upgrade 协商 h2c），并发的请求复用一个连接的多路流
+// ./chat --compress    响应声明 Accept-Encoding 边收边解压，1 KB 以上的请求体用 gzip 压缩（服务端回 415 时这次明文重发，之后发给它的都不压缩）
+// ./chat --retrieve 4    每轮只附上和输入最相关的 4 项设备定义，不上传整个 dev_ctrl.json（设备多于 32 项时默认开启，0 关闭）
+// ./chat --coalesce-ms 500    同一设备上一条指令执行后 500ms 内的指令合并，只执行最终状态（默认 250，0 只丢弃重复的指令）
+// ./chat --no-fast-path    关闭本地意图匹配，所有输入都发给模型
+// ./chat --no-cache    不使用回复缓存；单条输入以 ! 开头也会跳过缓存直接问模型
+// ./chat --cache-file chat.cache    回复缓存保存到文件，重启后仍然有效
+// ./chat --report-results    设备指令执行完后把结果汇总成一条消息告诉模型
+// ./chat --async    事件循环模式：请求在后台进行，可以继续输入；/cancel 取消在途请求
+// ./chat --async --supersede    新的输入直接取代还没回来的请求
+// ./chat --race 3    每轮同时发 3 个相同的请求，第一个有效回复胜出；429/5xx 退避重试（--race 1 只重试）
+// ./chat --race 2 --race-models gpt-4-turbo-preview,gpt-3.5-turbo    两路分别用不同的模型
+// ./chat --json-mode    请求里带 response_format json_object，回复直接是 JSON，不用 ```json 包裹
+// ./chat --json-schema    同上，并附上按 dev_ctrl.json 生成的回复 Schema
+// ./chat --tools    把 dev_ctrl.json 里的设备声明成函数工具，模型的工具调用一起并行执行，结果在一次后续请求里返回
+// ./chat --session-log chat.log    对话记入日志，重启后恢复历史；提示词和知识库没变时跳过初始化那一轮请求
+// ./chat --session-log chat.log --compact-log    按恢复后的历史重写日志后退出
+// ./chat --no-device-order    不保证同一设备的指令按顺序执行，全部线程一起分担
+// ./chat --log-level debug    日志级别：error、warn、info（默认）、debug、trace；也可以用 CHAT_LOG_LEVEL，运行中输入 /log <级别>
+// ./chat --metrics chat.prom    输入 /metrics 或退出时把指标写到文件（.json 后缀写 JSON）；不给文件时 /metrics 打印出来
+// ./chat --metrics-socket chat.sock    在 Unix 套接字上随时提供指标：curl --unix-socket chat.sock http://localhost/metrics
+
+// info 是启动和退出时的统计，debug 是每轮的耗时，trace 是完整的请求体和回复
+#define info(fmt, args...) log_at(LOG_INFO, fmt, ##args)
+#define debug(fmt, args...) log_at(LOG_DEBUG, fmt, ##args)
+#define trace(fmt, args...) log_at(LOG_TRACE, fmt, ##args)
+
+#ifdef CHAT_EMBEDDED
+// 嵌入式配置：每轮的 cJSON 树和序列化结果来自静态的临时内存，跨轮保留的 cJSON、回复、历史和缓存都有上限，
+// 超出时报错并放弃这一部分，内存不再增长。同步模式下这几项加起来不超过 CHAT_MEMORY_BUDGET；
+// 请求体由知识库、提示词和历史拼成，随 dev_ctrl.json 的大小变化，不在预算之内
+#define CHAT_MEMORY_BUDGET (256 * 1024)
+#define HISTORY_MAX_TURNS 16
+#define HISTORY_MAX_BYTES (32 * 1024)
+#define SCRATCH_BYTES (16 * 1024)   // 每轮的临时内存，静态分配
+#define SCRATCH_STRICT 1            // 用完时这一轮的处理失败，不退回堆
+#define JSON_HEAP_MAX (48 * 1024)   // 跨轮保留的 cJSON：设备定义、状态影子、执行中的指令
+#define RESPONSE_MAX (32 * 1024)    // 一条回复
+#define INPUT_MAX 512               // 一行输入
+#define CACHE_CAPACITY 32
+// 历史的内存池在淘汰留下的空洞超过存活数据时才压缩，最多占上限的两倍
+_Static_assert(SCRATCH_BYTES + JSON_HEAP_MAX + RESPONSE_MAX + 2 * HISTORY_MAX_BYTES +
+                   CACHE_CAPACITY * CACHE_VALUE_MAX <= CHAT_MEMORY_BUDGET,
+               "embedded memory budget exceeded");
 #else
-#define debug(fmt, args...)
+// 历史记录上限：保留最近的对话轮数和内容字节数（知识库和提示词不计入、不淘汰）
+#define HISTORY_MAX_TURNS 32
+#define HISTORY_MAX_BYTES (128 * 1024)
+// 每轮的临时内存，用完后退回堆；回复和 cJSON 堆不限
+#define SCRATCH_BYTES (64 * 1024)
+#define SCRATCH_STRICT 0
+#define JSON_HEAP_MAX 0
+#define RESPONSE_MAX 0
+#define INPUT_MAX 2048
+#define CACHE_CAPACITY 256
 #endif
-typedef struct Message
+// 每轮请求的 token 预算，超出后把最近几轮之前的对话压缩成摘要
+#define CONTEXT_TOKEN_BUDGET 6000
+#define CONTEXT_KEEP_TURNS 4
+// 回复缓存的有效期
+#define CACHE_TTL_SECONDS 3600
+// 执行控制指令的线程数
+#define WORKER_THREADS 4
+// 事件循环模式：最多同时在途的请求数、每个请求的截止时间、保留的延迟样本数
+#define ASYNC_MAX_INFLIGHT 4
+#define ASYNC_REQUEST_TIMEOUT_MS 30000
+#define LATENCY_SAMPLES 1024
+// 设备状态影子的合并窗口
+#define SHADOW_WINDOW_MS 250
+// 附在用户消息后面的设备状态摘要的最大长度
+#define SHADOW_SUMMARY_MAX 1024
+// 每轮的耗时、字节数和 token 数
+static metrics turn_metrics;
+static const char *metrics_file;
+
+// 线路上的字节数和新建的连接数，用来比较 HTTP/2 和压缩的效果
+static struct
 {
-    char *role;
-    char *content;
-    struct Message *next;
-} Message;
+    unsigned long exchanges;
+    unsigned long connections;
+    unsigned long http2;   // 走了 HTTP/2 的请求
+    uint64_t body_bytes;   // 压缩前的请求体
+    uint64_t sent;
+    uint64_t received;
+} transport_stats;
 
-struct response
+// 一次 HTTP 往返：连接阶段的耗时只在新建连接时有意义；resp 为 NULL 时（流式）不统计接收字节和 token
+static void record_exchange(const http_timing *timing, size_t sent, const response_buffer *resp)
 {
-    char *data;
-    size_t size;
-};
+    long prompt_tokens, completion_tokens;
+    uint64_t wire_sent = (uint64_t)(timing->header_sent + timing->body_sent);
+    uint64_t wire_received = (uint64_t)(timing->header_received + timing->body_received);
+
+    transport_stats.exchanges++;
+    transport_stats.connections += (unsigned long)timing->new_connects;
+    transport_stats.http2 += timing->http_version == CURL_HTTP_VERSION_2_0;
+    transport_stats.body_bytes += sent;
+    transport_stats.sent += wire_sent;
+    transport_stats.received += wire_received;
+    metrics_observe(&turn_metrics, METRIC_WIRE_SENT, wire_sent);
+    metrics_observe(&turn_metrics, METRIC_WIRE_RECEIVED, wire_received);
+    metrics_observe(&turn_metrics, METRIC_REQUEST_BYTES, sent);
+    if (timing->new_connects > 0)
+    {
+        metrics_observe_ms(&turn_metrics, METRIC_DNS, timing->dns * 1000);
+        metrics_observe_ms(&turn_metrics, METRIC_CONNECT, timing->connect * 1000);
+        if (timing->tls > 0)
+            metrics_observe_ms(&turn_metrics, METRIC_TLS, timing->tls * 1000);
+    }
+    metrics_observe_ms(&turn_metrics, METRIC_FIRST_BYTE, timing->first_byte * 1000);
+    metrics_observe_ms(&turn_metrics, METRIC_HTTP_TOTAL, timing->total * 1000);
+    if (resp == NULL)
+        return;
+    metrics_observe(&turn_metrics, METRIC_RESPONSE_BYTES, resp->size);
+    if (resp->data != NULL && response_usage(resp->data, resp->size, &prompt_tokens, &completion_tokens) == 0)
+    {
+        if (prompt_tokens >= 0)
+            metrics_observe(&turn_metrics, METRIC_PROMPT_TOKENS, (uint64_t)prompt_tokens);
+        if (completion_tokens >= 0)
+            metrics_observe(&turn_metrics, METRIC_COMPLETION_TOKENS, (uint64_t)completion_tokens);
+    }
+}
 
-void add_message(Message **head, const char *role, const char *content)
+// 发送请求并获取响应，连接由 client 在多轮对话之间复用；resp 的缓冲区也在多轮之间复用
+void send_request(http_client *client, const char *json_payload, response_buffer *resp)
 {
-    Message *new_message = malloc(sizeof(Message));
-    new_message->role = strdup(role);
-    new_message->content = strdup(content);
-    new_message->next = NULL;
+    http_timing timing;
+    char timing_text[160];
 
-    if (*head == NULL)
+    response_reset(resp);
+    http_post_json(client, "chat/completions", json_payload, response_write, resp, &timing);
+    record_exchange(&timing, strlen(json_payload), resp);
+    if (resp->overflow)
     {
-        *head = new_message;
+        fprintf(stderr, "Reply exceeds the %zu byte limit, discarded\n", resp->limit);
+        response_reset(resp);
     }
-    else
+    debug("[chat] %s\n", http_timing_format(&timing, timing_text, sizeof(timing_text)));
+}
+
+// 处理一条回复时的 cJSON 树、序列化结果和临时数组都从这里分配，处理完整体清空
+static scratch_arena turn_scratch;
+#ifdef CHAT_EMBEDDED
+static unsigned char turn_scratch_buf[SCRATCH_BYTES] __attribute__((aligned(16)));
+#else
+#define turn_scratch_buf NULL // 启动时分配一次
+#endif
+
+// 回复按 type、控制指令按 operation 分发，启动时由 dev_ctrl.json 构建
+static dispatcher commands;
+// 控制指令在线程池里执行
+static worker_pool workers;
+// 会话日志，fd 为 -1 表示没有启用
+static session_log transcript = {.fd = -1};
+// 知识库和提示词：启动时读进内存，运行中文件改了就热更新
+static config_file knowledge;
+static config_file prompt;
+static config_watcher watcher = {-1, -1};
+// 设备目录的检索索引；retrieve_k 为每轮附上的定义数，0 表示整个知识库作为固定消息发送
+static catalog devices;
+static int retrieve_k = -1;
+static char *input_buf; // 附上设备定义后的用户消息，多轮复用
+static size_t input_cap;
+// 每个会话每个设备最后下发的状态，去重和合并指令；终端是会话 0，网关按连接 id。
+// shadow_seen 是终端已经看到的状态版本
+static device_shadow shadow;
+static double coalesce_ms = SHADOW_WINDOW_MS;
+// 请求体的附加字段、回复的解析和分发、控制指令的执行，和 bench 共用
+static turn_engine engine;
+static unsigned long shadow_seen;
+static struct
+{
+    unsigned long reloads;
+    unsigned long bootstrap_avoided; // 没有因为重启而重发初始化请求的次数（热更新、恢复会话）
+    double reload_ms_total;
+    double reload_ms_max;
+} config_stats;
+
+// 知识库的固定消息：设备不多时是整个 dev_ctrl.json，否则只说明定义会随用户消息附上
+static void add_knowledge(History *history)
+{
+    if (retrieve_k == 0)
     {
-        Message *current = *head;
-        while (current->next != NULL)
-        {
-            current = current->next;
-        }
-        current->next = new_message;
+        add_pinned_text(history, ROLE_USER, knowledge.data, knowledge.size);
+        return;
+    }
+    char note[256];
+    snprintf(note, sizeof(note), "设备定义（dev_ctrl.json）共 %zu 项，不全部上传。每条用户消息后面会附上和它相关的"
+             "设备定义，格式同 dev_ctrl.json，控制指令只能使用其中的 operation 和参数。", devices.count);
+    add_pinned_message(history, ROLE_USER, note);
+}
+
+// 用户输入记入历史；检索模式下附上相关的设备定义。
+// 设备状态在这个会话上次看到之后变过（本地执行、合并后的最终状态、热更新），附上一行状态摘要
+static Message *add_user_input(History *history, uint64_t session, const char *user_input, unsigned long *seen)
+{
+    size_t len = 0;
+    if (retrieve_k > 0)
+        len = catalog_format(&devices, user_input, (size_t)retrieve_k, &input_buf, &input_cap);
+    const char *text = len > 0 ? input_buf : user_input;
+    char states[SHADOW_SUMMARY_MAX];
+    unsigned long version = shadow_version(&shadow, session);
+    if (version == *seen || shadow_summary(&shadow, session, states, sizeof(states)) == 0)
+        return add_message(history, ROLE_USER, text);
+    *seen = version;
+
+    static const char label[] = "\n\n设备当前状态：";
+    int formatted = len > 0;
+    if (!formatted)
+        len = strlen(user_input);
+    size_t need = len + sizeof(label) + strlen(states);
+    if (need > input_cap)
+    {
+        char *grown = realloc(input_buf, need);
+        if (grown == NULL)
+            return add_message(history, ROLE_USER, text);
+        input_buf = grown;
+        input_cap = need;
     }
+    if (!formatted)
+        memcpy(input_buf, user_input, len);
+    snprintf(input_buf + len, input_cap - len, "%s%s", label, states);
+    return add_message(history, ROLE_USER, input_buf);
 }
 
-char *create_json_payload(Message *head)
+static const char *command_status(const cJSON *json)
 {
-    // 创建一个 JSON 对象
-    cJSON *root = cJSON_CreateObject();
-    cJSON_AddItemToObject(root, "model", cJSON_CreateString("gpt-4-turbo-preview"));
+    const cJSON *parameters = cJSON_GetObjectItemCaseSensitive(json, "parameters");
+    const char *status = cJSON_GetStringValue(cJSON_GetObjectItemCaseSensitive(parameters, "status"));
+    return status != NULL ? status : "";
+}
+
+static void switch_light(const cJSON *json, void *userdata) {
+    printf("Switching Light, Status: %s\n", command_status(json));
+}
+
+static void activate_fusion(const cJSON *json, void *userdata) {
+    printf("Activating Fusion, Status: %s\n", command_status(json));
+}
+
+// dev_ctrl.json 里新加的设备，还没有专门的处理函数
+static void generic_control(const cJSON *json, void *userdata) {
+    const cJSON *operation = cJSON_GetObjectItemCaseSensitive(json, "operation");
+    char *parameters = cJSON_PrintUnformatted(cJSON_GetObjectItemCaseSensitive(json, "parameters"));
+    printf("Executing %s, Parameters: %s\n", operation->valuestring, parameters);
+    cJSON_free(parameters);
+}
 
-    // 创建消息数组
-    cJSON *messages = cJSON_CreateArray();
-    cJSON_AddItemToObject(root, "messages", messages);
+void process_dialog(const cJSON *json, void *userdata) {
+    // 获取 "message"
+    cJSON *message = cJSON_GetObjectItemCaseSensitive(json, "message");
+    if (cJSON_IsString(message) && (message->valuestring != NULL)) {
+        printf("Message: %s\n", message->valuestring);
+    } else {
+        printf("Message missing or incorrect format\n");
+    }
+}
 
-    // 遍历消息链表并添加到消息数组
-    for (Message *current = head; current != NULL; current = current->next)
+static void register_handlers(dispatcher *d)
+{
+    if (dispatcher_init(d, "./dev_ctrl.json") != 0)
     {
-        cJSON *message = cJSON_CreateObject();
-        cJSON_AddItemToArray(messages, message);
-        cJSON_AddStringToObject(message, "role", current->role);
-        cJSON_AddStringToObject(message, "content", current->content);
+        fprintf(stderr, "No operations loaded, control commands disabled\n");
     }
+    dispatcher_register_type(d, "控制指令", process_control_command, &engine);
+    dispatcher_register_type(d, "对话", process_dialog, NULL);
+    dispatcher_register_operation(d, "switchLight", switch_light, NULL);
+    dispatcher_register_operation(d, "activateFusion", activate_fusion, NULL);
+    dispatcher_set_fallback(d, generic_control, NULL);
+}
+
+// 摘要请求走同一个 HTTP 客户端
+static char *summarize_request(const char *request_json, void *userdata)
+{
+    response_buffer resp;
+    size_t len;
+    response_init(&resp);
+    resp.limit = RESPONSE_MAX;
+    send_request((http_client *)userdata, request_json, &resp);
+    char *content = resp.data != NULL ? response_content(resp.data, resp.size, &len) : NULL;
+    char *summary = content != NULL ? strdup(content) : NULL;
+    response_free(&resp);
+    return summary;
+}
 
-    // 将 JSON 对象转换为格式化的字符串
-    char *json = cJSON_Print(root);
-    // 将 JSON 对象转换为不格式化的字符串
-    // char *json = cJSON_PrintUnformatted(root);
+// 流式输出的状态
+struct stream_output
+{
+    chat_stream stream;
+    int text_started; // 已经逐字输出过文本
+};
+
+static void on_stream_text(const char *text, size_t len, void *userdata)
+{
+    struct stream_output *out = userdata;
+    if (!out->text_started)
+    {
+        printf(out->stream.mode == 2 ? "AI: " : "Message: ");
+        out->text_started = 1;
+    }
+    fwrite(text, 1, len, stdout);
+}
 
-    // 清理 cJSON 对象
-    cJSON_Delete(root);
-    return json;
+// JSON 对象一闭合就执行，不等整段回复结束
+static void on_stream_object(const char *json_text, size_t len, void *userdata)
+{
+    struct stream_output *out = userdata;
+    if (out->text_started)
+    {
+        printf("\n");
+    }
+    double start = now_ms();
+    scratch_begin(engine.scratch);
+    cJSON *json = cJSON_ParseWithLength(json_text, len);
+    if (json == NULL)
+    {
+        fprintf(stderr, "解析错误之前: %s\n", cJSON_GetErrorPtr());
+        scratch_end(engine.scratch);
+        return;
+    }
+    double parsed = now_ms();
+    metrics_observe_ms(&turn_metrics, METRIC_PARSE, parsed - start);
+    cJSON *type = cJSON_GetObjectItemCaseSensitive(reply_body(json), "type");
+    // 对话内容已经逐字输出过了
+    if (!(out->text_started && cJSON_IsString(type) && strcmp(type->valuestring, "对话") == 0))
+    {
+        process_reply(&engine, json);
+        metrics_observe_ms(&turn_metrics, METRIC_DISPATCH, now_ms() - parsed);
+    }
+    cJSON_Delete(json);
+    scratch_end(engine.scratch);
+    fflush(stdout);
 }
 
-// 写入响应数据的回调函数
-size_t write_response(void *ptr, size_t size, size_t nmemb, struct response *r)
+// 流式发送请求，返回需要记入历史的回复内容
+char *send_stream_request(http_client *client, const char *json_payload)
 {
-    size_t new_length = r->size + size * nmemb;
-    r->data = realloc(r->data, new_length + 1);
-    if (r->data)
+    struct stream_output out;
+    http_timing timing;
+    char timing_text[160];
+
+    memset(&out, 0, sizeof(out));
+    chat_stream_init(&out.stream, on_stream_text, on_stream_object, &out);
+    http_post_json(client, "chat/completions", json_payload, chat_stream_write, &out, &timing);
+    if (out.stream.mode == 2)
+    {
+        printf("\n");
+    }
+    record_exchange(&timing, strlen(json_payload), NULL);
+    debug("[chat] %s\n", http_timing_format(&timing, timing_text, sizeof(timing_text)));
+    if (out.stream.first_token_ms > 0 && out.stream.object_done)
+    {
+        debug("[stream] first token %.1fms, dispatched %.1fms\n", out.stream.first_token_ms - out.stream.start_ms,
+              out.stream.object_ms - out.stream.start_ms);
+    }
+    else if (out.stream.first_token_ms > 0)
+    {
+        debug("[stream] first token %.1fms\n", out.stream.first_token_ms - out.stream.start_ms);
+    }
+    if (out.stream.content_len == 0 && out.stream.other != NULL)
     {
-        memcpy(r->data + r->size, ptr, size * nmemb);
-        r->data[new_length] = '\0';
-        r->size = new_length;
+        fprintf(stderr, "Unexpected response: %s", out.stream.other);
     }
-    return size * nmemb;
+
+    char *ai_response = chat_stream_result(&out.stream);
+    chat_stream_free(&out.stream);
+    return ai_response;
 }
 
-// 发送请求并获取响应
-void send_request(const char *json_payload, struct response *resp)
+// 本地快速通道：命中的指令直接执行，并把这一问一答记入历史，模型后续能看到
+static void run_local_command(History *history, const char *user_input, const intent_command *command)
 {
-    CURL *curl;
-    CURLcode res;
-    struct curl_slist *headers = NULL;
+    scratch_begin(engine.scratch);
+    cJSON *json = cJSON_CreateObject();
+    cJSON_AddStringToObject(json, "type", "控制指令");
+    cJSON_AddStringToObject(json, "operation", command->operation);
+    cJSON *parameters = cJSON_AddObjectToObject(json, "parameters");
+    cJSON_AddStringToObject(parameters, "status", command->status);
+
+    process_control_command(json, &engine);
+
+    char *reply = cJSON_PrintUnformatted(json);
+    add_message(history, ROLE_USER, user_input);
+    if (reply != NULL)
+        add_message(history, ROLE_ASSISTANT, reply);
+    cJSON_free(reply);
+    cJSON_Delete(json);
+    scratch_end(engine.scratch);
+}
 
-    resp->data = malloc(1); // 将被 write_response 回调函数增长
-    resp->size = 0;
+// "灯开着吗"：按设备状态影子回答，和正常对话一样记入历史。状态未知返回 0
+static int answer_state(History *history, const char *user_input, const char *operation)
+{
+    char state[256];
+    if (shadow_describe(&shadow, 0, operation, state, sizeof(state)) != 0)
+        return 0;
+    char message[320];
+    snprintf(message, sizeof(message), "当前状态：%s", state);
+    printf("Message: %s\n", message);
 
-    curl_global_init(CURL_GLOBAL_ALL);
-    curl = curl_easy_init();
+    scratch_begin(engine.scratch);
+    cJSON *json = cJSON_CreateObject();
+    cJSON_AddStringToObject(json, "type", "对话");
+    cJSON_AddStringToObject(json, "message", message);
+    char *reply = cJSON_PrintUnformatted(json);
+    add_message(history, ROLE_USER, user_input);
+    if (reply != NULL)
+        add_message(history, ROLE_ASSISTANT, reply);
+    cJSON_free(reply);
+    cJSON_Delete(json);
+    scratch_end(engine.scratch);
+    return 1;
+}
 
-    if (curl)
+// 缓存命中：按当时的回复重放，并和正常对话一样记入历史
+static void replay_cached_reply(History *history, const char *user_input, const char *reply)
+{
+    scratch_begin(engine.scratch);
+    cJSON *json = reply[0] == '{' || reply[0] == '[' ? cJSON_Parse(reply) : NULL;
+    if (json != NULL)
+    {
+        process_reply(&engine, json);
+        cJSON_Delete(json);
+    }
+    else
     {
-        curl_easy_setopt(curl, CURLOPT_URL, "https://api.openai.com/v1/chat/completions");
-        headers = curl_slist_append(headers, "Content-Type: application/json");
-        headers = curl_slist_append(headers, "Authorization: Bearer apikey");
-        curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
-        curl_easy_setopt(curl, CURLOPT_POSTFIELDS, json_payload);
-        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_response);
-        curl_easy_setopt(curl, CURLOPT_WRITEDATA, resp);
+        printf("AI: %s\n", reply);
+    }
+    scratch_end(engine.scratch);
+    add_message(history, ROLE_USER, user_input);
+    add_message(history, ROLE_ASSISTANT, reply);
+}
+
+// 一次会话用到的各个模块，在主循环和事件循环的回调之间传递
+struct chat_session
+{
+    History *history;
+    payload_builder *payload;
+    context_manager *context;
+    intent_matcher *intent;
+    response_cache *cache;
+    http_client *client;
+    async_http *loop;
+    int fast_path;
+    int use_cache;
+    int report_results;
+    int supersede;
+    int json_mode;
+    int tool_mode;
+};
 
-        res = curl_easy_perform(curl);
-        if (res != CURLE_OK)
+// 本地能回答的输入直接处理并返回 1：明确的设备指令走快速通道，重复的问题用缓存重放。
+// 否则返回 0，*cache_key_value 是这次回复要写入的缓存键（0 表示不缓存）
+static int answer_locally(struct chat_session *s, char *user_input, uint64_t *cache_key_value)
+{
+    *cache_key_value = 0;
+    // 明确的设备指令直接在本地执行，不经过网络
+    const intent_command *command;
+    if (s->fast_path && intent_match(s->intent, user_input, &command) == INTENT_HIT)
+    {
+        // 状态查询：影子里有就直接回答，不知道才问模型
+        if (strcmp(command->status, INTENT_QUERY) != 0)
         {
-            fprintf(stderr, "curl_easy_perform() failed: %s\n", curl_easy_strerror(res));
+            run_local_command(s->history, user_input, command);
+            return 1;
         }
-
-        curl_slist_free_all(headers);
-        curl_easy_cleanup(curl);
+        if (answer_state(s->history, user_input, command->operation))
+            return 1;
+    }
+    // 以 ! 开头强制询问模型，不读缓存，但新回复仍然写入缓存
+    int bypass = user_input[0] == '!';
+    if (bypass)
+    {
+        memmove(user_input, user_input + 1, strlen(user_input));
+    }
+    *cache_key_value = s->use_cache ? cache_key(s->cache, user_input) : 0;
+    const char *cached = (*cache_key_value && !bypass) ? cache_lookup(s->cache, *cache_key_value) : NULL;
+    if (cached != NULL)
+    {
+        replay_cached_reply(s->history, user_input, cached);
+        return 1;
     }
+    return 0;
+}
+
+// 事件循环模式下每个在途请求的附加信息
+struct pending_turn
+{
+    struct chat_session *session;
+    uint64_t cache_key_value;
+    double input_ms; // 用户按下回车的时间
+};
+
+// 端到端延迟（输入到回复执行完）的样本
+static double turn_latency[LATENCY_SAMPLES];
+static size_t turn_latency_count;
+
+static void record_latency(double ms)
+{
+    turn_latency[turn_latency_count++ % LATENCY_SAMPLES] = ms;
+    metrics_observe_ms(&turn_metrics, METRIC_TURN, ms);
+}
 
-    curl_global_cleanup();
+static int compare_double(const void *a, const void *b)
+{
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+static void print_latency(void)
+{
+    size_t n = turn_latency_count < LATENCY_SAMPLES ? turn_latency_count : LATENCY_SAMPLES;
+    double sum = 0;
+    if (n == 0)
+        return;
+    qsort(turn_latency, n, sizeof(double), compare_double);
+    for (size_t i = 0; i < n; i++)
+        sum += turn_latency[i];
+    info("[latency] %zu turns, avg %.1fms p50 %.1fms p99 %.1fms max %.1fms\n", n, sum / n,
+          turn_latency[n / 2], turn_latency[(n * 99) / 100], turn_latency[n - 1]);
 }
 
-void free_messages(Message *head)
+static void on_turn_done(async_request *req, CURLcode result, void *userdata)
 {
-    Message *current = head;
-    while (current != NULL)
+    struct pending_turn *turn = userdata;
+    struct chat_session *s = turn->session;
+    char timing_text[160];
+
+    if (req->cancelled)
+    {
+        debug("[async] #%d cancelled\n", req->id);
+    }
+    else if (result == CURLE_OPERATION_TIMEDOUT)
+    {
+        printf("Request #%d timed out\n", req->id);
+    }
+    else if (req->resp.overflow)
+    {
+        fprintf(stderr, "Request #%d: reply exceeds the %zu byte limit, discarded\n", req->id, req->resp.limit);
+    }
+    else if (result != CURLE_OK)
+    {
+        fprintf(stderr, "Request #%d failed: %s\n", req->id, curl_easy_strerror(result));
+    }
+    else
+    {
+        record_exchange(&req->timing, strlen(req->payload), &req->resp);
+        debug("[chat] #%d %s\n", req->id, http_timing_format(&req->timing, timing_text, sizeof(timing_text)));
+        // 比它早发出的请求都已经过时，不能在更新的回复之后再执行，直接取消
+        while (s->loop->active != NULL && s->loop->active->id < req->id)
+        {
+            async_cancel(s->loop, s->loop->active);
+        }
+        size_t content_len;
+        char *ai_response = req->resp.data != NULL ? response_content(req->resp.data, req->resp.size, &content_len) : NULL;
+        if (ai_response != NULL)
+        {
+            handle_reply(&engine, s->history, s->cache, turn->cache_key_value, ai_response, content_len);
+        }
+        else if (req->resp.size > 0)
+        {
+            fprintf(stderr, "Unexpected response: %s\n", req->resp.data);
+        }
+        double latency = now_ms() - turn->input_ms;
+        record_latency(latency);
+        debug("[async] #%d done in %.1fms, %d in flight\n", req->id, latency, s->loop->active_count);
+    }
+    free(turn);
+}
+
+// 发出一轮请求，不等待回复
+static void submit_turn(struct chat_session *s, char *user_input, double input_ms)
+{
+    struct pending_turn *turn = malloc(sizeof(*turn));
+    if (turn == NULL)
+    {
+        fprintf(stderr, "Memory allocation failed\n");
+        return;
+    }
+    turn->session = s;
+    turn->input_ms = input_ms;
+    if (answer_locally(s, user_input, &turn->cache_key_value))
+    {
+        free(turn);
+        return;
+    }
+
+    // 新输入取代还没回来的请求；或者在途请求太多时放弃最早的
+    while (s->loop->active != NULL && (s->supersede || s->loop->active_count >= ASYNC_MAX_INFLIGHT))
+    {
+        async_cancel(s->loop, s->loop->active);
+    }
+
+    add_user_input(s->history, 0, user_input, &shadow_seen);
+    if (context_enforce(s->context, s->history))
     {
-        Message *next = current->next;
-        free(current->role);
-        free(current->content);
-        free(current);
-        current = next;
+        debug("[context] summarized %zu messages, now ~%zu tokens\n",
+              s->context->summarized_messages, s->context->last_tokens);
+        session_log_compact(&transcript, s->history); // 日志里的旧消息已经换成了摘要
+    }
+    const char *json_payload = create_json_payload(&engine, s->payload, s->history, 0);
+    if (json_payload == NULL ||
+        async_post_json(s->loop, "chat/completions", json_payload, ASYNC_REQUEST_TIMEOUT_MS, on_turn_done, turn) == NULL)
+    {
+        free(turn);
     }
 }
 
-char *extract_ai_response(const char *response)
+// 设备定义的变化：新增、修改的控制项给出新的定义，删除的只列名字。
+// 只改了注释（控制项没变）时把整个文件发过去，注释里有给模型看的说明。解析失败返回 NULL
+static char *controls_delta(const config_file *updated)
 {
-    cJSON *json = cJSON_Parse(response);
+    cJSON *json = cJSON_Parse(updated->stripped);
     if (json == NULL)
+        return NULL;
+    const cJSON *old_controls = cJSON_GetObjectItemCaseSensitive(commands.controls, "controls");
+    const cJSON *new_controls = cJSON_GetObjectItemCaseSensitive(json, "controls");
+    char *text = NULL;
+    size_t len = 0;
+    FILE *out = open_memstream(&text, &len);
+    if (out == NULL)
     {
-        const char *error_ptr = cJSON_GetErrorPtr();
-        if (error_ptr != NULL)
+        cJSON_Delete(json);
+        return NULL;
+    }
+    int changes = 0;
+    fprintf(out, "设备定义已更新，以下内容取代 dev_ctrl.json 中的对应项：\n");
+    const cJSON *control;
+    cJSON_ArrayForEach(control, new_controls)
+    {
+        const cJSON *old = cJSON_GetObjectItemCaseSensitive(old_controls, control->string);
+        if (old != NULL && cJSON_Compare(old, control, 1))
+            continue;
+        char *definition = cJSON_PrintUnformatted(control);
+        fprintf(out, "%s %s: %s\n", old == NULL ? "新增" : "修改", control->string, definition);
+        cJSON_free(definition);
+        changes++;
+    }
+    cJSON_ArrayForEach(control, old_controls)
+    {
+        if (cJSON_GetObjectItemCaseSensitive(new_controls, control->string) == NULL)
         {
-            fprintf(stderr, "Error before: %s\n", error_ptr);
+            fprintf(out, "删除 %s，不要再使用它的 operation\n", control->string);
+            changes++;
         }
-        return NULL;
     }
-
-    const cJSON *choices = cJSON_GetObjectItemCaseSensitive(json, "choices");
-    if (cJSON_IsArray(choices) && cJSON_GetArraySize(choices) > 0)
+    if (changes == 0)
     {
-        const cJSON *first_choice = cJSON_GetArrayItem(choices, 0);
-        const cJSON *message = cJSON_GetObjectItemCaseSensitive(first_choice, "message");
-        const cJSON *content = cJSON_GetObjectItemCaseSensitive(message, "content");
+        fprintf(out, "%.*s", (int)updated->size, updated->data);
+    }
+    fclose(out);
+    cJSON_Delete(json);
+    return text;
+}
 
-        char *ai_response = NULL;
-        if (cJSON_IsString(content) && (content->valuestring != NULL))
+// 知识库或提示词改了：重新加载，只把变化的部分作为一条固定消息告诉模型，
+// 不用重启、也不用再走一遍初始化请求
+static void reload_configs(struct chat_session *s)
+{
+    config_file *files[2] = {&knowledge, &prompt};
+    unsigned changed = config_poll_changes(&watcher, files, 2);
+    for (int i = 0; i < 2; i++)
+    {
+        config_file updated;
+        if (!(changed & (1u << i)) || config_load(&updated, files[i]->path) != 0)
+            continue;
+        double start = now_ms();
+        if (updated.fingerprint == files[i]->fingerprint)
+        {
+            config_unload(&updated); // 保存了但内容没变
+            continue;
+        }
+        char *delta = files[i] == &knowledge ? controls_delta(&updated) : config_prompt_delta(files[i], &updated);
+        if (delta == NULL || (files[i] == &knowledge && dispatcher_load(&commands, updated.stripped) != 0))
         {
-            ai_response = strdup(content->valuestring);
+            fprintf(stderr, "Error parsing %s, keeping the previous version\n", updated.path);
+            free(delta);
+            config_unload(&updated);
+            continue;
         }
+        if (files[i] == &knowledge && retrieve_k > 0)
+        {
+            // 检索模式下不发变化的定义，重建索引，以后附上的就是新定义
+            catalog rebuilt;
+            if (catalog_build(&rebuilt, updated.data, updated.size) == 0)
+            {
+                catalog_free(&devices);
+                devices = rebuilt;
+            }
+            char note[160];
+            snprintf(note, sizeof(note), "设备定义已更新，现在共 %zu 项，以之后附上的定义为准。", devices.count);
+            free(delta);
+            delta = strdup(note);
+        }
+        if (files[i] == &knowledge)
+        {
+            if (shadow_load(&shadow, commands.controls) != 0)
+                fprintf(stderr, "Device states not updated\n");
+            if (s->fast_path)
+            {
+                intent_free(s->intent);
+                if (intent_init(s->intent, knowledge.path, "./intent_phrases.txt") != 0)
+                    fprintf(stderr, "Fast path disabled\n");
+            }
+            build_request_fields(&engine, s->json_mode, s->tool_mode);
+        }
+        if (delta != NULL)
+            add_pinned_message(s->history, ROLE_SYSTEM, delta);
+        if (s->use_cache)
+            cache_set_fingerprint(s->cache, history_fingerprint(s->history, s->payload->model));
+        config_unload(files[i]);
+        *files[i] = updated;
 
-        cJSON_Delete(json);
-        return ai_response;
+        double elapsed = now_ms() - start;
+        config_stats.reloads++;
+        config_stats.bootstrap_avoided++;
+        config_stats.reload_ms_total += elapsed;
+        if (elapsed > config_stats.reload_ms_max)
+            config_stats.reload_ms_max = elapsed;
+        debug("[config] reloaded %s in %.2fms, delta %zu bytes instead of %zu\n", updated.name, elapsed,
+              delta != NULL ? strlen(delta) : 0, updated.size);
+        free(delta);
     }
+}
 
-    cJSON_Delete(json);
-    return NULL;
+// 控制台命令：/log [级别] 查看或调整日志级别，/metrics 导出指标。处理了返回 1
+static int console_command(const char *line)
+{
+    if (strncmp(line, "/log", 4) == 0 && (line[4] == ' ' || line[4] == '\0'))
+    {
+        int level = line[4] == ' ' ? log_parse_level(line + 5) : -1;
+        if (level >= 0)
+            log_current = (log_level)level;
+        printf("Log level: %s (error, warn, info, debug, trace)\n", log_level_name(log_current));
+        return 1;
+    }
+    if (strcmp(line, "/metrics") == 0)
+    {
+        if (metrics_file == NULL)
+            metrics_write_prometheus(&turn_metrics, stdout);
+        else if (metrics_write_file(&turn_metrics, metrics_file) == 0)
+            printf("Metrics written to %s\n", metrics_file);
+        return 1;
+    }
+    return 0;
+}
+
+// 事件循环模式：同时等待标准输入、在途请求和设备执行结果，输入不会被网络请求阻塞。
+// 输入 /cancel 取消所有在途请求；exit 或输入结束后等在途请求完成再退出
+static void run_event_loop(struct chat_session *s)
+{
+    async_http loop;
+    char line[INPUT_MAX];
+    size_t line_len = 0;
+    int reading = 1;
+    int skipping = 0; // 正在丢弃超长一行的剩余部分
+
+    if (async_http_init(&loop, s->client) != 0)
+    {
+        return;
+    }
+    loop.response_limit = RESPONSE_MAX;
+    s->loop = &loop;
+    if (async_watch_fd(&loop, STDIN_FILENO, 0) != 0 || async_watch_fd(&loop, workers.notify_fd, 1) != 0)
+    {
+        fprintf(stderr, "stdin cannot be watched (regular file?), use a terminal or a pipe\n");
+        async_http_cleanup(&loop);
+        return;
+    }
+    if (watcher.fd >= 0)
+    {
+        async_watch_fd(&loop, watcher.fd, 2);
+    }
+    printf("You: ");
+    fflush(stdout);
+
+    while (reading || loop.active_count > 0)
+    {
+        int tags[ASYNC_MAX_WATCHES];
+        int ready = async_poll(&loop, -1, tags, ASYNC_MAX_WATCHES);
+        for (int i = 0; i < ready; i++)
+        {
+            if (tags[i] == 1)
+            {
+                collect_command_results(&engine, s->history, s->report_results, NULL);
+                continue;
+            }
+            if (tags[i] == 2)
+            {
+                reload_configs(s);
+                continue;
+            }
+            ssize_t n = read(STDIN_FILENO, line + line_len, sizeof(line) - 1 - line_len);
+            if (n <= 0)
+            {
+                async_unwatch_fd(&loop, STDIN_FILENO);
+                reading = 0;
+                continue;
+            }
+            line_len += n;
+            char *newline;
+            // 一次读到的可能是多行，逐行处理
+            while (reading && (newline = memchr(line, '\n', line_len)) != NULL)
+            {
+                double input_ms = now_ms();
+                *newline = '\0';
+                if (skipping)
+                {
+                    skipping = 0;
+                }
+                else if (strcmp(line, "exit") == 0)
+                {
+                    async_unwatch_fd(&loop, STDIN_FILENO);
+                    reading = 0;
+                }
+                else if (strcmp(line, "/cancel") == 0)
+                {
+                    while (loop.active != NULL)
+                        async_cancel(&loop, loop.active);
+                }
+                else if (console_command(line))
+                {
+                }
+                else if (line[0] != '\0')
+                {
+                    collect_command_results(&engine, s->history, s->report_results, NULL);
+                    submit_turn(s, line, input_ms);
+                }
+                line_len -= newline + 1 - line;
+                memmove(line, newline + 1, line_len);
+            }
+            if (line_len == sizeof(line) - 1)
+            {
+                // 超长的一行整行丢弃，直到下一个换行
+                if (!skipping)
+                    fprintf(stderr, "Input longer than %d bytes, ignored\n", INPUT_MAX - 1);
+                skipping = 1;
+                line_len = 0;
+            }
+        }
+        fflush(stdout);
+    }
+
+    collect_command_results(&engine, s->history, s->report_results, NULL);
+    info("[async] completed %lu failed %lu timed out %lu cancelled %lu\n",
+          loop.completed, loop.failed, loop.timed_out, loop.cancelled);
+    async_http_cleanup(&loop);
+    s->loop = NULL;
+}
+
+// 网关模式：每个设备连接是一个会话，固定消息和请求体构建器各自一份，回复按 type 分发，
+// 控制指令同样交给线程池执行
+static void gateway_open(gateway_session *g, void *userdata)
+{
+    add_knowledge(&g->history);
+    add_pinned_text(&g->history, ROLE_USER, prompt.data, prompt.size);
+}
+
+static const char *gateway_build(gateway_session *g, const char *input, void *userdata)
+{
+    if (add_user_input(&g->history, g->id, input, &g->seen_version) == NULL)
+        return NULL;
+    const char *json_payload = create_json_payload(&engine, &g->payload, &g->history, 0);
+    if (json_payload == NULL)
+        history_drop_last(&g->history); // 没发出去的输入不留在历史里
+    return json_payload;
 }
 
+static void gateway_done(gateway_session *g, async_request *req, CURLcode result, double latency_ms, void *userdata)
+{
+    char text[160];
 
-void process_control_command(cJSON *json) {
-    // 获取 "operation"
-    cJSON *operation = cJSON_GetObjectItemCaseSensitive(json, "operation");
-    if (!cJSON_IsString(operation) || (operation->valuestring == NULL)) {
-        printf("Operation missing or incorrect format\n");
+    if (req->resp.overflow)
+    {
+        snprintf(text, sizeof(text), "upstream reply exceeds the %zu byte limit", req->resp.limit);
+        gateway_send(g, GATEWAY_FRAME_ERROR, text, strlen(text));
         return;
     }
+    if (result != CURLE_OK || req->http_code != 200)
+    {
+        snprintf(text, sizeof(text), "upstream failed: %s, HTTP %ld",
+                 result != CURLE_OK ? curl_easy_strerror(result) : "bad status", req->http_code);
+        gateway_send(g, GATEWAY_FRAME_ERROR, text, strlen(text));
+        return;
+    }
+    record_exchange(&req->timing, strlen(req->payload), &req->resp);
+    size_t content_len;
+    char *ai_response = req->resp.data != NULL ? response_content(req->resp.data, req->resp.size, &content_len) : NULL;
+    const Message *before = g->history.tail;
+    if (ai_response != NULL)
+    {
+        engine.session = g->id;
+        handle_reply(&engine, &g->history, NULL, 0, ai_response, content_len);
+        engine.session = 0;
+    }
+    // 记入历史的就是处理后的回复（去掉了 ```json 包裹），原样发给设备
+    if (g->history.tail != before && g->history.tail->role == ROLE_ASSISTANT)
+    {
+        gateway_send(g, GATEWAY_FRAME_REPLY, g->history.tail->content, g->history.tail->length);
+    }
+    else
+    {
+        snprintf(text, sizeof(text), "unexpected response");
+        gateway_send(g, GATEWAY_FRAME_ERROR, text, strlen(text));
+    }
+    record_latency(latency_ms);
+    debug("[gateway] session %u turn %lu in %.1fms\n", g->id, g->turns, latency_ms);
+}
+
+// 连接断开：这个会话的设备状态不再需要，窗口里等待的指令照常执行
+static void gateway_close(gateway_session *g, void *userdata)
+{
+    shadow_forget(&shadow, g->id);
+}
+
+// 每个会话两个描述符，上游连接另算，默认的 1024 不够
+static void raise_fd_limit(void)
+{
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max)
+    {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+}
+
+// 网关的退出信号。main 在创建工作线程之前就屏蔽它们（线程继承屏蔽字），只通过 signalfd 交给事件循环
+static void exit_signals(sigset_t *mask)
+{
+    sigemptyset(mask);
+    sigaddset(mask, SIGINT);
+    sigaddset(mask, SIGTERM);
+}
 
-    // 获取 "parameters"
-    cJSON *parameters = cJSON_GetObjectItemCaseSensitive(json, "parameters");
-    if (!cJSON_IsObject(parameters)) {
-        printf("Parameters missing or incorrect format\n");
+// 一直运行到收到 SIGINT 或 SIGTERM
+static void run_gateway(struct chat_session *s, const char *path, const gateway_options *options)
+{
+    async_http loop;
+    gateway gw;
+    gateway_handlers handlers = {gateway_open, gateway_build, gateway_done, gateway_close, NULL};
+    sigset_t mask;
+    struct rusage usage;
+    int running = 1;
+
+    raise_fd_limit();
+    if (async_http_init(&loop, s->client) != 0)
+    {
         return;
     }
-    cJSON *status = cJSON_GetObjectItemCaseSensitive(parameters, "status");
-    if (!cJSON_IsString(status) || (status->valuestring == NULL)) {
-        printf("Status missing or incorrect format\n");
+    loop.response_limit = RESPONSE_MAX;
+    exit_signals(&mask);
+    int signal_fd = signalfd(-1, &mask, SFD_CLOEXEC);
+    if (gateway_init(&gw, &loop, path, options, &handlers, 0) != 0)
+    {
+        if (signal_fd >= 0)
+            close(signal_fd);
+        async_http_cleanup(&loop);
         return;
     }
+    async_watch_fd(&loop, workers.notify_fd, 1);
+    if (signal_fd >= 0)
+    {
+        async_watch_fd(&loop, signal_fd, 2);
+    }
+    info("[gateway] listening on %s, %d sessions max, %d upstream requests in flight\n", path,
+         options->max_sessions, options->max_inflight);
+    double started = now_ms();
 
-    // 根据不同的 "operation" 执行不同的逻辑
-    if (strcmp(operation->valuestring, "activateFusion") == 0) {
-        // 处理 activateFusion 操作
-        printf("Activating Fusion, Status: %s\n", status->valuestring);
-    } else if (strcmp(operation->valuestring, "switchLight") == 0) {
-        // 处理 switchLight 操作
-        printf("Switching Light, Status: %s\n", status->valuestring);
-    } else {
-        // 未知操作
-        printf("Unknown operation: %s\n", operation->valuestring);
+    while (running)
+    {
+        int tags[ASYNC_MAX_WATCHES];
+        int ready = async_poll(&loop, -1, tags, ASYNC_MAX_WATCHES);
+        for (int i = 0; i < ready; i++)
+        {
+            if (tags[i] == 0)
+                gateway_process(&gw);
+            else if (tags[i] == 1)
+                collect_command_results(&engine, NULL, 0, NULL); // 结果不知道属于哪个会话，不汇总
+            else
+                running = 0;
+        }
+        fflush(stdout);
+    }
+
+    double elapsed = (now_ms() - started) / 1000.0;
+    gateway_cleanup(&gw);
+    collect_command_results(&engine, NULL, 0, NULL);
+    getrusage(RUSAGE_SELF, &usage);
+    double cpu = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 + usage.ru_stime.tv_sec +
+                 usage.ru_stime.tv_usec / 1e6;
+    info("[gateway] sessions %lu (peak %d, refused %lu), turns %lu, rate limited %lu, overflowed %lu, "
+         "bad frames %lu, peak in flight %d\n",
+         gw.accepted, gw.peak_sessions, gw.refused, gw.turns, gw.rate_limited, gw.overflowed, gw.bad_frames,
+         gw.peak_in_flight);
+    if (elapsed > 0 && cpu > 0)
+    {
+        info("[gateway] %.1f turns/s, cpu %.0f%%, %.0f peak sessions per core\n", gw.turns / elapsed,
+             cpu * 100 / elapsed, gw.peak_sessions / (cpu / elapsed));
     }
+    if (signal_fd >= 0)
+        close(signal_fd);
+    async_http_cleanup(&loop);
 }
 
-void process_dialog(cJSON *json) {
-    // 获取 "message"
-    cJSON *message = cJSON_GetObjectItemCaseSensitive(json, "message");
-    if (cJSON_IsString(message) && (message->valuestring != NULL)) {
-        printf("Message: %s\n", message->valuestring);
-    } else {
-        printf("Message missing or incorrect format\n");
+// 换掉请求体开头的模型名，用于让不同模型同时回答
+static char *payload_with_model(const char *json_payload, const char *old_model, const char *model)
+{
+    size_t skip = strlen("{\"model\":\"") + strlen(old_model);
+    size_t len = strlen(json_payload);
+    char *variant = malloc(len - skip + strlen(model) + 16);
+    if (variant != NULL)
+    {
+        sprintf(variant, "{\"model\":\"%s%s", model, json_payload + skip);
     }
+    return variant;
 }
-long getFileSize(FILE *file) {
-    long fileSize = 0;
-    fseek(file, 0, SEEK_END); // 移动文件指针到文件末尾
-    fileSize = ftell(file);   // 获取当前文件指针的位置，即文件大小
-    rewind(file);             // 将文件指针重新定位到文件开头
-    return fileSize;
+
+// 推测式并行请求：多路同时问，第一个有效回复胜出，其余取消；失败时退避重试
+static void race_turn(struct chat_session *s, async_http *loop, const char *json_payload, const race_options *options,
+                      race_stats *stats, char *models, uint64_t cache_key_value)
+{
+    const char *payloads[RACE_MAX_WIDTH];
+    char *variants[RACE_MAX_WIDTH];
+    int count = 0;
+
+    // --race-models 给了多个模型时，每路轮流用一个
+    char *saveptr = NULL;
+    char *list = models != NULL ? strdup(models) : NULL;
+    for (char *model = list != NULL ? strtok_r(list, ",", &saveptr) : NULL; model != NULL && count < RACE_MAX_WIDTH;
+         model = strtok_r(NULL, ",", &saveptr))
+    {
+        variants[count] = payload_with_model(json_payload, s->payload->model, model);
+        if (variants[count] != NULL)
+        {
+            payloads[count] = variants[count];
+            count++;
+        }
+    }
+    free(list);
+    if (count == 0)
+    {
+        payloads[count++] = json_payload;
+    }
+
+    race_result result;
+    if (race_post_json(loop, "chat/completions", payloads, count, options, stats, &result) == 0)
+    {
+        debug("[race] lane %d won, %d attempts, %.1fms\n", result.lane, result.attempts, result.elapsed_ms);
+        handle_reply(&engine, s->history, s->cache, cache_key_value, result.content, result.content_len);
+        race_result_free(&result);
+    }
+    else
+    {
+        printf("No valid reply within %ldms\n", options->deadline_ms);
+    }
+    for (int i = 0; models != NULL && i < count; i++)
+    {
+        free(variants[i]);
+    }
 }
-int main()
+
+int main(int argc, char *argv[])
 {
-    Message *history = NULL;
-    struct response resp;
-    char user_input[2048]; // 用户输入的缓冲区
+    History history;
+    payload_builder payload;
+    context_manager context;
+    intent_matcher intent;
+    response_cache cache;
+    response_buffer resp;
+    http_client client;
+    char user_input[INPUT_MAX]; // 用户输入的缓冲区
 
+    double startup_start = now_ms();
     int init = 1;
+    int stream_mode = 0;
+    int fast_path = 1;
+    int use_cache = 1;
+    int report_results = 0;
+    int device_order = 1;
+    int async_mode = 0;
+    int supersede = 0;
+    int race_width = 0;
+    int json_mode = 0; // 1: json_object，2: 附带回复 Schema
+    int tool_mode = 0;
+    int http2 = 0;
+    int compress = 0;
+    char *race_models = NULL;
+    const char *cache_file = NULL;
+    const char *session_file = NULL;
+    int compact_only = 0;
+    uint64_t cache_key_value = 0; // 本轮回复要写入的缓存键，0 表示不缓存
+    const char *metrics_socket = NULL;
+    const char *gateway_path = NULL;
+    gateway_options gateway_opts;
+
+    gateway_options_default(&gateway_opts);
+    gateway_opts.history_turns = HISTORY_MAX_TURNS;
+    gateway_opts.history_bytes = HISTORY_MAX_BYTES;
+
+    int level = log_parse_level(getenv("CHAT_LOG_LEVEL"));
+    if (level >= 0)
+        log_current = (log_level)level;
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--stream") == 0)
+        {
+            stream_mode = 1;
+        }
+        else if (strcmp(argv[i], "--no-fast-path") == 0)
+        {
+            fast_path = 0;
+        }
+        else if (strcmp(argv[i], "--report-results") == 0)
+        {
+            report_results = 1;
+        }
+        else if (strcmp(argv[i], "--async") == 0)
+        {
+            async_mode = 1;
+        }
+        else if (strcmp(argv[i], "--race") == 0 && i + 1 < argc)
+        {
+            race_width = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--race-models") == 0 && i + 1 < argc)
+        {
+            race_models = argv[++i];
+        }
+        else if (strcmp(argv[i], "--json-mode") == 0)
+        {
+            json_mode = 1;
+        }
+        else if (strcmp(argv[i], "--json-schema") == 0)
+        {
+            json_mode = 2;
+        }
+        else if (strcmp(argv[i], "--tools") == 0)
+        {
+            tool_mode = 1;
+        }
+        else if (strcmp(argv[i], "--session-log") == 0 && i + 1 < argc)
+        {
+            session_file = argv[++i];
+        }
+        else if (strcmp(argv[i], "--compact-log") == 0)
+        {
+            compact_only = 1;
+        }
+        else if (strcmp(argv[i], "--supersede") == 0)
+        {
+            supersede = 1;
+        }
+        else if (strcmp(argv[i], "--no-device-order") == 0)
+        {
+            device_order = 0;
+        }
+        else if (strcmp(argv[i], "--no-cache") == 0)
+        {
+            use_cache = 0;
+        }
+        else if (strcmp(argv[i], "--cache-file") == 0 && i + 1 < argc)
+        {
+            cache_file = argv[++i];
+        }
+        else if (strcmp(argv[i], "--log-level") == 0 && i + 1 < argc)
+        {
+            level = log_parse_level(argv[++i]);
+            if (level >= 0)
+                log_current = (log_level)level;
+            else
+                fprintf(stderr, "Unknown log level %s\n", argv[i]);
+        }
+        else if (strcmp(argv[i], "--metrics") == 0 && i + 1 < argc)
+        {
+            metrics_file = argv[++i];
+        }
+        else if (strcmp(argv[i], "--metrics-socket") == 0 && i + 1 < argc)
+        {
+            metrics_socket = argv[++i];
+        }
+        else if (strcmp(argv[i], "--http2") == 0)
+        {
+            http2 = 1;
+        }
+        else if (strcmp(argv[i], "--compress") == 0)
+        {
+            compress = 1;
+        }
+        else if (strcmp(argv[i], "--coalesce-ms") == 0 && i + 1 < argc)
+        {
+            coalesce_ms = atof(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--retrieve") == 0 && i + 1 < argc)
+        {
+            retrieve_k = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--gateway") == 0 && i + 1 < argc)
+        {
+            gateway_path = argv[++i];
+            init = 0; // 固定消息加在每个会话里，不发全局的初始化请求
+        }
+        else if (strcmp(argv[i], "--gateway-sessions") == 0 && i + 1 < argc)
+        {
+            gateway_opts.max_sessions = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--gateway-inflight") == 0 && i + 1 < argc)
+        {
+            gateway_opts.max_inflight = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--gateway-rate") == 0 && i + 1 < argc)
+        {
+            gateway_opts.rate = atof(argv[++i]);
+            gateway_opts.burst = gateway_opts.rate > 5 ? gateway_opts.rate : 5;
+        }
+    }
+    if (gateway_path != NULL)
+    {
+        sigset_t mask;
+        exit_signals(&mask);
+        sigprocmask(SIG_BLOCK, &mask, NULL);
+    }
+    metrics_init(&turn_metrics);
+    if (metrics_socket != NULL && metrics_serve(&turn_metrics, metrics_socket) != 0)
+    {
+        fprintf(stderr, "Metrics socket disabled\n");
+    }
+
+    if (scratch_init(&turn_scratch, turn_scratch_buf, SCRATCH_BYTES, SCRATCH_STRICT) != 0)
+    {
+        return 1;
+    }
+    scratch_install(&turn_scratch, JSON_HEAP_MAX);
+    response_init(&resp);
+    resp.limit = RESPONSE_MAX;
+    if (http_client_init(&client) != 0)
+    {
+        return 1;
+    }
+    http_client_set_transport(&client, http2, compress);
+    if (config_load(&knowledge, "./dev_ctrl.json") != 0 || config_load(&prompt, "./Prompt.txt") != 0)
+    {
+        return 1;
+    }
+    if (retrieve_k != 0 && catalog_build(&devices, knowledge.data, knowledge.size) != 0)
+    {
+        retrieve_k = 0; // 解析不了就整个文件发过去
+    }
+    if (retrieve_k < 0)
+    {
+        retrieve_k = devices.count > CATALOG_INLINE_MAX ? CATALOG_TOP_K : 0;
+    }
+    if (retrieve_k > 0)
+    {
+        info("[catalog] %zu devices indexed, %zu terms, sending the top %d per turn\n", devices.count,
+             devices.posting_count, retrieve_k);
+    }
+    if (config_watch(&watcher, ".") != 0)
+    {
+        fprintf(stderr, "Hot reload disabled\n");
+    }
+    turn_init(&engine, &commands, &workers, &shadow, &turn_metrics, &turn_scratch);
+    register_handlers(&commands);
+    if (tool_mode && (stream_mode || async_mode || race_width > 0))
+    {
+        fprintf(stderr, "--tools only works with buffered requests, ignored\n");
+        tool_mode = 0;
+    }
+    build_request_fields(&engine, json_mode, tool_mode);
+    if (worker_pool_init(&workers, WORKER_THREADS, device_order) != 0)
+    {
+        return 1;
+    }
+    if (shadow_init(&shadow, commands.controls, coalesce_ms, execute_held_command, &engine) != 0)
+    {
+        fprintf(stderr, "Device state shadow disabled\n");
+    }
+    history_init(&history, HISTORY_MAX_TURNS, HISTORY_MAX_BYTES);
+    payload_init(&payload, "gpt-4-turbo-preview");
+    if (fast_path && intent_init(&intent, "./dev_ctrl.json", "./intent_phrases.txt") != 0)
+    {
+        fprintf(stderr, "Fast path disabled\n");
+    }
+    if (use_cache && cache_init(&cache, cache_file, CACHE_CAPACITY, CACHE_TTL_SECONDS) != 0)
+    {
+        fprintf(stderr, "Response cache disabled\n");
+        use_cache = 0;
+    }
+    context_init(&context, CONTEXT_TOKEN_BUDGET, CONTEXT_KEEP_TURNS, "gpt-4-turbo-preview",
+                 summarize_request, &client);
+
+    async_http race_loop;
+    race_stats race_stats = {0};
+    race_options race_opts;
+    race_options_default(&race_opts, race_width);
+    if (race_width > 0 && async_http_init(&race_loop, &client) == 0)
+    {
+        race_loop.response_limit = RESPONSE_MAX;
+    }
+    else
+    {
+        race_width = 0;
+    }
+    srand((unsigned)time(NULL));
+
+    struct chat_session session = {&history, &payload, &context, &intent, &cache, &client, NULL,
+                                   fast_path, use_cache, report_results, supersede, json_mode, tool_mode};
 
     while (1)
     {
+        if (init == 0 && startup_start > 0)
+        {
+            info("[startup] first prompt after %.1fms\n", now_ms() - startup_start);
+            startup_start = 0;
+        }
         if (init == 1)
         {
-            // 知识库
-            if(1)
+            // 知识库和提示词：启动时已经读进内存了
+            printf("File size: %zu bytes\n", knowledge.size);
+            add_knowledge(&history);
+            printf("File size: %zu bytes\n", prompt.size);
+            add_pinned_text(&history, ROLE_USER, prompt.data, prompt.size);
+            uint64_t fingerprint = history_fingerprint(&history, payload.model);
+            if (use_cache)
             {
-                // 读取文件
-                FILE *fp = fopen("./dev_ctrl.json", "r");
-                if (fp == NULL)
-                {
-                    fprintf(stderr, "Error opening file\n");
-                    return 1;
-                }
-                // 获取文件大小
-                long size = getFileSize(fp);
-                printf("File size: %ld bytes\n", size);
-                // 为文件内容分配内存
-                char *knowledge_base = (char *)malloc(size + 64);
-                memset(knowledge_base, 0, sizeof(knowledge_base));
-                // 读取文件内容
-                fread(knowledge_base, 1, size, fp);
-                // 添加用户输入到对话历史
-                add_message(&history, "user", knowledge_base);
-                free(knowledge_base);
+                cache_set_fingerprint(&cache, fingerprint);
             }
-            // 提示词
-            if (1)
+            init = 0;
+            if (session_file != NULL)
             {
-                // 读取文件
-                FILE *fp = fopen("./Prompt.txt", "r");
-                if (fp == NULL)
+                long restored = session_log_open(&transcript, session_file, fingerprint, &history);
+                if (restored > 0)
+                {
+                    info("[session] restored %ld messages from %s\n", restored, session_file);
+                    config_stats.bootstrap_avoided++;
+                }
+                // 反复淘汰留下的旧记录比历史里的消息还多一倍时顺便压缩
+                if (compact_only || (restored > 0 && transcript.records > 2 * history.count))
                 {
-                    fprintf(stderr, "Error opening file\n");
-                    return 1;
+                    session_log_compact(&transcript, &history);
                 }
-                // 获取文件大小
-                long size = getFileSize(fp);
-                printf("File size: %ld bytes\n", size);
-                // 为文件内容分配内存
-                char *prompt = (char *)malloc(size + 64);
-                memset(prompt, 0, sizeof(prompt));
-                // 读取文件内容
-                fread(prompt, 1, size, fp);
-                // 添加用户输入到对话历史
-                add_message(&history, "user", prompt);
-                free(prompt);
+                if (compact_only)
+                {
+                    info("[session] compacted %s: %zu records, %zu bytes\n", session_file, transcript.records,
+                          transcript.size);
+                    break;
+                }
+                history.on_append = session_log_on_append;
+                history.on_append_userdata = &transcript;
+                // 初始化那一轮的回复已经恢复了，直接等用户输入
+                if (restored > 0)
+                    continue;
             }
-            init = 0;
+        }
+        else if (gateway_path != NULL)
+        {
+            run_gateway(&session, gateway_path, &gateway_opts);
+            break;
+        }
+        else if (async_mode)
+        {
+            run_event_loop(&session);
+            break;
         }
         else
         {
             printf("You: ");
             memset(user_input, 0, sizeof(user_input));
-            if (fgets(user_input, 2048, stdin) == NULL)
+            if (fgets(user_input, sizeof(user_input), stdin) == NULL)
             {
                 break; // 如果读取失败或遇到 EOF，则退出循环
             }
+            // 超长的一行整行丢弃，不拆成几轮发出去
+            if (strchr(user_input, '\n') == NULL && !feof(stdin))
+            {
+                int c;
+                while ((c = getchar()) != '\n' && c != EOF)
+                {
+                }
+                fprintf(stderr, "Input longer than %d bytes, ignored\n", INPUT_MAX - 2);
+                continue;
+            }
             user_input[strcspn(user_input, "\n")] = 0; // 去除换行符
+            if (console_command(user_input))
+                continue;
+            reload_configs(&session);
+            collect_command_results(&engine, &history, report_results, NULL);
+            if (answer_locally(&session, user_input, &cache_key_value))
+            {
+                if (strcmp(user_input, "exit") == 0)
+                    break;
+                continue;
+            }
             // 添加用户输入到对话历史
-            add_message(&history, "user", user_input);
+            add_user_input(&history, 0, user_input, &shadow_seen);
         }
 
-        // 创建 JSON 负载并发送请求
-        char *json_payload = create_json_payload(history);
-        debug("%s\n", json_payload);
-        send_request(json_payload, &resp);
-        debug("%s\n", resp.data);
+        // 超出 token 预算时先压缩旧对话
+        if (context_enforce(&context, &history))
+        {
+            debug("[context] summarized %zu messages, now ~%zu tokens\n",
+                  context.summarized_messages, context.last_tokens);
+            session_log_compact(&transcript, &history);
+        }
 
-        // 提取 AI 响应并打印
-        char *ai_response = extract_ai_response(resp.data);
-        if (ai_response != NULL)
+        // 创建 JSON 负载并发送请求
+        const char *json_payload = create_json_payload(&engine, &payload, &history, stream_mode);
+        if (json_payload == NULL)
         {
-            if (strncmp(ai_response, "```json", 6) == 0 && strncmp(ai_response + strlen(ai_response) - 3, "```", 3) == 0)
+            return 1;
+        }
+        trace("%s\n", json_payload);
+        if (stream_mode)
+        {
+            char *ai_response = send_stream_request(&client, json_payload);
+            if (ai_response != NULL)
             {
-                // 计算并复制JSON字符串
-                char *jsonStringStart = ai_response + 6 + 1;        // 跳过前面的```json和换行符
-                size_t jsonStringLen = strlen(jsonStringStart) - 3; // 减去结尾的```
-                char *jsonString = (char *)malloc(jsonStringLen + 1);
-                if (jsonString == NULL)
-                {
-                    fprintf(stderr, "Memory allocation failed\n");
-                    return 1;
-                }
-                strncpy(jsonString, jsonStringStart, jsonStringLen);
-                jsonString[jsonStringLen] = '\0';
-                debug("AI: %s\n", jsonString);
-                add_message(&history, "assistant", jsonString);
-                { // 解析json
-                    cJSON *json = cJSON_Parse(jsonString);
-                    if (json == NULL)
-                    {
-                        const char *error_ptr = cJSON_GetErrorPtr();
-                        if (error_ptr != NULL)
-                        {
-                            fprintf(stderr, "解析错误之前: %s\n", error_ptr);
-                        }
-                        continue;
-                    }
-
-                    cJSON *type = cJSON_GetObjectItemCaseSensitive(json, "type");
-                    if (cJSON_IsString(type) && (type->valuestring != NULL))
-                    {
-                        if (strcmp(type->valuestring, "控制指令") == 0)
-                        {
-                            process_control_command(json);
-                        }
-                        else if (strcmp(type->valuestring, "对话") == 0)
-                        {
-                            process_dialog(json);
-                        }
-                        else
-                        {
-                            printf("Unknown type: %s\n", type->valuestring);
-                        }
-                    }
-                    cJSON_Delete(json);
-                }
+                add_message(&history, ROLE_ASSISTANT, ai_response);
+                if (cache_key_value)
+                    cache_store(&cache, cache_key_value, ai_response);
                 free(ai_response);
-                free(jsonString);
             }
-            else
+            if (strcmp(user_input, "exit") == 0)
+                break;
+            continue;
+        }
+        double turn_start = now_ms();
+        if (race_width > 0)
+        {
+            race_turn(&session, &race_loop, json_payload, &race_opts, &race_stats, race_models, cache_key_value);
+            record_latency(now_ms() - turn_start);
+            if (strcmp(user_input, "exit") == 0)
+                break;
+            continue;
+        }
+        scratch_heap_stats heap_before, heap_after;
+        unsigned long scratch_before = turn_scratch.allocs;
+        scratch_heap(&heap_before);
+        send_request(&client, json_payload, &resp);
+        // 模型调用了工具：执行后把结果一起发回去，直到它给出正常回复
+        for (int round = 0; tool_mode && round < TOOL_MAX_ROUNDS; round++)
+        {
+            size_t calls_len;
+            const char *calls = resp.data != NULL ? response_tool_calls(resp.data, resp.size, &calls_len) : NULL;
+            if (calls == NULL || run_tool_calls(&engine, &history, calls, calls_len, report_results) <= 0)
+                break;
+            cache_key_value = 0; // 回复依赖执行结果，不缓存
+            const char *tool_payload = create_json_payload(&engine, &payload, &history, 0);
+            if (tool_payload == NULL)
             {
-                printf("AI: %s\n", ai_response);
-                add_message(&history, "assistant", ai_response);
-                free(ai_response);
+                fprintf(stderr, "Error creating JSON payload for tool results\n");
+                resp.size = 0; // 上一次的回复只有工具调用，不当作回复处理
+                break;
             }
+            send_request(&client, tool_payload, &resp);
         }
+        trace("%s\n", resp.data);
 
-        free(json_payload);
-        free(resp.data);
+        // 在接收缓冲区里原地取出回复内容，不复制
+        size_t content_len;
+        char *ai_response = resp.data != NULL ? response_content(resp.data, resp.size, &content_len) : NULL;
+        if (ai_response != NULL)
+        {
+            handle_reply(&engine, &history, &cache, cache_key_value, ai_response, content_len);
+        }
+        else if (resp.size > 0)
+        {
+            fprintf(stderr, "Unexpected response: %s\n", resp.data);
+        }
+        scratch_heap(&heap_after);
+        debug("[alloc] json %lu heap, %lu scratch (%zu bytes), receive buffer %zu bytes (grown %lu times)\n",
+              heap_after.allocs - heap_before.allocs, turn_scratch.allocs - scratch_before, turn_scratch.last,
+              resp.cap, resp.grows);
+        record_latency(now_ms() - turn_start);
 
         // 可以在这里添加退出条件
         if (strcmp(user_input, "exit") == 0)
             break;
     }
 
-    free_messages(history);
+    if (fast_path)
+    {
+        info("[intent] hits %lu misses %lu ambiguous %lu\n", intent.hits, intent.misses, intent.ambiguous);
+        intent_free(&intent);
+    }
+    if (use_cache)
+    {
+        info("[cache] hits %lu misses %lu stores %lu expired %lu evictions %lu\n",
+              cache.hits, cache.misses, cache.stores, cache.expired, cache.evictions);
+        cache_free(&cache);
+    }
+    if (race_width > 0)
+    {
+        info("[race] races %lu won %lu fallbacks %lu failed %lu attempts %lu backoffs %lu invalid %lu losers %lu\n",
+              race_stats.races, race_stats.won, race_stats.fallbacks, race_stats.failed, race_stats.attempts,
+              race_stats.backoffs, race_stats.invalid, race_stats.losers);
+        async_http_cleanup(&race_loop);
+    }
+    print_latency();
+    if (metrics_count(&turn_metrics, METRIC_HTTP_TOTAL) > 0)
+    {
+        info("[metrics] http p50 %.1fms p99 %.1fms, first byte p50 %.1fms, parse p99 %.3fms, dispatch p99 %.3fms, "
+             "%lu scrapes\n",
+             metrics_quantile(&turn_metrics, METRIC_HTTP_TOTAL, 0.5) / 1000.0,
+             metrics_quantile(&turn_metrics, METRIC_HTTP_TOTAL, 0.99) / 1000.0,
+             metrics_quantile(&turn_metrics, METRIC_FIRST_BYTE, 0.5) / 1000.0,
+             metrics_quantile(&turn_metrics, METRIC_PARSE, 0.99) / 1000.0,
+             metrics_quantile(&turn_metrics, METRIC_DISPATCH, 0.99) / 1000.0, (unsigned long)turn_metrics.scrapes);
+    }
+    if (transport_stats.exchanges > 0)
+    {
+        info("[transport] %lu requests over %lu new connections (%lu on HTTP/2), wire %.1f KB sent "
+             "(request bodies %.1f KB before compression) %.1f KB received, %.0f bytes per request\n",
+             transport_stats.exchanges, transport_stats.connections, transport_stats.http2,
+             transport_stats.sent / 1024.0, transport_stats.body_bytes / 1024.0, transport_stats.received / 1024.0,
+             (double)(transport_stats.sent + transport_stats.received) / transport_stats.exchanges);
+    }
+    if (metrics_file != NULL)
+    {
+        metrics_write_file(&turn_metrics, metrics_file);
+    }
+    metrics_stop(&turn_metrics);
+    log_flush();
+    info("[config] reloads %lu (avg %.2fms max %.2fms), bootstrap requests avoided %lu\n", config_stats.reloads,
+          config_stats.reloads ? config_stats.reload_ms_total / config_stats.reloads : 0.0, config_stats.reload_ms_max,
+          config_stats.bootstrap_avoided);
+    if (retrieve_k > 0)
+    {
+        info("[catalog] queries %lu, without a match %lu\n", devices.queries, devices.empty);
+    }
+    catalog_free(&devices);
+    free(input_buf);
+    config_unwatch(&watcher);
+    config_unload(&knowledge);
+    config_unload(&prompt);
+    if (transcript.fd >= 0)
+    {
+        info("[session] restored %lu appended %lu dropped %lu compactions %lu\n", transcript.restored,
+              transcript.appended, transcript.dropped, transcript.compactions);
+        session_log_close(&transcript);
+    }
+    if (tool_mode)
+    {
+        info("[tools] rounds %lu calls %lu rejected %lu\n", engine.stats.tool_rounds, engine.stats.tool_calls,
+             engine.stats.tool_rejected);
+    }
+    info("[reply] structured %lu fenced %lu text %lu malformed %lu\n", engine.stats.structured,
+          engine.stats.fenced, engine.stats.text, engine.stats.malformed);
+    scratch_heap_stats heap;
+    scratch_heap(&heap);
+    info("[memory] scratch peak %zu of %zu bytes, %lu allocs in %lu turns, %lu fell back to heap, %lu failed; "
+         "json heap peak %zu bytes (limit %zu), %lu allocs, %lu refused; receive buffer %zu bytes\n",
+         turn_scratch.peak, turn_scratch.size, turn_scratch.allocs, turn_scratch.turns, turn_scratch.fallbacks,
+         turn_scratch.failures, heap.peak, heap.limit, heap.allocs, heap.failures, resp.cap);
+    turn_free(&engine);
+    // 合并窗口里还没执行的指令先交给线程池，再等线程池做完
+    shadow_free(&shadow);
+    worker_pool_shutdown(&workers);
+    if (workers.submitted > 0)
+    {
+        info("[workers] completed %lu, queue wait avg %.3fms max %.3fms\n", (unsigned long)workers.completed,
+              workers.wait_us_total / 1000.0 / workers.completed, workers.wait_us_max / 1000.0);
+    }
+    if (shadow.commands > 0 || shadow.answered > 0)
+    {
+        info("[shadow] commands %lu executed %lu, avoided %lu (duplicates %lu, coalesced %lu), answered %lu locally, "
+             "actuation p50 %.2fms p99 %.2fms\n", shadow.commands, shadow.executed,
+             shadow.duplicates + shadow.coalesced, shadow.duplicates, shadow.coalesced, shadow.answered,
+             metrics_quantile(&turn_metrics, METRIC_ACTUATION, 0.5) / 1000.0,
+             metrics_quantile(&turn_metrics, METRIC_ACTUATION, 0.99) / 1000.0);
+    }
+    info("[dispatch] dispatched %lu unknown %lu invalid %lu\n",
+          commands.dispatched, commands.unknown, commands.invalid);
+    dispatcher_free(&commands);
+    response_free(&resp);
+    payload_free(&payload);
+    free_messages(&history);
+    http_client_cleanup(&client);
+    scratch_free(&turn_scratch);
     return 0;
 }
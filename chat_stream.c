@@ -0,0 +1,422 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "chat_stream.h"
+#include "response.h"
+#include "util.h"
+
+// 按 2 倍增长追加数据，避免每个分片都 realloc
+static int append(char **buf, size_t *len, size_t *cap, const char *data, size_t n)
+{
+    if (*len + n + 1 > *cap)
+    {
+        size_t new_cap = *cap ? *cap : 256;
+        while (*len + n + 1 > new_cap)
+        {
+            new_cap *= 2;
+        }
+        char *p = realloc(*buf, new_cap);
+        if (p == NULL)
+        {
+            fprintf(stderr, "Memory allocation failed\n");
+            return -1;
+        }
+        *buf = p;
+        *cap = new_cap;
+    }
+    memcpy(*buf + *len, data, n);
+    *len += n;
+    (*buf)[*len] = '\0';
+    return 0;
+}
+
+void chat_stream_init(chat_stream *stream,
+                      void (*on_text)(const char *text, size_t len, void *userdata),
+                      void (*on_object)(const char *json, size_t len, void *userdata),
+                      void *userdata)
+{
+    memset(stream, 0, sizeof(*stream));
+    stream->on_text = on_text;
+    stream->on_object = on_object;
+    stream->userdata = userdata;
+    stream->start_ms = now_ms();
+}
+
+void chat_stream_free(chat_stream *stream)
+{
+    free(stream->line);
+    free(stream->content);
+    free(stream->other);
+    memset(stream, 0, sizeof(*stream));
+}
+
+static void emit_text(chat_stream *stream, const char *text, size_t len)
+{
+    if (stream->on_text != NULL && len > 0)
+    {
+        stream->on_text(text, len, stream->userdata);
+    }
+}
+
+// 把一个码点按 UTF-8 输出
+static void emit_codepoint(chat_stream *stream, unsigned int cp)
+{
+    char out[4];
+    size_t n;
+    if (cp < 0x80)
+    {
+        out[0] = (char)cp;
+        n = 1;
+    }
+    else if (cp < 0x800)
+    {
+        out[0] = (char)(0xC0 | (cp >> 6));
+        out[1] = (char)(0x80 | (cp & 0x3F));
+        n = 2;
+    }
+    else if (cp < 0x10000)
+    {
+        out[0] = (char)(0xE0 | (cp >> 12));
+        out[1] = (char)(0x80 | ((cp >> 6) & 0x3F));
+        out[2] = (char)(0x80 | (cp & 0x3F));
+        n = 3;
+    }
+    else
+    {
+        out[0] = (char)(0xF0 | (cp >> 18));
+        out[1] = (char)(0x80 | ((cp >> 12) & 0x3F));
+        out[2] = (char)(0x80 | ((cp >> 6) & 0x3F));
+        out[3] = (char)(0x80 | (cp & 0x3F));
+        n = 4;
+    }
+    emit_text(stream, out, n);
+}
+
+// 没等到低位的高位代理输出成 U+FFFD
+static void flush_surrogate(chat_stream *stream)
+{
+    if (stream->high_surrogate != 0)
+    {
+        stream->high_surrogate = 0;
+        emit_codepoint(stream, 0xFFFD);
+    }
+}
+
+// 一个 \uXXXX 结束：代理对（例如 \uD83D\uDE00）先拼成一个码点再编码，落单的代理输出 U+FFFD
+static void emit_escaped_unit(chat_stream *stream, unsigned int unit)
+{
+    if (unit >= 0xDC00 && unit <= 0xDFFF)
+    {
+        if (stream->high_surrogate != 0)
+        {
+            unsigned int cp = 0x10000 + ((stream->high_surrogate - 0xD800) << 10) + (unit - 0xDC00);
+            stream->high_surrogate = 0;
+            emit_codepoint(stream, cp);
+        }
+        else
+        {
+            emit_codepoint(stream, 0xFFFD);
+        }
+        return;
+    }
+    flush_surrogate(stream);
+    if (unit >= 0xD800 && unit <= 0xDBFF)
+    {
+        stream->high_surrogate = unit;
+        return;
+    }
+    emit_codepoint(stream, unit);
+}
+
+static int hex_value(char c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return 0;
+}
+
+// 处理 message 字符串值里的一个字符（已在字符串内）
+static void print_string_char(chat_stream *stream, char c)
+{
+    if (stream->unicode_left > 0)
+    {
+        stream->unicode_value = (stream->unicode_value << 4) | hex_value(c);
+        if (--stream->unicode_left == 0)
+        {
+            emit_escaped_unit(stream, stream->unicode_value);
+        }
+        return;
+    }
+    if (stream->escape && c == 'u')
+    {
+        stream->unicode_left = 4; // 高位代理留着，看后面是不是低位
+        stream->unicode_value = 0;
+        return;
+    }
+    flush_surrogate(stream);
+    if (!stream->escape)
+    {
+        emit_text(stream, &c, 1);
+        return;
+    }
+    switch (c)
+    {
+    case 'n':
+        emit_text(stream, "\n", 1);
+        break;
+    case 't':
+        emit_text(stream, "\t", 1);
+        break;
+    case 'r':
+        emit_text(stream, "\r", 1);
+        break;
+    case 'b':
+        emit_text(stream, "\b", 1);
+        break;
+    case 'f':
+        emit_text(stream, "\f", 1);
+        break;
+    default: // \" \\ \/ 等直接输出字符本身
+        emit_text(stream, &c, 1);
+        break;
+    }
+}
+
+// 增量扫描新到的回复内容
+static void scan_content(chat_stream *stream)
+{
+    while (stream->scan_pos < stream->content_len)
+    {
+        size_t i = stream->scan_pos++;
+        char c = stream->content[i];
+
+        if (stream->mode == 0)
+        {
+            // 跳过前导空白和 ```json 围栏，找到第一个 '{'
+            if (c == '{')
+            {
+                stream->mode = 1;
+                stream->depth = 1;
+                stream->level = 1;
+                stream->expect_key = 1;
+                stream->object_start = i;
+            }
+            else if (c == '`')
+            {
+                stream->fenced = 1;
+            }
+            else if (!stream->fenced && c != ' ' && c != '\n' && c != '\r' && c != '\t')
+            {
+                // 不是 JSON，按普通文本逐字输出
+                stream->mode = 2;
+                emit_text(stream, stream->content + i, stream->content_len - i);
+                stream->scan_pos = stream->content_len;
+            }
+            continue;
+        }
+        if (stream->mode == 2)
+        {
+            emit_text(stream, stream->content + i, stream->content_len - i);
+            stream->scan_pos = stream->content_len;
+            continue;
+        }
+        if (stream->object_done)
+        {
+            // 对象之后的内容（结尾的 ```）忽略
+            stream->scan_pos = stream->content_len;
+            continue;
+        }
+
+        if (stream->in_string)
+        {
+            if (stream->printing && !(c == '"' && !stream->escape && stream->unicode_left == 0))
+            {
+                if (c == '\\' && !stream->escape && stream->unicode_left == 0)
+                {
+                    stream->escape = 1;
+                    continue;
+                }
+                print_string_char(stream, c);
+                stream->escape = 0;
+                continue;
+            }
+            if (stream->escape)
+            {
+                stream->escape = 0;
+            }
+            else if (c == '\\')
+            {
+                stream->escape = 1;
+            }
+            else if (c == '"')
+            {
+                stream->in_string = 0;
+                if (stream->printing)
+                    flush_surrogate(stream);
+                stream->printing = 0;
+                if (stream->depth == stream->level && stream->string_is_key)
+                {
+                    size_t key_len = i - stream->key_start;
+                    stream->last_key_is_message =
+                        key_len == 7 && memcmp(stream->content + stream->key_start, "message", 7) == 0;
+                    stream->last_key_is_reply = stream->level == 1 && key_len == 5 &&
+                                                memcmp(stream->content + stream->key_start, "reply", 5) == 0;
+                }
+            }
+            continue;
+        }
+
+        switch (c)
+        {
+        case '"':
+            stream->in_string = 1;
+            stream->string_is_key = stream->depth == stream->level && stream->expect_key;
+            if (stream->string_is_key)
+            {
+                stream->key_start = i + 1;
+            }
+            else if (stream->depth == stream->level && stream->last_key_is_message)
+            {
+                stream->printing = 1;
+            }
+            break;
+        case ':':
+            if (stream->depth == stream->level)
+                stream->expect_key = 0;
+            break;
+        case ',':
+            if (stream->depth == stream->level)
+            {
+                stream->expect_key = 1;
+                stream->last_key_is_message = 0;
+                stream->last_key_is_reply = 0;
+            }
+            break;
+        case '{':
+            // --json-schema 的回复在 "reply" 里，往下一层找 message
+            if (stream->depth == 1 && stream->last_key_is_reply && !stream->expect_key)
+            {
+                stream->level = 2;
+                stream->expect_key = 1;
+                stream->last_key_is_reply = 0;
+            }
+            stream->depth++;
+            break;
+        case '[':
+            stream->depth++;
+            break;
+        case '}':
+        case ']':
+            if (--stream->depth == 0)
+            {
+                // 对象闭合，不等 [DONE] 立即回调
+                stream->object_done = 1;
+                stream->object_len = i - stream->object_start + 1;
+                stream->object_ms = now_ms();
+                if (stream->on_object != NULL)
+                {
+                    stream->on_object(stream->content + stream->object_start, stream->object_len,
+                                      stream->userdata);
+                }
+            }
+            break;
+        default:
+            break;
+        }
+    }
+}
+
+void chat_stream_feed_content(chat_stream *stream, const char *text, size_t len)
+{
+    if (len == 0)
+        return;
+    if (stream->first_token_ms == 0)
+    {
+        stream->first_token_ms = now_ms();
+    }
+    if (append(&stream->content, &stream->content_len, &stream->content_cap, text, len) != 0)
+        return;
+    scan_content(stream);
+}
+
+// 处理一行 SSE
+static void handle_line(chat_stream *stream, char *line, size_t len)
+{
+    if (len > 0 && line[len - 1] == '\r')
+    {
+        line[--len] = '\0';
+    }
+    if (len == 0 || line[0] == ':')
+    {
+        return; // 事件分隔或注释
+    }
+    if (strncmp(line, "data:", 5) != 0)
+    {
+        // 不是 SSE（例如服务器直接返回的错误 JSON）
+        append(&stream->other, &stream->other_len, &stream->other_cap, line, len);
+        append(&stream->other, &stream->other_len, &stream->other_cap, "\n", 1);
+        return;
+    }
+
+    char *data = line + 5;
+    while (*data == ' ')
+        data++;
+    if (strcmp(data, "[DONE]") == 0)
+    {
+        stream->done = 1;
+        return;
+    }
+
+    // 和非流式回复一样在行缓冲里原地取出 delta.content，每个分片不建 cJSON 树
+    if (*data != '{')
+    {
+        fprintf(stderr, "Bad stream chunk: %s\n", data);
+        return;
+    }
+    size_t content_len;
+    char *content = response_delta_content(data, len - (data - line), &content_len);
+    if (content != NULL)
+    {
+        chat_stream_feed_content(stream, content, content_len);
+    }
+}
+
+size_t chat_stream_write(char *ptr, size_t size, size_t nmemb, void *userdata)
+{
+    chat_stream *stream = userdata;
+    size_t n = size * nmemb;
+    size_t start = 0;
+
+    for (size_t i = 0; i < n; i++)
+    {
+        if (ptr[i] != '\n')
+            continue;
+        if (append(&stream->line, &stream->line_len, &stream->line_cap, ptr + start, i - start) != 0)
+            return 0;
+        handle_line(stream, stream->line, stream->line_len);
+        stream->line_len = 0;
+        start = i + 1;
+    }
+    if (start < n && append(&stream->line, &stream->line_len, &stream->line_cap, ptr + start, n - start) != 0)
+        return 0;
+    fflush(stdout);
+    return n;
+}
+
+char *chat_stream_result(const chat_stream *stream)
+{
+    if (stream->object_done)
+    {
+        return strndup(stream->content + stream->object_start, stream->object_len);
+    }
+    if (stream->content_len > 0)
+    {
+        return strdup(stream->content);
+    }
+    return NULL;
+}
@@ -0,0 +1,75 @@
+#ifndef CHAT_STREAM_H
+#define CHAT_STREAM_H
+#include <stddef.h>
+
+// 流式（SSE）对话解析
+// 请求里带上 "stream": true 后，服务器按 "data: {...}\n\n" 逐段返回 delta.content。
+// 这里一边接收一边扫描回复内容：对话消息逐字输出，控制指令的 JSON 对象一闭合就立即回调，
+// 不必等整段回复生成完。
+
+typedef struct chat_stream
+{
+    // SSE 行缓冲（一行可能跨多个网络分片）
+    char *line;
+    size_t line_len;
+    size_t line_cap;
+
+    // 累积的回复内容（所有 delta.content 拼接）
+    char *content;
+    size_t content_len;
+    size_t content_cap;
+
+    // 回复内容的增量扫描状态
+    size_t scan_pos;     // 已扫描到 content 的位置
+    int mode;            // 0 未确定，1 JSON 对象，2 普通文本
+    int fenced;          // 内容以 ```json 围栏开头
+    int depth;           // 花括号深度
+    int in_string;       // 是否在字符串内
+    int escape;          // 上一个字符是否是反斜杠
+    int unicode_left;    // \uXXXX 还差几位十六进制
+    unsigned int unicode_value;
+    unsigned int high_surrogate; // 等待配对的 \uD800-\uDBFF，0 表示没有
+    int expect_key;      // 第一层对象中，下一个字符串是否是键
+    int printing;        // 正在逐字输出 "message" 的值
+    int string_is_key;   // 当前字符串是第一层的键
+    size_t key_start;    // 当前第一层字符串的起点
+    size_t object_start; // JSON 对象在 content 中的起点
+    size_t object_len;
+    int object_done;     // 对象已经闭合并回调过
+    int last_key_is_message; // 最近的第一层键是 "message"
+    int last_key_is_reply;   // 最近的第一层键是 "reply"
+    int level;               // 回复所在的层：1，或者包在 {"reply": {...}} 里时为 2
+
+    // 非 SSE 的响应（例如错误 JSON）原样保存，便于报错
+    char *other;
+    size_t other_len;
+    size_t other_cap;
+
+    int done;                // 收到 [DONE]
+    double start_ms;         // 请求开始时间
+    double first_token_ms;   // 收到第一个内容分片的时间
+    double object_ms;        // 对象闭合、回调的时间
+
+    // 逐字输出回调：message 字段或普通文本的新片段
+    void (*on_text)(const char *text, size_t len, void *userdata);
+    // JSON 对象闭合回调：json 指向 content 中的对象文本（不以 '\0' 结尾）
+    void (*on_object)(const char *json, size_t len, void *userdata);
+    void *userdata;
+} chat_stream;
+
+void chat_stream_init(chat_stream *stream,
+                      void (*on_text)(const char *text, size_t len, void *userdata),
+                      void (*on_object)(const char *json, size_t len, void *userdata),
+                      void *userdata);
+void chat_stream_free(chat_stream *stream);
+
+// curl 写回调，userdata 为 chat_stream
+size_t chat_stream_write(char *ptr, size_t size, size_t nmemb, void *userdata);
+
+// 直接喂入一段 delta.content（测试或非 SSE 来源时使用）
+void chat_stream_feed_content(chat_stream *stream, const char *text, size_t len);
+
+// 请求结束后取回完整的 JSON 对象（没有对象时返回整段内容），返回新分配的字符串
+char *chat_stream_result(const chat_stream *stream);
+
+#endif
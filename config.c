@@ -0,0 +1,207 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include "util.h"
+#include "config.h"
+
+int config_load(config_file *file, const char *path)
+{
+    struct stat st;
+
+    memset(file, 0, sizeof(*file));
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || fstat(fd, &st) != 0)
+    {
+        fprintf(stderr, "Error opening file %s\n", path);
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+    // 读一份到堆上，不用 mmap：编辑器原地改写文件时，映射会跟着变（变短还会 SIGBUS），
+    // 热更新时就没法和上次发给模型的内容比较了
+    file->size = (size_t)st.st_size;
+    char *data = malloc(file->size + 1);
+    size_t got = 0;
+    while (data != NULL && got < file->size)
+    {
+        ssize_t n = read(fd, data + got, file->size - got);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break; // 读的时候文件被截短了，按读到的算
+        got += (size_t)n;
+    }
+    close(fd);
+    if (data == NULL)
+    {
+        fprintf(stderr, "Memory allocation failed\n");
+        return -1;
+    }
+    data[got] = '\0';
+    file->data = data;
+    file->size = got;
+
+    file->path = strdup(path);
+    file->stripped = config_strip_comments(file->data, file->size);
+    if (file->path == NULL || file->stripped == NULL)
+    {
+        fprintf(stderr, "Memory allocation failed\n");
+        config_unload(file);
+        return -1;
+    }
+    const char *slash = strrchr(file->path, '/');
+    file->name = slash != NULL ? slash + 1 : file->path;
+    file->fingerprint = hash_bytes(HASH_INIT, file->data, file->size);
+    return 0;
+}
+
+void config_unload(config_file *file)
+{
+    free((void *)file->data);
+    free(file->path);
+    free(file->stripped);
+    memset(file, 0, sizeof(*file));
+}
+
+static int has_line(const char *text, size_t size, const char *line, size_t len)
+{
+    for (const char *p = text; p < text + size;)
+    {
+        const char *end = memchr(p, '\n', text + size - p);
+        size_t n = end != NULL ? (size_t)(end - p) : (size_t)(text + size - p);
+        if (n == len && memcmp(p, line, len) == 0)
+            return 1;
+        p += n + 1;
+    }
+    return 0;
+}
+
+// 把 from 里有、to 里没有的非空行写出去
+static void write_missing_lines(FILE *out, const char *label, const config_file *from, const config_file *to)
+{
+    for (const char *p = from->data; p < from->data + from->size;)
+    {
+        const char *end = memchr(p, '\n', from->data + from->size - p);
+        size_t n = end != NULL ? (size_t)(end - p) : (size_t)(from->data + from->size - p);
+        if (n > 0 && !has_line(to->data, to->size, p, n))
+            fprintf(out, "%s%.*s\n", label, (int)n, p);
+        p += n + 1;
+    }
+}
+
+char *config_prompt_delta(const config_file *old, const config_file *updated)
+{
+    char *text = NULL;
+    size_t len = 0;
+    FILE *out = open_memstream(&text, &len);
+    if (out == NULL)
+        return NULL;
+    fprintf(out, "提示词已更新。\n");
+    write_missing_lines(out, "新增：", updated, old);
+    write_missing_lines(out, "不再适用：", old, updated);
+    fclose(out);
+    return text;
+}
+
+char *config_strip_comments(const char *text, size_t len)
+{
+    char *out = malloc(len + 1);
+    if (out == NULL)
+        return NULL;
+    size_t i = 0;
+    while (i < len)
+    {
+        char c = text[i];
+        if (c == '"')
+        {
+            // 字符串原样拷贝，里面的 // 不是注释
+            out[i] = text[i];
+            for (i++; i < len; i++)
+            {
+                out[i] = text[i];
+                if (text[i] == '\\' && i + 1 < len)
+                {
+                    out[i + 1] = text[i + 1];
+                    i++;
+                }
+                else if (text[i] == '"')
+                {
+                    i++;
+                    break;
+                }
+            }
+        }
+        else if (c == '/' && i + 1 < len && text[i + 1] == '/')
+        {
+            while (i < len && text[i] != '\n')
+                out[i++] = ' ';
+        }
+        else if (c == '/' && i + 1 < len && text[i + 1] == '*')
+        {
+            out[i] = out[i + 1] = ' ';
+            for (i += 2; i < len && !(text[i] == '*' && i + 1 < len && text[i + 1] == '/'); i++)
+                out[i] = text[i] == '\n' ? '\n' : ' ';
+            for (int k = 0; k < 2 && i < len; k++)
+                out[i++] = ' ';
+        }
+        else
+        {
+            out[i] = c;
+            i++;
+        }
+    }
+    out[len] = '\0';
+    return out;
+}
+
+int config_watch(config_watcher *watcher, const char *dir)
+{
+    watcher->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    watcher->wd = watcher->fd >= 0 ? inotify_add_watch(watcher->fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO) : -1;
+    if (watcher->wd < 0)
+    {
+        perror("inotify");
+        config_unwatch(watcher);
+        return -1;
+    }
+    return 0;
+}
+
+void config_unwatch(config_watcher *watcher)
+{
+    if (watcher->fd >= 0)
+        close(watcher->fd);
+    watcher->fd = -1;
+    watcher->wd = -1;
+}
+
+unsigned config_poll_changes(config_watcher *watcher, config_file *const *files, int count)
+{
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    unsigned changed = 0;
+    ssize_t n;
+
+    if (watcher->fd < 0)
+        return 0;
+    while ((n = read(watcher->fd, buf, sizeof(buf))) > 0)
+    {
+        for (char *p = buf; p < buf + n;)
+        {
+            const struct inotify_event *event = (const struct inotify_event *)p;
+            for (int i = 0; event->len > 0 && i < count; i++)
+            {
+                if (files[i]->name != NULL && strcmp(event->name, files[i]->name) == 0)
+                    changed |= 1u << i;
+            }
+            p += sizeof(struct inotify_event) + event->len;
+        }
+    }
+    if (n < 0 && errno != EAGAIN)
+        perror("read inotify");
+    return changed;
+}
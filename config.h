@@ -0,0 +1,43 @@
+#ifndef CONFIG_H
+#define CONFIG_H
+#include <stddef.h>
+#include <stdint.h>
+
+// 启动配置（知识库 dev_ctrl.json、提示词 Prompt.txt）的加载和热更新
+// 文件整个读到堆上（不受之后原地改写的影响），内容直接作为固定消息发给模型（注释对模型有用，原样保留），
+// 同时生成一份去掉 // 和 /* */ 注释的严格 JSON 给解析用，注释换成空格，行号不变。
+// 用 inotify 监视所在目录（编辑器大多是写临时文件再改名），文件内容的指纹变了才算变化。
+
+typedef struct config_file
+{
+    char *path;
+    const char *name;     // path 里的文件名部分
+    const char *data;     // 加载时的内容，以 '\0' 结尾（不计入 size）
+    size_t size;
+    uint64_t fingerprint; // 内容的 FNV-1a 哈希
+    char *stripped;       // 去掉注释的内容，以 '\0' 结尾
+} config_file;
+
+typedef struct config_watcher
+{
+    int fd; // inotify，非阻塞，可以放进 epoll
+    int wd;
+} config_watcher;
+
+// 失败返回 -1，file 保持为空
+int config_load(config_file *file, const char *path);
+void config_unload(config_file *file);
+
+// 提示词按行比较 old 和 updated，返回只含新增和删掉的行的说明（新分配的字符串）
+char *config_prompt_delta(const config_file *old, const config_file *updated);
+
+// 去掉 JSON 文本里字符串之外的注释，返回新分配的字符串
+char *config_strip_comments(const char *text, size_t len);
+
+// 监视 dir 目录；失败返回 -1（此时不热更新）
+int config_watch(config_watcher *watcher, const char *dir);
+void config_unwatch(config_watcher *watcher);
+// 读出所有待处理的事件，files 中被写入或替换过的文件在返回的位掩码里置位（第 i 个对应 1 << i）
+unsigned config_poll_changes(config_watcher *watcher, config_file *const *files, int count);
+
+#endif
@@ -0,0 +1,196 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <cJSON.h>
+#include "context.h"
+
+// 每条消息在请求中的固定开销（role、分隔符等）
+#define MESSAGE_OVERHEAD_TOKENS 4
+
+#define SUMMARY_PROMPT "请用中文简要总结下面这段对话，保留用户的偏好、设备的当前状态和尚未完成的请求，" \
+                       "不超过200字，只输出总结内容。"
+#define SUMMARY_PREFIX "此前对话的摘要："
+
+void context_init(context_manager *context, size_t token_budget, size_t keep_turns, const char *model,
+                  summarize_fn summarize, void *userdata)
+{
+    memset(context, 0, sizeof(*context));
+    context->token_budget = token_budget;
+    context->keep_turns = keep_turns;
+    context->model = model;
+    context->summarize = summarize;
+    context->userdata = userdata;
+}
+
+size_t estimate_tokens(const char *text, size_t len)
+{
+    size_t tokens = 0;
+    size_t ascii = 0;
+    for (size_t i = 0; i < len; i++)
+    {
+        unsigned char c = (unsigned char)text[i];
+        if (c < 0x80)
+        {
+            ascii++;
+        }
+        else if ((c & 0xC0) != 0x80)
+        {
+            // 多字节字符的首字节，中文基本是一字一个 token
+            tokens++;
+        }
+    }
+    return tokens + (ascii + 3) / 4;
+}
+
+static size_t message_tokens(Message *message)
+{
+    if (message->tokens == 0)
+    {
+        message->tokens = estimate_tokens(message->content, message->length) + MESSAGE_OVERHEAD_TOKENS;
+    }
+    return message->tokens;
+}
+
+size_t context_tokens(History *history)
+{
+    size_t total = 0;
+    for (Message *current = history->head; current != NULL; current = current->next)
+    {
+        total += message_tokens(current);
+    }
+    return total;
+}
+
+// 统计可以压缩的消息：最近 keep_turns 个用户轮次之前的未固定消息和旧摘要
+static size_t compressible_messages(const context_manager *context, History *history)
+{
+    size_t user_turns = 0;
+    size_t count = 0;
+
+    for (Message *current = history->head; current != NULL; current = current->next)
+    {
+        if (!current->pinned && current->role == ROLE_USER)
+            user_turns++;
+    }
+    if (user_turns <= context->keep_turns)
+    {
+        return 0;
+    }
+
+    // 第 (user_turns - keep_turns) 个用户轮次之后的消息都保留原文
+    size_t turns_to_compress = user_turns - context->keep_turns;
+    for (Message *current = history->head; current != NULL; current = current->next)
+    {
+        if (!current->pinned && current->role == ROLE_USER)
+        {
+            if (turns_to_compress == 0)
+                break;
+            turns_to_compress--;
+        }
+        if (!current->pinned || current->summary)
+        {
+            count++;
+        }
+    }
+    return count;
+}
+
+// 摘要请求：系统提示 + 旧对话的文字记录（包括之前的摘要）
+static char *create_summary_payload(const context_manager *context, History *history, size_t count)
+{
+    size_t transcript_len = 0;
+    size_t n = 0;
+    for (Message *current = history->head; current != NULL && n < count; current = current->next)
+    {
+        if (!current->pinned || current->summary)
+        {
+            transcript_len += current->length + 16;
+            n++;
+        }
+    }
+
+    char *transcript = malloc(transcript_len + 1);
+    if (transcript == NULL)
+    {
+        fprintf(stderr, "Memory allocation failed\n");
+        return NULL;
+    }
+    size_t pos = 0;
+    n = 0;
+    for (Message *current = history->head; current != NULL && n < count; current = current->next)
+    {
+        if (!current->pinned || current->summary)
+        {
+            pos += sprintf(transcript + pos, "%s: %s\n", role_name(current->role), current->content);
+            n++;
+        }
+    }
+
+    cJSON *root = cJSON_CreateObject();
+    cJSON_AddStringToObject(root, "model", context->model);
+    cJSON *messages = cJSON_AddArrayToObject(root, "messages");
+    cJSON *system = cJSON_CreateObject();
+    cJSON_AddStringToObject(system, "role", "system");
+    cJSON_AddStringToObject(system, "content", SUMMARY_PROMPT);
+    cJSON_AddItemToArray(messages, system);
+    cJSON *user = cJSON_CreateObject();
+    cJSON_AddStringToObject(user, "role", "user");
+    cJSON_AddStringToObject(user, "content", transcript);
+    cJSON_AddItemToArray(messages, user);
+
+    char *json = cJSON_PrintUnformatted(root);
+    cJSON_Delete(root);
+    free(transcript);
+    return json;
+}
+
+int context_enforce(context_manager *context, History *history)
+{
+    context->last_tokens = context_tokens(history);
+    if (context->token_budget == 0 || context->last_tokens <= context->token_budget)
+    {
+        return 0;
+    }
+
+    size_t count = compressible_messages(context, history);
+    if (count == 0)
+    {
+        return 0;
+    }
+
+    char *summary = NULL;
+    if (context->summarize != NULL)
+    {
+        char *request = create_summary_payload(context, history, count);
+        if (request != NULL)
+        {
+            summary = context->summarize(request, context->userdata);
+            cJSON_free(request);
+        }
+    }
+
+    if (summary != NULL)
+    {
+        size_t len = strlen(SUMMARY_PREFIX) + strlen(summary) + 1;
+        char *content = malloc(len);
+        if (content != NULL)
+        {
+            snprintf(content, len, "%s%s", SUMMARY_PREFIX, summary);
+            history_replace_oldest(history, count, ROLE_SYSTEM, content);
+            context->summaries++;
+            context->summarized_messages += count;
+            free(content);
+        }
+        free(summary);
+    }
+    else
+    {
+        // 摘要失败时直接丢弃旧对话，保证请求不超过模型的上下文限制
+        fprintf(stderr, "Summary request failed, dropping %zu old messages\n", count);
+        history_replace_oldest(history, count, ROLE_SYSTEM, NULL);
+        context->dropped_messages += count;
+    }
+
+    context->last_tokens = context_tokens(history);
+    return 1;
+}
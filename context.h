@@ -0,0 +1,40 @@
+#ifndef CONTEXT_H
+#define CONTEXT_H
+#include <stddef.h>
+#include "history.h"
+
+// 上下文窗口管理
+// 按本地估算的 token 数控制每轮请求的大小。超过预算时，把最近几轮之前的旧对话
+// 交给一个单独的摘要请求压缩成一条摘要消息；知识库和提示词（固定消息）始终保留。
+
+// 摘要请求的发送方式由调用方提供（真实接口或本地测试桩）。
+// 返回新分配的摘要文本，失败返回 NULL
+typedef char *(*summarize_fn)(const char *request_json, void *userdata);
+
+typedef struct context_manager
+{
+    size_t token_budget; // 每轮请求的 token 上限
+    size_t keep_turns;   // 压缩时保留原文的最近轮数
+    const char *model;   // 摘要请求使用的模型
+    summarize_fn summarize;
+    void *userdata;
+
+    size_t last_tokens;         // 最近一次估算的总 token 数
+    size_t summaries;           // 生成过的摘要次数
+    size_t summarized_messages; // 被压缩掉的消息条数
+    size_t dropped_messages;    // 摘要失败时直接丢弃的消息条数
+} context_manager;
+
+void context_init(context_manager *context, size_t token_budget, size_t keep_turns, const char *model,
+                  summarize_fn summarize, void *userdata);
+
+// 估算一段 UTF-8 文本的 token 数：ASCII 约 4 字节一个 token，其余每个字符按一个 token 计
+size_t estimate_tokens(const char *text, size_t len);
+
+// 整个历史的 token 数，每条消息的估算结果缓存在 Message.tokens 中
+size_t context_tokens(History *history);
+
+// 保证历史不超过预算；发生压缩返回 1，未压缩返回 0
+int context_enforce(context_manager *context, History *history);
+
+#endif
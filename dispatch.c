@@ -0,0 +1,437 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "dispatch.h"
+#include "util.h"
+
+static char *read_file(const char *path)
+{
+    FILE *fp = fopen(path, "rb");
+    if (fp == NULL)
+    {
+        return NULL;
+    }
+    fseek(fp, 0, SEEK_END);
+    long size = ftell(fp);
+    rewind(fp);
+    char *data = malloc(size + 1);
+    if (data != NULL)
+    {
+        size_t n = fread(data, 1, size, fp);
+        data[n] = '\0';
+    }
+    fclose(fp);
+    return data;
+}
+
+static dispatch_entry *table_find(const dispatch_table *table, const char *name, uint32_t hash)
+{
+    if (table->size == 0)
+        return NULL;
+    size_t mask = table->size - 1;
+    for (size_t pos = hash & mask;; pos = (pos + 1) & mask)
+    {
+        dispatch_entry *entry = &table->slots[pos];
+        if (entry->name == NULL)
+            return NULL;
+        if (entry->hash == hash && strcmp(entry->name, name) == 0)
+            return entry;
+    }
+}
+
+static void table_place(dispatch_table *table, const dispatch_entry *entry)
+{
+    size_t mask = table->size - 1;
+    size_t pos = entry->hash & mask;
+    while (table->slots[pos].name != NULL)
+        pos = (pos + 1) & mask;
+    table->slots[pos] = *entry;
+}
+
+// 负载超过一半时翻倍，保持探测链很短
+static int table_grow(dispatch_table *table)
+{
+    size_t size = table->size ? table->size * 2 : 16;
+    dispatch_entry *old = table->slots;
+    size_t old_size = table->size;
+
+    table->slots = calloc(size, sizeof(dispatch_entry));
+    if (table->slots == NULL)
+    {
+        table->slots = old;
+        return -1;
+    }
+    table->size = size;
+    for (size_t i = 0; i < old_size; i++)
+    {
+        if (old[i].name != NULL)
+            table_place(table, &old[i]);
+    }
+    free(old);
+    return 0;
+}
+
+// 查找或新建一项
+static dispatch_entry *table_insert(dispatch_table *table, const char *name)
+{
+    uint32_t hash = (uint32_t)hash_string(name);
+    dispatch_entry *entry = table_find(table, name, hash);
+    if (entry != NULL)
+        return entry;
+    if ((table->count + 1) * 2 > table->size && table_grow(table) != 0)
+        return NULL;
+
+    dispatch_entry created = {0};
+    created.name = strdup(name);
+    created.hash = hash;
+    if (created.name == NULL)
+        return NULL;
+    table_place(table, &created);
+    table->count++;
+    return table_find(table, name, hash);
+}
+
+static void table_free(dispatch_table *table)
+{
+    for (size_t i = 0; i < table->size; i++)
+    {
+        free(table->slots[i].name);
+    }
+    free(table->slots);
+    memset(table, 0, sizeof(*table));
+}
+
+int dispatcher_init(dispatcher *d, const char *controls_path)
+{
+    memset(d, 0, sizeof(*d));
+
+    char *text = read_file(controls_path);
+    if (text == NULL)
+    {
+        fprintf(stderr, "Error opening file %s\n", controls_path);
+        return -1;
+    }
+    int result = dispatcher_load(d, text);
+    free(text);
+    if (result != 0)
+    {
+        fprintf(stderr, "Error parsing %s\n", controls_path);
+    }
+    return result;
+}
+
+int dispatcher_load(dispatcher *d, const char *json_text)
+{
+    // 文件里的 // 注释先用 cJSON_Minify 去掉
+    char *text = strdup(json_text);
+    if (text == NULL)
+    {
+        return -1;
+    }
+    cJSON_Minify(text);
+    cJSON *controls = cJSON_Parse(text);
+    free(text);
+    if (controls == NULL)
+    {
+        return -1;
+    }
+
+    // 新表建好再替换，中途失败时原来的定义不受影响
+    dispatch_table operations;
+    memset(&operations, 0, sizeof(operations));
+    const cJSON *control;
+    cJSON_ArrayForEach(control, cJSON_GetObjectItemCaseSensitive(controls, "controls"))
+    {
+        const cJSON *operation = cJSON_GetObjectItemCaseSensitive(control, "operation");
+        const cJSON *parameters = cJSON_GetObjectItemCaseSensitive(control, "parameters");
+        if (!cJSON_IsString(operation) || !cJSON_IsObject(parameters))
+        {
+            fprintf(stderr, "Control %s has no operation or parameters\n", control->string);
+            continue;
+        }
+        uint32_t hash = (uint32_t)hash_string(operation->valuestring);
+        if (table_find(&operations, operation->valuestring, hash) != NULL)
+        {
+            fprintf(stderr, "Duplicate operation: %s\n", operation->valuestring);
+            continue;
+        }
+        dispatch_entry *entry = table_insert(&operations, operation->valuestring);
+        if (entry == NULL)
+        {
+            table_free(&operations);
+            cJSON_Delete(controls);
+            return -1;
+        }
+        entry->schema = parameters;
+        // 重新加载时保留已注册的处理函数
+        const dispatch_entry *old = table_find(&d->operations, operation->valuestring, hash);
+        if (old != NULL)
+        {
+            entry->handler = old->handler;
+            entry->userdata = old->userdata;
+        }
+    }
+
+    table_free(&d->operations);
+    d->operations = operations;
+    cJSON_Delete(d->controls);
+    d->controls = controls;
+    return 0;
+}
+
+void dispatcher_free(dispatcher *d)
+{
+    table_free(&d->types);
+    table_free(&d->operations);
+    cJSON_Delete(d->controls);
+    memset(d, 0, sizeof(*d));
+}
+
+int dispatcher_register_type(dispatcher *d, const char *type, dispatch_handler handler, void *userdata)
+{
+    dispatch_entry *entry = table_insert(&d->types, type);
+    if (entry == NULL)
+    {
+        return -1;
+    }
+    entry->handler = handler;
+    entry->userdata = userdata;
+    return 0;
+}
+
+int dispatcher_register_operation(dispatcher *d, const char *operation, dispatch_handler handler, void *userdata)
+{
+    dispatch_entry *entry = table_find(&d->operations, operation, (uint32_t)hash_string(operation));
+    if (entry == NULL)
+    {
+        fprintf(stderr, "Operation %s is not defined in dev_ctrl.json\n", operation);
+        return -1;
+    }
+    entry->handler = handler;
+    entry->userdata = userdata;
+    return 0;
+}
+
+void dispatcher_set_fallback(dispatcher *d, dispatch_handler handler, void *userdata)
+{
+    d->fallback = handler;
+    d->fallback_userdata = userdata;
+}
+
+// 类型相同；cJSON 把 true 和 false 当成两种类型，布尔值只看是不是布尔
+static int same_type(const cJSON *value, const cJSON *expected)
+{
+    if (cJSON_IsBool(expected))
+        return cJSON_IsBool(value);
+    return (value->type & 0xFF) == (expected->type & 0xFF);
+}
+
+// 定义里的每个参数都必须出现，类型和示例值相同
+static int check_parameters(const cJSON *schema, const cJSON *parameters)
+{
+    const cJSON *expected;
+    cJSON_ArrayForEach(expected, schema)
+    {
+        const cJSON *value = cJSON_GetObjectItemCaseSensitive(parameters, expected->string);
+        if (value == NULL || !same_type(value, expected) ||
+            (cJSON_IsString(value) && value->valuestring == NULL))
+        {
+            printf("Parameter %s missing or incorrect format\n", expected->string);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+dispatch_result dispatch_resolve(dispatcher *d, const cJSON *json, dispatch_handler *handler, void **userdata)
+{
+    const cJSON *operation = cJSON_GetObjectItemCaseSensitive(json, "operation");
+    if (!cJSON_IsString(operation) || (operation->valuestring == NULL))
+    {
+        printf("Operation missing or incorrect format\n");
+        d->invalid++;
+        return DISPATCH_INVALID;
+    }
+
+    dispatch_entry *entry = table_find(&d->operations, operation->valuestring, (uint32_t)hash_string(operation->valuestring));
+    *handler = entry != NULL && entry->handler != NULL ? entry->handler : d->fallback;
+    if (entry == NULL || *handler == NULL)
+    {
+        printf("Unknown operation: %s\n", operation->valuestring);
+        d->unknown++;
+        return DISPATCH_UNKNOWN;
+    }
+
+    const cJSON *parameters = cJSON_GetObjectItemCaseSensitive(json, "parameters");
+    if (!cJSON_IsObject(parameters))
+    {
+        printf("Parameters missing or incorrect format\n");
+        d->invalid++;
+        return DISPATCH_INVALID;
+    }
+    if (check_parameters(entry->schema, parameters) != 0)
+    {
+        d->invalid++;
+        return DISPATCH_INVALID;
+    }
+
+    *userdata = entry->handler != NULL ? entry->userdata : d->fallback_userdata;
+    d->dispatched++;
+    return DISPATCH_OK;
+}
+
+dispatch_result dispatch_command(dispatcher *d, const cJSON *json)
+{
+    dispatch_handler handler;
+    void *userdata;
+    dispatch_result result = dispatch_resolve(d, json, &handler, &userdata);
+    if (result == DISPATCH_OK)
+    {
+        handler(json, userdata);
+    }
+    return result;
+}
+
+dispatch_result dispatch_reply(dispatcher *d, const cJSON *json)
+{
+    const cJSON *type = cJSON_GetObjectItemCaseSensitive(json, "type");
+    if (!cJSON_IsString(type) || (type->valuestring == NULL))
+    {
+        return DISPATCH_INVALID;
+    }
+    dispatch_entry *entry = table_find(&d->types, type->valuestring, (uint32_t)hash_string(type->valuestring));
+    if (entry == NULL || entry->handler == NULL)
+    {
+        printf("Unknown type: %s\n", type->valuestring);
+        return DISPATCH_UNKNOWN;
+    }
+    entry->handler(json, entry->userdata);
+    return DISPATCH_OK;
+}
+
+static const char *schema_type(const cJSON *value)
+{
+    if (cJSON_IsString(value))
+        return "string";
+    if (cJSON_IsNumber(value))
+        return "number";
+    if (cJSON_IsBool(value))
+        return "boolean";
+    if (cJSON_IsArray(value))
+        return "array";
+    return "object";
+}
+
+static cJSON *object_schema(cJSON **properties, cJSON **required)
+{
+    cJSON *schema = cJSON_CreateObject();
+    cJSON_AddStringToObject(schema, "type", "object");
+    *properties = cJSON_AddObjectToObject(schema, "properties");
+    *required = cJSON_AddArrayToObject(schema, "required");
+    cJSON_AddFalseToObject(schema, "additionalProperties"); // strict 要求每个对象都封闭
+    return schema;
+}
+
+static void add_property(cJSON *properties, cJSON *required, const char *name, cJSON *schema)
+{
+    cJSON_AddItemToObject(properties, name, schema);
+    cJSON_AddItemToArray(required, cJSON_CreateString(name));
+}
+
+static cJSON *const_schema(const char *value)
+{
+    cJSON *schema = cJSON_CreateObject();
+    cJSON_AddStringToObject(schema, "const", value);
+    return schema;
+}
+
+static cJSON *type_schema(const char *type)
+{
+    cJSON *schema = cJSON_CreateObject();
+    cJSON_AddStringToObject(schema, "type", type);
+    return schema;
+}
+
+// 参数全部必填，类型取定义里示例值的类型
+static cJSON *parameters_schema(const cJSON *parameters)
+{
+    cJSON *properties, *required;
+    cJSON *schema = object_schema(&properties, &required);
+    const cJSON *expected;
+    cJSON_ArrayForEach(expected, parameters)
+    {
+        add_property(properties, required, expected->string, type_schema(schema_type(expected)));
+    }
+    return schema;
+}
+
+// {"operation":"...","parameters":{...}}
+static cJSON *operation_schema(const char *operation, const cJSON *parameters)
+{
+    cJSON *properties, *required;
+    cJSON *schema = object_schema(&properties, &required);
+    add_property(properties, required, "operation", const_schema(operation));
+    add_property(properties, required, "parameters", parameters_schema(parameters));
+    return schema;
+}
+
+cJSON *dispatcher_reply_schema(const dispatcher *d, const char *dialog_type, const char *command_type)
+{
+    cJSON *properties, *required;
+    // strict 模式下根必须是对象，各种回复的并集放在 "reply" 属性里
+    cJSON *root = object_schema(&properties, &required);
+    cJSON *reply = cJSON_CreateObject();
+    cJSON *any_of = cJSON_AddArrayToObject(reply, "anyOf");
+    add_property(properties, required, DISPATCH_REPLY_KEY, reply);
+
+    cJSON *dialog = object_schema(&properties, &required);
+    add_property(properties, required, "type", const_schema(dialog_type));
+    add_property(properties, required, "message", type_schema("string"));
+    cJSON_AddItemToArray(any_of, dialog);
+
+    // 每个 operation 一个分支，单条指令把 type 加进去，数组形式只要 operation 和 parameters
+    cJSON *items = cJSON_CreateObject();
+    cJSON *item_any_of = cJSON_AddArrayToObject(items, "anyOf");
+    for (size_t i = 0; i < d->operations.size; i++)
+    {
+        const dispatch_entry *entry = &d->operations.slots[i];
+        if (entry->name == NULL)
+            continue;
+        cJSON *single = operation_schema(entry->name, entry->schema);
+        cJSON_AddItemToObject(cJSON_GetObjectItemCaseSensitive(single, "properties"), "type",
+                              const_schema(command_type));
+        cJSON_AddItemToArray(cJSON_GetObjectItemCaseSensitive(single, "required"), cJSON_CreateString("type"));
+        cJSON_AddItemToArray(any_of, single);
+        cJSON_AddItemToArray(item_any_of, operation_schema(entry->name, entry->schema));
+    }
+
+    cJSON *batch = object_schema(&properties, &required);
+    add_property(properties, required, "type", const_schema(command_type));
+    cJSON *commands = type_schema("array");
+    cJSON_AddItemToObject(commands, "items", items);
+    add_property(properties, required, "commands", commands);
+    cJSON_AddItemToArray(any_of, batch);
+    return root;
+}
+
+cJSON *dispatcher_tools(const dispatcher *d)
+{
+    cJSON *tools = cJSON_CreateArray();
+    const cJSON *control;
+    // 按 dev_ctrl.json 里的顺序，请求体每次都一样，便于服务端缓存前缀
+    cJSON_ArrayForEach(control, cJSON_GetObjectItemCaseSensitive(d->controls, "controls"))
+    {
+        const char *operation = cJSON_GetStringValue(cJSON_GetObjectItemCaseSensitive(control, "operation"));
+        const cJSON *parameters = cJSON_GetObjectItemCaseSensitive(control, "parameters");
+        if (operation == NULL || !cJSON_IsObject(parameters))
+            continue;
+        cJSON *tool = cJSON_CreateObject();
+        cJSON_AddStringToObject(tool, "type", "function");
+        cJSON *function = cJSON_AddObjectToObject(tool, "function");
+        cJSON_AddStringToObject(function, "name", operation);
+        cJSON_AddStringToObject(function, "description", control->string);
+        cJSON_AddItemToObject(function, "parameters", parameters_schema(parameters));
+        cJSON_AddItemToArray(tools, tool);
+    }
+    return tools;
+}
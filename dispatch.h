@@ -0,0 +1,79 @@
+#ifndef DISPATCH_H
+#define DISPATCH_H
+#include <stddef.h>
+#include <stdint.h>
+#include <cJSON.h>
+
+// 回复分发
+// 启动时从 dev_ctrl.json 的 controls 读出所有 operation 和它们的 parameters 定义，
+// 和回复的 type 一起放进开放寻址的哈希表，按名字常数时间找到处理函数。
+// 处理函数通过函数指针注册；dev_ctrl.json 里新加的设备没有专门的处理函数时交给默认处理函数，
+// 不用改代码重新编译。执行前按定义检查参数：每个参数都要有，类型和定义里的示例值一致。
+
+typedef void (*dispatch_handler)(const cJSON *json, void *userdata);
+
+typedef enum dispatch_result
+{
+    DISPATCH_OK = 0,
+    DISPATCH_UNKNOWN, // 没有这个 type / operation，或者没有处理函数
+    DISPATCH_INVALID, // 格式或参数不符合定义
+} dispatch_result;
+
+typedef struct dispatch_entry
+{
+    char *name;          // NULL 表示空槽
+    uint32_t hash;
+    dispatch_handler handler;
+    void *userdata;
+    const cJSON *schema; // operation 的 parameters 定义，指向 controls 内部
+} dispatch_entry;
+
+typedef struct dispatch_table
+{
+    dispatch_entry *slots;
+    size_t size;  // 2 的幂
+    size_t count;
+} dispatch_table;
+
+typedef struct dispatcher
+{
+    dispatch_table types;
+    dispatch_table operations;
+    dispatch_handler fallback; // 已定义但没有注册处理函数的 operation
+    void *fallback_userdata;
+    cJSON *controls;
+
+    // 统计
+    unsigned long dispatched;
+    unsigned long unknown;
+    unsigned long invalid;
+} dispatcher;
+
+// 读取 dev_ctrl.json 中定义的 operation；失败返回 -1（此时只能分发 type）
+int dispatcher_init(dispatcher *d, const char *controls_path);
+// 用新的定义（dev_ctrl.json 的内容）重建 operation 表，已注册的处理函数保留；
+// 解析失败返回 -1，原来的定义不变
+int dispatcher_load(dispatcher *d, const char *json_text);
+void dispatcher_free(dispatcher *d);
+
+int dispatcher_register_type(dispatcher *d, const char *type, dispatch_handler handler, void *userdata);
+// 注册 dev_ctrl.json 里没有定义的 operation 会失败并返回 -1
+int dispatcher_register_operation(dispatcher *d, const char *operation, dispatch_handler handler, void *userdata);
+void dispatcher_set_fallback(dispatcher *d, dispatch_handler handler, void *userdata);
+
+// 按 "type" 分发一条回复
+dispatch_result dispatch_reply(dispatcher *d, const cJSON *json);
+// 按 "operation" 分发一条控制指令，先检查参数
+dispatch_result dispatch_command(dispatcher *d, const cJSON *json);
+// 只查找处理函数并检查参数，不执行；用于把指令交给其他线程执行
+dispatch_result dispatch_resolve(dispatcher *d, const cJSON *json, dispatch_handler *handler, void **userdata);
+
+// 按 dev_ctrl.json 生成回复的 JSON Schema：对话回复，或者 operation 和参数都符合定义的控制指令
+// （单条或 "commands" 数组），用于请求里 strict 的 response_format。根是对象，回复本身在
+// {"reply": ...} 里，所有对象都不允许额外的属性。返回的对象由调用方 cJSON_Delete
+#define DISPATCH_REPLY_KEY "reply"
+cJSON *dispatcher_reply_schema(const dispatcher *d, const char *dialog_type, const char *command_type);
+// 把 dev_ctrl.json 里的每个设备声明成一个函数工具（name 为 operation，参数按定义），用于请求里的 tools
+cJSON *dispatcher_tools(const dispatcher *d);
+
+#endif
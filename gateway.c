@@ -0,0 +1,457 @@
+#define _GNU_SOURCE // accept4
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "gateway.h"
+#include "util.h"
+
+#define GATEWAY_EVENTS 256 // 每次最多处理的就绪连接数，剩下的下一轮再处理
+
+void gateway_options_default(gateway_options *options)
+{
+    options->max_sessions = 4096;
+    options->max_inflight = 64;
+    options->max_pending = 8;
+    options->rate = 2;
+    options->burst = 5;
+    options->history_turns = 32;
+    options->history_bytes = 128 * 1024;
+    options->timeout_ms = 30000;
+    options->model = "gpt-4-turbo-preview";
+}
+
+static void enqueue_ready(gateway *gw, gateway_session *s)
+{
+    s->queued = 1;
+    s->next_ready = NULL;
+    if (gw->ready_tail != NULL)
+        gw->ready_tail->next_ready = s;
+    else
+        gw->ready_head = s;
+    gw->ready_tail = s;
+}
+
+static void dequeue_ready(gateway *gw, gateway_session *s)
+{
+    gateway_session *prev = NULL;
+    for (gateway_session *p = gw->ready_head; p != NULL; prev = p, p = p->next_ready)
+    {
+        if (p != s)
+            continue;
+        if (prev != NULL)
+            prev->next_ready = s->next_ready;
+        else
+            gw->ready_head = s->next_ready;
+        if (gw->ready_tail == s)
+            gw->ready_tail = prev;
+        break;
+    }
+    s->queued = 0;
+}
+
+static void free_session(gateway *gw, gateway_session *s)
+{
+    if (s->prev != NULL)
+        s->prev->next = s->next;
+    else
+        gw->sessions = s->next;
+    if (s->next != NULL)
+        s->next->prev = s->prev;
+    gw->session_count--;
+    if (gw->handlers.close != NULL)
+        gw->handlers.close(s, gw->handlers.userdata);
+
+    while (s->inputs != NULL)
+    {
+        gateway_input *input = s->inputs;
+        s->inputs = input->next;
+        free(input);
+    }
+    free_messages(&s->history);
+    payload_free(&s->payload);
+    free(s->in);
+    free(s->out);
+    free(s);
+}
+
+// 断开连接；有在途请求时取消它，会话在请求的回调里释放
+static void close_session(gateway *gw, gateway_session *s)
+{
+    epoll_ctl(gw->epfd, EPOLL_CTL_DEL, s->fd, NULL);
+    close(s->fd);
+    s->fd = -1;
+    s->closed = 1;
+    if (s->queued)
+        dequeue_ready(gw, s);
+    if (s->request != NULL)
+        async_cancel(gw->loop, s->request);
+    else
+        free_session(gw, s);
+}
+
+static void watch_writable(gateway *gw, gateway_session *s, int writing)
+{
+    if (s->writing == writing)
+        return;
+    struct epoll_event ev = {EPOLLIN | (writing ? EPOLLOUT : 0), {.ptr = s}};
+    epoll_ctl(gw->epfd, EPOLL_CTL_MOD, s->fd, &ev);
+    s->writing = writing;
+}
+
+static int flush_output(gateway_session *s)
+{
+    while (s->out_off < s->out_len)
+    {
+        ssize_t n = send(s->fd, s->out + s->out_off, s->out_len - s->out_off, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        if (n <= 0)
+            return -1;
+        s->out_off += (size_t)n;
+    }
+    if (s->out_off == s->out_len)
+        s->out_off = s->out_len = 0;
+    watch_writable(s->gateway, s, s->out_len > 0);
+    return 0;
+}
+
+int gateway_send(gateway_session *s, char type, const char *data, size_t len)
+{
+    if (s->closed)
+        return -1;
+    if (s->out_off > 0)
+    {
+        memmove(s->out, s->out + s->out_off, s->out_len - s->out_off);
+        s->out_len -= s->out_off;
+        s->out_off = 0;
+    }
+    if (s->out_len + 5 + len > s->out_cap)
+    {
+        size_t cap = s->out_cap ? s->out_cap : 1024;
+        while (cap < s->out_len + 5 + len)
+            cap *= 2;
+        char *out = realloc(s->out, cap);
+        if (out == NULL)
+            return -1;
+        s->out = out;
+        s->out_cap = cap;
+    }
+    uint32_t frame_len = (uint32_t)len + 1;
+    unsigned char *p = (unsigned char *)s->out + s->out_len;
+    p[0] = frame_len >> 24;
+    p[1] = frame_len >> 16;
+    p[2] = frame_len >> 8;
+    p[3] = frame_len;
+    p[4] = (unsigned char)type;
+    memcpy(p + 5, data, len);
+    s->out_len += 5 + len;
+    if (flush_output(s) != 0)
+    {
+        // 这里可能在请求回调里，不能释放会话；关掉读写，epoll 随后报告断开
+        shutdown(s->fd, SHUT_RDWR);
+        return -1;
+    }
+    return 0;
+}
+
+static void send_error(gateway_session *s, const char *message)
+{
+    gateway_send(s, GATEWAY_FRAME_ERROR, message, strlen(message));
+}
+
+static void schedule(gateway *gw);
+
+static void on_turn_done(async_request *req, CURLcode result, void *userdata)
+{
+    gateway_session *s = userdata;
+    gateway *gw = s->gateway;
+
+    s->request = NULL;
+    gw->in_flight--;
+    if (s->closed)
+    {
+        free_session(gw, s);
+        return;
+    }
+    gw->turns++;
+    s->turns++;
+    gw->handlers.done(s, req, result, now_ms() - s->turn_ms, gw->handlers.userdata);
+    if (s->inputs != NULL)
+        enqueue_ready(gw, s); // 排回队尾，让其他会话先走
+    if (!gw->stopping)
+        schedule(gw);
+}
+
+// 上游有空位时按就绪队列的顺序发出请求
+static void schedule(gateway *gw)
+{
+    while (gw->in_flight < gw->options.max_inflight && gw->ready_head != NULL)
+    {
+        gateway_session *s = gw->ready_head;
+        gw->ready_head = s->next_ready;
+        if (gw->ready_head == NULL)
+            gw->ready_tail = NULL;
+        s->queued = 0;
+
+        gateway_input *input = s->inputs;
+        s->inputs = input->next;
+        if (s->inputs == NULL)
+            s->inputs_tail = NULL;
+        s->pending--;
+        s->turn_ms = input->received_ms;
+        const char *json_payload = gw->handlers.build(s, input->text, gw->handlers.userdata);
+        free(input);
+        s->request = json_payload != NULL ? async_post_json(gw->loop, "chat/completions", json_payload,
+                                                            gw->options.timeout_ms, on_turn_done, s)
+                                          : NULL;
+        if (s->request == NULL)
+        {
+            send_error(s, "upstream request failed");
+            if (s->inputs != NULL)
+                enqueue_ready(gw, s);
+            continue;
+        }
+        gw->in_flight++;
+        if (gw->in_flight > gw->peak_in_flight)
+            gw->peak_in_flight = gw->in_flight;
+    }
+}
+
+static void handle_frame(gateway *gw, gateway_session *s, char type, const char *data, size_t len)
+{
+    if (type != GATEWAY_FRAME_INPUT)
+    {
+        gw->bad_frames++;
+        send_error(s, "unknown frame type");
+        return;
+    }
+
+    double now = now_ms();
+    s->tokens += (now - s->refilled_ms) * gw->options.rate / 1000.0;
+    if (s->tokens > gw->options.burst)
+        s->tokens = gw->options.burst;
+    s->refilled_ms = now;
+    if (s->pending >= gw->options.max_pending)
+    {
+        gw->overflowed++;
+        send_error(s, "too many pending inputs");
+        return;
+    }
+    if (s->tokens < 1)
+    {
+        gw->rate_limited++;
+        send_error(s, "rate limited");
+        return;
+    }
+
+    gateway_input *input = malloc(sizeof(*input) + len + 1);
+    if (input == NULL)
+    {
+        send_error(s, "out of memory");
+        return;
+    }
+    s->tokens -= 1;
+    input->next = NULL;
+    input->received_ms = now;
+    memcpy(input->text, data, len);
+    input->text[len] = '\0';
+    if (s->inputs_tail != NULL)
+        s->inputs_tail->next = input;
+    else
+        s->inputs = input;
+    s->inputs_tail = input;
+    s->pending++;
+    if (s->request == NULL && !s->queued)
+        enqueue_ready(gw, s);
+}
+
+// 读出所有可读的数据并处理完整的帧；连接断开或协议错误返回 -1
+static int read_session(gateway *gw, gateway_session *s)
+{
+    for (;;)
+    {
+        if (s->in_cap - s->in_len < 4096)
+        {
+            size_t cap = s->in_cap ? s->in_cap * 2 : 8192;
+            char *in = realloc(s->in, cap);
+            if (in == NULL)
+                return -1;
+            s->in = in;
+            s->in_cap = cap;
+        }
+        ssize_t n = read(s->fd, s->in + s->in_len, s->in_cap - s->in_len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        if (n <= 0)
+            return -1;
+        s->in_len += (size_t)n;
+
+        size_t off = 0;
+        while (s->in_len - off >= 4)
+        {
+            const unsigned char *p = (const unsigned char *)s->in + off;
+            size_t len = (size_t)p[0] << 24 | (size_t)p[1] << 16 | (size_t)p[2] << 8 | p[3];
+            if (len == 0 || len > GATEWAY_MAX_FRAME)
+            {
+                gw->bad_frames++;
+                return -1;
+            }
+            if (s->in_len - off < 4 + len)
+                break;
+            handle_frame(gw, s, (char)p[4], (const char *)p + 5, len - 1);
+            off += 4 + len;
+        }
+        s->in_len -= off;
+        memmove(s->in, s->in + off, s->in_len);
+    }
+    return 0;
+}
+
+static void accept_sessions(gateway *gw)
+{
+    for (;;)
+    {
+        int fd = accept4(gw->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                perror("accept");
+            return;
+        }
+        gateway_session *s = gw->session_count < gw->options.max_sessions ? calloc(1, sizeof(*s)) : NULL;
+        if (s == NULL)
+        {
+            gw->refused++;
+            close(fd);
+            continue;
+        }
+        s->gateway = gw;
+        s->fd = fd;
+        s->id = ++gw->next_id;
+        s->tokens = gw->options.burst;
+        s->refilled_ms = now_ms();
+        history_init(&s->history, gw->options.history_turns, gw->options.history_bytes);
+        payload_init(&s->payload, gw->options.model);
+        struct epoll_event ev = {EPOLLIN, {.ptr = s}};
+        if (epoll_ctl(gw->epfd, EPOLL_CTL_ADD, fd, &ev) != 0)
+        {
+            perror("epoll_ctl");
+            close(fd);
+            payload_free(&s->payload);
+            free(s);
+            continue;
+        }
+        s->next = gw->sessions;
+        if (gw->sessions != NULL)
+            gw->sessions->prev = s;
+        gw->sessions = s;
+        gw->session_count++;
+        gw->accepted++;
+        if (gw->session_count > gw->peak_sessions)
+            gw->peak_sessions = gw->session_count;
+        if (gw->handlers.open != NULL)
+            gw->handlers.open(s, gw->handlers.userdata);
+    }
+}
+
+int gateway_init(gateway *gw, async_http *loop, const char *path, const gateway_options *options,
+                 const gateway_handlers *handlers, int tag)
+{
+    struct sockaddr_un addr;
+
+    memset(gw, 0, sizeof(*gw));
+    gw->options = *options;
+    gw->handlers = *handlers;
+    gw->loop = loop;
+    gw->epfd = -1;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path))
+    {
+        fprintf(stderr, "Socket path too long: %s\n", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+    unlink(path);
+
+    gw->listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (gw->listen_fd < 0 || bind(gw->listen_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+        listen(gw->listen_fd, SOMAXCONN) != 0)
+    {
+        perror("gateway socket");
+        if (gw->listen_fd >= 0)
+            close(gw->listen_fd);
+        return -1;
+    }
+    gw->path = strdup(path);
+    gw->epfd = epoll_create1(EPOLL_CLOEXEC);
+    struct epoll_event ev = {EPOLLIN, {.ptr = NULL}}; // 监听套接字的 ptr 为 NULL
+    if (gw->path == NULL || gw->epfd < 0 || epoll_ctl(gw->epfd, EPOLL_CTL_ADD, gw->listen_fd, &ev) != 0 ||
+        async_watch_fd(loop, gw->epfd, tag) != 0)
+    {
+        perror("gateway epoll");
+        gateway_cleanup(gw);
+        return -1;
+    }
+    return 0;
+}
+
+void gateway_process(gateway *gw)
+{
+    struct epoll_event events[GATEWAY_EVENTS];
+    int n = epoll_wait(gw->epfd, events, GATEWAY_EVENTS, 0);
+
+    for (int i = 0; i < n; i++)
+    {
+        gateway_session *s = events[i].data.ptr;
+        if (s == NULL)
+        {
+            accept_sessions(gw);
+            continue;
+        }
+        if ((events[i].events & EPOLLOUT) && flush_output(s) != 0)
+        {
+            close_session(gw, s);
+            continue;
+        }
+        if ((events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) && read_session(gw, s) != 0)
+            close_session(gw, s);
+    }
+    schedule(gw);
+}
+
+void gateway_cleanup(gateway *gw)
+{
+    gw->stopping = 1;
+    while (gw->sessions != NULL)
+        close_session(gw, gw->sessions);
+    if (gw->epfd >= 0)
+    {
+        async_unwatch_fd(gw->loop, gw->epfd);
+        close(gw->epfd);
+        gw->epfd = -1;
+    }
+    if (gw->listen_fd >= 0)
+    {
+        close(gw->listen_fd);
+        gw->listen_fd = -1;
+    }
+    if (gw->path != NULL)
+    {
+        unlink(gw->path);
+        free(gw->path);
+        gw->path = NULL;
+    }
+}
@@ -0,0 +1,137 @@
+#ifndef GATEWAY_H
+#define GATEWAY_H
+#include <stddef.h>
+#include <stdint.h>
+#include "async_http.h"
+#include "history.h"
+#include "payload.h"
+
+// 多会话网关
+// 在 Unix 域套接字上接受很多设备的连接，每个连接是一个会话，有自己的对话历史和请求体构建器；
+// 所有会话共用一个 async_http 事件循环，也就共用同一组上游长连接。
+// 网关自己有一个 epoll（监听套接字和所有会话连接），整个挂进 async_http，所以连接再多也只占一个监视位。
+//
+// 帧格式：4 字节大端长度（类型加数据）、1 字节类型、数据。
+//   设备 → 网关  'I' 一条用户输入
+//   网关 → 设备  'R' 回复内容；'E' 错误说明（限流、排队已满、上游失败）
+//
+// 公平性：每个会话同时最多一个请求在途（历史要按顺序追加），有输入的会话排成一个先进先出队列，
+// 上游有空位时从队头取，本轮完成后还有输入的会话排回队尾，轮转执行。
+// 限流：每个会话一个令牌桶，超出的输入直接回 'E'，不占用排队位置。
+
+#define GATEWAY_FRAME_INPUT 'I'
+#define GATEWAY_FRAME_REPLY 'R'
+#define GATEWAY_FRAME_ERROR 'E'
+#define GATEWAY_MAX_FRAME (16 * 1024) // 类型加数据的最大长度
+
+typedef struct gateway_input
+{
+    struct gateway_input *next;
+    double received_ms;
+    char text[];
+} gateway_input;
+
+typedef struct gateway_session
+{
+    struct gateway *gateway;
+    int fd;
+    unsigned int id;
+    History history;
+    payload_builder payload;
+
+    // 收到还没组成完整帧的数据
+    char *in;
+    size_t in_len;
+    size_t in_cap;
+    // 还没写出去的数据
+    char *out;
+    size_t out_len;
+    size_t out_off;
+    size_t out_cap;
+    int writing;              // epoll 里关注了可写
+
+    gateway_input *inputs;    // 等待发给上游的输入
+    gateway_input *inputs_tail;
+    int pending;
+    async_request *request;   // 在途的请求
+    double turn_ms;           // 在途这一轮的输入时间
+    int closed;               // 连接已断开，在途请求结束后释放
+
+    double tokens;            // 令牌桶
+    double refilled_ms;
+
+    int queued;               // 在就绪队列里
+    struct gateway_session *next_ready;
+    struct gateway_session *prev;
+    struct gateway_session *next;
+    unsigned long turns;
+    unsigned long seen_version; // 调用方用：这个会话已经看到的设备状态版本
+} gateway_session;
+
+typedef struct gateway_options
+{
+    int max_sessions;
+    int max_inflight;     // 所有会话合计的上游在途请求数
+    int max_pending;      // 每个会话最多排队的输入
+    double rate;          // 每个会话每秒的输入数
+    double burst;
+    size_t history_turns; // 每个会话的历史限制，同 history_init
+    size_t history_bytes;
+    long timeout_ms;      // 单个上游请求的截止时间
+    const char *model;    // 请求体构建器的模型名
+} gateway_options;
+
+typedef struct gateway_handlers
+{
+    // 新会话：加入固定消息（知识库、提示词）
+    void (*open)(gateway_session *s, void *userdata);
+    // 把用户输入加入历史（可以附加内容），生成这一轮的请求体；返回 NULL 表示失败
+    const char *(*build)(gateway_session *s, const char *input, void *userdata);
+    // 上游请求结束：处理回复、记入历史，用 gateway_send 回给设备。latency_ms 从收到输入算起
+    void (*done)(gateway_session *s, async_request *req, CURLcode result, double latency_ms, void *userdata);
+    // 会话释放之前（可以为 NULL）：丢掉调用方按会话记下的状态
+    void (*close)(gateway_session *s, void *userdata);
+    void *userdata;
+} gateway_handlers;
+
+typedef struct gateway
+{
+    gateway_options options;
+    gateway_handlers handlers;
+    async_http *loop;
+    int listen_fd;
+    int epfd;
+    char *path;
+    gateway_session *sessions;
+    int session_count;
+    gateway_session *ready_head;
+    gateway_session *ready_tail;
+    int in_flight;
+    unsigned int next_id;
+    int stopping;
+
+    // 统计
+    unsigned long accepted;
+    unsigned long refused;      // 超过会话上限
+    unsigned long turns;
+    unsigned long rate_limited;
+    unsigned long overflowed;   // 排队已满
+    unsigned long bad_frames;
+    int peak_sessions;
+    int peak_in_flight;
+} gateway;
+
+void gateway_options_default(gateway_options *options);
+
+// 在 path 上监听（已有的套接字文件会先删除），把网关的 epoll 挂进 loop，就绪时 async_poll 返回 tag。
+// 失败返回 -1
+int gateway_init(gateway *gw, async_http *loop, const char *path, const gateway_options *options,
+                 const gateway_handlers *handlers, int tag);
+// async_poll 返回 tag 时调用：接受新连接、读输入、写回复、发出排队的请求
+void gateway_process(gateway *gw);
+// 向设备发一帧，写不完的部分等可写时再发；失败返回 -1
+int gateway_send(gateway_session *s, char type, const char *data, size_t len);
+// 断开所有会话（在途请求被取消），关闭监听套接字
+void gateway_cleanup(gateway *gw);
+
+#endif
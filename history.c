@@ -0,0 +1,327 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "history.h"
+#include "util.h"
+
+// 每个内存池块的大小，单条超长消息单独占一个块
+#define HISTORY_BLOCK_SIZE (64 * 1024)
+
+static const char *role_names[] = {"system", "user", "assistant", "tool"};
+
+const char *role_name(message_role role)
+{
+    return role_names[role];
+}
+
+uint64_t history_fingerprint(const History *history, const char *model)
+{
+    uint64_t hash = hash_bytes(HASH_INIT, model, strlen(model));
+    for (const Message *message = history->head; message != NULL; message = message->next)
+    {
+        if (message->pinned && !message->summary)
+            hash = hash_bytes(hash, message->content, message->length + 1);
+    }
+    return hash;
+}
+
+void history_init(History *history, size_t max_turns, size_t max_bytes)
+{
+    memset(history, 0, sizeof(*history));
+    history->max_turns = max_turns;
+    history->max_bytes = max_bytes;
+}
+
+static size_t node_size(size_t length)
+{
+    return (sizeof(Message) + length + 1 + 7) & ~(size_t)7;
+}
+
+// 从块链表中分配，当前块放不下时在表头挂一个新块
+static void *arena_alloc(arena_block **blocks, size_t size)
+{
+    arena_block *block = *blocks;
+    if (block == NULL || block->size - block->used < size)
+    {
+        size_t block_size = size > HISTORY_BLOCK_SIZE ? size : HISTORY_BLOCK_SIZE;
+        block = malloc(sizeof(arena_block) + block_size);
+        if (block == NULL)
+        {
+            fprintf(stderr, "Memory allocation failed\n");
+            return NULL;
+        }
+        block->next = *blocks;
+        block->used = 0;
+        block->size = block_size;
+        *blocks = block;
+    }
+    void *p = block->data + block->used;
+    block->used += size;
+    return p;
+}
+
+static void free_blocks(arena_block *block)
+{
+    while (block != NULL)
+    {
+        arena_block *next = block->next;
+        free(block);
+        block = next;
+    }
+}
+
+// 把存活的消息搬到新的块里，释放淘汰留下的空洞
+static void history_compact(History *history)
+{
+    arena_block *blocks = NULL;
+    Message *head = NULL;
+    Message *tail = NULL;
+    size_t used = 0;
+
+    for (Message *current = history->head; current != NULL; current = current->next)
+    {
+        size_t size = node_size(current->length);
+        Message *copy = arena_alloc(&blocks, size);
+        if (copy == NULL)
+        {
+            free_blocks(blocks);
+            return; // 压缩失败不影响现有数据
+        }
+        *copy = *current;
+        copy->content = (char *)(copy + 1);
+        memcpy(copy->content, current->content, current->length + 1);
+        copy->next = NULL;
+        if (tail == NULL)
+            head = copy;
+        else
+            tail->next = copy;
+        tail = copy;
+        used += size;
+    }
+
+    free_blocks(history->blocks);
+    history->blocks = blocks;
+    history->head = head;
+    history->tail = tail;
+    history->arena_used = used;
+    history->arena_live = used;
+    history->epoch++; // 节点都搬了家，缓存的消息指针全部失效
+}
+
+static int over_budget(const History *history)
+{
+    return (history->max_turns > 0 && history->turns > history->max_turns) ||
+           (history->max_bytes > 0 && history->bytes > history->max_bytes);
+}
+
+// 压缩会把节点搬到新的块里，之前拿到的 Message 指针都失效；
+// 调用方要返回的消息压缩后按位置重新找
+static void maybe_compact(History *history)
+{
+    size_t dead = history->arena_used - history->arena_live;
+    if (dead > history->arena_live && dead > HISTORY_BLOCK_SIZE)
+    {
+        history_compact(history);
+    }
+}
+
+// 从链表中摘掉一条消息并更新统计
+static void unlink_message(History *history, Message *prev, Message *message)
+{
+    if (prev == NULL)
+        history->head = message->next;
+    else
+        prev->next = message->next;
+    if (history->tail == message)
+        history->tail = prev;
+    if (!message->pinned)
+    {
+        if (message->role == ROLE_USER)
+            history->turns--;
+        history->bytes -= message->length;
+    }
+    history->arena_live -= node_size(message->length);
+    history->count--;
+    history->evicted++;
+    history->epoch++;
+}
+
+// 淘汰最早的未固定轮次（一条用户消息连同其后的回复），最新一条消息始终保留
+static void history_evict(History *history)
+{
+    while (over_budget(history))
+    {
+        Message *prev = NULL;
+        Message *current = history->head;
+        while (current != NULL && current->pinned)
+        {
+            prev = current;
+            current = current->next;
+        }
+        if (current == NULL || current == history->tail)
+        {
+            break;
+        }
+
+        do
+        {
+            Message *next = current->next;
+            unlink_message(history, prev, current);
+            current = next;
+        } while (current != history->tail && current->role != ROLE_USER && !current->pinned);
+    }
+
+    maybe_compact(history);
+}
+
+// 从内存池分配并填好一条消息，不挂到链表上
+static Message *new_message(History *history, message_role role, const char *content, size_t length, int pinned)
+{
+    size_t size = node_size(length);
+    Message *message = arena_alloc(&history->blocks, size);
+    if (message == NULL)
+    {
+        return NULL;
+    }
+    message->role = role;
+    message->pinned = pinned;
+    message->summary = 0;
+    message->raw = 0;
+    message->tokens = 0;
+    message->length = length;
+    message->content = (char *)(message + 1);
+    memcpy(message->content, content, length);
+    message->content[length] = '\0';
+    message->payload_offset = 0;
+    message->payload_len = 0;
+    message->next = NULL;
+
+    history->count++;
+    history->arena_used += size;
+    history->arena_live += size;
+    return message;
+}
+
+static Message *append(History *history, message_role role, const char *content, size_t length, int pinned, int raw)
+{
+    Message *message = new_message(history, role, content, length, pinned);
+    if (message == NULL)
+    {
+        return NULL;
+    }
+    message->raw = raw;
+    if (history->tail == NULL)
+        history->head = message;
+    else
+        history->tail->next = message;
+    history->tail = message;
+
+    if (history->on_append != NULL)
+    {
+        history->on_append(message, history->on_append_userdata);
+    }
+    if (!pinned)
+    {
+        history->bytes += message->length;
+        if (role == ROLE_USER)
+            history->turns++;
+        history_evict(history);
+    }
+    // 淘汰不会删掉最新一条，压缩保持顺序，新消息仍在末尾；淘汰后可能压缩过，message 不能再用
+    return history->tail;
+}
+
+Message *add_message(History *history, message_role role, const char *content)
+{
+    return append(history, role, content, strlen(content), 0, 0);
+}
+
+Message *add_pinned_message(History *history, message_role role, const char *content)
+{
+    return append(history, role, content, strlen(content), 1, 0);
+}
+
+Message *add_pinned_text(History *history, message_role role, const char *text, size_t length)
+{
+    return append(history, role, text, length, 1, 0);
+}
+
+Message *add_raw_message(History *history, message_role role, const char *json)
+{
+    return append(history, role, json, strlen(json), 0, 1);
+}
+
+Message *history_replace_oldest(History *history, size_t count, message_role role, const char *content)
+{
+    Message *prev = NULL;
+    Message *current = history->head;
+    Message *insert_after = NULL;
+    int found = 0;
+
+    while (current != NULL && count > 0)
+    {
+        Message *next = current->next;
+        if (!current->pinned || current->summary)
+        {
+            if (!found)
+            {
+                insert_after = prev;
+                found = 1;
+            }
+            unlink_message(history, prev, current);
+            count--;
+        }
+        else
+        {
+            prev = current;
+        }
+        current = next;
+    }
+
+    Message *summary = NULL;
+    if (content != NULL && (summary = new_message(history, role, content, strlen(content), 1)) != NULL)
+    {
+        summary->summary = 1;
+        if (!found)
+            insert_after = history->tail;
+        summary->next = insert_after != NULL ? insert_after->next : history->head;
+        if (insert_after != NULL)
+            insert_after->next = summary;
+        else
+            history->head = summary;
+        if (summary->next == NULL)
+            history->tail = summary;
+        history->epoch++;
+    }
+    if (summary == NULL)
+    {
+        maybe_compact(history);
+        return NULL;
+    }
+    // 压缩后按位置找回摘要
+    size_t position = 0;
+    for (Message *current = history->head; current != summary; current = current->next)
+        position++;
+    maybe_compact(history);
+    summary = history->head;
+    while (position-- > 0)
+        summary = summary->next;
+    return summary;
+}
+
+void history_drop_last(History *history)
+{
+    Message *prev = NULL;
+    if (history->tail == NULL)
+        return;
+    for (Message *current = history->head; current != history->tail; current = current->next)
+        prev = current;
+    unlink_message(history, prev, history->tail);
+    maybe_compact(history);
+}
+
+void free_messages(History *history)
+{
+    free_blocks(history->blocks);
+    history_init(history, history->max_turns, history->max_bytes);
+}
@@ -0,0 +1,88 @@
+#ifndef HISTORY_H
+#define HISTORY_H
+#include <stddef.h>
+#include <stdint.h>
+
+// 对话历史
+// 消息节点和内容一起从分块内存池（arena）里分配，每条消息只分配一次；
+// 有尾指针，追加是 O(1)。超过轮数或字节上限时淘汰最早的对话轮次，
+// 固定（pinned）的知识库和提示词消息永远保留。淘汰产生的空洞超过存活数据时整体压缩一次，
+// 所以长时间运行内存占用保持稳定。
+
+typedef enum message_role
+{
+    ROLE_SYSTEM = 0,
+    ROLE_USER,
+    ROLE_ASSISTANT,
+    ROLE_TOOL,
+} message_role;
+
+typedef struct Message
+{
+    message_role role;
+    int pinned;       // 固定消息，不会被淘汰
+    int summary;      // 旧对话的摘要，不会被淘汰，但可以被新的摘要替换
+    int raw;          // content 是序列化好的完整消息对象（带 tool_calls 的回复、工具结果），原样写入请求体
+    size_t tokens;    // 估算的 token 数，0 表示还没有估算
+    size_t length;    // content 的字节数
+    char *content;    // 紧跟在节点后面，和节点同一次分配
+    size_t payload_offset; // 由 payload 构建器维护：该消息在请求体缓冲区中的位置
+    size_t payload_len;    // 0 表示还没有序列化过
+    struct Message *next;
+} Message;
+
+typedef struct arena_block
+{
+    struct arena_block *next;
+    size_t used;
+    size_t size;
+    char data[];
+} arena_block;
+
+typedef struct History
+{
+    Message *head;
+    Message *tail;
+    size_t count;       // 消息条数
+    size_t turns;       // 未固定的用户轮次数
+    size_t bytes;       // 未固定消息的内容字节数
+    size_t max_turns;   // 0 表示不限制
+    size_t max_bytes;   // 0 表示不限制
+    size_t evicted;     // 累计淘汰的消息条数
+    size_t epoch;       // 每次淘汰后加一，缓存了消息位置的一方据此判断是否需要重建
+
+    arena_block *blocks; // 第一个块是当前分配的块
+    size_t arena_used;   // 已分配字节（含已淘汰的空洞）
+    size_t arena_live;   // 存活消息占用的字节
+
+    // 每追加一条消息回调一次（会话日志用），可以为 NULL
+    void (*on_append)(const Message *message, void *userdata);
+    void *on_append_userdata;
+} History;
+
+const char *role_name(message_role role);
+
+void history_init(History *history, size_t max_turns, size_t max_bytes);
+
+// 追加一条消息，必要时淘汰旧轮次；返回新消息，内存不足返回 NULL
+Message *add_message(History *history, message_role role, const char *content);
+// 追加一条固定消息（知识库、提示词）
+Message *add_pinned_message(History *history, message_role role, const char *content);
+// 同上，内容不需要以 '\0' 结尾（例如 mmap 进来的文件）
+Message *add_pinned_text(History *history, message_role role, const char *text, size_t length);
+// 追加一条已经序列化好的消息对象，例如 {"role":"tool","tool_call_id":"...","content":"..."}
+Message *add_raw_message(History *history, message_role role, const char *json);
+
+// 用一条摘要替换最早的 count 条可压缩消息（未固定消息和旧摘要），摘要插在原来的位置；
+// content 为 NULL 时只删除。返回插入的摘要消息
+Message *history_replace_oldest(History *history, size_t count, message_role role, const char *content);
+
+// 删掉最后一条消息（例如这一轮的请求没能发出去），缓存了消息位置的一方会按 epoch 重建
+void history_drop_last(History *history);
+
+void free_messages(History *history);
+
+// 固定消息（知识库、提示词）和模型的指纹，任何一个变了缓存键和会话日志都作废
+uint64_t history_fingerprint(const History *history, const char *model);
+
+#endif
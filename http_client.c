@@ -0,0 +1,398 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+#include "util.h"
+#include "http_client.h"
+
+static void apply_common_options(http_client *client, CURL *curl);
+
+// share 句柄的加锁回调
+static void share_lock(CURL *handle, curl_lock_data data, curl_lock_access access, void *userptr)
+{
+    http_client *client = userptr;
+    (void)handle;
+    (void)access;
+    pthread_mutex_lock(&client->locks[data]);
+}
+
+static void share_unlock(CURL *handle, curl_lock_data data, void *userptr)
+{
+    http_client *client = userptr;
+    (void)handle;
+    pthread_mutex_unlock(&client->locks[data]);
+}
+
+int http_client_init(http_client *client)
+{
+    char auth[512];
+    const char *base_url = getenv("OPENAI_BASE_URL");
+    const char *api_key = getenv("OPENAI_API_KEY");
+
+    memset(client, 0, sizeof(*client));
+    if (curl_global_init(CURL_GLOBAL_ALL) != CURLE_OK)
+    {
+        fprintf(stderr, "curl_global_init() failed\n");
+        return -1;
+    }
+
+    for (int i = 0; i < CURL_LOCK_DATA_LAST; i++)
+    {
+        pthread_mutex_init(&client->locks[i], NULL);
+    }
+    pthread_mutex_init(&client->deflate_lock, NULL);
+    pthread_mutex_init(&client->plain_lock, NULL);
+
+    // DNS、TLS 会话和连接池在所有 easy 句柄之间共享
+    client->share = curl_share_init();
+    if (client->share == NULL)
+    {
+        fprintf(stderr, "curl_share_init() failed\n");
+        curl_global_cleanup();
+        return -1;
+    }
+    curl_share_setopt(client->share, CURLSHOPT_LOCKFUNC, share_lock);
+    curl_share_setopt(client->share, CURLSHOPT_UNLOCKFUNC, share_unlock);
+    curl_share_setopt(client->share, CURLSHOPT_USERDATA, client);
+    curl_share_setopt(client->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+    curl_share_setopt(client->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+    curl_share_setopt(client->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+
+    snprintf(client->base_url, sizeof(client->base_url), "%s",
+             base_url != NULL && base_url[0] != '\0' ? base_url : HTTP_DEFAULT_BASE_URL);
+    // 去掉结尾的 '/'，拼接路径时统一补上
+    size_t len = strlen(client->base_url);
+    while (len > 0 && client->base_url[len - 1] == '/')
+    {
+        client->base_url[--len] = '\0';
+    }
+
+    // 没有设置密钥时不带鉴权头（本地测试桩、模拟服务不需要）
+    client->json_headers = curl_slist_append(client->json_headers, "Content-Type: application/json");
+    if (api_key != NULL && api_key[0] != '\0')
+    {
+        snprintf(auth, sizeof(auth), "Authorization: Bearer %s", api_key);
+        client->json_headers = curl_slist_append(client->json_headers, auth);
+    }
+    for (const struct curl_slist *header = client->json_headers; header != NULL; header = header->next)
+    {
+        client->gzip_headers = curl_slist_append(client->gzip_headers, header->data);
+    }
+    client->gzip_headers = curl_slist_append(client->gzip_headers, "Content-Encoding: gzip");
+
+    client->easy = http_client_new_handle(client);
+    if (client->easy == NULL)
+    {
+        http_client_cleanup(client);
+        return -1;
+    }
+    return 0;
+}
+
+void http_client_cleanup(http_client *client)
+{
+    if (client->easy != NULL)
+    {
+        curl_easy_cleanup(client->easy);
+        client->easy = NULL;
+    }
+    if (client->share != NULL)
+    {
+        curl_share_cleanup(client->share);
+        client->share = NULL;
+        for (int i = 0; i < CURL_LOCK_DATA_LAST; i++)
+        {
+            pthread_mutex_destroy(&client->locks[i]);
+        }
+        curl_global_cleanup();
+    }
+    curl_slist_free_all(client->json_headers);
+    curl_slist_free_all(client->gzip_headers);
+    client->json_headers = NULL;
+    client->gzip_headers = NULL;
+    http_body_free(&client->body);
+    if (client->deflate != NULL)
+    {
+        deflateEnd(client->deflate);
+        free(client->deflate);
+        client->deflate = NULL;
+    }
+    pthread_mutex_destroy(&client->deflate_lock);
+    pthread_mutex_destroy(&client->plain_lock);
+}
+
+void http_client_set_transport(http_client *client, int http2, int compress)
+{
+    client->http2 = http2;
+    client->accept_encoding = compress;
+    client->compress_requests = compress;
+    if (client->easy != NULL)
+    {
+        curl_easy_reset(client->easy);
+        apply_common_options(client, client->easy);
+    }
+}
+
+// 每个 easy 句柄的公共选项；curl_easy_reset 之后也要重新设置
+static void apply_common_options(http_client *client, CURL *curl)
+{
+    curl_easy_setopt(curl, CURLOPT_SHARE, client->share);
+    curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+    curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
+    curl_easy_setopt(curl, CURLOPT_DNS_CACHE_TIMEOUT, 600L);
+    if (client->http2)
+    {
+        // https 用 ALPN 协商，明文地址用 Upgrade: h2c，服务端不认识时仍是 HTTP/1.1。
+        // 不用 prior knowledge：这个版本的 libcurl 在已有的 h2c 连接上复用时会报帧错误。
+        // 同时发出的请求等着复用已有连接的多路流
+        curl_easy_setopt(curl, CURLOPT_HTTP_VERSION, (long)CURL_HTTP_VERSION_2_0);
+        curl_easy_setopt(curl, CURLOPT_PIPEWAIT, 1L);
+    }
+    if (client->accept_encoding)
+    {
+        curl_easy_setopt(curl, CURLOPT_ACCEPT_ENCODING, ""); // curl 支持的全部编码，边收边解压
+    }
+}
+
+CURL *http_client_new_handle(http_client *client)
+{
+    CURL *curl = curl_easy_init();
+    if (curl == NULL)
+    {
+        fprintf(stderr, "curl_easy_init() failed\n");
+        return NULL;
+    }
+    apply_common_options(client, curl);
+    return curl;
+}
+
+const char *http_client_url(const http_client *client, const char *path, char *buf, size_t size)
+{
+    if (strncmp(path, "http://", 7) == 0 || strncmp(path, "https://", 8) == 0)
+    {
+        return path;
+    }
+    while (*path == '/')
+    {
+        path++;
+    }
+    snprintf(buf, size, "%s/%s", client->base_url, path);
+    return buf;
+}
+
+// gzip 压缩到 body->data；失败返回 -1
+// 压缩流在请求之间复用，多个线程同时发请求时加锁
+static int gzip_body(http_client *client, http_body *body, const char *data, size_t len)
+{
+    int result = Z_STREAM_ERROR;
+    pthread_mutex_lock(&client->deflate_lock);
+    z_stream *z = client->deflate;
+    if (z != NULL)
+    {
+        deflateReset(z);
+    }
+    else if ((z = calloc(1, sizeof(z_stream))) != NULL)
+    {
+        // windowBits 加 16 输出 gzip 格式；级别 6 是压缩率和耗时的折中
+        if (deflateInit2(z, 6, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) == Z_OK)
+        {
+            client->deflate = z;
+        }
+        else
+        {
+            free(z);
+            z = NULL;
+        }
+    }
+    size_t bound = z != NULL ? deflateBound(z, len) : 0;
+    if (z != NULL && bound > body->cap)
+    {
+        char *grown = realloc(body->data, bound);
+        if (grown != NULL)
+        {
+            body->data = grown;
+            body->cap = bound;
+        }
+    }
+    if (z != NULL && bound <= body->cap)
+    {
+        z->next_in = (Bytef *)data;
+        z->avail_in = (uInt)len;
+        z->next_out = (Bytef *)body->data;
+        z->avail_out = (uInt)body->cap;
+        result = deflate(z, Z_FINISH);
+        body->len = z->total_out;
+    }
+    pthread_mutex_unlock(&client->deflate_lock);
+    return result == Z_STREAM_END ? 0 : -1;
+}
+
+// url 开头 scheme://host[:port] 部分的长度
+static size_t origin_len(const char *url)
+{
+    const char *host = strstr(url, "://");
+    if (host == NULL)
+        return strlen(url);
+    host += 3;
+    return (size_t)(host - url) + strcspn(host, "/?#");
+}
+
+// 按 origin 的哈希查，origin 多长都行
+static uint64_t origin_hash(const char *url)
+{
+    return hash_bytes(HASH_INIT, url, origin_len(url));
+}
+
+static int find_plain_host(const http_client *client, uint64_t origin)
+{
+    unsigned count = client->plain_host_count < HTTP_PLAIN_HOSTS ? client->plain_host_count : HTTP_PLAIN_HOSTS;
+    for (unsigned i = 0; i < count; i++)
+    {
+        if (client->plain_hosts[i] == origin)
+            return 1;
+    }
+    return 0;
+}
+
+int http_client_gzip_allowed(http_client *client, const char *url)
+{
+    if (!client->compress_requests)
+        return 0;
+    pthread_mutex_lock(&client->plain_lock);
+    int rejected = client->plain_host_count > 0 && find_plain_host(client, origin_hash(url));
+    pthread_mutex_unlock(&client->plain_lock);
+    return !rejected;
+}
+
+void http_client_reject_gzip(http_client *client, const char *url)
+{
+    uint64_t origin = origin_hash(url);
+    pthread_mutex_lock(&client->plain_lock);
+    if (!find_plain_host(client, origin))
+    {
+        client->plain_hosts[client->plain_host_count++ % HTTP_PLAIN_HOSTS] = origin;
+        fprintf(stderr, "%.*s rejected gzip request bodies, sending them uncompressed\n", (int)origin_len(url), url);
+    }
+    pthread_mutex_unlock(&client->plain_lock);
+}
+
+void http_client_set_body(http_client *client, CURL *curl, const char *url, const char *json_payload,
+                          http_body *body, int plain)
+{
+    size_t len = strlen(json_payload);
+    body->plain_len = len;
+    body->gzip = !plain && len >= HTTP_COMPRESS_MIN && http_client_gzip_allowed(client, url) &&
+                 gzip_body(client, body, json_payload, len) == 0;
+    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, body->gzip ? client->gzip_headers : client->json_headers);
+    curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE_LARGE, (curl_off_t)(body->gzip ? body->len : len));
+    curl_easy_setopt(curl, CURLOPT_POSTFIELDS, body->gzip ? body->data : json_payload);
+}
+
+void http_body_free(http_body *body)
+{
+    free(body->data);
+    memset(body, 0, sizeof(*body));
+}
+
+void http_timing_collect(CURL *curl, http_timing *timing)
+{
+    curl_off_t sent = 0, received = 0;
+    memset(timing, 0, sizeof(*timing));
+    curl_easy_getinfo(curl, CURLINFO_NAMELOOKUP_TIME, &timing->dns);
+    curl_easy_getinfo(curl, CURLINFO_CONNECT_TIME, &timing->connect);
+    curl_easy_getinfo(curl, CURLINFO_APPCONNECT_TIME, &timing->tls);
+    curl_easy_getinfo(curl, CURLINFO_STARTTRANSFER_TIME, &timing->first_byte);
+    curl_easy_getinfo(curl, CURLINFO_TOTAL_TIME, &timing->total);
+    curl_easy_getinfo(curl, CURLINFO_NUM_CONNECTS, &timing->new_connects);
+    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &timing->http_code);
+    curl_easy_getinfo(curl, CURLINFO_HTTP_VERSION, &timing->http_version);
+    curl_easy_getinfo(curl, CURLINFO_REQUEST_SIZE, &timing->header_sent);
+    curl_easy_getinfo(curl, CURLINFO_HEADER_SIZE, &timing->header_received);
+    curl_easy_getinfo(curl, CURLINFO_SIZE_UPLOAD_T, &sent);
+    curl_easy_getinfo(curl, CURLINFO_SIZE_DOWNLOAD_T, &received);
+    timing->body_sent = (long)sent;
+    timing->body_received = (long)received;
+}
+
+const char *http_timing_format(const http_timing *timing, char *buf, size_t size)
+{
+    snprintf(buf, size, "http%s %ld dns %.1fms connect %.1fms tls %.1fms ttfb %.1fms total %.1fms new_conn %ld "
+             "wire %ld/%ld bytes",
+             timing->http_version == CURL_HTTP_VERSION_2_0 ? "/2" : "", timing->http_code, timing->dns * 1000,
+             timing->connect * 1000, timing->tls * 1000, timing->first_byte * 1000, timing->total * 1000,
+             timing->new_connects, timing->header_sent + timing->body_sent,
+             timing->header_received + timing->body_received);
+    return buf;
+}
+
+// 压缩的请求被拒绝（415）时的响应体不交给调用方，重发之后调用方只看到一份响应
+struct guarded_writer
+{
+    CURL *curl;
+    curl_write_callback write_cb;
+    void *userdata;
+};
+
+static size_t guarded_write(char *data, size_t size, size_t nmemb, void *arg)
+{
+    struct guarded_writer *w = arg;
+    long http_code = 0;
+    curl_easy_getinfo(w->curl, CURLINFO_RESPONSE_CODE, &http_code);
+    if (http_code == 415)
+        return size * nmemb;
+    return w->write_cb(data, size, nmemb, w->userdata);
+}
+
+static CURLcode perform(http_client *client, const char *url, const char *json_payload,
+                        curl_write_callback write_cb, void *userdata, http_timing *timing)
+{
+    CURL *curl = client->easy;
+    CURLcode res;
+    struct guarded_writer writer = {curl, write_cb, userdata};
+
+    // reset 只清除选项，连接和缓存都保留
+    curl_easy_reset(curl);
+    apply_common_options(client, curl);
+    curl_easy_setopt(curl, CURLOPT_URL, url);
+    for (int plain = 0;; plain = 1)
+    {
+        if (json_payload != NULL)
+        {
+            http_client_set_body(client, curl, url, json_payload, &client->body, plain);
+        }
+        int guarded = json_payload != NULL && client->body.gzip;
+        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, guarded ? guarded_write : write_cb);
+        curl_easy_setopt(curl, CURLOPT_WRITEDATA, guarded ? (void *)&writer : userdata);
+
+        res = curl_easy_perform(curl);
+        long http_code = 0;
+        curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &http_code);
+        if (!guarded || res != CURLE_OK || http_code != 415)
+            break;
+        // 服务端不接受压缩的请求体：记下这个服务端，只换请求体在同一个连接上重发，其余选项不动
+        http_client_reject_gzip(client, url);
+    }
+    if (res != CURLE_OK)
+    {
+        fprintf(stderr, "curl_easy_perform() failed: %s\n", curl_easy_strerror(res));
+    }
+    if (timing != NULL)
+    {
+        http_timing_collect(curl, timing);
+    }
+    return res;
+}
+
+CURLcode http_post_json(http_client *client, const char *path, const char *json_payload,
+                        curl_write_callback write_cb, void *userdata, http_timing *timing)
+{
+    char url[512];
+    return perform(client, http_client_url(client, path, url, sizeof(url)), json_payload,
+                   write_cb, userdata, timing);
+}
+
+CURLcode http_get(http_client *client, const char *url,
+                  curl_write_callback write_cb, void *userdata, http_timing *timing)
+{
+    return perform(client, url, NULL, write_cb, userdata, timing);
+}
@@ -0,0 +1,108 @@
+#ifndef HTTP_CLIENT_H
+#define HTTP_CLIENT_H
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <curl/curl.h>
+
+// 长连接 HTTP 客户端上下文
+// 进程内只初始化一次，所有请求复用同一个 share 句柄（连接池、TLS 会话、DNS 缓存），
+// 单线程路径上再复用同一个 easy 句柄，避免每轮对话重新握手。
+// 传输选项（http_client_set_transport）：
+//   HTTP/2：https 通过 ALPN 协商，http 地址通过 Upgrade: h2c 协商；并发的请求等待复用同一个连接的多路流，
+//           不再各开一个连接
+//   压缩：声明 Accept-Encoding（gzip、br、zstd 等 curl 支持的编码），响应边收边解压；
+//         较大的请求体用 gzip 压缩并带 Content-Encoding；服务端回 415 时这次改用明文在同一个连接上重发，
+//         并记住这个服务端（scheme://host:port），之后发给它的请求不再压缩，发给别的服务端的照常压缩
+
+// 默认的接口地址，可以用环境变量 OPENAI_BASE_URL 覆盖（例如指向本地 http 测试桩）
+#define HTTP_DEFAULT_BASE_URL "https://api.openai.com/v1"
+
+#define HTTP_COMPRESS_MIN 1024 // 小于这个大小的请求体不压缩
+#define HTTP_PLAIN_HOSTS 16    // 记住的不接受压缩请求体的服务端个数，满了之后覆盖最早的
+
+// 单次请求的耗时统计，单位秒，均从请求开始计时
+typedef struct http_timing
+{
+    double dns;        // DNS 解析完成
+    double connect;    // TCP 连接建立
+    double tls;        // TLS 握手完成（明文 http 时为 0）
+    double first_byte; // 收到第一个字节
+    double total;      // 整个请求完成
+    long new_connects; // 本次新建的连接数，0 表示复用了已有连接
+    long http_code;    // HTTP 状态码
+    long http_version; // CURL_HTTP_VERSION_1_1、CURL_HTTP_VERSION_2_0 等
+    // 线路上的字节数：请求头、请求体（压缩后）、响应头、响应体（解压前）；HTTP/2 的头部按 HPACK 之前计
+    long header_sent;
+    long body_sent;
+    long header_received;
+    long body_received;
+} http_timing;
+
+// 要发送的请求体：启用压缩时是 gzip 后的数据，缓冲区在多次请求之间复用
+typedef struct http_body
+{
+    char *data;
+    size_t len;
+    size_t cap;
+    size_t plain_len; // 压缩前的大小
+    int gzip;
+} http_body;
+
+typedef struct http_client
+{
+    CURLSH *share;                                 // 跨 easy 句柄共享的缓存
+    CURL *easy;                                    // 单线程路径复用的 easy 句柄
+    pthread_mutex_t locks[CURL_LOCK_DATA_LAST];    // share 句柄的锁，多线程共享时使用
+    struct curl_slist *json_headers;               // Content-Type + Authorization（设置了密钥时）
+    struct curl_slist *gzip_headers;               // 同上，再加 Content-Encoding: gzip
+    char base_url[256];
+    int http2;
+    int accept_encoding;
+    int compress_requests;                         // 启用了请求体压缩
+    uint64_t plain_hosts[HTTP_PLAIN_HOSTS];        // 回过 415 的服务端（scheme://host:port 的哈希）
+    unsigned plain_host_count;                     // 记下过的个数，按 HTTP_PLAIN_HOSTS 取模是下一个位置
+    pthread_mutex_t plain_lock;
+    struct z_stream_s *deflate;                    // 压缩请求体的 zlib 流，deflateReset 复用，比每次初始化快几倍
+    pthread_mutex_t deflate_lock;
+    http_body body;                                // 单线程路径的请求体缓冲区
+} http_client;
+
+// 全局初始化一次；失败返回 -1
+int http_client_init(http_client *client);
+void http_client_cleanup(http_client *client);
+
+// 启用 HTTP/2 和压缩，在 http_client_init 之后、发请求之前调用
+void http_client_set_transport(http_client *client, int http2, int compress);
+
+// 新建一个挂在同一个 share 句柄上的 easy 句柄，给多线程或 curl_multi 使用
+CURL *http_client_new_handle(http_client *client);
+
+// 给 curl 设置 JSON 请求体和请求头；启用了压缩、足够大且 url 的服务端没有回过 415 时先 gzip 到 body 里，
+// body 在传输结束前必须有效。plain 为真时不压缩
+void http_client_set_body(http_client *client, CURL *curl, const char *url, const char *json_payload,
+                          http_body *body, int plain);
+void http_body_free(http_body *body);
+
+// 压缩的请求体被 url 的服务端拒绝（415）：记下来，以后发给它的请求体不再压缩
+void http_client_reject_gzip(http_client *client, const char *url);
+// url 的服务端是否接受压缩的请求体（没有回过 415）
+int http_client_gzip_allowed(http_client *client, const char *url);
+
+// 把相对路径（如 "chat/completions"）拼成完整地址；以 http:// 或 https:// 开头的直接使用
+const char *http_client_url(const http_client *client, const char *path, char *buf, size_t size);
+
+// POST 一个 JSON 请求体到 path，响应通过 write_cb 交给调用方
+CURLcode http_post_json(http_client *client, const char *path, const char *json_payload,
+                        curl_write_callback write_cb, void *userdata, http_timing *timing);
+
+// GET 一个地址（不带鉴权头），用于下载图片等资源
+CURLcode http_get(http_client *client, const char *url,
+                  curl_write_callback write_cb, void *userdata, http_timing *timing);
+
+// 从一个已完成的 easy 句柄中读取耗时统计
+void http_timing_collect(CURL *curl, http_timing *timing);
+// 格式化成一行文本，便于调试输出
+const char *http_timing_format(const http_timing *timing, char *buf, size_t size);
+
+#endif
@@ -0,0 +1,630 @@
+#define _GNU_SOURCE // fallocate
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <curl/curl.h>
+#include <cJSON.h>
+#include "image_batch.h"
+#include "md5.h"
+#include "util.h"
+
+#define IMAGE_GENERATE_TIMEOUT_MS 180000
+#define IMAGE_DOWNLOAD_TIMEOUT_MS 120000
+#define IMAGE_DOWNLOAD_ATTEMPTS 5   // 下载最多尝试的次数（包括续传）
+#define IMAGE_STALL_BYTES 1024      // 连续 IMAGE_STALL_SECONDS 秒低于这个速度算卡住，断开续传
+#define IMAGE_STALL_SECONDS 20
+#define IMAGE_WRITE_BUFFER 65536
+#define IMAGE_MAX_SUFFIX 1000      // 名字冲突时最多试到 image-NNN-999.png
+
+// b64_json 流式解码的状态
+enum b64_state
+{
+    B64_SEARCH, // 找 "b64_json"
+    B64_COLON,  // 跳过冒号和空白，等字符串开头的引号
+    B64_VALUE,  // 字符串内容
+    B64_ESCAPE, // 字符串里反斜杠之后的字符
+    B64_DONE,
+    B64_ERROR,
+};
+
+typedef struct image_job
+{
+    struct image_batch *batch;
+    int index;
+    const char *prompt;
+    char path[512];      // 正式的名字，数据完整后才出现
+    char part[520];      // 写入中的临时文件，用 O_EXCL 创建来占住名字
+    int suffix;          // 名字冲突时的后缀，0 表示没有
+    int fd;              // part 的描述符，还没创建时为 -1
+    double started_ms;
+    double generated_ms; // 生成请求完成的时间
+    size_t written;      // 写进文件的字节数
+    size_t copied;       // 图片数据在用户态拷贝的字节数
+
+    // url 下载
+    async_request *download;
+    int attempts;
+    int body_started;    // 这次尝试的响应头已经处理过
+    int partial;         // 这次尝试的响应是 206
+    curl_off_t expected; // 完整的字节数，-1 表示不知道
+    size_t fetched;      // 所有尝试收到的字节数
+    char etag[128];
+    char content_md5[32];
+    struct curl_slist *headers; // 续传时的 If-Range
+
+    // b64_json 解码
+    enum b64_state state;
+    int matched;         // B64_SEARCH 阶段已经匹配的字符数
+    uint32_t quad;       // 攒着的 6 位组
+    int quad_len;
+    unsigned char out[IMAGE_WRITE_BUFFER];
+    size_t out_len;
+} image_job;
+
+static const char B64_KEY[] = "\"b64_json\"";
+static signed char b64_table[256];
+
+static void b64_table_init(void)
+{
+    const char *alphabet = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    memset(b64_table, -1, sizeof(b64_table));
+    for (int i = 0; alphabet[i] != '\0'; i++)
+        b64_table[(unsigned char)alphabet[i]] = (signed char)i;
+}
+
+static int write_all(int fd, const void *data, size_t len)
+{
+    const char *p = data;
+    while (len > 0)
+    {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        p += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+// 每张图的进度和出错信息，quiet 时不输出
+static void job_log(const image_job *job, const char *format, ...)
+{
+    va_list args;
+    if (job->batch->quiet)
+        return;
+    fprintf(stderr, "[image %d] ", job->index);
+    va_start(args, format);
+    vfprintf(stderr, format, args);
+    va_end(args);
+}
+
+// image-<序号>.png，有后缀时 image-<序号>-<后缀>.png
+static void output_name(image_job *job)
+{
+    if (job->suffix == 0)
+        snprintf(job->path, sizeof(job->path), "%s/image-%03d.png", job->batch->out_dir, job->index);
+    else
+        snprintf(job->path, sizeof(job->path), "%s/image-%03d-%d.png", job->batch->out_dir, job->index,
+                 job->suffix);
+}
+
+// 用 O_EXCL 创建 <名字>.part 占住名字：别的进程正在写同一个名字时 part 已经存在，换下一个后缀；
+// 正式的名字已经有图时也换。正式的名字在数据完整之前不出现
+static int open_output(image_job *job)
+{
+    for (job->suffix = 0; job->suffix < IMAGE_MAX_SUFFIX; job->suffix++)
+    {
+        output_name(job);
+        if (access(job->path, F_OK) == 0)
+            continue;
+        snprintf(job->part, sizeof(job->part), "%s.part", job->path);
+        job->fd = open(job->part, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+        if (job->fd >= 0)
+            return 0;
+        if (errno != EEXIST)
+            break;
+    }
+    perror(job->part);
+    job->part[0] = '\0';
+    return -1;
+}
+
+// 数据落盘后把 part 发布成正式的名字，不覆盖这期间别人写下的同名文件：
+// renameat2(RENAME_NOREPLACE) 一步完成；文件系统不支持时先 link 占住名字再删掉 part。
+// 名字被占了就换下一个后缀
+static int commit_output(image_job *job)
+{
+    int failed = fsync(job->fd) != 0;
+    failed = close(job->fd) != 0 || failed;
+    job->fd = -1;
+    while (!failed)
+    {
+        int result = renameat2(AT_FDCWD, job->part, AT_FDCWD, job->path, RENAME_NOREPLACE);
+        if (result != 0 && (errno == EINVAL || errno == ENOSYS))
+        {
+            result = link(job->part, job->path);
+            if (result == 0)
+                unlink(job->part);
+        }
+        if (result == 0)
+        {
+            job->part[0] = '\0';
+            return 0;
+        }
+        if (errno != EEXIST || ++job->suffix >= IMAGE_MAX_SUFFIX)
+            break;
+        output_name(job);
+    }
+    perror(job->part);
+    return -1;
+}
+
+static int flush_output(image_job *job)
+{
+    if (job->out_len == 0)
+        return 0;
+    if (write_all(job->fd, job->out, job->out_len) != 0)
+    {
+        perror(job->part);
+        return -1;
+    }
+    job->written += job->out_len;
+    job->out_len = 0;
+    return 0;
+}
+
+// 凑满 4 个字符解出 3 个字节；结尾不足 4 个时解出剩下的 1 到 2 个字节（'=' 补位直接忽略）
+static int b64_emit(image_job *job, int final)
+{
+    int bytes = final ? job->quad_len - 1 : 3;
+    if (bytes <= 0)
+        return 0;
+    uint32_t quad = job->quad << (6 * (4 - job->quad_len));
+    if (job->out_len + 3 > sizeof(job->out) && flush_output(job) != 0)
+        return -1;
+    for (int i = 0; i < bytes; i++)
+        job->out[job->out_len++] = (unsigned char)(quad >> (16 - 8 * i));
+    job->copied += (size_t)bytes;
+    job->quad = 0;
+    job->quad_len = 0;
+    return 0;
+}
+
+static int b64_char(image_job *job, char c)
+{
+    if (c == '=')
+        return 0;
+    int value = b64_table[(unsigned char)c];
+    if (value < 0)
+        return -1;
+    job->quad = job->quad << 6 | (uint32_t)value;
+    if (++job->quad_len == 4)
+        return b64_emit(job, 0);
+    return 0;
+}
+
+// b64_json 模式的写回调：逐字节推进状态机，解出来的数据攒满缓冲区就写文件
+static size_t write_b64(char *data, size_t size, size_t nmemb, void *userdata)
+{
+    image_job *job = userdata;
+    size_t len = size * nmemb;
+
+    for (size_t i = 0; i < len && job->state != B64_DONE; i++)
+    {
+        char c = data[i];
+        switch (job->state)
+        {
+        case B64_SEARCH:
+            if (c == B64_KEY[job->matched])
+            {
+                if (B64_KEY[++job->matched] == '\0')
+                    job->state = B64_COLON;
+            }
+            else
+                job->matched = c == '"' ? 1 : 0;
+            break;
+        case B64_COLON:
+            if (c == '"')
+            {
+                if (open_output(job) != 0)
+                    return 0;
+                job->state = B64_VALUE;
+            }
+            else if (c != ':' && c != ' ' && c != '\t' && c != '\r' && c != '\n')
+                job->state = B64_ERROR;
+            break;
+        case B64_VALUE:
+            if (c == '\\')
+                job->state = B64_ESCAPE;
+            else if (c == '"')
+            {
+                if (b64_emit(job, 1) != 0 || flush_output(job) != 0)
+                    return 0;
+                job->state = B64_DONE;
+            }
+            else if (b64_char(job, c) != 0)
+                job->state = B64_ERROR;
+            break;
+        case B64_ESCAPE:
+            // 有的服务端把 '/' 转义成 "\/"；转义的换行只是折行，跳过
+            job->state = B64_VALUE;
+            if (c != 'n' && c != 'r' && b64_char(job, c) != 0)
+                job->state = B64_ERROR;
+            break;
+        default:
+            break;
+        }
+        if (job->state == B64_ERROR)
+        {
+            job_log(job, "malformed b64_json\n");
+            return 0;
+        }
+    }
+    return len;
+}
+
+// 取出 "Name: value" 形式的响应头的值，去掉首尾空白
+static int header_value(const char *line, size_t len, const char *name, char *out, size_t size)
+{
+    size_t name_len = strlen(name);
+    if (len <= name_len || strncasecmp(line, name, name_len) != 0 || line[name_len] != ':')
+        return 0;
+    const char *value = line + name_len + 1;
+    const char *end = line + len;
+    while (value < end && (*value == ' ' || *value == '\t'))
+        value++;
+    while (end > value && (end[-1] == '\r' || end[-1] == '\n' || end[-1] == ' '))
+        end--;
+    if ((size_t)(end - value) >= size)
+        return 0;
+    memcpy(out, value, end - value);
+    out[end - value] = '\0';
+    return 1;
+}
+
+static size_t download_header(char *data, size_t size, size_t nitems, void *userdata)
+{
+    image_job *job = userdata;
+    size_t len = size * nitems;
+
+    if (len > 5 && strncmp(data, "HTTP/", 5) == 0)
+    {
+        // 新的响应（重定向之后或者续传），重新判断。206 的 Content-MD5 只是这一段的，
+        // 整个文件的摘要沿用之前完整响应里的；其他响应从头写，之前的 ETag 和摘要作废
+        const char *code = memchr(data, ' ', len);
+        job->body_started = 0;
+        job->partial = code != NULL && atoi(code + 1) == 206;
+        if (!job->partial)
+        {
+            job->etag[0] = '\0';
+            job->content_md5[0] = '\0';
+        }
+    }
+    else if (!header_value(data, len, "ETag", job->etag, sizeof(job->etag)) && !job->partial)
+        header_value(data, len, "Content-MD5", job->content_md5, sizeof(job->content_md5));
+    return len;
+}
+
+// 第一块数据到达时响应头已经齐了：206 接着写；200 说明服务端忽略了 Range 或者图变了，从头写
+static int start_body(image_job *job)
+{
+    long code = 0;
+    curl_off_t length = -1;
+    curl_easy_getinfo(job->download->easy, CURLINFO_RESPONSE_CODE, &code);
+    curl_easy_getinfo(job->download->easy, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &length);
+
+    if (code != 200 && code != 206)
+        return 0; // 错误页不写进文件
+    if (code == 200 && job->written > 0)
+    {
+        if (ftruncate(job->fd, 0) != 0 || lseek(job->fd, 0, SEEK_SET) != 0)
+            return -1;
+        job->written = 0;
+    }
+    if (length >= 0)
+    {
+        job->expected = (curl_off_t)job->written + length;
+        // 空间不够在这里就能发现；文件系统不支持时照常写
+        if (fallocate(job->fd, FALLOC_FL_KEEP_SIZE, (off_t)job->written, (off_t)length) != 0 &&
+            errno == ENOSPC)
+        {
+            return -1;
+        }
+    }
+    job->body_started = 1;
+    return 0;
+}
+
+// url 模式的下载：数据直接写文件，不经过用户态缓冲
+static size_t write_file(char *data, size_t size, size_t nmemb, void *userdata)
+{
+    image_job *job = userdata;
+    size_t len = size * nmemb;
+
+    if (!job->body_started && start_body(job) != 0)
+    {
+        perror(job->part);
+        return 0;
+    }
+    job->fetched += len;
+    if (!job->body_started)
+        return len;
+    if (write_all(job->fd, data, len) != 0)
+    {
+        perror(job->part);
+        return 0;
+    }
+    job->written += len;
+    return len;
+}
+
+static void start_jobs(image_batch *batch);
+
+static void finish_job(image_job *job, int ok)
+{
+    image_batch *batch = job->batch;
+    double now = now_ms();
+
+    if (ok && job->fd >= 0)
+        ok = commit_output(job) == 0;
+    if (ok)
+    {
+        batch->saved++;
+        batch->written += job->written;
+        batch->copied += job->copied;
+        batch->fetched += job->fetched;
+        batch->resumes += job->attempts > 1 ? job->attempts - 1 : 0;
+        if (!batch->quiet)
+        {
+            printf("[image %d] %s, %zu bytes, generate %.0fms, total %.0fms", job->index, job->path,
+                   job->written, job->generated_ms - job->started_ms, now - job->started_ms);
+            if (job->attempts > 1)
+                printf(", %d attempts, %zu bytes fetched", job->attempts, job->fetched);
+            printf("\n");
+        }
+    }
+    else
+    {
+        batch->failed++;
+        // 不留下半截的图；正式的名字还没发布，不用管
+        if (job->fd >= 0)
+            close(job->fd);
+        if (job->part[0] != '\0')
+            unlink(job->part);
+        job_log(job, "failed: %s\n", job->prompt);
+    }
+    if (batch->done != NULL)
+        batch->done(job->index, ok, ok ? job->path : NULL, now - job->started_ms, batch->userdata);
+    batch->in_flight--;
+    free(job);
+    start_jobs(batch); // 空出一个位置，马上补上下一个提示词
+}
+
+// 长度不对就不算完成；服务端给了 Content-MD5（base64 编码的摘要）时把整个文件读回来核对
+static int verify_download(image_job *job)
+{
+    if (job->expected >= 0 && (curl_off_t)job->written != job->expected)
+    {
+        job_log(job, "incomplete: %zu of %lld bytes\n", job->written, (long long)job->expected);
+        return 0;
+    }
+    if (job->content_md5[0] == '\0')
+        return 1;
+
+    unsigned char expected[18], digest[16];
+    size_t n = 0;
+    for (const char *p = job->content_md5; *p != '\0' && *p != '=' && n < sizeof(expected); p += 4)
+    {
+        uint32_t quad = 0;
+        int k;
+        for (k = 0; k < 4 && p[k] != '\0' && p[k] != '='; k++)
+            quad = quad << 6 | (uint32_t)(b64_table[(unsigned char)p[k]] & 0x3F);
+        quad <<= 6 * (4 - k);
+        for (int i = 0; i < k - 1 && n < sizeof(expected); i++)
+            expected[n++] = (unsigned char)(quad >> (16 - 8 * i));
+        if (k < 4)
+            break;
+    }
+
+    md5_ctx md5;
+    char buf[IMAGE_WRITE_BUFFER];
+    ssize_t len;
+    int fd = open(job->part, O_RDONLY | O_CLOEXEC);
+    md5_init(&md5);
+    while (fd >= 0 && (len = read(fd, buf, sizeof(buf))) > 0)
+        md5_update(&md5, buf, (size_t)len);
+    if (fd >= 0)
+        close(fd);
+    md5_final(&md5, digest);
+    if (n != sizeof(digest) || memcmp(expected, digest, sizeof(digest)) != 0)
+    {
+        job_log(job, "Content-MD5 mismatch\n");
+        return 0;
+    }
+    return 1;
+}
+
+// 连接断开、卡住或服务端临时出错，可以续传
+static int download_retryable(CURLcode result, long http_code)
+{
+    switch (result)
+    {
+    case CURLE_OK:
+        return http_code >= 500 || http_code == 429;
+    case CURLE_PARTIAL_FILE:
+    case CURLE_RECV_ERROR:
+    case CURLE_SEND_ERROR:
+    case CURLE_GOT_NOTHING:
+    case CURLE_HTTP2_STREAM: // HTTP/2 上流被重置，相当于连接断了
+    case CURLE_COULDNT_CONNECT:
+    case CURLE_OPERATION_TIMEDOUT:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+static void on_downloaded(async_request *req, CURLcode result, void *userdata);
+
+static int request_download(image_job *job, const char *url)
+{
+    async_request *req = async_get(&job->batch->loop, url, IMAGE_DOWNLOAD_TIMEOUT_MS, on_downloaded, job);
+    if (req == NULL)
+        return -1;
+    async_set_writer(req, write_file, job);
+    curl_easy_setopt(req->easy, CURLOPT_HEADERFUNCTION, download_header);
+    curl_easy_setopt(req->easy, CURLOPT_HEADERDATA, job);
+    curl_easy_setopt(req->easy, CURLOPT_LOW_SPEED_LIMIT, (long)IMAGE_STALL_BYTES);
+    curl_easy_setopt(req->easy, CURLOPT_LOW_SPEED_TIME, (long)IMAGE_STALL_SECONDS);
+    if (job->written > 0)
+    {
+        // 续传：只要还没拿到的部分；If-Range 保证拼起来的是同一张图。
+        // 用 CURLOPT_RANGE 而不是 RESUME_FROM，服务端不支持 Range 回 200 时由 start_body 从头写
+        char range[32];
+        snprintf(range, sizeof(range), "%zu-", job->written);
+        curl_easy_setopt(req->easy, CURLOPT_RANGE, range);
+        if (job->etag[0] != '\0')
+        {
+            char if_range[160];
+            snprintf(if_range, sizeof(if_range), "If-Range: %s", job->etag);
+            job->headers = curl_slist_append(NULL, if_range);
+            curl_easy_setopt(req->easy, CURLOPT_HTTPHEADER, job->headers);
+        }
+    }
+    job->download = req;
+    job->body_started = 0;
+    job->attempts++;
+    return 0;
+}
+
+static void on_downloaded(async_request *req, CURLcode result, void *userdata)
+{
+    image_job *job = userdata;
+    int complete = result == CURLE_OK && (req->http_code == 200 || req->http_code == 206);
+
+    job->download = NULL;
+    curl_slist_free_all(job->headers);
+    job->headers = NULL;
+    if (!complete && download_retryable(result, req->http_code) && job->attempts < IMAGE_DOWNLOAD_ATTEMPTS)
+    {
+        char *url = NULL;
+        curl_easy_getinfo(req->easy, CURLINFO_EFFECTIVE_URL, &url);
+        job_log(job, "download interrupted at %zu bytes (%s, http %ld), resuming\n", job->written,
+                curl_easy_strerror(result), req->http_code);
+        if (url != NULL && request_download(job, url) == 0)
+            return;
+    }
+    if (!complete)
+        job_log(job, "download: %s, http %ld\n", curl_easy_strerror(result), req->http_code);
+    finish_job(job, complete && verify_download(job));
+}
+
+// 生成结果里取出图片地址，开始下载
+static int start_download(image_job *job, async_request *req)
+{
+    int started = 0;
+    cJSON *json = req->resp.data != NULL ? cJSON_ParseWithLength(req->resp.data, req->resp.size) : NULL;
+    cJSON *data = cJSON_GetObjectItemCaseSensitive(json, "data");
+    cJSON *url = cJSON_GetObjectItemCaseSensitive(cJSON_GetArrayItem(data, 0), "url");
+    if (!cJSON_IsString(url) || url->valuestring == NULL)
+        job_log(job, "no url in response\n");
+    else if (open_output(job) == 0)
+        started = request_download(job, url->valuestring) == 0;
+    cJSON_Delete(json);
+    return started;
+}
+
+static void on_generated(async_request *req, CURLcode result, void *userdata)
+{
+    image_job *job = userdata;
+    job->generated_ms = now_ms();
+
+    if (result != CURLE_OK || req->http_code != 200)
+    {
+        job_log(job, "generate: %s, http %ld\n", curl_easy_strerror(result), req->http_code);
+        finish_job(job, 0);
+    }
+    else if (job->batch->b64)
+        finish_job(job, job->state == B64_DONE);
+    else if (!start_download(job, req))
+        finish_job(job, 0);
+}
+
+static char *image_payload(const char *prompt, int b64)
+{
+    cJSON *json = cJSON_CreateObject();
+    cJSON_AddItemToObject(json, "model", cJSON_CreateString("dall-e-3"));
+    cJSON_AddItemToObject(json, "prompt", cJSON_CreateString(prompt));
+    cJSON_AddItemToObject(json, "n", cJSON_CreateNumber(1));
+    cJSON_AddItemToObject(json, "size", cJSON_CreateString("1024x1024"));
+    if (b64)
+        cJSON_AddItemToObject(json, "response_format", cJSON_CreateString("b64_json"));
+    char *payload = cJSON_PrintUnformatted(json);
+    cJSON_Delete(json);
+    return payload;
+}
+
+static void start_jobs(image_batch *batch)
+{
+    while (batch->in_flight < batch->parallel && batch->next < batch->count)
+    {
+        int index = batch->next++;
+        image_job *job = calloc(1, sizeof(image_job));
+        char *payload = image_payload(batch->prompts[index], batch->b64);
+        async_request *req = NULL;
+        if (job != NULL && payload != NULL)
+        {
+            job->batch = batch;
+            job->index = index;
+            job->prompt = batch->prompts[index];
+            job->fd = -1;
+            job->expected = -1;
+            job->started_ms = now_ms();
+            req = async_post_json(&batch->loop, "images/generations", payload, IMAGE_GENERATE_TIMEOUT_MS,
+                                  on_generated, job);
+        }
+        free(payload);
+        if (req == NULL)
+        {
+            free(job);
+            batch->failed++;
+            fprintf(stderr, "[image %d] failed to start\n", index);
+            continue;
+        }
+        if (batch->b64)
+            async_set_writer(req, write_b64, job);
+        batch->in_flight++;
+    }
+}
+
+void image_batch_init(image_batch *batch)
+{
+    memset(batch, 0, sizeof(*batch));
+    batch->parallel = IMAGE_DEFAULT_PARALLEL;
+    batch->out_dir = ".";
+}
+
+double image_batch_run(image_batch *batch)
+{
+    double start = now_ms();
+
+    if (batch->parallel < 1)
+        batch->parallel = 1;
+    if (batch->parallel > IMAGE_MAX_PARALLEL)
+        batch->parallel = IMAGE_MAX_PARALLEL;
+    b64_table_init();
+    start_jobs(batch);
+    while (batch->in_flight > 0)
+    {
+        async_poll(&batch->loop, -1, NULL, 0);
+    }
+    return now_ms() - start;
+}
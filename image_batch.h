@@ -0,0 +1,52 @@
+#ifndef IMAGE_BATCH_H
+#define IMAGE_BATCH_H
+#include <stddef.h>
+#include "async_http.h"
+
+// 批量生成图片，image 和 bench 共用这一份实现
+// 所有提示词在同一个 curl_multi 事件循环里处理，共享 http_client 的连接池：
+// 最多 parallel 张图同时在途，一张图生成完马上开始下载，同时别的图还在生成。
+// 图片数据不经过内存缓冲：url 模式下下载的数据直接 write 到文件；
+// b64_json 模式下边收边在响应里找 "b64_json" 字段，解码后直接写文件，不解析整个 JSON。
+// 数据先写到用 O_EXCL 创建的 <名字>.part，完整之后 fsync，再用 renameat2(RENAME_NOREPLACE)（不支持时用 link）
+// 发布成正式的名字：名字冲突时加后缀，不会覆盖已有的图，目录里看到的图总是完整的。
+// 下载知道 Content-Length 时先 fallocate 预留空间；连接断了或卡住时用 Range 从已写的位置续传
+// （带 If-Range，图变了服务端会整个重发），最后核对长度，服务端给了 Content-MD5 的话再核对哈希。
+
+#define IMAGE_DEFAULT_PARALLEL 4
+#define IMAGE_MAX_PARALLEL 64
+
+// 一张图处理完：ok 时 path 是写好的文件
+typedef void (*image_done_fn)(int index, int ok, const char *path, double elapsed_ms, void *userdata);
+
+typedef struct image_batch
+{
+    async_http loop;     // 调用方用 async_http_init 初始化
+    char **prompts;
+    int count;
+    int parallel;
+    int b64;
+    const char *out_dir;
+    int quiet;           // 不逐张输出（包括出错信息），结果只看 done 回调和统计
+    image_done_fn done;  // 可以为 NULL
+    void *userdata;
+
+    int next;            // 下一个要开始的提示词
+    int in_flight;
+
+    // 统计
+    int saved;
+    int failed;
+    size_t written;
+    size_t copied;
+    size_t fetched;
+    int resumes;
+} image_batch;
+
+// 清零并填上默认参数，提示词和事件循环由调用方设置
+void image_batch_init(image_batch *batch);
+
+// 处理全部提示词，阻塞到最后一张图完成，返回耗时（毫秒）
+double image_batch_run(image_batch *batch);
+
+#endif
@@ -0,0 +1,350 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <cJSON.h>
+#include "intent.h"
+
+// 出现在未匹配部分时说明用户的意思可能相反，交给模型处理
+static const char *negation_words[] = {"不", "别", "没", "勿", NULL};
+// 不计入无关字数的标点
+static const char *punctuation[] = {"，", "。", "！", "？", "、", "～", NULL};
+
+static char *read_file(const char *path)
+{
+    FILE *fp = fopen(path, "rb");
+    if (fp == NULL)
+    {
+        return NULL;
+    }
+    fseek(fp, 0, SEEK_END);
+    long size = ftell(fp);
+    rewind(fp);
+    char *data = malloc(size + 1);
+    if (data != NULL)
+    {
+        size_t n = fread(data, 1, size, fp);
+        data[n] = '\0';
+    }
+    fclose(fp);
+    return data;
+}
+
+static int new_node(intent_matcher *matcher, unsigned char byte)
+{
+    if (matcher->node_count == matcher->node_cap)
+    {
+        int cap = matcher->node_cap ? matcher->node_cap * 2 : 64;
+        intent_node *nodes = realloc(matcher->nodes, cap * sizeof(intent_node));
+        if (nodes == NULL)
+        {
+            return -1;
+        }
+        matcher->nodes = nodes;
+        matcher->node_cap = cap;
+    }
+    intent_node *node = &matcher->nodes[matcher->node_count];
+    node->first_child = -1;
+    node->next_sibling = -1;
+    node->fail = 0;
+    node->output = -1;
+    node->dict_link = -1;
+    node->byte = byte;
+    return matcher->node_count++;
+}
+
+static int find_child(const intent_matcher *matcher, int node, unsigned char byte)
+{
+    for (int child = matcher->nodes[node].first_child; child != -1; child = matcher->nodes[child].next_sibling)
+    {
+        if (matcher->nodes[child].byte == byte)
+            return child;
+    }
+    return -1;
+}
+
+// 查找或新建一条指令，相同的 operation + status 只保存一份
+static int add_command(intent_matcher *matcher, const char *operation, const char *status)
+{
+    for (int i = 0; i < matcher->command_count; i++)
+    {
+        if (strcmp(matcher->commands[i].operation, operation) == 0 &&
+            strcmp(matcher->commands[i].status, status) == 0)
+            return i;
+    }
+    intent_command *commands = realloc(matcher->commands, (matcher->command_count + 1) * sizeof(intent_command));
+    if (commands == NULL)
+    {
+        return -1;
+    }
+    matcher->commands = commands;
+    commands[matcher->command_count].operation = strdup(operation);
+    commands[matcher->command_count].status = strdup(status);
+    return matcher->command_count++;
+}
+
+static int add_pattern(intent_matcher *matcher, const char *phrase, int command)
+{
+    intent_pattern *patterns = realloc(matcher->patterns, (matcher->pattern_count + 1) * sizeof(intent_pattern));
+    if (patterns == NULL)
+    {
+        return -1;
+    }
+    matcher->patterns = patterns;
+
+    // 插入字典树
+    int node = 0;
+    for (const unsigned char *p = (const unsigned char *)phrase; *p; p++)
+    {
+        int child = find_child(matcher, node, *p);
+        if (child == -1)
+        {
+            child = new_node(matcher, *p);
+            if (child == -1)
+                return -1;
+            matcher->nodes[child].next_sibling = matcher->nodes[node].first_child;
+            matcher->nodes[node].first_child = child;
+        }
+        node = child;
+    }
+    matcher->nodes[node].output = matcher->pattern_count;
+
+    patterns[matcher->pattern_count].phrase = strdup(phrase);
+    patterns[matcher->pattern_count].len = strlen(phrase);
+    patterns[matcher->pattern_count].command = command;
+    matcher->pattern_count++;
+    return 0;
+}
+
+// 广度优先计算失配指针和输出链接
+static int build_links(intent_matcher *matcher)
+{
+    int *queue = malloc(matcher->node_count * sizeof(int));
+    int head = 0;
+    int tail = 0;
+    if (queue == NULL)
+    {
+        return -1;
+    }
+    for (int child = matcher->nodes[0].first_child; child != -1; child = matcher->nodes[child].next_sibling)
+    {
+        matcher->nodes[child].fail = 0;
+        queue[tail++] = child;
+    }
+    while (head < tail)
+    {
+        int node = queue[head++];
+        for (int child = matcher->nodes[node].first_child; child != -1; child = matcher->nodes[child].next_sibling)
+        {
+            unsigned char byte = matcher->nodes[child].byte;
+            int fail = matcher->nodes[node].fail;
+            int next;
+            while ((next = find_child(matcher, fail, byte)) == -1 && fail != 0)
+            {
+                fail = matcher->nodes[fail].fail;
+            }
+            matcher->nodes[child].fail = next != -1 ? next : 0;
+            int target = matcher->nodes[child].fail;
+            matcher->nodes[child].dict_link =
+                matcher->nodes[target].output != -1 ? target : matcher->nodes[target].dict_link;
+            queue[tail++] = child;
+        }
+    }
+    free(queue);
+    return 0;
+}
+
+// 读出 dev_ctrl.json 中定义的所有 operation；文件里的 // 注释先用 cJSON_Minify 去掉
+static cJSON *load_controls(const char *controls_path)
+{
+    char *text = read_file(controls_path);
+    if (text == NULL)
+    {
+        fprintf(stderr, "Error opening file %s\n", controls_path);
+        return NULL;
+    }
+    cJSON_Minify(text);
+    cJSON *json = cJSON_Parse(text);
+    free(text);
+    if (json == NULL)
+    {
+        fprintf(stderr, "Error parsing %s\n", controls_path);
+    }
+    return json;
+}
+
+static int operation_defined(const cJSON *controls, const char *operation)
+{
+    const cJSON *control;
+    cJSON_ArrayForEach(control, controls)
+    {
+        const cJSON *op = cJSON_GetObjectItemCaseSensitive(control, "operation");
+        if (cJSON_IsString(op) && strcmp(op->valuestring, operation) == 0)
+            return 1;
+    }
+    return 0;
+}
+
+int intent_init(intent_matcher *matcher, const char *controls_path, const char *phrases_path)
+{
+    char line[512];
+    memset(matcher, 0, sizeof(*matcher));
+    if (new_node(matcher, 0) != 0) // 根节点
+    {
+        return -1;
+    }
+
+    cJSON *json = load_controls(controls_path);
+    if (json == NULL)
+    {
+        return -1;
+    }
+    const cJSON *controls = cJSON_GetObjectItemCaseSensitive(json, "controls");
+
+    FILE *fp = fopen(phrases_path, "r");
+    if (fp == NULL)
+    {
+        fprintf(stderr, "Error opening file %s\n", phrases_path);
+        cJSON_Delete(json);
+        return -1;
+    }
+    // 每行：短语 操作 status，# 开头为注释
+    while (fgets(line, sizeof(line), fp) != NULL)
+    {
+        char *phrase = strtok(line, " \t\r\n");
+        char *operation = strtok(NULL, " \t\r\n");
+        char *status = strtok(NULL, " \t\r\n");
+        if (phrase == NULL || phrase[0] == '#')
+            continue;
+        if (operation == NULL || status == NULL)
+        {
+            fprintf(stderr, "Bad phrase line: %s\n", phrase);
+            continue;
+        }
+        if (!operation_defined(controls, operation))
+        {
+            fprintf(stderr, "Phrase \"%s\" uses unknown operation: %s\n", phrase, operation);
+            continue;
+        }
+        int command = add_command(matcher, operation, status);
+        if (command == -1 || add_pattern(matcher, phrase, command) != 0)
+        {
+            fclose(fp);
+            cJSON_Delete(json);
+            return -1;
+        }
+    }
+    fclose(fp);
+    cJSON_Delete(json);
+    return build_links(matcher);
+}
+
+void intent_free(intent_matcher *matcher)
+{
+    for (int i = 0; i < matcher->pattern_count; i++)
+    {
+        free(matcher->patterns[i].phrase);
+    }
+    for (int i = 0; i < matcher->command_count; i++)
+    {
+        free(matcher->commands[i].operation);
+        free(matcher->commands[i].status);
+    }
+    free(matcher->patterns);
+    free(matcher->commands);
+    free(matcher->nodes);
+    memset(matcher, 0, sizeof(*matcher));
+}
+
+static size_t utf8_length(unsigned char c)
+{
+    if (c < 0x80)
+        return 1;
+    if ((c & 0xE0) == 0xC0)
+        return 2;
+    if ((c & 0xF0) == 0xE0)
+        return 3;
+    return 4;
+}
+
+static int in_list(const char *text, size_t len, const char **list)
+{
+    for (int i = 0; list[i] != NULL; i++)
+    {
+        if (strlen(list[i]) == len && memcmp(text, list[i], len) == 0)
+            return 1;
+    }
+    return 0;
+}
+
+intent_status intent_match(intent_matcher *matcher, const char *input, const intent_command **command)
+{
+    size_t len = strlen(input);
+    unsigned char covered[2048];
+    int found = -1;
+    int conflict = 0;
+
+    if (matcher->pattern_count == 0 || len == 0 || len > sizeof(covered))
+    {
+        matcher->misses++;
+        return INTENT_MISS;
+    }
+    memset(covered, 0, len);
+
+    // 扫描一遍，记录所有匹配到的短语覆盖的字节
+    int node = 0;
+    for (size_t i = 0; i < len; i++)
+    {
+        unsigned char byte = (unsigned char)input[i];
+        int next;
+        while ((next = find_child(matcher, node, byte)) == -1 && node != 0)
+        {
+            node = matcher->nodes[node].fail;
+        }
+        node = next != -1 ? next : 0;
+
+        int out = matcher->nodes[node].output != -1 ? node : matcher->nodes[node].dict_link;
+        for (; out != -1; out = matcher->nodes[out].dict_link)
+        {
+            const intent_pattern *pattern = &matcher->patterns[matcher->nodes[out].output];
+            memset(covered + i + 1 - pattern->len, 1, pattern->len);
+            if (found == -1)
+                found = pattern->command;
+            else if (found != pattern->command)
+                conflict = 1;
+        }
+    }
+
+    if (found == -1)
+    {
+        matcher->misses++;
+        return INTENT_MISS;
+    }
+
+    // 检查未匹配的部分：否定词或者无关内容太多都不算确定
+    int filler = 0;
+    for (size_t i = 0; i < len;)
+    {
+        size_t n = utf8_length((unsigned char)input[i]);
+        if (i + n > len)
+            n = len - i;
+        if (!covered[i])
+        {
+            if (in_list(input + i, n, negation_words))
+                conflict = 1;
+            else if (n > 1 ? !in_list(input + i, n, punctuation)
+                           : !(input[i] == ' ' || input[i] == '\t' || input[i] == '!' ||
+                               input[i] == '.' || input[i] == ',' || input[i] == '?'))
+                filler++;
+        }
+        i += n;
+    }
+    if (conflict || filler > INTENT_MAX_FILLER)
+    {
+        matcher->ambiguous++;
+        return INTENT_AMBIGUOUS;
+    }
+
+    matcher->hits++;
+    *command = &matcher->commands[found];
+    return INTENT_HIT;
+}
@@ -0,0 +1,69 @@
+#ifndef INTENT_H
+#define INTENT_H
+#include <stddef.h>
+
+// 本地意图匹配（快速通道）
+// 用 dev_ctrl.json 里的控制项加一张短语表（intent_phrases.txt）预先构建 Aho-Corasick 自动机，
+// 按 UTF-8 字节扫描用户输入。只有一条明确的指令、没有否定词、剩余的无关字很少时才算命中，
+// 命中后直接在本地执行，其余输入仍然交给模型。
+// 短语表里 status 为 ? 的是状态查询（"灯开着吗"），由设备状态影子回答。
+
+#define INTENT_MAX_FILLER 4 // 命中时允许的无关字数（如 "请帮我开灯" 里的 "请帮我"）
+#define INTENT_QUERY "?"    // 状态查询的 status
+
+typedef enum intent_status
+{
+    INTENT_MISS = 0,   // 没有匹配到任何短语
+    INTENT_HIT,        // 明确的单条指令
+    INTENT_AMBIGUOUS,  // 有匹配但不够确定（多条指令、否定词、多余内容太多）
+} intent_status;
+
+typedef struct intent_command
+{
+    char *operation;
+    char *status;
+} intent_command;
+
+typedef struct intent_pattern
+{
+    char *phrase;
+    size_t len;
+    int command; // commands 数组下标
+} intent_pattern;
+
+// 自动机节点：子节点用兄弟链表存储，短语表不大，省内存
+typedef struct intent_node
+{
+    int first_child;
+    int next_sibling;
+    int fail;      // 失配指针
+    int output;    // 在此结束的短语下标，-1 表示没有
+    int dict_link; // 沿失配链最近的有输出的节点，-1 表示没有
+    unsigned char byte;
+} intent_node;
+
+typedef struct intent_matcher
+{
+    intent_node *nodes;
+    int node_count;
+    int node_cap;
+    intent_pattern *patterns;
+    int pattern_count;
+    intent_command *commands;
+    int command_count;
+
+    // 统计
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long ambiguous;
+} intent_matcher;
+
+// 从控制项定义和短语表构建匹配器；短语里引用了 dev_ctrl.json 中不存在的操作会被忽略。
+// 失败返回 -1（此时匹配器为空，所有输入都不命中）
+int intent_init(intent_matcher *matcher, const char *controls_path, const char *phrases_path);
+void intent_free(intent_matcher *matcher);
+
+// 匹配一条用户输入，命中时 *command 指向匹配到的指令
+intent_status intent_match(intent_matcher *matcher, const char *input, const intent_command **command);
+
+#endif
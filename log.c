@@ -0,0 +1,80 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include "log.h"
+#include "util.h"
+
+log_level log_current = LOG_INFO;
+
+static log_site *sites;
+
+static const char *level_names[] = {"error", "warn", "info", "debug", "trace"};
+
+int log_parse_level(const char *name)
+{
+    if (name == NULL || name[0] == '\0')
+        return -1;
+    for (int i = 0; i <= LOG_TRACE; i++)
+    {
+        if (strcasecmp(name, level_names[i]) == 0)
+            return i;
+    }
+    char *end;
+    long level = strtol(name, &end, 10);
+    return *end == '\0' && level >= LOG_ERROR && level <= LOG_TRACE ? (int)level : -1;
+}
+
+const char *log_level_name(log_level level)
+{
+    return level >= LOG_ERROR && level <= LOG_TRACE ? level_names[level] : "?";
+}
+
+int log_admit(log_site *site)
+{
+    double now = now_ms();
+    if (site->refilled_ms == 0)
+    {
+        site->tokens = LOG_BURST;
+        site->next = sites;
+        sites = site;
+    }
+    else
+        site->tokens += (now - site->refilled_ms) * LOG_RATE_PER_SEC / 1000;
+    if (site->tokens > LOG_BURST)
+        site->tokens = LOG_BURST;
+    site->refilled_ms = now;
+    if (site->tokens < 1)
+    {
+        site->suppressed++;
+        return 0;
+    }
+    site->tokens -= 1;
+    return 1;
+}
+
+static void report_suppressed(log_site *site)
+{
+    if (site->suppressed > 0)
+    {
+        fprintf(stderr, "[log] %lu lines suppressed at %s:%d\n", site->suppressed, site->file, site->line);
+        site->suppressed = 0;
+    }
+}
+
+void log_flush(void)
+{
+    for (log_site *site = sites; site != NULL; site = site->next)
+        report_suppressed(site);
+}
+
+void log_write(log_site *site, const char *fmt, ...)
+{
+    va_list args;
+    report_suppressed(site);
+    va_start(args, fmt);
+    vfprintf(stderr, fmt, args);
+    va_end(args);
+}
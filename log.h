@@ -0,0 +1,51 @@
+#ifndef LOG_H
+#define LOG_H
+
+// 运行时日志级别
+// 取代原来编译期的 debug 开关：级别用 --log-level 或环境变量 CHAT_LOG_LEVEL 设置，运行中输入 /log <级别> 修改。
+// 每个输出点各自限速（令牌桶），刷屏的输出点被限住时不影响其他输出点，丢掉的行数在这个点下一次输出时补报。
+// 日志写到 stderr，不和对话内容混在一起。限速状态没有加锁，只在主线程使用。
+
+typedef enum log_level
+{
+    LOG_ERROR,
+    LOG_WARN,
+    LOG_INFO,  // 默认：启动、退出时的统计
+    LOG_DEBUG, // 每轮的耗时
+    LOG_TRACE, // 完整的请求体和回复
+} log_level;
+
+#define LOG_RATE_PER_SEC 5.0 // 每个输出点平均每秒最多输出的行数
+#define LOG_BURST 20         // 每个输出点允许的突发行数
+
+typedef struct log_site
+{
+    const char *file;
+    int line;
+    double tokens;
+    double refilled_ms; // 0 表示还没输出过
+    unsigned long suppressed;
+    struct log_site *next; // 输出过的点串成链表，退出时补报
+} log_site;
+
+extern log_level log_current;
+
+// 名字（error、warn、info、debug、trace）或数字，失败返回 -1
+int log_parse_level(const char *name);
+const char *log_level_name(log_level level);
+
+// 令牌桶允许这一行输出时返回 1
+int log_admit(log_site *site);
+void log_write(log_site *site, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+// 补报所有输出点还没报过的丢弃行数，退出前调用
+void log_flush(void);
+
+#define log_at(level, fmt, args...)                                          \
+    do                                                                       \
+    {                                                                        \
+        static log_site log_site_ = {__FILE__, __LINE__, 0, 0, 0, NULL};     \
+        if ((level) <= log_current && log_admit(&log_site_))                 \
+            log_write(&log_site_, fmt, ##args);                              \
+    } while (0)
+
+#endif
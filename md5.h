@@ -0,0 +1,19 @@
+#ifndef MD5_H
+#define MD5_H
+#include <stddef.h>
+#include <stdint.h>
+
+// MD5（RFC 1321），只用来核对下载的完整性（对象存储的 Content-MD5 响应头），不用于安全场景
+
+typedef struct md5_ctx
+{
+    uint32_t state[4];
+    uint64_t length;         // 已输入的字节数
+    unsigned char block[64]; // 不满一块的剩余数据
+} md5_ctx;
+
+void md5_init(md5_ctx *ctx);
+void md5_update(md5_ctx *ctx, const void *data, size_t len);
+void md5_final(md5_ctx *ctx, unsigned char digest[16]);
+
+#endif
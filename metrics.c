@@ -0,0 +1,318 @@
+#define _GNU_SOURCE // accept4
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include "metrics.h"
+
+static const struct
+{
+    const char *name;
+    const char *help;
+    double scale; // 导出时乘上，时间统一换算成秒
+} metric_info[METRIC_COUNT] = {
+    [METRIC_PAYLOAD_BUILD] = {"chat_payload_build_seconds", "Time to build the request body", 1e-6},
+    [METRIC_REQUEST_BYTES] = {"chat_request_bytes", "Request body size", 1},
+    [METRIC_RESPONSE_BYTES] = {"chat_response_bytes", "Response body size", 1},
+    [METRIC_WIRE_SENT] = {"chat_wire_sent_bytes", "Bytes sent on the wire, headers and encoded body", 1},
+    [METRIC_WIRE_RECEIVED] = {"chat_wire_received_bytes", "Bytes received on the wire, headers and encoded body", 1},
+    [METRIC_DNS] = {"chat_dns_seconds", "Name lookup done, from request start", 1e-6},
+    [METRIC_CONNECT] = {"chat_connect_seconds", "TCP connect done, from request start", 1e-6},
+    [METRIC_TLS] = {"chat_tls_seconds", "TLS handshake done, from request start", 1e-6},
+    [METRIC_FIRST_BYTE] = {"chat_first_byte_seconds", "First response byte, from request start", 1e-6},
+    [METRIC_HTTP_TOTAL] = {"chat_http_seconds", "Whole HTTP request", 1e-6},
+    [METRIC_PARSE] = {"chat_parse_seconds", "Extracting and parsing the reply", 1e-6},
+    [METRIC_DISPATCH] = {"chat_dispatch_seconds", "Dispatching the reply to handlers", 1e-6},
+    [METRIC_TURN] = {"chat_turn_seconds", "End-to-end turn latency", 1e-6},
+    [METRIC_ACTUATION] = {"chat_actuation_seconds", "Control command received to handler done", 1e-6},
+    [METRIC_PROMPT_TOKENS] = {"chat_prompt_tokens", "Prompt tokens reported in usage", 1},
+    [METRIC_COMPLETION_TOKENS] = {"chat_completion_tokens", "Completion tokens reported in usage", 1},
+};
+
+void metrics_init(metrics *m)
+{
+    memset(m, 0, sizeof(*m));
+    m->listen_fd = -1;
+}
+
+// 最小的 i 使 value <= 2^i
+static int bucket_index(uint64_t value)
+{
+    int i = value <= 1 ? 0 : 64 - __builtin_clzll(value - 1);
+    return i < METRICS_BUCKETS ? i : METRICS_BUCKETS - 1;
+}
+
+void metrics_observe(metrics *m, metric_id id, uint64_t value)
+{
+    metric_histogram *h = &m->histograms[id];
+    atomic_fetch_add_explicit(&h->buckets[bucket_index(value)], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&h->sum, value, memory_order_relaxed);
+}
+
+void metrics_observe_ms(metrics *m, metric_id id, double ms)
+{
+    metrics_observe(m, id, ms > 0 ? (uint64_t)(ms * 1000 + 0.5) : 0);
+}
+
+// 读一份桶的快照，返回总数
+static uint64_t snapshot(const metric_histogram *h, uint64_t counts[METRICS_BUCKETS])
+{
+    uint64_t total = 0;
+    for (int i = 0; i < METRICS_BUCKETS; i++)
+    {
+        counts[i] = atomic_load_explicit(&h->buckets[i], memory_order_relaxed);
+        total += counts[i];
+    }
+    return total;
+}
+
+uint64_t metrics_count(const metrics *m, metric_id id)
+{
+    uint64_t counts[METRICS_BUCKETS];
+    return snapshot(&m->histograms[id], counts);
+}
+
+static uint64_t quantile(const uint64_t counts[METRICS_BUCKETS], uint64_t total, double q)
+{
+    uint64_t rank = (uint64_t)(q * total);
+    uint64_t seen = 0;
+    if (total == 0)
+        return 0;
+    for (int i = 0; i < METRICS_BUCKETS; i++)
+    {
+        seen += counts[i];
+        if (seen > rank)
+            return 1ULL << i;
+    }
+    return 1ULL << (METRICS_BUCKETS - 1);
+}
+
+uint64_t metrics_quantile(const metrics *m, metric_id id, double q)
+{
+    uint64_t counts[METRICS_BUCKETS];
+    uint64_t total = snapshot(&m->histograms[id], counts);
+    return quantile(counts, total, q);
+}
+
+void metrics_write_prometheus(const metrics *m, FILE *out)
+{
+    for (int id = 0; id < METRIC_COUNT; id++)
+    {
+        const metric_histogram *h = &m->histograms[id];
+        uint64_t counts[METRICS_BUCKETS];
+        uint64_t total = snapshot(h, counts);
+        double scale = metric_info[id].scale;
+
+        fprintf(out, "# HELP %s %s\n# TYPE %s histogram\n", metric_info[id].name, metric_info[id].help,
+                metric_info[id].name);
+        uint64_t cumulative = 0;
+        for (int i = 0; i < METRICS_BUCKETS - 1; i++)
+        {
+            cumulative += counts[i];
+            fprintf(out, "%s_bucket{le=\"%.9g\"} %llu\n", metric_info[id].name, (double)(1ULL << i) * scale,
+                    (unsigned long long)cumulative);
+        }
+        fprintf(out, "%s_bucket{le=\"+Inf\"} %llu\n", metric_info[id].name, (unsigned long long)total);
+        fprintf(out, "%s_sum %.9g\n", metric_info[id].name,
+                (double)atomic_load_explicit(&h->sum, memory_order_relaxed) * scale);
+        fprintf(out, "%s_count %llu\n", metric_info[id].name, (unsigned long long)total);
+    }
+}
+
+void metrics_write_json(const metrics *m, FILE *out)
+{
+    fprintf(out, "{");
+    for (int id = 0; id < METRIC_COUNT; id++)
+    {
+        const metric_histogram *h = &m->histograms[id];
+        uint64_t counts[METRICS_BUCKETS];
+        uint64_t total = snapshot(h, counts);
+        double scale = metric_info[id].scale;
+
+        fprintf(out, "%s\"%s\":{\"count\":%llu,\"sum\":%.9g,\"p50\":%.9g,\"p90\":%.9g,\"p99\":%.9g,\"buckets\":[",
+                id > 0 ? "," : "", metric_info[id].name, (unsigned long long)total,
+                (double)atomic_load_explicit(&h->sum, memory_order_relaxed) * scale,
+                (double)quantile(counts, total, 0.5) * scale, (double)quantile(counts, total, 0.9) * scale,
+                (double)quantile(counts, total, 0.99) * scale);
+        // 只列出非空的桶：[上界, 个数]
+        int first = 1;
+        for (int i = 0; i < METRICS_BUCKETS; i++)
+        {
+            if (counts[i] == 0)
+                continue;
+            fprintf(out, "%s[%.9g,%llu]", first ? "" : ",", (double)(1ULL << i) * scale,
+                    (unsigned long long)counts[i]);
+            first = 0;
+        }
+        fprintf(out, "]}");
+    }
+    fprintf(out, "}\n");
+}
+
+static int is_json_path(const char *path)
+{
+    size_t len = strlen(path);
+    return len >= 5 && strcmp(path + len - 5, ".json") == 0;
+}
+
+int metrics_write_file(const metrics *m, const char *path)
+{
+    size_t len = strlen(path) + 5;
+    char *tmp = malloc(len);
+    if (tmp == NULL)
+        return -1;
+    snprintf(tmp, len, "%s.tmp", path);
+
+    FILE *out = fopen(tmp, "w");
+    if (out != NULL)
+    {
+        if (is_json_path(path))
+            metrics_write_json(m, out);
+        else
+            metrics_write_prometheus(m, out);
+    }
+    // 改名之后读的一方看到的总是一份完整的文件
+    if (out == NULL || fclose(out) != 0 || rename(tmp, path) != 0)
+    {
+        perror(tmp);
+        unlink(tmp);
+        free(tmp);
+        return -1;
+    }
+    free(tmp);
+    return 0;
+}
+
+static int write_all(int fd, const char *data, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t n = write(fd, data, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        data += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+// 读一行请求：HTTP 的 "GET /metrics.json HTTP/1.1"，或者只是 "json"；什么都不发默认 Prometheus 格式
+static void serve_client(metrics *m, int fd)
+{
+    char request[1024];
+    size_t len = 0;
+    struct timeval timeout = {1, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    while (len < sizeof(request) - 1)
+    {
+        ssize_t n = read(fd, request + len, sizeof(request) - 1 - len);
+        if (n <= 0)
+            break;
+        len += (size_t)n;
+        if (memchr(request, '\n', len) != NULL)
+            break;
+    }
+    request[len] = '\0';
+    char *newline = strchr(request, '\n');
+    if (newline != NULL)
+        *newline = '\0';
+    int http = strncmp(request, "GET ", 4) == 0;
+    int json = strstr(request, "json") != NULL;
+
+    char *body = NULL;
+    size_t body_len = 0;
+    FILE *out = open_memstream(&body, &body_len);
+    if (out == NULL)
+        return;
+    if (json)
+        metrics_write_json(m, out);
+    else
+        metrics_write_prometheus(m, out);
+    fclose(out);
+
+    if (http)
+    {
+        char header[256];
+        int n = snprintf(header, sizeof(header),
+                         "HTTP/1.1 200 OK\r\nContent-Type: %s\r\nContent-Length: %zu\r\nConnection: close\r\n\r\n",
+                         json ? "application/json" : "text/plain; version=0.0.4", body_len);
+        write_all(fd, header, (size_t)n);
+    }
+    write_all(fd, body, body_len);
+    free(body);
+    atomic_fetch_add_explicit(&m->scrapes, 1, memory_order_relaxed);
+}
+
+static void *serve_thread(void *arg)
+{
+    metrics *m = arg;
+    for (;;)
+    {
+        int fd = accept4(m->listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (fd < 0)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            break; // metrics_stop 关闭了监听套接字
+        }
+        serve_client(m, fd);
+        close(fd);
+    }
+    return NULL;
+}
+
+int metrics_serve(metrics *m, const char *path)
+{
+    struct sockaddr_un addr;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path))
+    {
+        fprintf(stderr, "Socket path too long: %s\n", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+    unlink(path); // 上次没有正常退出留下的
+    m->listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (m->listen_fd < 0 || bind(m->listen_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+        listen(m->listen_fd, 8) != 0)
+    {
+        perror(path);
+        if (m->listen_fd >= 0)
+            close(m->listen_fd);
+        m->listen_fd = -1;
+        return -1;
+    }
+    m->socket_path = strdup(path);
+    if (pthread_create(&m->thread, NULL, serve_thread, m) != 0)
+    {
+        fprintf(stderr, "Failed to start metrics thread\n");
+        close(m->listen_fd);
+        m->listen_fd = -1;
+        unlink(path);
+        free(m->socket_path);
+        m->socket_path = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+void metrics_stop(metrics *m)
+{
+    if (m->listen_fd < 0)
+        return;
+    shutdown(m->listen_fd, SHUT_RDWR); // 让阻塞在 accept 上的线程返回
+    pthread_join(m->thread, NULL);
+    close(m->listen_fd);
+    m->listen_fd = -1;
+    unlink(m->socket_path);
+    free(m->socket_path);
+    m->socket_path = NULL;
+}
@@ -0,0 +1,76 @@
+#ifndef METRICS_H
+#define METRICS_H
+#include <stdio.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+// 每轮对话的延迟和吞吐指标
+// 每个指标是一个按 2 的幂分桶的直方图，记录只做几次原子加，不加锁；
+// 导出可以在任何线程随时进行（Unix 套接字的服务线程就是这样），读到的是近似一致的快照。
+// 导出格式为 Prometheus 文本格式或 JSON：写到文件（/metrics 命令或退出时），或者在 Unix 套接字上按需提供，
+//   curl --unix-socket chat.sock http://localhost/metrics       Prometheus
+//   curl --unix-socket chat.sock http://localhost/metrics.json  JSON
+//   echo json | nc -U chat.sock                                 不走 HTTP 也可以
+
+#define METRICS_BUCKETS 32 // 第 i 个桶的上界是 2^i 个单位，最后一个桶收下所有更大的值
+
+typedef enum metric_id
+{
+    METRIC_PAYLOAD_BUILD,   // 生成请求体，微秒
+    METRIC_REQUEST_BYTES,
+    METRIC_RESPONSE_BYTES,
+    METRIC_WIRE_SENT,       // 线路上的字节数（头部加压缩后的请求体 / 解压前的响应体）
+    METRIC_WIRE_RECEIVED,
+    METRIC_DNS,             // curl 的耗时统计，都从请求开始计时，微秒
+    METRIC_CONNECT,
+    METRIC_TLS,
+    METRIC_FIRST_BYTE,
+    METRIC_HTTP_TOTAL,
+    METRIC_PARSE,           // 取出回复内容并解析，微秒
+    METRIC_DISPATCH,        // 分发回复（控制指令只算到交给线程池为止），微秒
+    METRIC_TURN,            // 一轮对话的端到端延迟，微秒
+    METRIC_ACTUATION,       // 控制指令从收到到执行完（含合并窗口里的等待），微秒
+    METRIC_PROMPT_TOKENS,   // 回复 usage 字段里的 token 数
+    METRIC_COMPLETION_TOKENS,
+    METRIC_COUNT
+} metric_id;
+
+typedef struct metric_histogram
+{
+    atomic_ullong buckets[METRICS_BUCKETS];
+    atomic_ullong sum;
+} metric_histogram;
+
+typedef struct metrics
+{
+    metric_histogram histograms[METRIC_COUNT];
+    atomic_ulong scrapes; // 套接字上的导出次数
+
+    // Unix 套接字导出
+    int listen_fd;
+    char *socket_path;
+    pthread_t thread;
+} metrics;
+
+void metrics_init(metrics *m);
+
+void metrics_observe(metrics *m, metric_id id, uint64_t value);
+// 毫秒转成微秒记录
+void metrics_observe_ms(metrics *m, metric_id id, double ms);
+
+// 样本数；分位数取所在桶的上界（最多高估一倍）
+uint64_t metrics_count(const metrics *m, metric_id id);
+uint64_t metrics_quantile(const metrics *m, metric_id id, double q);
+
+void metrics_write_prometheus(const metrics *m, FILE *out);
+void metrics_write_json(const metrics *m, FILE *out);
+// 后缀是 .json 时写 JSON，否则写 Prometheus 文本；先写临时文件再改名。返回 0 成功
+int metrics_write_file(const metrics *m, const char *path);
+
+// 在 path 上监听 Unix 套接字，由一个后台线程响应；失败返回 -1
+int metrics_serve(metrics *m, const char *path);
+// 停止服务线程，删除套接字文件
+void metrics_stop(metrics *m);
+
+#endif
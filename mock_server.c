@@ -0,0 +1,1445 @@
+#define _GNU_SOURCE // accept4、strcasestr
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <zlib.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include "mock_server.h"
+#include "md5.h"
+
+#define MOCK_POLL_MS 100 // 连接线程检查是否停止的间隔
+
+// 轮流使用的回复
+static const char *mock_replies[] = {
+    "{\"type\":\"控制指令\",\"operation\":\"switchLight\",\"parameters\":{\"status\":\"on\"}}",
+    "{\"type\":\"对话\",\"message\":\"我是贾维斯，很高兴为您服务。能源核心运行正常，核聚变反应堆处于待机状态。\"}",
+    "{\"type\":\"控制指令\",\"operation\":\"activateFusion\",\"parameters\":{\"status\":\"start\"}}",
+};
+#define MOCK_REPLY_COUNT (sizeof(mock_replies) / sizeof(mock_replies[0]))
+
+// HTTP/2 的帧类型和标志
+#define H2_DATA 0x0
+#define H2_HEADERS 0x1
+#define H2_RST_STREAM 0x3
+#define H2_SETTINGS 0x4
+#define H2_PING 0x6
+#define H2_GOAWAY 0x7
+#define H2_WINDOW_UPDATE 0x8
+#define H2_CONTINUATION 0x9
+#define H2_END_STREAM 0x1
+#define H2_ACK 0x1
+#define H2_END_HEADERS 0x4
+#define H2_PADDED 0x8
+#define H2_PRIORITY 0x20
+#define H2_MAX_FRAME 16384 // 对方没有调大时 DATA 帧的上限
+static const char h2_preface[] = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+
+// HPACK 动态表的一项
+struct hpack_entry
+{
+    char *name;
+    char *value;
+    size_t size; // 名字和值的长度加 32
+};
+
+struct mock_connection
+{
+    mock_server *server;
+    int fd;
+    unsigned int seed;
+    char *buf; // 收到的数据，总是以 '\0' 结尾
+    size_t len;
+    size_t cap;
+
+    // HTTP/2：流的线程和连接线程一起写，发帧时加锁；最后一个持有者释放连接
+    atomic_int refs;
+    pthread_mutex_t write_lock;
+    struct hpack_entry *table; // 最新的在末尾
+    size_t table_count;
+    size_t table_size;
+    size_t table_max;
+    z_stream deflate; // HTTP/1.1 响应复用的压缩流
+    int deflate_ready;
+};
+
+// 一个请求的响应：HTTP/1.1 直接写到连接上，HTTP/2 写成这个流的 HEADERS 和 DATA 帧。
+// 客户端接受 gzip 时响应体边写边压缩，每次写都 Z_SYNC_FLUSH，客户端收到一段就能解出一段
+struct mock_reply
+{
+    mock_server *server;
+    struct mock_connection *conn;
+    uint32_t stream;  // HTTP/2 的流号，0 表示 HTTP/1.1
+    unsigned int seed;
+    int gzip;
+    int chunked;      // HTTP/1.1 分块传输
+    unsigned char head[384]; // 响应头（HTTP/2 是 HPACK 块），和第一段响应体一起发出，少一次系统调用
+    size_t head_len;
+    char range[32];   // 请求头 Range 和 If-Range 的值，没有时为空
+    char if_range[64];
+    const char *etag; // 下载响应额外带的头，没有时为 NULL
+    const char *content_md5;
+    const char *content_range;
+    z_stream own;     // HTTP/2 的流各用各的压缩流
+    z_stream *z;
+};
+
+void mock_options_default(mock_options *options)
+{
+    memset(options, 0, sizeof(*options));
+    options->stream_piece = 8;
+    options->image_bytes = 256 * 1024;
+}
+
+static void sleep_us(long us)
+{
+    struct timespec ts = {us / 1000000, (us % 1000000) * 1000};
+    while (us > 0 && nanosleep(&ts, &ts) != 0 && errno == EINTR)
+        ;
+}
+
+// 几段数据用一次 sendmsg 写出（写不完时接着写剩下的）
+static int send_iov(mock_server *server, int fd, struct iovec *iov, int count)
+{
+    while (count > 0)
+    {
+        struct msghdr msg = {.msg_iov = iov, .msg_iovlen = (size_t)count};
+        ssize_t n = sendmsg(fd, &msg, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        atomic_fetch_add_explicit(&server->bytes_sent, (unsigned long)n, memory_order_relaxed);
+        while (count > 0 && (size_t)n >= iov->iov_len)
+        {
+            n -= (ssize_t)iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0)
+        {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= (size_t)n;
+        }
+    }
+    return 0;
+}
+
+static int send_all(mock_server *server, int fd, const char *data, size_t len)
+{
+    struct iovec iov = {(void *)data, len};
+    return send_iov(server, fd, &iov, 1);
+}
+
+static void frame_header(unsigned char *out, int type, int flags, uint32_t stream, size_t len)
+{
+    out[0] = (unsigned char)(len >> 16);
+    out[1] = (unsigned char)(len >> 8);
+    out[2] = (unsigned char)len;
+    out[3] = (unsigned char)type;
+    out[4] = (unsigned char)flags;
+    out[5] = (unsigned char)(stream >> 24 & 0x7F);
+    out[6] = (unsigned char)(stream >> 16);
+    out[7] = (unsigned char)(stream >> 8);
+    out[8] = (unsigned char)stream;
+}
+
+// 发一个 HTTP/2 帧，多个流的线程可能同时在写
+static int send_frame(struct mock_connection *conn, int type, int flags, uint32_t stream, const void *payload,
+                      size_t len)
+{
+    unsigned char header[9];
+    frame_header(header, type, flags, stream, len);
+    struct iovec iov[2] = {{header, sizeof(header)}, {(void *)payload, len}};
+    pthread_mutex_lock(&conn->write_lock);
+    int result = send_iov(conn->server, conn->fd, iov, 2);
+    pthread_mutex_unlock(&conn->write_lock);
+    return result;
+}
+
+// HPACK 整数：prefix 位前缀，超出的部分每字节 7 位
+static size_t hpack_put_int(unsigned char *out, unsigned char flags, int prefix, size_t value)
+{
+    size_t max = (1u << prefix) - 1;
+    size_t n = 0;
+    if (value < max)
+    {
+        out[n++] = (unsigned char)(flags | value);
+        return n;
+    }
+    out[n++] = (unsigned char)(flags | max);
+    for (value -= max; value >= 128; value >>= 7)
+        out[n++] = (unsigned char)((value & 0x7F) | 0x80);
+    out[n++] = (unsigned char)value;
+    return n;
+}
+
+// 不加索引的字面量，名字用静态表的下标，值不做 Huffman 编码
+static size_t hpack_put_header(unsigned char *out, size_t index, const char *value)
+{
+    size_t len = strlen(value);
+    size_t n = hpack_put_int(out, 0x00, 4, index);
+    n += hpack_put_int(out + n, 0x00, 7, len);
+    memcpy(out + n, value, len);
+    return n + len;
+}
+
+// 静态表里没有的名字（content-md5）：名字也是字面量
+static size_t hpack_put_literal(unsigned char *out, const char *name, const char *value)
+{
+    size_t len = strlen(name);
+    size_t n = hpack_put_int(out, 0x00, 4, 0);
+    n += hpack_put_int(out + n, 0x00, 7, len);
+    memcpy(out + n, name, len);
+    n += len;
+    len = strlen(value);
+    n += hpack_put_int(out + n, 0x00, 7, len);
+    memcpy(out + n, value, len);
+    return n + len;
+}
+
+// 把 data 按传输方式写出去，还没发的响应头一起带上；last 表示响应到此结束
+static int emit(struct mock_reply *r, const char *data, size_t len, int last)
+{
+    if (len == 0 && !last)
+        return 0;
+    if (r->stream != 0)
+    {
+        do
+        {
+            size_t n = len < H2_MAX_FRAME ? len : H2_MAX_FRAME;
+            unsigned char headers[9], frame[9];
+            frame_header(headers, H2_HEADERS, H2_END_HEADERS, r->stream, r->head_len);
+            frame_header(frame, H2_DATA, last && n == len ? H2_END_STREAM : 0, r->stream, n);
+            struct iovec iov[4] = {{headers, r->head_len > 0 ? sizeof(headers) : 0}, {r->head, r->head_len},
+                                   {frame, sizeof(frame)}, {(void *)data, n}};
+            pthread_mutex_lock(&r->conn->write_lock);
+            int result = send_iov(r->server, r->conn->fd, iov, 4);
+            pthread_mutex_unlock(&r->conn->write_lock);
+            if (result != 0)
+                return -1;
+            r->head_len = 0;
+            data += n;
+            len -= n;
+        } while (len > 0);
+        return 0;
+    }
+    char size[16];
+    int size_len = r->chunked && len > 0 ? snprintf(size, sizeof(size), "%zx\r\n", len) : 0;
+    struct iovec iov[5] = {{r->head, r->head_len},
+                           {size, (size_t)size_len},
+                           {(void *)data, len},
+                           {"\r\n", size_len > 0 ? 2 : 0},
+                           {"0\r\n\r\n", r->chunked && last ? 5 : 0}};
+    r->head_len = 0;
+    return send_iov(r->server, r->conn->fd, iov, 5);
+}
+
+// 开始响应；len 为 -1 表示长度事先不知道（SSE）。响应头先存着，和响应体一起发
+static int reply_start(struct mock_reply *r, const char *status, const char *content_type, long len)
+{
+    int retry = strncmp(status, "503", 3) == 0;
+    if (strncmp(content_type, "image/", 6) == 0)
+        r->gzip = 0; // 图片本身已经压缩过
+    if (r->gzip && r->stream == 0 && r->conn->deflate_ready)
+    {
+        r->z = &r->conn->deflate;
+        deflateReset(r->z);
+    }
+    else if (r->gzip)
+    {
+        r->z = r->stream != 0 ? &r->own : &r->conn->deflate;
+        if (deflateInit2(r->z, 6, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+            r->gzip = 0;
+        else if (r->stream == 0)
+            r->conn->deflate_ready = 1;
+    }
+    if (r->stream != 0)
+    {
+        unsigned char *block = r->head;
+        size_t n = 0;
+        char code[4] = "";
+        char length[24];
+        snprintf(code, sizeof(code), "%.3s", status);
+        if (strcmp(code, "200") == 0)
+            block[n++] = 0x88; // 静态表 8 是 ":status: 200"
+        else
+            n += hpack_put_header(block + n, 8, code);
+        n += hpack_put_header(block + n, 31, content_type);
+        if (r->gzip)
+            n += hpack_put_header(block + n, 26, "gzip");
+        else if (len >= 0)
+        {
+            snprintf(length, sizeof(length), "%ld", len);
+            n += hpack_put_header(block + n, 28, length);
+        }
+        if (retry)
+            n += hpack_put_header(block + n, 53, "0");
+        if (r->etag != NULL)
+            n += hpack_put_header(block + n, 34, r->etag);
+        if (r->content_range != NULL)
+            n += hpack_put_header(block + n, 30, r->content_range);
+        if (r->content_md5 != NULL)
+            n += hpack_put_literal(block + n, "content-md5", r->content_md5);
+        r->head_len = n;
+        return 0;
+    }
+
+    char *header = (char *)r->head;
+    size_t size = sizeof(r->head);
+    int n = snprintf(header, size, "HTTP/1.1 %s\r\nContent-Type: %s\r\n%s", status, content_type,
+                     retry ? "Retry-After: 0\r\n" : "");
+    if (r->etag != NULL)
+        n += snprintf(header + n, size - n, "ETag: %s\r\nAccept-Ranges: bytes\r\n", r->etag);
+    if (r->content_range != NULL)
+        n += snprintf(header + n, size - n, "Content-Range: %s\r\n", r->content_range);
+    if (r->content_md5 != NULL)
+        n += snprintf(header + n, size - n, "Content-MD5: %s\r\n", r->content_md5);
+    r->chunked = r->gzip || len < 0;
+    if (r->chunked)
+        n += snprintf(header + n, size - n, "%sTransfer-Encoding: chunked\r\n\r\n",
+                      r->gzip ? "Content-Encoding: gzip\r\n" : "");
+    else
+        n += snprintf(header + n, size - n, "Content-Length: %ld\r\n\r\n", len);
+    r->head_len = (size_t)n;
+    return 0;
+}
+
+static int reply_write(struct mock_reply *r, const char *data, size_t len, int last)
+{
+    if (!r->gzip)
+        return emit(r, data, len, last);
+    char out[8192];
+    r->z->next_in = (Bytef *)data;
+    r->z->avail_in = (uInt)len;
+    int result;
+    do
+    {
+        r->z->next_out = (Bytef *)out;
+        r->z->avail_out = sizeof(out);
+        result = deflate(r->z, last ? Z_FINISH : Z_SYNC_FLUSH);
+        int done = last ? result == Z_STREAM_END : r->z->avail_out != 0;
+        if (emit(r, out, sizeof(out) - r->z->avail_out, done && last) != 0)
+            result = Z_STREAM_ERROR;
+        if (done)
+            break;
+    } while (result == Z_OK);
+    return result == Z_OK || result == Z_STREAM_END || result == Z_BUF_ERROR ? 0 : -1;
+}
+
+// 响应体按 chunk_bytes 分片写出，模拟慢速链路上一段一段到达
+static int send_response(struct mock_reply *r, const char *status, const char *content_type, const char *body,
+                         size_t len)
+{
+    if (reply_start(r, status, content_type, (long)len) != 0)
+        return -1;
+    size_t chunk = r->server->options.chunk_bytes > 0 ? r->server->options.chunk_bytes : len;
+    size_t off = 0;
+    do
+    {
+        size_t n = len - off < chunk ? len - off : chunk;
+        if (off > 0 && r->server->options.chunk_delay_us > 0)
+            sleep_us(r->server->options.chunk_delay_us);
+        if (reply_write(r, body + off, n, off + n == len) != 0)
+            return -1;
+        off += n;
+    } while (off < len);
+    return 0;
+}
+
+// 只处理回复里会出现的字符：引号、反斜杠和换行
+static size_t escape_json(char *out, const char *in, size_t len)
+{
+    size_t n = 0;
+    for (size_t i = 0; i < len; i++)
+    {
+        if (in[i] == '"' || in[i] == '\\')
+        {
+            out[n++] = '\\';
+            out[n++] = in[i];
+        }
+        else if (in[i] == '\n')
+        {
+            out[n++] = '\\';
+            out[n++] = 'n';
+        }
+        else
+            out[n++] = in[i];
+    }
+    out[n] = '\0';
+    return n;
+}
+
+// 这一轮用户输入已经调用过几次工具：最后一条用户消息之后有几条带 tool_calls 的消息
+static int tool_round(const char *body)
+{
+    static const char user[] = "{\"role\":\"user\",\"content\":";
+    const char *start = body;
+    for (const char *p = body; (p = strstr(p, user)) != NULL; p++)
+        start = p;
+    int round = 0;
+    for (const char *p = start; (p = strstr(p, "\"tool_calls\":")) != NULL; p++)
+        round++;
+    return round;
+}
+
+// 工具调用脚本：每次调用 switchLight 和 activateFusion，参数按回过的 tool_calls 次数交替，
+// 单个客户端连续的调用不会因为状态相同而被拒绝
+static int tool_calls_reply(struct mock_reply *r, size_t body_len, unsigned int seq)
+{
+    int off = atomic_fetch_add(&r->server->tool_replies, 1) % 2;
+    static const char call[] = "{\"id\":\"call_%u_%d\",\"type\":\"function\",\"function\":{\"name\":\"%s\","
+                               "\"arguments\":\"{\\\"status\\\":\\\"%s\\\"}\"}}";
+    char calls[512];
+    int n = snprintf(calls, sizeof(calls), call, seq, 0, "switchLight", off ? "off" : "on");
+    calls[n++] = ',';
+    n += snprintf(calls + n, sizeof(calls) - n, call, seq, 1, "activateFusion", off ? "stop" : "start");
+    char response[1024];
+    n = snprintf(response, sizeof(response),
+                 "{\"id\":\"mock-%u\",\"object\":\"chat.completion\",\"created\":0,\"model\":\"mock\","
+                 "\"choices\":[{\"index\":0,\"message\":{\"role\":\"assistant\",\"content\":null,\"tool_calls\":[%.*s]},"
+                 "\"finish_reason\":\"tool_calls\"}],"
+                 "\"usage\":{\"prompt_tokens\":%zu,\"completion_tokens\":%d,\"total_tokens\":%zu}}",
+                 seq, n, calls, body_len / 4, n / 4 + 1, body_len / 4 + n / 4 + 1);
+    return send_response(r, "200 OK", "application/json", response, (size_t)n);
+}
+
+static int chat_reply(struct mock_reply *r, const char *body, size_t body_len, unsigned int seq)
+{
+    mock_server *server = r->server;
+    int tool_rounds = server->options.tool_rounds;
+    if (tool_rounds > 0 && strstr(body, "\"tools\":") != NULL && strstr(body, "\"stream\":true") == NULL)
+    {
+        if (tool_round(body) < tool_rounds)
+            return tool_calls_reply(r, body_len, seq);
+    }
+    const char *reply = mock_replies[seq % MOCK_REPLY_COUNT];
+    int structured = strstr(body, "\"response_format\"") != NULL;
+    int wrapped = strstr(body, "\"json_schema\"") != NULL; // 回复 Schema 的根是 {"reply": ...}
+    char content[512];
+    int content_len = snprintf(content, sizeof(content),
+                               wrapped ? "{\"reply\":%s}" : structured ? "%s" : "```json\n%s\n```", reply);
+    char escaped[1024];
+
+    if (strstr(body, "\"stream\":true") == NULL)
+    {
+        size_t escaped_len = escape_json(escaped, content, (size_t)content_len);
+        char response[2048];
+        int n = snprintf(response, sizeof(response),
+                         "{\"id\":\"mock-%u\",\"object\":\"chat.completion\",\"created\":0,\"model\":\"mock\","
+                         "\"choices\":[{\"index\":0,\"message\":{\"role\":\"assistant\",\"content\":\"%.*s\"},"
+                         "\"finish_reason\":\"stop\"}],"
+                         "\"usage\":{\"prompt_tokens\":%zu,\"completion_tokens\":%d,\"total_tokens\":%zu}}",
+                         seq, (int)escaped_len, escaped, body_len / 4, content_len / 4 + 1,
+                         body_len / 4 + content_len / 4 + 1);
+        return send_response(r, "200 OK", "application/json", response, (size_t)n);
+    }
+
+    // SSE：HTTP/1.1 下每个事件一个分块，HTTP/2 下每个事件一个 DATA 帧
+    if (reply_start(r, "200 OK", "text/event-stream", -1) != 0)
+        return -1;
+    size_t piece = server->options.stream_piece > 0 ? server->options.stream_piece : (size_t)content_len;
+    for (size_t off = 0; off < (size_t)content_len;)
+    {
+        size_t end = off + piece < (size_t)content_len ? off + piece : (size_t)content_len;
+        while (end < (size_t)content_len && (content[end] & 0xC0) == 0x80)
+            end++; // 不切断 UTF-8 字符
+        escape_json(escaped, content + off, end - off);
+        char event[1200];
+        int n = snprintf(event, sizeof(event),
+                         "data: {\"id\":\"mock-%u\",\"choices\":[{\"index\":0,\"delta\":{\"content\":\"%s\"}}]}\n\n",
+                         seq, escaped);
+        if (off > 0 && server->options.chunk_delay_us > 0)
+            sleep_us(server->options.chunk_delay_us);
+        if (reply_write(r, event, (size_t)n, 0) != 0)
+            return -1;
+        off = end;
+    }
+    static const char done[] = "data: [DONE]\n\n";
+    return reply_write(r, done, sizeof(done) - 1, 1);
+}
+
+static int image_reply(struct mock_reply *r, const char *body, unsigned int seq)
+{
+    mock_server *server = r->server;
+    if (strstr(body, "b64_json") == NULL)
+    {
+        char response[256];
+        int n = snprintf(response, sizeof(response),
+                         "{\"created\":0,\"data\":[{\"url\":\"http://127.0.0.1:%d/files/%u.png\"}]}", server->port,
+                         seq);
+        return send_response(r, "200 OK", "application/json", response, (size_t)n);
+    }
+    static const char prefix[] = "{\"created\":0,\"data\":[{\"b64_json\":\"";
+    static const char suffix[] = "\"}]}";
+    size_t len = sizeof(prefix) - 1 + server->image_b64_len + sizeof(suffix) - 1;
+    char *response = malloc(len);
+    if (response == NULL)
+        return -1;
+    memcpy(response, prefix, sizeof(prefix) - 1);
+    memcpy(response + sizeof(prefix) - 1, server->image_b64, server->image_b64_len);
+    memcpy(response + len - (sizeof(suffix) - 1), suffix, sizeof(suffix) - 1);
+    int result = send_response(r, "200 OK", "application/json", response, len);
+    free(response);
+    return result;
+}
+
+// 图片下载：带 ETag，完整的响应带 Content-MD5，支持 Range: bytes=N-（If-Range 和 ETag 对不上时整个重发）。
+// 配置了 cut_bytes 时，不带 Range 的下载声明完整长度、只发 cut_bytes 字节就断开（HTTP/2 上重置这个流），
+// 客户端要靠续传拿到剩下的部分；stale_etag 让 If-Range 总是对不上，corrupt_range 把续传的第一个字节改掉
+static int file_reply(struct mock_reply *r)
+{
+    mock_server *server = r->server;
+    size_t size = server->options.image_bytes;
+    size_t from = 0;
+    int ranged = strncmp(r->range, "bytes=", 6) == 0;
+    char content_range[72];
+
+    if (ranged && r->if_range[0] != '\0' &&
+        (server->options.stale_etag || strcmp(r->if_range, server->image_etag) != 0))
+        ranged = 0;
+    if (ranged)
+    {
+        from = strtoul(r->range + 6, NULL, 10);
+        if (from >= size)
+        {
+            snprintf(content_range, sizeof(content_range), "bytes */%zu", size);
+            r->content_range = content_range;
+            return send_response(r, "416 Range Not Satisfiable", "text/plain", "", 0);
+        }
+        snprintf(content_range, sizeof(content_range), "bytes %zu-%zu/%zu", from, size - 1, size);
+        r->content_range = content_range;
+        atomic_fetch_add_explicit(&server->range_requests, 1, memory_order_relaxed);
+    }
+    r->etag = server->image_etag;
+    if (!ranged)
+        r->content_md5 = server->image_md5; // 206 的 Content-MD5 只算这一段，不发
+
+    const char *body = (const char *)server->image + from;
+    size_t len = size - from;
+    if (r->range[0] == '\0' && server->options.cut_bytes > 0 && server->options.cut_bytes < len)
+    {
+        atomic_fetch_add_explicit(&server->cut_downloads, 1, memory_order_relaxed);
+        if (reply_start(r, "200 OK", "image/png", (long)len) == 0 &&
+            emit(r, body, server->options.cut_bytes, 0) == 0 && r->stream != 0)
+        {
+            unsigned char frame[13];
+            frame_header(frame, H2_RST_STREAM, 0, r->stream, 4);
+            memcpy(frame + 9, "\0\0\0\2", 4); // INTERNAL_ERROR
+            pthread_mutex_lock(&r->conn->write_lock);
+            send_all(server, r->conn->fd, (const char *)frame, sizeof(frame));
+            pthread_mutex_unlock(&r->conn->write_lock);
+        }
+        return -1; // HTTP/1.1 上返回 -1 关闭连接
+    }
+    if (ranged && server->options.corrupt_range && len > 0)
+    {
+        char *copy = malloc(len);
+        if (copy == NULL)
+            return -1;
+        memcpy(copy, body, len);
+        copy[0] ^= 0x5A;
+        int result = send_response(r, "206 Partial Content", "image/png", copy, len);
+        free(copy);
+        return result;
+    }
+    return send_response(r, ranged ? "206 Partial Content" : "200 OK", "image/png", body, len);
+}
+
+// 解压 gzip 请求体，结果以 '\0' 结尾；失败返回 NULL
+static char *gunzip(const char *data, size_t len, size_t *out_len)
+{
+    z_stream z;
+    memset(&z, 0, sizeof(z));
+    if (inflateInit2(&z, 15 + 16) != Z_OK)
+        return NULL;
+    size_t cap = len * 4 + 1024;
+    char *out = malloc(cap);
+    int result = Z_OK;
+    z.next_in = (Bytef *)data;
+    z.avail_in = (uInt)len;
+    while (out != NULL && result == Z_OK)
+    {
+        if (z.total_out + 1 >= cap)
+        {
+            char *grown = realloc(out, cap * 2);
+            if (grown == NULL)
+                break;
+            out = grown;
+            cap *= 2;
+        }
+        z.next_out = (Bytef *)out + z.total_out;
+        z.avail_out = (uInt)(cap - z.total_out - 1);
+        result = inflate(&z, Z_NO_FLUSH);
+    }
+    inflateEnd(&z);
+    if (result != Z_STREAM_END)
+    {
+        free(out);
+        return NULL;
+    }
+    out[z.total_out] = '\0';
+    *out_len = z.total_out;
+    return out;
+}
+
+// gzip_body 为真时 body 是压缩过的，先解压（或者按配置回 415）
+static int handle_request(struct mock_reply *r, const char *method, const char *path, const char *body,
+                          size_t body_len, int gzip_body)
+{
+    mock_server *server = r->server;
+    if (gzip_body)
+    {
+        if (server->options.reject_gzip)
+        {
+            atomic_fetch_add_explicit(&server->gzip_rejected, 1, memory_order_relaxed);
+            static const char unsupported[] = "{\"error\":{\"message\":\"unsupported content encoding\"}}";
+            return send_response(r, "415 Unsupported Media Type", "application/json", unsupported,
+                                 sizeof(unsupported) - 1);
+        }
+        size_t plain_len;
+        char *plain = gunzip(body, body_len, &plain_len);
+        if (plain == NULL)
+        {
+            static const char bad[] = "{\"error\":{\"message\":\"bad gzip body\"}}";
+            return send_response(r, "400 Bad Request", "application/json", bad, sizeof(bad) - 1);
+        }
+        atomic_fetch_add_explicit(&server->gzip_requests, 1, memory_order_relaxed);
+        int result = handle_request(r, method, path, plain, plain_len, 0);
+        free(plain);
+        return result;
+    }
+
+    unsigned int seq = atomic_fetch_add_explicit(&server->sequence, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&server->requests, 1, memory_order_relaxed);
+
+    if (server->options.latency_ms > 0 || server->options.jitter_ms > 0)
+    {
+        long delay_us = server->options.latency_ms * 1000L;
+        if (server->options.jitter_ms > 0)
+            delay_us += (long)(rand_r(&r->seed) % (2 * server->options.jitter_ms * 1000 + 1)) -
+                        server->options.jitter_ms * 1000L;
+        if (delay_us > 0)
+            sleep_us(delay_us);
+    }
+    if (server->options.error_rate > 0 && rand_r(&r->seed) < server->options.error_rate * RAND_MAX)
+    {
+        static const char error[] = "{\"error\":{\"message\":\"mock overload\",\"type\":\"server_error\"}}";
+        atomic_fetch_add_explicit(&server->errors, 1, memory_order_relaxed);
+        return send_response(r, "503 Service Unavailable", "application/json", error, sizeof(error) - 1);
+    }
+
+    size_t path_len = strcspn(path, "? ");
+    if (strcmp(method, "POST") == 0 && path_len >= 17 && strncmp(path + path_len - 17, "/chat/completions", 17) == 0)
+        return chat_reply(r, body, body_len, seq);
+    if (strcmp(method, "POST") == 0 && path_len >= 19 && strncmp(path + path_len - 19, "/images/generations", 19) == 0)
+        return image_reply(r, body, seq);
+    if (strcmp(method, "GET") == 0 && strncmp(path, "/files/", 7) == 0)
+        return file_reply(r);
+    static const char not_found[] = "{\"error\":{\"message\":\"not found\"}}";
+    return send_response(r, "404 Not Found", "application/json", not_found, sizeof(not_found) - 1);
+}
+
+// 再读一些数据；对方关闭或服务停止时返回 0，出错返回 -1
+static int read_more(struct mock_connection *conn)
+{
+    if (conn->len + 4096 + 1 > conn->cap)
+    {
+        size_t cap = conn->cap ? conn->cap * 2 : 8192;
+        char *buf = realloc(conn->buf, cap);
+        if (buf == NULL)
+            return -1;
+        conn->buf = buf;
+        conn->cap = cap;
+    }
+    while (!atomic_load(&conn->server->stopping))
+    {
+        struct pollfd pfd = {conn->fd, POLLIN, 0};
+        int ready = poll(&pfd, 1, MOCK_POLL_MS);
+        if (ready < 0 && errno != EINTR)
+            return -1;
+        if (ready <= 0)
+            continue;
+        ssize_t n = read(conn->fd, conn->buf + conn->len, conn->cap - conn->len - 1);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return (int)n;
+        atomic_fetch_add_explicit(&conn->server->bytes_received, (unsigned long)n, memory_order_relaxed);
+        conn->len += (size_t)n;
+        conn->buf[conn->len] = '\0';
+        return 1;
+    }
+    return 0;
+}
+
+static void consume(struct mock_connection *conn, size_t n)
+{
+    conn->len -= n;
+    memmove(conn->buf, conn->buf + n, conn->len + 1);
+}
+
+// 连接的最后一个持有者（连接线程或 HTTP/2 流的线程）关闭连接
+static void release_connection(struct mock_connection *conn)
+{
+    if (atomic_fetch_sub(&conn->refs, 1) != 1)
+        return;
+    mock_server *server = conn->server;
+    close(conn->fd);
+    for (size_t i = 0; i < conn->table_count; i++)
+    {
+        free(conn->table[i].name);
+        free(conn->table[i].value);
+    }
+    free(conn->table);
+    if (conn->deflate_ready)
+        deflateEnd(&conn->deflate);
+    pthread_mutex_destroy(&conn->write_lock);
+    free(conn->buf);
+    free(conn);
+    atomic_fetch_sub(&server->connections, 1);
+}
+
+// ---- HPACK 解码（只用来读出请求的方法、路径和编码）----
+
+static const struct
+{
+    const char *name;
+    const char *value;
+} hpack_static[] = {
+    {":authority", ""}, {":method", "GET"}, {":method", "POST"}, {":path", "/"}, {":path", "/index.html"},
+    {":scheme", "http"}, {":scheme", "https"}, {":status", "200"}, {":status", "204"}, {":status", "206"},
+    {":status", "304"}, {":status", "400"}, {":status", "404"}, {":status", "500"}, {"accept-charset", ""},
+    {"accept-encoding", "gzip, deflate"}, {"accept-language", ""}, {"accept-ranges", ""}, {"accept", ""},
+    {"access-control-allow-origin", ""}, {"age", ""}, {"allow", ""}, {"authorization", ""}, {"cache-control", ""},
+    {"content-disposition", ""}, {"content-encoding", ""}, {"content-language", ""}, {"content-length", ""},
+    {"content-location", ""}, {"content-range", ""}, {"content-type", ""}, {"cookie", ""}, {"date", ""},
+    {"etag", ""}, {"expect", ""}, {"expires", ""}, {"from", ""}, {"host", ""}, {"if-match", ""},
+    {"if-modified-since", ""}, {"if-none-match", ""}, {"if-range", ""}, {"if-unmodified-since", ""},
+    {"last-modified", ""}, {"link", ""}, {"location", ""}, {"max-forwards", ""}, {"proxy-authenticate", ""},
+    {"proxy-authorization", ""}, {"range", ""}, {"referer", ""}, {"refresh", ""}, {"retry-after", ""},
+    {"server", ""}, {"set-cookie", ""}, {"strict-transport-security", ""}, {"transfer-encoding", ""},
+    {"user-agent", ""}, {"vary", ""}, {"via", ""}, {"www-authenticate", ""},
+};
+#define HPACK_STATIC_COUNT (sizeof(hpack_static) / sizeof(hpack_static[0]))
+
+// RFC 7541 附录 B 的 Huffman 码长（符号 0..256）；码是规范码，按（码长，符号）顺序依次分配，由码长就能还原
+static const unsigned char huffman_lengths[257] = {
+    13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28,
+    28, 28, 28, 28, 28, 6,  10, 10, 12, 13, 6,  8,  11, 10, 10, 8,  11, 8,  6,  6,  6,  5,  5,  5,  6,  6,  6,
+    6,  6,  6,  6,  7,  8,  15, 6,  12, 10, 13, 6,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,
+    7,  7,  7,  7,  7,  7,  7,  8,  7,  8,  13, 19, 13, 14, 6,  15, 5,  6,  5,  6,  5,  6,  6,  6,  5,  7,  7,
+    6,  6,  6,  5,  6,  7,  6,  5,  5,  6,  7,  7,  7,  7,  7,  15, 11, 14, 13, 28, 20, 22, 20, 20, 22, 22, 22,
+    23, 22, 23, 23, 23, 23, 23, 24, 23, 24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24, 22, 21,
+    20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23, 21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23,
+    22, 22, 23, 26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25, 19, 21, 26, 27, 27, 26, 27, 24,
+    21, 21, 26, 26, 28, 27, 27, 27, 20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23, 26, 27, 26,
+    26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26, 30,
+};
+
+static struct
+{
+    uint32_t first[31];  // 每个码长的第一个码
+    uint16_t count[31];
+    uint16_t offset[31]; // 在 symbols 里的起点
+    uint16_t symbols[257];
+} huffman;
+static pthread_once_t huffman_once = PTHREAD_ONCE_INIT;
+
+static void huffman_init(void)
+{
+    size_t n = 0;
+    uint32_t code = 0;
+    for (int len = 1; len <= 30; len++)
+    {
+        huffman.offset[len] = (uint16_t)n;
+        for (int symbol = 0; symbol < 257; symbol++)
+        {
+            if (huffman_lengths[symbol] == len)
+                huffman.symbols[n++] = (uint16_t)symbol;
+        }
+        huffman.count[len] = (uint16_t)(n - huffman.offset[len]);
+        huffman.first[len] = code;
+        code = (code + huffman.count[len]) << 1;
+    }
+}
+
+static char *huffman_decode(const unsigned char *in, size_t len)
+{
+    pthread_once(&huffman_once, huffman_init);
+    char *out = malloc(len * 8 / 5 + 1); // 最短的码 5 位
+    size_t n = 0;
+    uint32_t code = 0;
+    int bits = 0;
+    if (out == NULL)
+        return NULL;
+    for (size_t i = 0; i < len * 8; i++)
+    {
+        code = code << 1 | (in[i / 8] >> (7 - i % 8) & 1);
+        bits++;
+        if (bits > 30)
+            break;
+        if (code - huffman.first[bits] < huffman.count[bits])
+        {
+            uint16_t symbol = huffman.symbols[huffman.offset[bits] + code - huffman.first[bits]];
+            if (symbol == 256)
+                break; // EOS 不应该出现
+            out[n++] = (char)symbol;
+            code = 0;
+            bits = 0;
+        }
+    }
+    out[n] = '\0'; // 结尾不满一个码的是填充的 1
+    return out;
+}
+
+// 失败返回 -1
+static int hpack_int(const unsigned char **p, const unsigned char *end, int prefix, size_t *value)
+{
+    size_t max = (1u << prefix) - 1;
+    if (*p >= end)
+        return -1;
+    *value = **p & max;
+    (*p)++;
+    if (*value < max)
+        return 0;
+    for (int shift = 0; *p < end && shift < 28; shift += 7)
+    {
+        unsigned char byte = *(*p)++;
+        *value += (size_t)(byte & 0x7F) << shift;
+        if (!(byte & 0x80))
+            return 0;
+    }
+    return -1;
+}
+
+static char *hpack_string(const unsigned char **p, const unsigned char *end)
+{
+    if (*p >= end)
+        return NULL;
+    int huffman_coded = **p & 0x80;
+    size_t len;
+    if (hpack_int(p, end, 7, &len) != 0 || len > (size_t)(end - *p))
+        return NULL;
+    char *text = huffman_coded ? huffman_decode(*p, len) : strndup((const char *)*p, len);
+    *p += len;
+    return text;
+}
+
+static void table_evict(struct mock_connection *conn, size_t limit)
+{
+    size_t drop = 0;
+    while (drop < conn->table_count && conn->table_size > limit)
+    {
+        conn->table_size -= conn->table[drop].size;
+        free(conn->table[drop].name);
+        free(conn->table[drop].value);
+        drop++;
+    }
+    conn->table_count -= drop;
+    if (drop > 0)
+        memmove(conn->table, conn->table + drop, conn->table_count * sizeof(conn->table[0]));
+}
+
+static int table_add(struct mock_connection *conn, const char *name, const char *value)
+{
+    size_t size = strlen(name) + strlen(value) + 32;
+    table_evict(conn, size > conn->table_max ? 0 : conn->table_max - size);
+    if (size > conn->table_max)
+        return 0;
+    struct hpack_entry *table = realloc(conn->table, (conn->table_count + 1) * sizeof(conn->table[0]));
+    if (table == NULL)
+        return -1;
+    conn->table = table;
+    table[conn->table_count].name = strdup(name);
+    table[conn->table_count].value = strdup(value);
+    table[conn->table_count].size = size;
+    conn->table_count++;
+    conn->table_size += size;
+    return 0;
+}
+
+// 1 起的下标：先静态表，再动态表（最新的在前）
+static int table_get(struct mock_connection *conn, size_t index, const char **name, const char **value)
+{
+    if (index >= 1 && index <= HPACK_STATIC_COUNT)
+    {
+        *name = hpack_static[index - 1].name;
+        *value = hpack_static[index - 1].value;
+        return 0;
+    }
+    index -= HPACK_STATIC_COUNT + 1;
+    if (index >= conn->table_count)
+        return -1;
+    *name = conn->table[conn->table_count - 1 - index].name;
+    *value = conn->table[conn->table_count - 1 - index].value;
+    return 0;
+}
+
+// 一个正在接收或等待回复的 HTTP/2 请求
+struct h2_stream
+{
+    struct mock_connection *conn;
+    uint32_t id;
+    char method[8];
+    char path[256];
+    int gzip_body;
+    int accept_gzip;
+    char range[32];
+    char if_range[64];
+    char *body;
+    size_t len;
+    size_t cap;
+    struct h2_stream *next;
+};
+
+static void stream_header(struct h2_stream *stream, const char *name, const char *value)
+{
+    if (strcmp(name, ":method") == 0)
+        snprintf(stream->method, sizeof(stream->method), "%s", value);
+    else if (strcmp(name, ":path") == 0)
+        snprintf(stream->path, sizeof(stream->path), "%s", value);
+    else if (strcmp(name, "content-encoding") == 0)
+        stream->gzip_body = strstr(value, "gzip") != NULL;
+    else if (strcmp(name, "accept-encoding") == 0)
+        stream->accept_gzip = strstr(value, "gzip") != NULL;
+    else if (strcmp(name, "range") == 0)
+        snprintf(stream->range, sizeof(stream->range), "%s", value);
+    else if (strcmp(name, "if-range") == 0)
+        snprintf(stream->if_range, sizeof(stream->if_range), "%s", value);
+}
+
+static int decode_headers(struct mock_connection *conn, struct h2_stream *stream, const unsigned char *p,
+                          const unsigned char *end)
+{
+    while (p < end)
+    {
+        size_t index;
+        const char *name, *value;
+        if (*p & 0x80) // 已索引
+        {
+            if (hpack_int(&p, end, 7, &index) != 0 || table_get(conn, index, &name, &value) != 0)
+                return -1;
+            stream_header(stream, name, value);
+            continue;
+        }
+        if ((*p & 0xE0) == 0x20) // 动态表大小更新
+        {
+            if (hpack_int(&p, end, 5, &index) != 0)
+                return -1;
+            conn->table_max = index;
+            table_evict(conn, index);
+            continue;
+        }
+        int indexing = (*p & 0xC0) == 0x40;
+        if (hpack_int(&p, end, indexing ? 6 : 4, &index) != 0)
+            return -1;
+        char *literal_name = NULL;
+        if (index == 0)
+            name = literal_name = hpack_string(&p, end);
+        else if (table_get(conn, index, &name, &value) != 0)
+            return -1;
+        char *literal_value = name != NULL ? hpack_string(&p, end) : NULL;
+        int result = literal_value != NULL ? 0 : -1;
+        if (result == 0)
+        {
+            stream_header(stream, name, literal_value);
+            if (indexing)
+                result = table_add(conn, name, literal_value);
+        }
+        free(literal_name);
+        free(literal_value);
+        if (result != 0)
+            return -1;
+    }
+    return 0;
+}
+
+static void *stream_thread(void *arg)
+{
+    struct h2_stream *stream = arg;
+    struct mock_connection *conn = stream->conn;
+    struct mock_reply reply = {conn->server, conn, stream->id, conn->seed ^ stream->id, stream->accept_gzip, 0};
+    memcpy(reply.range, stream->range, sizeof(reply.range));
+    memcpy(reply.if_range, stream->if_range, sizeof(reply.if_range));
+
+    if (stream->body == NULL)
+        stream->body = calloc(1, 1);
+    else
+        stream->body[stream->len] = '\0';
+    if (stream->body != NULL)
+        handle_request(&reply, stream->method, stream->path, stream->body, stream->len, stream->gzip_body);
+    if (reply.gzip)
+        deflateEnd(&reply.own); // 没有初始化或已经结束时什么也不做
+    free(stream->body);
+    free(stream);
+    release_connection(conn);
+    return NULL;
+}
+
+// 请求收齐了：交给一个线程回复，这样同一连接上的请求可以并发
+static void start_stream(struct h2_stream *stream)
+{
+    pthread_t thread;
+    pthread_attr_t attr;
+    atomic_fetch_add(&stream->conn->refs, 1);
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&thread, &attr, stream_thread, stream) != 0)
+        stream_thread(stream);
+    pthread_attr_destroy(&attr);
+}
+
+static struct h2_stream *find_stream(struct h2_stream **streams, uint32_t id, int unlink)
+{
+    for (struct h2_stream **p = streams; *p != NULL; p = &(*p)->next)
+    {
+        struct h2_stream *stream = *p;
+        if (stream->id != id)
+            continue;
+        if (unlink)
+            *p = stream->next;
+        return stream;
+    }
+    return NULL;
+}
+
+static int append_body(struct h2_stream *stream, const unsigned char *data, size_t len)
+{
+    if (stream->len + len + 1 > stream->cap)
+    {
+        size_t cap = stream->cap ? stream->cap : 4096;
+        while (cap < stream->len + len + 1)
+            cap *= 2;
+        char *body = realloc(stream->body, cap);
+        if (body == NULL)
+            return -1;
+        stream->body = body;
+        stream->cap = cap;
+    }
+    memcpy(stream->body + stream->len, data, len);
+    stream->len += len;
+    return 0;
+}
+
+static void window_update(struct mock_connection *conn, uint32_t stream, size_t len)
+{
+    unsigned char increment[4] = {(unsigned char)(len >> 24 & 0x7F), (unsigned char)(len >> 16),
+                                  (unsigned char)(len >> 8), (unsigned char)len};
+    send_frame(conn, H2_WINDOW_UPDATE, 0, stream, increment, sizeof(increment));
+}
+
+// h2c：连接序言之后按帧处理。只实现 curl 会用到的部分：
+// 收到的 DATA 立即补回流量窗口；发送方向不做流量控制（curl 一开始就给了足够大的窗口）。
+// upgraded 是通过 Upgrade: h2c 升级的那个 HTTP/1.1 请求，作为流 1 回复
+static void h2_connection(struct mock_connection *conn, struct h2_stream *upgraded)
+{
+    struct h2_stream *streams = NULL; // 还在接收的请求
+    struct h2_stream *headers_for = NULL; // 等 CONTINUATION 的请求
+    unsigned char *block = NULL;
+    size_t block_len = 0;
+    int headers_end_stream = 0;
+
+    atomic_fetch_add(&conn->server->h2_connections, 1);
+    conn->table_max = 4096;
+    static const unsigned char settings[] = {0, 3, 0, 0, 1, 0}; // MAX_CONCURRENT_STREAMS 256
+    int sent = send_frame(conn, H2_SETTINGS, 0, 0, settings, sizeof(settings));
+    if (upgraded != NULL)
+    {
+        if (sent == 0)
+            start_stream(upgraded);
+        else
+        {
+            free(upgraded->body);
+            free(upgraded);
+        }
+    }
+    if (sent != 0)
+        return;
+    while (conn->len < sizeof(h2_preface) - 1)
+    {
+        if (read_more(conn) <= 0)
+            return;
+    }
+    if (memcmp(conn->buf, h2_preface, sizeof(h2_preface) - 1) != 0)
+        return;
+    consume(conn, sizeof(h2_preface) - 1);
+
+    for (;;)
+    {
+        while (conn->len < 9 || conn->len < 9 + ((size_t)(unsigned char)conn->buf[0] << 16 |
+                                                 (size_t)(unsigned char)conn->buf[1] << 8 |
+                                                 (unsigned char)conn->buf[2]))
+        {
+            if (read_more(conn) <= 0)
+                goto done;
+        }
+        const unsigned char *frame = (const unsigned char *)conn->buf;
+        size_t len = (size_t)frame[0] << 16 | (size_t)frame[1] << 8 | frame[2];
+        int type = frame[3];
+        int flags = frame[4];
+        uint32_t id = ((uint32_t)frame[5] << 24 | (uint32_t)frame[6] << 16 | (uint32_t)frame[7] << 8 | frame[8]) &
+                      0x7FFFFFFF;
+        const unsigned char *payload = frame + 9;
+        const unsigned char *end = payload + len;
+        if ((type == H2_DATA || type == H2_HEADERS) && (flags & H2_PADDED) && len > 0)
+        {
+            if (payload[0] >= len)
+                goto done;
+            end -= payload[0];
+            payload++;
+        }
+
+        if (type == H2_SETTINGS && !(flags & H2_ACK))
+        {
+            send_frame(conn, H2_SETTINGS, H2_ACK, 0, NULL, 0);
+        }
+        else if (type == H2_PING && !(flags & H2_ACK))
+        {
+            send_frame(conn, H2_PING, H2_ACK, 0, payload, len);
+        }
+        else if (type == H2_GOAWAY)
+        {
+            goto done;
+        }
+        else if (type == H2_RST_STREAM)
+        {
+            struct h2_stream *stream = find_stream(&streams, id, 1);
+            if (stream != NULL)
+            {
+                free(stream->body);
+                free(stream);
+            }
+        }
+        else if (type == H2_HEADERS || (type == H2_CONTINUATION && headers_for != NULL))
+        {
+            if (type == H2_HEADERS)
+            {
+                if (flags & H2_PRIORITY)
+                    payload += 5;
+                headers_for = calloc(1, sizeof(struct h2_stream));
+                if (headers_for == NULL || payload > end)
+                    goto done;
+                headers_for->conn = conn;
+                headers_for->id = id;
+                headers_end_stream = flags & H2_END_STREAM;
+                block_len = 0;
+            }
+            unsigned char *grown = realloc(block, block_len + (size_t)(end - payload) + 1);
+            if (grown == NULL)
+                goto done;
+            block = grown;
+            memcpy(block + block_len, payload, (size_t)(end - payload));
+            block_len += (size_t)(end - payload);
+            if (flags & H2_END_HEADERS)
+            {
+                struct h2_stream *stream = headers_for;
+                headers_for = NULL;
+                if (decode_headers(conn, stream, block, block + block_len) != 0)
+                {
+                    free(stream);
+                    goto done; // 压缩状态已经不一致，只能断开
+                }
+                if (headers_end_stream)
+                    start_stream(stream);
+                else
+                {
+                    stream->next = streams;
+                    streams = stream;
+                }
+            }
+        }
+        else if (type == H2_DATA)
+        {
+            struct h2_stream *stream = find_stream(&streams, id, flags & H2_END_STREAM);
+            if (len > 0)
+            {
+                window_update(conn, 0, len);
+                if (!(flags & H2_END_STREAM))
+                    window_update(conn, id, len);
+            }
+            if (stream != NULL && append_body(stream, payload, (size_t)(end - payload)) != 0)
+                goto done;
+            if (stream != NULL && (flags & H2_END_STREAM))
+                start_stream(stream);
+        }
+        consume(conn, 9 + len);
+    }
+done:
+    free(headers_for);
+    free(block);
+    while (streams != NULL)
+    {
+        struct h2_stream *next = streams->next;
+        free(streams->body);
+        free(streams);
+        streams = next;
+    }
+}
+
+// 取出 HTTP/1.1 请求头 name（"\r\nName:" 的形式）的值，没有时为空
+static void header_copy(const char *buf, const char *header_end, const char *name, char *out, size_t size)
+{
+    const char *line = strcasestr(buf, name);
+    out[0] = '\0';
+    if (line == NULL || line >= header_end)
+        return;
+    const char *value = line + strlen(name);
+    value += strspn(value, " \t");
+    snprintf(out, size, "%.*s", (int)strcspn(value, "\r"), value);
+}
+
+static void *connection_thread(void *arg)
+{
+    struct mock_connection *conn = arg;
+
+    // 先看是不是 HTTP/2 的连接序言
+    while (conn->len < sizeof(h2_preface) - 1 && (conn->buf == NULL || strstr(conn->buf, "\r\n\r\n") == NULL))
+    {
+        if (read_more(conn) <= 0)
+            goto done;
+    }
+    if (conn->len >= sizeof(h2_preface) - 1 && memcmp(conn->buf, h2_preface, sizeof(h2_preface) - 1) == 0)
+    {
+        h2_connection(conn, NULL);
+        goto done;
+    }
+
+    for (;;)
+    {
+        char *header_end;
+        while (conn->buf == NULL || (header_end = strstr(conn->buf, "\r\n\r\n")) == NULL)
+        {
+            if (read_more(conn) <= 0)
+                goto done;
+        }
+        size_t header_len = (size_t)(header_end - conn->buf) + 4;
+        size_t body_len = 0;
+        const char *length = strcasestr(conn->buf, "\r\nContent-Length:");
+        if (length != NULL && length < header_end)
+            body_len = strtoul(length + 17, NULL, 10);
+        const char *encoding = strcasestr(conn->buf, "\r\nContent-Encoding:");
+        int gzip_body = encoding != NULL && encoding < header_end && strncmp(encoding + 19, " gzip", 5) == 0;
+        const char *accept = strcasestr(conn->buf, "\r\nAccept-Encoding:");
+        const char *gzip = accept != NULL && accept < header_end ? strstr(accept, "gzip") : NULL;
+        int accept_gzip = gzip != NULL && gzip < strstr(accept + 2, "\r\n");
+        while (conn->len < header_len + body_len)
+        {
+            if (read_more(conn) <= 0)
+                goto done;
+        }
+
+        char method[8] = "";
+        char path[256] = "";
+        sscanf(conn->buf, "%7s %255s", method, path);
+        const char *upgrade = strcasestr(conn->buf, "\r\nUpgrade: h2c");
+        if (upgrade != NULL && upgrade < header_end)
+        {
+            // 升级到 HTTP/2：这个请求成为流 1，回复在 HTTP/2 上发出
+            static const char switching[] = "HTTP/1.1 101 Switching Protocols\r\nConnection: Upgrade\r\n"
+                                            "Upgrade: h2c\r\n\r\n";
+            struct h2_stream *stream = calloc(1, sizeof(*stream));
+            if (stream == NULL || (stream->body = malloc(body_len + 1)) == NULL)
+            {
+                free(stream);
+                break;
+            }
+            stream->conn = conn;
+            stream->id = 1;
+            snprintf(stream->method, sizeof(stream->method), "%s", method);
+            snprintf(stream->path, sizeof(stream->path), "%s", path);
+            stream->gzip_body = gzip_body;
+            stream->accept_gzip = accept_gzip;
+            memcpy(stream->body, conn->buf + header_len, body_len);
+            stream->len = body_len;
+            consume(conn, header_len + body_len);
+            if (send_all(conn->server, conn->fd, switching, sizeof(switching) - 1) != 0)
+            {
+                free(stream->body);
+                free(stream);
+                break;
+            }
+            h2_connection(conn, stream);
+            break;
+        }
+        // 请求体后面临时补 '\0'，方便查找字段
+        char saved = conn->buf[header_len + body_len];
+        conn->buf[header_len + body_len] = '\0';
+        struct mock_reply reply = {conn->server, conn, 0, rand_r(&conn->seed), accept_gzip, 0};
+        header_copy(conn->buf, header_end, "\r\nRange:", reply.range, sizeof(reply.range));
+        header_copy(conn->buf, header_end, "\r\nIf-Range:", reply.if_range, sizeof(reply.if_range));
+        int result = handle_request(&reply, method, path, conn->buf + header_len, body_len, gzip_body);
+        conn->buf[header_len + body_len] = saved;
+        if (result != 0)
+            break;
+        consume(conn, header_len + body_len);
+    }
+done:
+    release_connection(conn);
+    return NULL;
+}
+
+static void *accept_thread(void *arg)
+{
+    mock_server *server = arg;
+    for (;;)
+    {
+        int fd = accept4(server->listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (fd < 0)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            break; // mock_server_stop 关闭了监听套接字
+        }
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        struct mock_connection *conn = calloc(1, sizeof(*conn));
+        pthread_t thread;
+        pthread_attr_t attr;
+        if (conn == NULL)
+        {
+            close(fd);
+            continue;
+        }
+        conn->server = server;
+        conn->fd = fd;
+        // 描述符号会复用，按连接序号区分，否则断开重连的连接拿到同样的随机延迟
+        unsigned long accepted = atomic_fetch_add(&server->accepted, 1);
+        conn->seed = (unsigned int)(accepted + 1) * 2654435761u ^ (unsigned int)time(NULL);
+        atomic_init(&conn->refs, 1);
+        pthread_mutex_init(&conn->write_lock, NULL);
+        atomic_fetch_add(&server->connections, 1);
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        if (pthread_create(&thread, &attr, connection_thread, conn) != 0)
+            release_connection(conn);
+        pthread_attr_destroy(&attr);
+    }
+    return NULL;
+}
+
+static char *base64_encode(const unsigned char *data, size_t len, size_t *out_len)
+{
+    static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    char *out = malloc((len + 2) / 3 * 4 + 1);
+    size_t n = 0;
+    if (out == NULL)
+        return NULL;
+    for (size_t i = 0; i < len; i += 3)
+    {
+        unsigned int v = (unsigned int)data[i] << 16 | (i + 1 < len ? data[i + 1] << 8 : 0) |
+                         (i + 2 < len ? data[i + 2] : 0);
+        out[n++] = alphabet[v >> 18 & 63];
+        out[n++] = alphabet[v >> 12 & 63];
+        out[n++] = i + 1 < len ? alphabet[v >> 6 & 63] : '=';
+        out[n++] = i + 2 < len ? alphabet[v & 63] : '=';
+    }
+    out[n] = '\0';
+    *out_len = n;
+    return out;
+}
+
+// 固定的图片：PNG 文件头加上伪随机数据（压缩不了，和真实图片的大小相当）
+static int make_image(mock_server *server)
+{
+    static const unsigned char signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+    size_t len = server->options.image_bytes < sizeof(signature) ? sizeof(signature) : server->options.image_bytes;
+    server->options.image_bytes = len;
+    server->image = malloc(len);
+    if (server->image == NULL)
+        return -1;
+    memcpy(server->image, signature, sizeof(signature));
+    unsigned int state = 7;
+    for (size_t i = sizeof(signature); i < len; i++)
+    {
+        state = state * 1103515245u + 12345u;
+        server->image[i] = (unsigned char)(state >> 16);
+    }
+    server->image_b64 = base64_encode(server->image, len, &server->image_b64_len);
+    if (server->image_b64 == NULL)
+        return -1;
+
+    // 下载响应的 Content-MD5 是摘要的 base64，ETag 取摘要的前 8 个字节
+    md5_ctx md5;
+    unsigned char digest[16];
+    size_t md5_len;
+    md5_init(&md5);
+    md5_update(&md5, server->image, len);
+    md5_final(&md5, digest);
+    char *md5_b64 = base64_encode(digest, sizeof(digest), &md5_len);
+    if (md5_b64 == NULL)
+        return -1;
+    snprintf(server->image_md5, sizeof(server->image_md5), "%s", md5_b64);
+    free(md5_b64);
+    snprintf(server->image_etag, sizeof(server->image_etag), "\"%02x%02x%02x%02x%02x%02x%02x%02x\"", digest[0],
+             digest[1], digest[2], digest[3], digest[4], digest[5], digest[6], digest[7]);
+    return 0;
+}
+
+int mock_server_start(mock_server *server, const mock_options *options)
+{
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof(addr);
+    int one = 1;
+
+    memset(server, 0, sizeof(*server));
+    server->options = *options;
+    server->listen_fd = -1;
+    if (make_image(server) != 0)
+    {
+        fprintf(stderr, "Memory allocation failed\n");
+        mock_server_stop(server);
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons((unsigned short)options->port);
+    server->listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (server->listen_fd < 0 || setsockopt(server->listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) != 0 ||
+        bind(server->listen_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(server->listen_fd, 64) != 0 ||
+        getsockname(server->listen_fd, (struct sockaddr *)&addr, &addr_len) != 0)
+    {
+        perror("mock server");
+        mock_server_stop(server);
+        return -1;
+    }
+    server->port = ntohs(addr.sin_port);
+    if (pthread_create(&server->thread, NULL, accept_thread, server) != 0)
+    {
+        fprintf(stderr, "Failed to start mock server thread\n");
+        mock_server_stop(server);
+        return -1;
+    }
+    return 0;
+}
+
+void mock_server_stop(mock_server *server)
+{
+    if (server->listen_fd >= 0)
+    {
+        atomic_store(&server->stopping, 1);
+        shutdown(server->listen_fd, SHUT_RDWR);
+        if (server->port > 0)
+            pthread_join(server->thread, NULL);
+        // 连接线程最多 MOCK_POLL_MS 就能发现要停止
+        while (atomic_load(&server->connections) > 0)
+            sleep_us(1000);
+        close(server->listen_fd);
+        server->listen_fd = -1;
+    }
+    free(server->image);
+    free(server->image_b64);
+    server->image = NULL;
+    server->image_b64 = NULL;
+}
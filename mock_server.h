@@ -0,0 +1,73 @@
+#ifndef MOCK_SERVER_H
+#define MOCK_SERVER_H
+#include <stddef.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+// 本地的模拟接口服务，跑基准测试不需要网络，也不需要密钥
+// 监听 127.0.0.1，后台线程接受连接，每个连接一个线程，支持 keep-alive。
+// 连接以 HTTP/2 连接序言开头（prior knowledge）或请求带 Upgrade: h2c 时改用 HTTP/2，每个流一个线程，同一连接上的请求并发回复。
+// 请求体带 Content-Encoding: gzip 时先解压；请求声明 Accept-Encoding: gzip 时响应体边写边压缩。
+//   POST /v1/chat/completions    回复一段 JSON；请求里有 "stream":true 时按 SSE 分段返回
+//   POST /v1/images/generations  response_format 为 b64_json 时图片以 base64 内嵌，否则给出下载地址
+//   GET  /files/<名字>           返回固定的图片数据，带 ETag 和 Content-MD5，支持 Range 续传（可以配置成中途断开）
+// 回复轮流是控制指令和对话；请求带 response_format 时直接返回 JSON，否则用 ```json 包裹。
+// 配置了 tool_rounds 时，带 tools 的非流式请求先按脚本回几次 tool_calls，收到执行结果后再给正常回复。
+// 延迟、分片、SSE 片段大小和出错比例都可以配置。
+
+typedef struct mock_options
+{
+    int port;              // 0 表示自动选一个空闲端口
+    int latency_ms;        // 每个请求回复之前的等待
+    int jitter_ms;         // 等待时间在 ±jitter_ms 之间随机浮动
+    size_t chunk_bytes;    // 非流式响应体每次最多写出的字节数，0 表示一次写完
+    int chunk_delay_us;    // 分片之间（以及 SSE 事件之间）的间隔
+    size_t stream_piece;   // SSE 每个事件携带的回复字节数（不切断 UTF-8 字符）
+    double error_rate;     // 返回 503 的比例
+    size_t image_bytes;    // 图片大小
+    int reject_gzip;       // 压缩的请求体回 415，模拟不支持的服务端
+    int tool_rounds;       // 每轮用户输入先回几次 tool_calls，0 表示不调用工具
+    size_t cut_bytes;      // 不带 Range 的图片下载只发这么多字节就断开，0 表示不断开
+    int stale_etag;        // If-Range 总是对不上，模拟图变了，续传时整个重发
+    int corrupt_range;     // 续传的数据改掉一个字节，模拟拼错的文件，客户端要靠 Content-MD5 发现
+} mock_options;
+
+typedef struct mock_server
+{
+    mock_options options;
+    int listen_fd;
+    int port;
+    pthread_t thread;
+    atomic_int stopping;
+    atomic_int connections; // 活动的连接（HTTP/2 连接在最后一个流回复完之后才算结束）
+
+    unsigned char *image;
+    char *image_b64;
+    size_t image_b64_len;
+    char image_etag[24];
+    char image_md5[32];     // 摘要的 base64
+
+    // 统计
+    atomic_uint sequence;   // 请求序号，决定回复内容
+    atomic_ulong requests;
+    atomic_ulong errors;    // 注入的 503
+    atomic_ulong bytes_sent;
+    atomic_ulong bytes_received;
+    atomic_ulong accepted;  // 接受的连接数
+    atomic_ulong h2_connections;
+    atomic_ulong gzip_requests; // 请求体压缩过的请求
+    atomic_ulong gzip_rejected; // 按 reject_gzip 回的 415
+    atomic_uint tool_replies;   // 回过的 tool_calls
+    atomic_ulong range_requests; // 按 Range 回的 206
+    atomic_ulong cut_downloads;  // 按 cut_bytes 断开的下载
+} mock_server;
+
+// 默认参数：无延迟、一次写完、SSE 每段 8 字节、不出错、256 KiB 图片
+void mock_options_default(mock_options *options);
+
+// 启动服务，成功后 server->port 为实际端口；失败返回 -1
+int mock_server_start(mock_server *server, const mock_options *options);
+// 停止接受连接，等所有连接线程退出后释放资源
+void mock_server_stop(mock_server *server);
+
+#endif
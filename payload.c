@@ -0,0 +1,234 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "payload.h"
+
+#define PAYLOAD_INITIAL_SIZE (16 * 1024)
+
+static int reserve(char **buf, size_t *cap, size_t need)
+{
+    if (need <= *cap)
+    {
+        return 0;
+    }
+    size_t new_cap = *cap ? *cap : PAYLOAD_INITIAL_SIZE;
+    while (new_cap < need)
+    {
+        new_cap *= 2;
+    }
+    char *p = realloc(*buf, new_cap);
+    if (p == NULL)
+    {
+        fprintf(stderr, "Memory allocation failed\n");
+        return -1;
+    }
+    *buf = p;
+    *cap = new_cap;
+    return 0;
+}
+
+static int put(char **buf, size_t *len, size_t *cap, const char *data, size_t n)
+{
+    if (reserve(buf, cap, *len + n + 1) != 0)
+    {
+        return -1;
+    }
+    memcpy(*buf + *len, data, n);
+    *len += n;
+    (*buf)[*len] = '\0';
+    return 0;
+}
+
+int json_escape_append(char **buf, size_t *len, size_t *cap, const char *text, size_t text_len)
+{
+    static const char hex[] = "0123456789abcdef";
+    // 最坏情况每个字节变成 \u00XX
+    if (reserve(buf, cap, *len + text_len * 6 + 3) != 0)
+    {
+        return -1;
+    }
+    char *out = *buf + *len;
+    *out++ = '"';
+    for (size_t i = 0; i < text_len; i++)
+    {
+        unsigned char c = (unsigned char)text[i];
+        switch (c)
+        {
+        case '"':
+            *out++ = '\\';
+            *out++ = '"';
+            break;
+        case '\\':
+            *out++ = '\\';
+            *out++ = '\\';
+            break;
+        case '\n':
+            *out++ = '\\';
+            *out++ = 'n';
+            break;
+        case '\r':
+            *out++ = '\\';
+            *out++ = 'r';
+            break;
+        case '\t':
+            *out++ = '\\';
+            *out++ = 't';
+            break;
+        default:
+            if (c < 0x20)
+            {
+                *out++ = '\\';
+                *out++ = 'u';
+                *out++ = '0';
+                *out++ = '0';
+                *out++ = hex[c >> 4];
+                *out++ = hex[c & 0xF];
+            }
+            else
+            {
+                *out++ = (char)c; // UTF-8 原样输出
+            }
+            break;
+        }
+    }
+    *out++ = '"';
+    *out = '\0';
+    *len = out - *buf;
+    return 0;
+}
+
+void payload_init(payload_builder *builder, const char *model)
+{
+    memset(builder, 0, sizeof(*builder));
+    builder->model = model;
+}
+
+void payload_free(payload_builder *builder)
+{
+    free(builder->buf);
+    payload_init(builder, builder->model);
+}
+
+// 追加一条消息：{"role":"...","content":"..."}，并记录它在缓冲区中的位置
+static int append_message(char **buf, size_t *len, size_t *cap, Message *message, int first)
+{
+    size_t start = *len;
+    if (!first && put(buf, len, cap, ",", 1) != 0)
+        return -1;
+    size_t offset = *len;
+    if (message->raw)
+    {
+        if (put(buf, len, cap, message->content, message->length) != 0)
+        {
+            *len = start;
+            return -1;
+        }
+    }
+    else if (put(buf, len, cap, "{\"role\":\"", 9) != 0 ||
+             put(buf, len, cap, role_name(message->role), strlen(role_name(message->role))) != 0 ||
+             put(buf, len, cap, "\",\"content\":", 12) != 0 ||
+             json_escape_append(buf, len, cap, message->content, message->length) != 0 ||
+             put(buf, len, cap, "}", 1) != 0)
+    {
+        *len = start;
+        return -1;
+    }
+    message->payload_offset = offset;
+    message->payload_len = *len - offset;
+    return 0;
+}
+
+static int write_header(payload_builder *builder, char **buf, size_t *len, size_t *cap)
+{
+    *len = 0;
+    return put(buf, len, cap, "{\"model\":", 9) != 0 ||
+                   json_escape_append(buf, len, cap, builder->model, strlen(builder->model)) != 0 ||
+                   put(buf, len, cap, ",\"messages\":[", 13) != 0
+               ? -1
+               : 0;
+}
+
+// 历史发生淘汰后重建前缀：已序列化过的消息直接从旧缓冲区拷贝片段
+static int rebuild(payload_builder *builder, History *history)
+{
+    char *buf = NULL;
+    size_t len = 0;
+    size_t cap = 0;
+    const Message *last = NULL;
+
+    // 新缓冲区直接按旧容量预分配
+    if (reserve(&buf, &cap, builder->cap) != 0 || write_header(builder, &buf, &len, &cap) != 0)
+    {
+        free(buf);
+        return -1;
+    }
+    for (Message *current = history->head; current != NULL; current = current->next)
+    {
+        int first = current == history->head;
+        if (current->payload_len > 0 && builder->buf != NULL)
+        {
+            size_t offset;
+            if ((!first && put(&buf, &len, &cap, ",", 1) != 0))
+            {
+                free(buf);
+                return -1;
+            }
+            offset = len;
+            if (put(&buf, &len, &cap, builder->buf + current->payload_offset, current->payload_len) != 0)
+            {
+                free(buf);
+                return -1;
+            }
+            current->payload_offset = offset;
+        }
+        else if (append_message(&buf, &len, &cap, current, first) != 0)
+        {
+            free(buf);
+            return -1;
+        }
+        last = current;
+    }
+
+    free(builder->buf);
+    builder->buf = buf;
+    builder->cap = cap;
+    builder->prefix_len = len;
+    builder->last = last;
+    builder->epoch = history->epoch;
+    builder->rebuilds++;
+    return 0;
+}
+
+const char *payload_build(payload_builder *builder, History *history, const char *extra_fields)
+{
+    size_t len;
+
+    if (builder->buf == NULL || builder->epoch != history->epoch)
+    {
+        if (rebuild(builder, history) != 0)
+            return NULL;
+    }
+    else
+    {
+        // 只追加上次之后新增的消息
+        len = builder->prefix_len;
+        Message *current = builder->last != NULL ? builder->last->next : history->head;
+        for (; current != NULL; current = current->next)
+        {
+            if (append_message(&builder->buf, &len, &builder->cap, current, current == history->head) != 0)
+                return NULL;
+            builder->last = current;
+        }
+        builder->prefix_len = len;
+    }
+
+    // 结尾部分写在前缀之后，下一轮会被覆盖
+    len = builder->prefix_len;
+    if (put(&builder->buf, &len, &builder->cap, "]", 1) != 0 ||
+        (extra_fields != NULL && put(&builder->buf, &len, &builder->cap, extra_fields, strlen(extra_fields)) != 0) ||
+        put(&builder->buf, &len, &builder->cap, "}", 1) != 0)
+    {
+        return NULL;
+    }
+    return builder->buf;
+}
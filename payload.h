@@ -0,0 +1,32 @@
+#ifndef PAYLOAD_H
+#define PAYLOAD_H
+#include <stddef.h>
+#include "history.h"
+
+// 增量构建请求体
+// 缓冲区里常驻 {"model":"...","messages":[m1,m2,... 这一段前缀，每条消息只转义、序列化一次；
+// 新消息直接追加到前缀后面，结尾的 "]...}" 每轮在前缀之后重写。
+// 历史发生淘汰时，用各消息记录的位置把已转义的片段拷贝到新缓冲区，不再重新转义。
+
+typedef struct payload_builder
+{
+    char *buf;            // 请求体，每轮复用
+    size_t prefix_len;    // 前缀（消息数组，不含结尾）长度
+    size_t cap;
+    const Message *last;  // 已写入前缀的最后一条消息
+    size_t epoch;         // 与 History.epoch 对比，判断是否发生过淘汰
+    size_t rebuilds;      // 因淘汰重建前缀的次数
+    const char *model;
+} payload_builder;
+
+void payload_init(payload_builder *builder, const char *model);
+void payload_free(payload_builder *builder);
+
+// 生成完整请求体；extra_fields 是已经序列化好的附加字段（如 ,"stream":true），可以为 NULL。
+// 返回的字符串属于 builder，下一次调用前有效，不要释放。
+const char *payload_build(payload_builder *builder, History *history, const char *extra_fields);
+
+// 把 text 按 JSON 字符串规则转义（含两端引号）后追加到 *buf，按需增长；失败返回 -1
+int json_escape_append(char **buf, size_t *len, size_t *cap, const char *text, size_t text_len);
+
+#endif
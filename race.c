@@ -0,0 +1,259 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <cJSON.h>
+#include "race.h"
+#include "util.h"
+
+struct race_state;
+
+struct race_lane
+{
+    struct race_state *race;
+    int index;
+    async_request *req;
+    double start_at;  // 下一次发请求的时间，0 表示这一路已经结束
+    int failures;     // 连续失败次数，决定退避时长
+};
+
+struct race_state
+{
+    async_http *loop;
+    const char *path;
+    const char *const *payloads;
+    int payload_count;
+    const race_options *options;
+    race_stats *stats;
+    race_result *result;
+    struct race_lane lanes[RACE_MAX_WIDTH];
+    int width;
+    int attempts;
+    int won;
+    double deadline;
+    // 格式不对但至少有内容的第一个回复，兜底用
+    response_buffer fallback;
+    char *fallback_content;
+    size_t fallback_len;
+    long fallback_code;
+    int fallback_lane;
+};
+
+void race_options_default(race_options *options, int width)
+{
+    options->width = width;
+    options->max_attempts = RACE_MAX_ATTEMPTS;
+    options->hedge_ms = RACE_HEDGE_MS;
+    options->deadline_ms = RACE_DEADLINE_MS;
+    options->backoff_base_ms = RACE_BACKOFF_BASE_MS;
+    options->backoff_max_ms = RACE_BACKOFF_MAX_MS;
+}
+
+int race_valid_reply(const char *content, size_t len)
+{
+    size_t span_len;
+    const char *span = response_fence_span(content, len, &span_len);
+    if (span == NULL)
+    {
+        span = content;
+        span_len = len;
+    }
+    cJSON *json = cJSON_ParseWithLength(span, span_len);
+    if (json == NULL)
+    {
+        return 0;
+    }
+    int valid = cJSON_IsArray(json) || cJSON_IsString(cJSON_GetObjectItemCaseSensitive(json, "type"));
+    cJSON_Delete(json);
+    return valid;
+}
+
+// 指数退避加 ±50% 的随机抖动，避免多路请求同时重试
+static double backoff_ms(const race_options *options, int failures, long retry_after_ms)
+{
+    double delay = options->backoff_base_ms;
+    for (int i = 1; i < failures && delay < options->backoff_max_ms; i++)
+    {
+        delay *= 2;
+    }
+    if (delay > options->backoff_max_ms)
+    {
+        delay = options->backoff_max_ms;
+    }
+    delay *= 0.5 + (double)rand() / RAND_MAX;
+    return delay > retry_after_ms ? delay : retry_after_ms;
+}
+
+// 把请求的接收缓冲区转给 dst，请求释放时就不会再释放它
+static void take_body(async_request *req, response_buffer *dst)
+{
+    response_free(dst);
+    *dst = req->resp;
+    response_init(&req->resp);
+}
+
+static void on_lane_done(async_request *req, CURLcode result, void *userdata)
+{
+    struct race_lane *lane = userdata;
+    struct race_state *race = lane->race;
+    double now = now_ms();
+
+    lane->req = NULL;
+    if (req->cancelled || race->won)
+    {
+        return;
+    }
+
+    if (result == CURLE_OK && req->http_code == 200)
+    {
+        size_t len;
+        char *content = req->resp.data != NULL ? response_content(req->resp.data, req->resp.size, &len) : NULL;
+        if (content != NULL && race_valid_reply(content, len))
+        {
+            race->won = 1;
+            take_body(req, &race->result->body);
+            race->result->content = content;
+            race->result->content_len = len;
+            race->result->lane = lane->index;
+            race->result->http_code = req->http_code;
+            return;
+        }
+        race->stats->invalid++;
+        if (content != NULL && race->fallback_content == NULL)
+        {
+            take_body(req, &race->fallback);
+            race->fallback_content = content;
+            race->fallback_len = len;
+            race->fallback_code = req->http_code;
+            race->fallback_lane = lane->index;
+        }
+        lane->start_at = now; // 格式不对，马上再问一次
+        return;
+    }
+
+    if (result == CURLE_OPERATION_TIMEDOUT ||
+        (result == CURLE_OK && req->http_code != 429 && req->http_code < 500))
+    {
+        // 截止时间到了，或者是重试也没用的 4xx
+        fprintf(stderr, "Request failed: %s, http %ld\n", curl_easy_strerror(result), req->http_code);
+        lane->start_at = 0;
+        return;
+    }
+
+    curl_off_t retry_after = 0;
+    curl_easy_getinfo(req->easy, CURLINFO_RETRY_AFTER, &retry_after);
+    lane->failures++;
+    lane->start_at = now + backoff_ms(race->options, lane->failures, (long)retry_after * 1000);
+    race->stats->backoffs++;
+}
+
+static void start_lane(struct race_state *race, struct race_lane *lane, double now)
+{
+    if (race->attempts >= race->options->max_attempts || now >= race->deadline)
+    {
+        lane->start_at = 0;
+        return;
+    }
+    const char *payload = race->payloads[lane->index % race->payload_count];
+    lane->req = async_post_json(race->loop, race->path, payload, (long)(race->deadline - now) + 1,
+                                on_lane_done, lane);
+    lane->start_at = 0;
+    if (lane->req != NULL)
+    {
+        race->attempts++;
+        race->stats->attempts++;
+    }
+}
+
+int race_post_json(async_http *loop, const char *path, const char *const *payloads, int payload_count,
+                   const race_options *options, race_stats *stats, race_result *result)
+{
+    struct race_state race;
+    double start = now_ms();
+
+    memset(&race, 0, sizeof(race));
+    memset(result, 0, sizeof(*result));
+    race.loop = loop;
+    race.path = path;
+    race.payloads = payloads;
+    race.payload_count = payload_count;
+    race.options = options;
+    race.stats = stats;
+    race.result = result;
+    race.width = options->width < 1 ? 1 : options->width > RACE_MAX_WIDTH ? RACE_MAX_WIDTH : options->width;
+    race.deadline = start + options->deadline_ms;
+    stats->races++;
+
+    for (int i = 0; i < race.width; i++)
+    {
+        race.lanes[i].race = &race;
+        race.lanes[i].index = i;
+        race.lanes[i].start_at = start + (i > 0 ? options->hedge_ms : 0);
+    }
+
+    while (!race.won)
+    {
+        double now = now_ms();
+        if (now >= race.deadline)
+            break;
+
+        // 到点的路发出请求，同时算出下一次需要醒来的时间
+        double wake = race.deadline;
+        int busy = 0;
+        for (int i = 0; i < race.width; i++)
+        {
+            struct race_lane *lane = &race.lanes[i];
+            if (lane->req == NULL && lane->start_at > 0 && lane->start_at <= now)
+                start_lane(&race, lane, now);
+            if (lane->req != NULL)
+                busy = 1;
+            else if (lane->start_at > 0)
+            {
+                busy = 1;
+                if (lane->start_at < wake)
+                    wake = lane->start_at;
+            }
+        }
+        if (!busy)
+            break; // 所有路都放弃了
+        async_poll(loop, (int)(wake - now) + 1, NULL, 0);
+    }
+
+    // 取消还在进行的慢请求
+    for (int i = 0; i < race.width; i++)
+    {
+        if (race.lanes[i].req != NULL)
+        {
+            async_cancel(loop, race.lanes[i].req);
+            if (race.won)
+                stats->losers++;
+        }
+    }
+
+    result->attempts = race.attempts;
+    result->elapsed_ms = now_ms() - start;
+    if (race.won)
+    {
+        stats->won++;
+        response_free(&race.fallback);
+        return 0;
+    }
+    if (race.fallback_content != NULL)
+    {
+        stats->fallbacks++;
+        result->body = race.fallback;
+        result->content = race.fallback_content;
+        result->content_len = race.fallback_len;
+        result->http_code = race.fallback_code;
+        result->lane = race.fallback_lane;
+        return 0;
+    }
+    stats->failed++;
+    return -1;
+}
+
+void race_result_free(race_result *result)
+{
+    response_free(&result->body);
+    result->content = NULL;
+}
@@ -0,0 +1,66 @@
+#ifndef RACE_H
+#define RACE_H
+#include <stddef.h>
+#include "async_http.h"
+#include "response.h"
+
+// 推测式并行请求
+// 同一轮同时发出 width 路请求（请求体相同，或者换了模型），第一个能解析成有效指令或对话 JSON 的回复胜出，
+// 其余的立即取消。某一路遇到 429、5xx 或网络错误时按带抖动的指数退避重试（有 Retry-After 时不早于它），
+// 收到格式不对的回复时立即重试；整轮有一个截止时间，到点还没有有效回复就放弃。
+// 所有路都只拿到格式不对的回复时，用第一个拿到的回复兜底，和以前的行为一致。
+
+#define RACE_MAX_WIDTH 8
+// 默认的整轮截止时间、最多请求数、退避时长、后几路的延迟发出时间
+#define RACE_DEADLINE_MS 30000
+#define RACE_MAX_ATTEMPTS 8
+#define RACE_BACKOFF_BASE_MS 200
+#define RACE_BACKOFF_MAX_MS 5000
+#define RACE_HEDGE_MS 0
+
+typedef struct race_options
+{
+    int width;            // 同时发出的请求数
+    int max_attempts;     // 整轮最多发出的请求数（含重试）
+    long hedge_ms;        // 第 2 路及以后延迟多久再发，0 表示同时发
+    long deadline_ms;     // 整轮截止时间
+    long backoff_base_ms; // 第一次退避的时长
+    long backoff_max_ms;  // 退避的上限
+} race_options;
+
+typedef struct race_stats
+{
+    unsigned long races;
+    unsigned long won;       // 拿到有效回复
+    unsigned long fallbacks; // 只拿到格式不对的回复，用它兜底
+    unsigned long failed;    // 截止时间内什么都没拿到
+    unsigned long attempts;
+    unsigned long backoffs;  // 因 429/5xx/网络错误退避重试
+    unsigned long invalid;   // 格式不对的回复
+    unsigned long losers;    // 被取消的慢请求
+} race_stats;
+
+typedef struct race_result
+{
+    response_buffer body; // 胜出请求的接收缓冲区
+    char *content;        // 指向 body 内部，已反转义
+    size_t content_len;
+    int lane;             // 胜出的是第几路
+    int attempts;
+    long http_code;
+    double elapsed_ms;
+} race_result;
+
+// 默认参数，width 路
+void race_options_default(race_options *options, int width);
+
+// payloads[lane % payload_count] 作为第 lane 路的请求体。阻塞直到有结果或截止。
+// 成功返回 0（result 需要用 race_result_free 释放），失败返回 -1
+int race_post_json(async_http *loop, const char *path, const char *const *payloads, int payload_count,
+                   const race_options *options, race_stats *stats, race_result *result);
+void race_result_free(race_result *result);
+
+// 回复内容是否是有效的指令或对话 JSON（可以带 ```json 包裹），不修改 content
+int race_valid_reply(const char *content, size_t len);
+
+#endif
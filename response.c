@@ -0,0 +1,331 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "response.h"
+
+#define RESPONSE_INITIAL_SIZE 4096
+
+void response_init(response_buffer *resp)
+{
+    memset(resp, 0, sizeof(*resp));
+}
+
+void response_reset(response_buffer *resp)
+{
+    resp->size = 0;
+    resp->overflow = 0;
+    if (resp->data != NULL)
+    {
+        resp->data[0] = '\0';
+    }
+}
+
+void response_free(response_buffer *resp)
+{
+    free(resp->data);
+    memset(resp, 0, sizeof(*resp));
+}
+
+size_t response_write(char *ptr, size_t size, size_t nmemb, void *userdata)
+{
+    response_buffer *resp = userdata;
+    size_t n = size * nmemb;
+    if (resp->limit > 0 && resp->size + n + 1 > resp->limit)
+    {
+        resp->overflow = 1;
+        return 0; // 超过上限，不再增长，让 curl 中止传输
+    }
+    if (resp->size + n + 1 > resp->cap)
+    {
+        size_t cap = resp->cap ? resp->cap : RESPONSE_INITIAL_SIZE;
+        while (cap < resp->size + n + 1)
+        {
+            cap *= 2;
+        }
+        if (resp->limit > 0 && cap > resp->limit)
+        {
+            cap = resp->limit;
+        }
+        char *data = realloc(resp->data, cap);
+        if (data == NULL)
+        {
+            fprintf(stderr, "Memory allocation failed\n");
+            return 0; // 让 curl 中止传输
+        }
+        resp->data = data;
+        resp->cap = cap;
+        resp->grows++;
+    }
+    memcpy(resp->data + resp->size, ptr, n);
+    resp->size += n;
+    resp->data[resp->size] = '\0';
+    return n;
+}
+
+static const char *skip_ws(const char *p, const char *end)
+{
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n'))
+        p++;
+    return p;
+}
+
+// p 指向开头的引号，返回结尾引号之后的位置
+static const char *skip_string(const char *p, const char *end)
+{
+    for (p++; p < end; p++)
+    {
+        if (*p == '\\')
+            p++;
+        else if (*p == '"')
+            return p + 1;
+    }
+    return NULL;
+}
+
+static const char *skip_value(const char *p, const char *end)
+{
+    int depth = 0;
+    while (p < end)
+    {
+        switch (*p)
+        {
+        case '"':
+            p = skip_string(p, end);
+            if (p == NULL)
+                return NULL;
+            if (depth == 0)
+                return p;
+            continue;
+        case '{':
+        case '[':
+            depth++;
+            break;
+        case '}':
+        case ']':
+            if (depth == 0)
+                return p;
+            if (--depth == 0)
+                return p + 1;
+            break;
+        case ',':
+            if (depth == 0)
+                return p;
+            break;
+        }
+        p++;
+    }
+    return depth == 0 ? p : NULL;
+}
+
+// p 指向 '{'，返回 key 对应的值的起始位置
+static const char *find_key(const char *p, const char *end, const char *key)
+{
+    size_t key_len = strlen(key);
+    if (p == NULL || p >= end || *p != '{')
+        return NULL;
+    p = skip_ws(p + 1, end);
+    while (p < end && *p == '"')
+    {
+        const char *name = p + 1;
+        p = skip_string(p, end);
+        if (p == NULL)
+            return NULL;
+        int match = (size_t)(p - 1 - name) == key_len && memcmp(name, key, key_len) == 0;
+        p = skip_ws(p, end);
+        if (p >= end || *p != ':')
+            return NULL;
+        p = skip_ws(p + 1, end);
+        if (match)
+            return p;
+        p = skip_value(p, end);
+        if (p == NULL)
+            return NULL;
+        p = skip_ws(p, end);
+        if (p < end && *p == ',')
+            p = skip_ws(p + 1, end);
+    }
+    return NULL;
+}
+
+static int hex4(const char *p, const char *end, unsigned int *value)
+{
+    *value = 0;
+    if (end - p < 4)
+        return -1;
+    for (int i = 0; i < 4; i++)
+    {
+        char c = p[i];
+        int digit = (c >= '0' && c <= '9')   ? c - '0'
+                    : (c >= 'a' && c <= 'f') ? c - 'a' + 10
+                    : (c >= 'A' && c <= 'F') ? c - 'A' + 10
+                                             : -1;
+        if (digit < 0)
+            return -1;
+        *value = *value << 4 | digit;
+    }
+    return 0;
+}
+
+// 原地反转义：输出总不会比输入长（\uXXXX 6 字节最多变成 3 字节，代理对 12 字节变成 4 字节）
+static char *unescape(char *p, const char *end, size_t *len)
+{
+    char *out = p;
+    char *start = p;
+    while (p < end && *p != '"')
+    {
+        if (*p != '\\')
+        {
+            *out++ = *p++;
+            continue;
+        }
+        if (++p >= end)
+            return NULL;
+        char c = *p++;
+        switch (c)
+        {
+        case 'b': *out++ = '\b'; break;
+        case 'f': *out++ = '\f'; break;
+        case 'n': *out++ = '\n'; break;
+        case 'r': *out++ = '\r'; break;
+        case 't': *out++ = '\t'; break;
+        case 'u':
+        {
+            unsigned int cp;
+            if (hex4(p, end, &cp) != 0)
+                return NULL;
+            p += 4;
+            unsigned int low;
+            if (cp >= 0xD800 && cp <= 0xDBFF && end - p >= 6 && p[0] == '\\' && p[1] == 'u' &&
+                hex4(p + 2, end, &low) == 0 && low >= 0xDC00 && low <= 0xDFFF)
+            {
+                cp = 0x10000 + ((cp - 0xD800) << 10) + (low - 0xDC00);
+                p += 6;
+            }
+            if (cp < 0x80)
+            {
+                *out++ = (char)cp;
+            }
+            else if (cp < 0x800)
+            {
+                *out++ = (char)(0xC0 | cp >> 6);
+                *out++ = (char)(0x80 | (cp & 0x3F));
+            }
+            else if (cp < 0x10000)
+            {
+                *out++ = (char)(0xE0 | cp >> 12);
+                *out++ = (char)(0x80 | (cp >> 6 & 0x3F));
+                *out++ = (char)(0x80 | (cp & 0x3F));
+            }
+            else
+            {
+                *out++ = (char)(0xF0 | cp >> 18);
+                *out++ = (char)(0x80 | (cp >> 12 & 0x3F));
+                *out++ = (char)(0x80 | (cp >> 6 & 0x3F));
+                *out++ = (char)(0x80 | (cp & 0x3F));
+            }
+            break;
+        }
+        default: // \" \\ \/
+            *out++ = c;
+            break;
+        }
+    }
+    if (p >= end)
+        return NULL;
+    *out = '\0';
+    *len = out - start;
+    return start;
+}
+
+// choices[0].<field>.content，field 是 message 或 delta
+static char *choice_content(char *json, size_t json_len, const char *field, size_t *len)
+{
+    const char *end = json + json_len;
+    const char *p = find_key(skip_ws(json, end), end, "choices");
+    if (p == NULL || *p != '[')
+        return NULL;
+    p = skip_ws(p + 1, end); // 第一个 choice
+    p = find_key(p, end, field);
+    p = find_key(p, end, "content");
+    if (p == NULL || *p != '"')
+        return NULL;
+    return unescape(json + (p + 1 - json), end, len);
+}
+
+char *response_content(char *json, size_t json_len, size_t *len)
+{
+    return choice_content(json, json_len, "message", len);
+}
+
+char *response_delta_content(char *json, size_t json_len, size_t *len)
+{
+    return choice_content(json, json_len, "delta", len);
+}
+
+const char *response_tool_calls(const char *json, size_t json_len, size_t *span_len)
+{
+    const char *end = json + json_len;
+    const char *p = find_key(skip_ws(json, end), end, "choices");
+    if (p == NULL || *p != '[')
+        return NULL;
+    p = skip_ws(p + 1, end);
+    p = find_key(p, end, "message");
+    p = find_key(p, end, "tool_calls");
+    if (p == NULL || *p != '[')
+        return NULL;
+    const char *value_end = skip_value(p, end);
+    if (value_end == NULL)
+        return NULL;
+    *span_len = value_end - p;
+    return p;
+}
+
+static long parse_count(const char *p, const char *end)
+{
+    long value = 0;
+    if (p == NULL)
+        return -1;
+    for (; p < end && *p >= '0' && *p <= '9'; p++)
+        value = value * 10 + (*p - '0');
+    return value;
+}
+
+int response_usage(const char *json, size_t json_len, long *prompt_tokens, long *completion_tokens)
+{
+    const char *end = json + json_len;
+    const char *usage = find_key(skip_ws(json, end), end, "usage");
+    if (usage == NULL || *usage != '{')
+        return -1;
+    *prompt_tokens = parse_count(find_key(usage, end, "prompt_tokens"), end);
+    *completion_tokens = parse_count(find_key(usage, end, "completion_tokens"), end);
+    return 0;
+}
+
+const char *response_fence_span(const char *text, size_t len, size_t *span_len)
+{
+    if (len < 6 || strncmp(text, "```", 3) != 0)
+        return NULL;
+    size_t end = len;
+    while (end > 0 && (text[end - 1] == ' ' || text[end - 1] == '\n' || text[end - 1] == '\r'))
+        end--;
+    if (end < 3 || strncmp(text + end - 3, "```", 3) != 0)
+        return NULL;
+    end -= 3;
+    // 跳过语言标记那一行
+    const char *newline = memchr(text, '\n', end);
+    if (newline == NULL)
+        return NULL;
+    *span_len = text + end - (newline + 1);
+    return newline + 1;
+}
+
+char *response_unfence(char *text, size_t *len)
+{
+    size_t span_len;
+    char *start = (char *)response_fence_span(text, *len, &span_len);
+    if (start == NULL)
+        return NULL;
+    start[span_len] = '\0';
+    *len = span_len;
+    return start;
+}
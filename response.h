@@ -0,0 +1,49 @@
+#ifndef RESPONSE_H
+#define RESPONSE_H
+#include <stddef.h>
+
+// 非流式回复的接收和解析
+// 接收缓冲区按倍数增长，并在多轮对话之间复用，稳定后每轮不再分配内存。
+// 回复正文 choices[0].message.content 直接在缓冲区里定位、原地反转义，
+// 不建 cJSON 树也不复制；```json 包裹的内容同样原地截取，再从这段内存直接解析。
+
+typedef struct response_buffer
+{
+    char *data;
+    size_t size;
+    size_t cap;
+    unsigned long grows; // 扩容次数
+    size_t limit;        // 回复的字节上限，0 表示不限；超出时中止传输
+    int overflow;        // 这次回复超过了上限，内容不完整
+} response_buffer;
+
+void response_init(response_buffer *resp);
+// 清空内容，保留已分配的内存和上限
+void response_reset(response_buffer *resp);
+void response_free(response_buffer *resp);
+
+// curl 写回调，userdata 为 response_buffer
+size_t response_write(char *ptr, size_t size, size_t nmemb, void *userdata);
+
+// 在 JSON 文本中找到 choices[0].message.content，原地反转义。
+// 返回指向 json 内部、以 '\0' 结尾的内容，*len 为字节数；找不到或不是字符串返回 NULL。
+// 调用后 json 里 content 之后的部分不再是合法 JSON。
+char *response_content(char *json, size_t json_len, size_t *len);
+// 同上，取流式分片里的 choices[0].delta.content
+char *response_delta_content(char *json, size_t json_len, size_t *len);
+
+// 找到 choices[0].message.tool_calls 数组，不修改 json；返回数组的起点，*span_len 为长度。
+// 没有工具调用返回 NULL。要在 response_content 之前调用
+const char *response_tool_calls(const char *json, size_t json_len, size_t *span_len);
+
+// 读出顶层 usage 里的 prompt_tokens 和 completion_tokens，不修改 json；没有 usage 返回 -1。
+// 要在 response_content 之前调用
+int response_usage(const char *json, size_t json_len, long *prompt_tokens, long *completion_tokens);
+
+// 去掉 ```json ... ``` 包裹：返回 text 内部、以 '\0' 结尾的 JSON 部分，
+// 没有包裹返回 NULL（text 不变）
+char *response_unfence(char *text, size_t *len);
+// 同上，但不修改 text，只返回 JSON 部分的起点和长度
+const char *response_fence_span(const char *text, size_t len, size_t *span_len);
+
+#endif
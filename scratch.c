@@ -0,0 +1,184 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <malloc.h>
+#include "scratch.h"
+
+#define SCRATCH_ALIGN 16
+
+// 安装的 arena，释放时据此判断指针是不是切出来的；当前线程正在使用的 arena
+static scratch_arena *installed;
+static __thread scratch_arena *active;
+
+// cJSON 堆的用量按 malloc_usable_size 计，不在每块内存前面加头部，
+// 堆上的 cJSON 字符串直接 free 也不会出错（只是少计一次释放）
+static size_t heap_limit;
+static atomic_size_t heap_live;
+static atomic_size_t heap_peak;
+static atomic_ulong heap_allocs;
+static atomic_ulong heap_failures;
+static atomic_int heap_reported;
+
+int scratch_init(scratch_arena *arena, void *buf, size_t size, int strict)
+{
+    memset(arena, 0, sizeof(*arena));
+    if (buf == NULL)
+    {
+        buf = malloc(size);
+        if (buf == NULL)
+        {
+            return -1;
+        }
+        arena->owned = 1;
+    }
+    arena->base = buf;
+    arena->size = size;
+    arena->strict = strict;
+    return 0;
+}
+
+void scratch_free(scratch_arena *arena)
+{
+    if (arena->owned)
+    {
+        free(arena->base);
+    }
+    memset(arena, 0, sizeof(*arena));
+}
+
+static int owns(const scratch_arena *arena, const void *ptr)
+{
+    return arena != NULL && (const unsigned char *)ptr >= arena->base &&
+           (const unsigned char *)ptr < arena->base + arena->size;
+}
+
+void *scratch_alloc(scratch_arena *arena, size_t size)
+{
+    size_t start = (arena->used + SCRATCH_ALIGN - 1) & ~(size_t)(SCRATCH_ALIGN - 1);
+    if (start > arena->size || size > arena->size - start)
+    {
+        return NULL;
+    }
+    arena->used = start + size;
+    if (arena->used > arena->peak)
+    {
+        arena->peak = arena->used;
+    }
+    arena->allocs++;
+    return arena->base + start;
+}
+
+static void *heap_alloc(size_t size)
+{
+    if (heap_limit > 0 && atomic_load_explicit(&heap_live, memory_order_relaxed) + size > heap_limit)
+    {
+        atomic_fetch_add(&heap_failures, 1);
+        if (!atomic_exchange(&heap_reported, 1))
+        {
+            fprintf(stderr, "JSON heap budget of %zu bytes exhausted, allocation refused\n", heap_limit);
+        }
+        return NULL;
+    }
+    void *ptr = malloc(size);
+    if (ptr == NULL)
+    {
+        return NULL;
+    }
+    size_t live = atomic_fetch_add(&heap_live, malloc_usable_size(ptr)) + malloc_usable_size(ptr);
+    size_t peak = atomic_load_explicit(&heap_peak, memory_order_relaxed);
+    while (live > peak && !atomic_compare_exchange_weak(&heap_peak, &peak, live))
+    {
+    }
+    atomic_fetch_add_explicit(&heap_allocs, 1, memory_order_relaxed);
+    return ptr;
+}
+
+static void *json_malloc(size_t size)
+{
+    scratch_arena *arena = active;
+    if (arena != NULL)
+    {
+        void *ptr = scratch_alloc(arena, size);
+        if (ptr != NULL)
+        {
+            return ptr;
+        }
+        if (arena->strict)
+        {
+            arena->failures++;
+            if (!arena->reported)
+            {
+                fprintf(stderr, "Scratch memory of %zu bytes exhausted, reply processing aborted\n", arena->size);
+                arena->reported = 1;
+            }
+            return NULL;
+        }
+        arena->fallbacks++;
+    }
+    return heap_alloc(size);
+}
+
+static void json_free(void *ptr)
+{
+    if (ptr == NULL || owns(active, ptr) || owns(installed, ptr))
+    {
+        return; // 切出来的内存随 arena 一起清空
+    }
+    atomic_fetch_sub_explicit(&heap_live, malloc_usable_size(ptr), memory_order_relaxed);
+    free(ptr);
+}
+
+void scratch_install(scratch_arena *arena, size_t limit)
+{
+    installed = arena;
+    heap_limit = limit;
+    if (arena == NULL)
+    {
+        cJSON_InitHooks(NULL);
+        return;
+    }
+    cJSON_Hooks hooks = {json_malloc, json_free};
+    cJSON_InitHooks(&hooks);
+}
+
+void scratch_begin(scratch_arena *arena)
+{
+    if (arena->depth++ == 0)
+    {
+        active = arena;
+    }
+}
+
+void scratch_end(scratch_arena *arena)
+{
+    if (--arena->depth > 0)
+    {
+        return;
+    }
+    active = NULL;
+    arena->last = arena->used;
+    arena->used = 0;
+    arena->reported = 0;
+    arena->turns++;
+    atomic_store(&heap_reported, 0);
+}
+
+cJSON *scratch_keep(const cJSON *item)
+{
+    scratch_arena *saved = active;
+    active = NULL;
+    cJSON *copy = item != NULL ? cJSON_Duplicate(item, 1) : NULL;
+    active = saved;
+    return copy;
+}
+
+void scratch_heap(scratch_heap_stats *stats)
+{
+    stats->live = atomic_load(&heap_live);
+    stats->peak = atomic_load(&heap_peak);
+    stats->limit = heap_limit;
+    stats->allocs = atomic_load(&heap_allocs);
+    stats->failures = atomic_load(&heap_failures);
+}
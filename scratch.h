@@ -0,0 +1,63 @@
+#ifndef SCRATCH_H
+#define SCRATCH_H
+#include <stddef.h>
+#include <cJSON.h>
+
+// 每轮的临时内存
+// 一块固定大小的内存，按顺序切分，不逐个释放，一轮处理完整体清空。
+// 安装成 cJSON 的分配函数后，本线程在 scratch_begin 和 scratch_end 之间建的 cJSON 树、
+// 序列化出的字符串以及 cJSON_malloc 的临时数组都从这里切，cJSON_Delete / cJSON_free 遇到它们什么也不做；
+// 最外层的 scratch_end 把整块内存清空。范围之外和其他线程（线程池、状态影子）的分配仍然走堆，
+// 计入 cJSON 堆的用量。要留到这一轮之后的 cJSON（交给线程池的指令、影子里的状态）用 scratch_keep 复制到堆上。
+//
+// 严格模式下临时内存用完时分配失败，cJSON 堆超过上限时也失败，各报一次错，内存不会无限增长；
+// 否则临时内存用完后退回堆。
+
+typedef struct scratch_arena
+{
+    unsigned char *base;
+    size_t size;
+    size_t used;
+    size_t peak;             // 单轮用到的最多字节数
+    size_t last;             // 上一轮用了多少
+    int depth;               // scratch_begin 的嵌套层数
+    int strict;              // 用完时分配失败，不退回堆
+    int owned;               // base 由 scratch_init 分配
+    int reported;            // 这一轮已经报过错
+    unsigned long allocs;    // 从这里切出的次数
+    unsigned long fallbacks; // 用完后退回堆的次数
+    unsigned long failures;  // 严格模式下分配失败的次数
+    unsigned long turns;     // 清空的次数
+} scratch_arena;
+
+// cJSON 堆（范围之外的分配）的用量
+typedef struct scratch_heap_stats
+{
+    size_t live;
+    size_t peak;
+    size_t limit;            // 0 表示不限
+    unsigned long allocs;
+    unsigned long failures;  // 超过上限而失败的次数
+} scratch_heap_stats;
+
+// buf 为 NULL 时分配 size 字节。失败返回 -1
+int scratch_init(scratch_arena *arena, void *buf, size_t size, int strict);
+void scratch_free(scratch_arena *arena);
+
+// 把 cJSON 的分配函数换成这里的实现；heap_limit 是范围之外 cJSON 堆的上限（字节），0 表示不限。
+// 要在建任何 cJSON 对象之前调用；arena 为 NULL 时恢复 cJSON 默认的 malloc / free
+void scratch_install(scratch_arena *arena, size_t heap_limit);
+
+// 本线程之后的 cJSON 分配来自 arena，可以嵌套，最外层的 scratch_end 清空
+void scratch_begin(scratch_arena *arena);
+void scratch_end(scratch_arena *arena);
+
+// 从 arena 切 size 字节（按 16 字节对齐），不够返回 NULL
+void *scratch_alloc(scratch_arena *arena, size_t size);
+
+// 把 item 复制到堆上，不受 arena 清空的影响，用 cJSON_Delete 释放；item 为 NULL 返回 NULL
+cJSON *scratch_keep(const cJSON *item);
+
+void scratch_heap(scratch_heap_stats *stats);
+
+#endif
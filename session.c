@@ -0,0 +1,247 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include "session.h"
+
+static uint32_t crc_table[256];
+
+static void crc_init(void)
+{
+    for (uint32_t i = 0; i < 256; i++)
+    {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++)
+            c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+        crc_table[i] = c;
+    }
+}
+
+static uint32_t crc32_update(uint32_t crc, const void *data, size_t len)
+{
+    const unsigned char *p = data;
+    if (crc_table[1] == 0)
+        crc_init();
+    crc = ~crc;
+    for (size_t i = 0; i < len; i++)
+        crc = crc_table[(crc ^ p[i]) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+}
+
+static uint32_t record_checksum(const session_record *record, const char *content)
+{
+    uint8_t meta[2] = {record->role, record->flags};
+    uint32_t crc = crc32_update(0, meta, sizeof(meta));
+    return crc32_update(crc, content, record->length);
+}
+
+// 头、内容和结尾的 '\0' 用一次 writev 写出，要么整条写进去，要么下次打开时被截掉
+static int write_record(int fd, const Message *message)
+{
+    session_record record;
+    memset(&record, 0, sizeof(record));
+    record.length = (uint32_t)message->length;
+    record.role = (uint8_t)message->role;
+    record.flags = (message->raw ? SESSION_RAW : 0) | (message->summary ? SESSION_SUMMARY : 0);
+    record.checksum = record_checksum(&record, message->content);
+
+    struct iovec iov[2] = {
+        {&record, sizeof(record)},
+        {message->content, message->length + 1},
+    };
+    ssize_t expected = sizeof(record) + message->length + 1;
+    return writev(fd, iov, 2) == expected ? 0 : -1;
+}
+
+static int write_header(int fd, uint64_t fingerprint)
+{
+    session_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SESSION_MAGIC, sizeof(SESSION_MAGIC));
+    header.version = SESSION_VERSION;
+    header.fingerprint = fingerprint;
+    return write(fd, &header, sizeof(header)) == sizeof(header) ? 0 : -1;
+}
+
+// 只记录会进请求体、又不是由指纹代表的消息
+static int should_log(const Message *message)
+{
+    return !message->pinned || message->summary;
+}
+
+static void restore_message(History *history, const session_record *record, const char *content)
+{
+    if (record->flags & SESSION_SUMMARY)
+    {
+        Message *summary = add_pinned_message(history, (message_role)record->role, content);
+        if (summary != NULL)
+            summary->summary = 1;
+    }
+    else if (record->flags & SESSION_RAW)
+        add_raw_message(history, (message_role)record->role, content);
+    else
+        add_message(history, (message_role)record->role, content);
+}
+
+// 顺序扫描映射，恢复每条完整、校验通过的记录；返回最后一条好记录之后的偏移
+static size_t replay(session_log *log, const char *map, size_t size, History *history)
+{
+    size_t offset = sizeof(session_header);
+    while (offset + sizeof(session_record) < size)
+    {
+        session_record record;
+        memcpy(&record, map + offset, sizeof(record)); // 映射里不保证对齐
+        const char *content = map + offset + sizeof(record);
+        if (record.length > size - offset - sizeof(record) - 1 || content[record.length] != '\0' ||
+            record.role > ROLE_TOOL || record_checksum(&record, content) != record.checksum)
+        {
+            break;
+        }
+        restore_message(history, &record, content);
+        log->records++;
+        log->restored++;
+        offset += sizeof(record) + record.length + 1;
+    }
+    return offset;
+}
+
+long session_log_open(session_log *log, const char *path, uint64_t fingerprint, History *history)
+{
+    struct stat st;
+
+    memset(log, 0, sizeof(*log));
+    log->fingerprint = fingerprint;
+    log->path = strdup(path);
+    log->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (log->path == NULL || log->fd < 0 || fstat(log->fd, &st) != 0)
+    {
+        perror(path);
+        session_log_close(log);
+        return -1;
+    }
+
+    size_t size = (size_t)st.st_size;
+    size_t good = 0;
+    if (size >= sizeof(session_header))
+    {
+        char *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, log->fd, 0);
+        if (map == MAP_FAILED)
+        {
+            perror("mmap");
+            session_log_close(log);
+            return -1;
+        }
+        session_header header;
+        memcpy(&header, map, sizeof(header));
+        if (memcmp(header.magic, SESSION_MAGIC, sizeof(SESSION_MAGIC)) == 0 && header.version == SESSION_VERSION &&
+            header.fingerprint == fingerprint)
+        {
+            good = replay(log, map, size, history);
+        }
+        munmap(map, size);
+    }
+
+    if (good == 0)
+    {
+        // 新文件、格式不认识或者指纹变了：旧记录对不上新的提示词，清空重来
+        if (ftruncate(log->fd, 0) != 0 || write_header(log->fd, fingerprint) != 0)
+        {
+            perror(path);
+            session_log_close(log);
+            return -1;
+        }
+        good = sizeof(session_header);
+    }
+    else if (good < size)
+    {
+        // 结尾是写了一半的记录
+        log->dropped++;
+        if (ftruncate(log->fd, good) != 0)
+            perror(path);
+    }
+    log->size = good;
+    if (lseek(log->fd, 0, SEEK_END) < 0 || fcntl(log->fd, F_SETFL, O_APPEND) != 0)
+    {
+        perror(path);
+    }
+    return (long)log->restored;
+}
+
+void session_log_close(session_log *log)
+{
+    if (log->fd >= 0)
+        close(log->fd);
+    free(log->path);
+    log->fd = -1;
+    log->path = NULL;
+}
+
+int session_log_append(session_log *log, const Message *message)
+{
+    if (log->fd < 0 || !should_log(message))
+        return 0;
+    if (write_record(log->fd, message) != 0)
+    {
+        perror(log->path);
+        return -1;
+    }
+    log->records++;
+    log->size += sizeof(session_record) + message->length + 1;
+    log->appended++;
+    return 0;
+}
+
+void session_log_on_append(const Message *message, void *userdata)
+{
+    session_log_append(userdata, message);
+}
+
+int session_log_compact(session_log *log, const History *history)
+{
+    if (log->fd < 0)
+        return -1;
+
+    size_t len = strlen(log->path) + 5;
+    char *tmp = malloc(len);
+    if (tmp == NULL)
+        return -1;
+    snprintf(tmp, len, "%s.tmp", log->path);
+
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    int failed = fd < 0 || write_header(fd, log->fingerprint) != 0;
+    size_t records = 0;
+    size_t size = sizeof(session_header);
+    for (const Message *message = history->head; !failed && message != NULL; message = message->next)
+    {
+        if (!should_log(message))
+            continue;
+        failed = write_record(fd, message) != 0;
+        records++;
+        size += sizeof(session_record) + message->length + 1;
+    }
+    // 先落盘再改名，任何时候磁盘上都是一份完整的日志
+    if (!failed)
+        failed = fsync(fd) != 0 || rename(tmp, log->path) != 0;
+    if (failed)
+    {
+        perror(tmp);
+        if (fd >= 0)
+            close(fd);
+        unlink(tmp);
+        free(tmp);
+        return -1;
+    }
+    free(tmp);
+    close(fd);
+
+    close(log->fd);
+    log->fd = open(log->path, O_WRONLY | O_APPEND | O_CLOEXEC);
+    log->records = records;
+    log->size = size;
+    log->compactions++;
+    return log->fd >= 0 ? 0 : -1;
+}
@@ -0,0 +1,67 @@
+#ifndef SESSION_H
+#define SESSION_H
+#include <stddef.h>
+#include <stdint.h>
+#include "history.h"
+
+// 会话日志
+// 只追加的二进制文件：文件头记录知识库和提示词的指纹，之后每条非固定消息（和摘要）一条记录，
+// 记录由定长头（长度、校验和、角色、标志）加内容组成，内容以 '\0' 结尾。
+// 启动时 mmap 整个文件顺序扫一遍，内容直接从映射里拷进历史，不需要解析 JSON；
+// 指纹没变时连初始化那一轮的回复也一起恢复，不用再发一次请求。
+// 每条记录用一次 write 追加，断电或崩溃留下的半条记录在下次打开时按校验和截掉。
+// 淘汰和摘要不改写日志，由 session_log_compact 按当前历史重写整个文件。
+
+#define SESSION_MAGIC "CHATLOG"
+#define SESSION_VERSION 1
+
+// 记录标志
+#define SESSION_RAW 1     // Message.raw
+#define SESSION_SUMMARY 2 // Message.summary
+
+typedef struct session_header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+    uint64_t fingerprint;
+} session_header;
+
+typedef struct session_record
+{
+    uint32_t length;   // 内容字节数，不含结尾的 '\0'
+    uint32_t checksum; // role、flags 和内容的 CRC32
+    uint8_t role;
+    uint8_t flags;
+    uint16_t reserved;
+} session_record;
+
+typedef struct session_log
+{
+    int fd;
+    char *path;
+    uint64_t fingerprint;
+    size_t records; // 文件中的记录数
+    size_t size;    // 文件长度
+
+    // 统计
+    unsigned long restored;
+    unsigned long appended;
+    unsigned long dropped;     // 打开时截掉的残缺记录
+    unsigned long compactions;
+} session_log;
+
+// 打开日志，不存在就创建；指纹不同时清空重来。指纹相同时把记录恢复到 history（在固定消息之后），
+// 返回恢复的消息条数；失败返回 -1
+long session_log_open(session_log *log, const char *path, uint64_t fingerprint, History *history);
+void session_log_close(session_log *log);
+
+// 追加一条消息；固定消息不记录（它们由指纹代表）
+int session_log_append(session_log *log, const Message *message);
+// 按 history 当前的内容重写日志（写临时文件再改名），返回 0 成功
+int session_log_compact(session_log *log, const History *history);
+
+// 可以直接作为 History.on_append 回调，userdata 为 session_log
+void session_log_on_append(const Message *message, void *userdata);
+
+#endif
@@ -0,0 +1,527 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "shadow.h"
+#include "scratch.h"
+#include "util.h"
+
+static shadow_control *find_control(shadow_control *controls, size_t size, const char *operation, uint64_t hash)
+{
+    if (size == 0)
+        return NULL;
+    size_t mask = size - 1;
+    for (size_t pos = hash & mask;; pos = (pos + 1) & mask)
+    {
+        shadow_control *control = &controls[pos];
+        if (control->operation == NULL)
+            return control;
+        if (control->hash == hash && strcmp(control->operation, operation) == 0)
+            return control;
+    }
+}
+
+static uint32_t entry_hash(const shadow_control *control, uint64_t session)
+{
+    return (uint32_t)hash_bytes(control->hash, &session, sizeof(session));
+}
+
+static shadow_entry *find_entry(shadow_entry *slots, size_t size, const shadow_control *control, uint64_t session,
+                                uint32_t hash)
+{
+    if (size == 0)
+        return NULL;
+    size_t mask = size - 1;
+    for (size_t pos = hash & mask;; pos = (pos + 1) & mask)
+    {
+        shadow_entry *entry = &slots[pos];
+        if (entry->control == NULL)
+            return entry;
+        if (entry->control == control && entry->session == session)
+            return entry;
+    }
+}
+
+static void free_controls(shadow_control *controls, size_t size)
+{
+    for (size_t i = 0; i < size; i++)
+    {
+        free(controls[i].operation);
+        free(controls[i].device);
+    }
+    free(controls);
+}
+
+static void free_slots(shadow_entry *slots, size_t size)
+{
+    for (size_t i = 0; i < size; i++)
+    {
+        if (slots[i].control != NULL)
+        {
+            cJSON_Delete(slots[i].state);
+            cJSON_Delete(slots[i].pending);
+        }
+    }
+    free(slots);
+}
+
+// 按定义建 operation 表，负载不超过一半
+static shadow_control *build_controls(const cJSON *definitions, size_t *size_out, size_t *count_out)
+{
+    const cJSON *controls = cJSON_GetObjectItemCaseSensitive(definitions, "controls");
+    size_t size = 16;
+    while (size < (size_t)cJSON_GetArraySize(controls) * 2)
+        size *= 2;
+    shadow_control *table = calloc(size, sizeof(shadow_control));
+    if (table == NULL)
+        return NULL;
+
+    size_t count = 0;
+    const cJSON *item;
+    cJSON_ArrayForEach(item, controls)
+    {
+        const char *operation = cJSON_GetStringValue(cJSON_GetObjectItemCaseSensitive(item, "operation"));
+        if (operation == NULL)
+            continue;
+        uint64_t hash = hash_string(operation);
+        shadow_control *control = find_control(table, size, operation, hash);
+        if (control->operation != NULL)
+            continue; // 重复的 operation，dispatcher 已经报过
+        control->operation = strdup(operation);
+        control->device = strdup(item->string != NULL ? item->string : operation);
+        control->hash = hash;
+        if (control->operation == NULL || control->device == NULL)
+        {
+            free_controls(table, size);
+            return NULL;
+        }
+        count++;
+    }
+    *size_out = size;
+    *count_out = count;
+    return table;
+}
+
+// 把 old 里的项搬进一张 size 大小的新表。controls 不为 NULL 时按 operation 换成新定义里的项，
+// 已经删掉的设备连同状态和等待的指令一起丢弃；skip 的会话不搬。失败返回 NULL，old 不变
+static shadow_entry *move_slots(shadow_entry *old, size_t old_size, size_t size, shadow_control *controls,
+                                size_t control_size, const uint64_t *skip, size_t *count_out)
+{
+    shadow_entry *slots = calloc(size, sizeof(shadow_entry));
+    if (slots == NULL)
+        return NULL;
+    size_t count = 0;
+    for (size_t i = 0; i < old_size; i++)
+    {
+        shadow_entry *entry = &old[i];
+        if (entry->control == NULL || (skip != NULL && entry->session == *skip))
+            continue;
+        const shadow_control *control = entry->control;
+        if (controls != NULL)
+        {
+            control = find_control(controls, control_size, control->operation, control->hash);
+            if (control->operation == NULL)
+                continue;
+        }
+        uint32_t hash = entry_hash(control, entry->session);
+        shadow_entry *moved = find_entry(slots, size, control, entry->session, hash);
+        *moved = *entry;
+        moved->control = control;
+        moved->hash = hash;
+        entry->state = NULL;
+        entry->pending = NULL;
+        count++;
+    }
+    *count_out = count;
+    return slots;
+}
+
+// 找到 session 的 operation 对应的项，没有就加一项，负载超过一半时先扩容。
+// 不在定义里或内存不够返回 NULL。调用时持有锁
+static shadow_entry *lookup(device_shadow *s, uint64_t session, const char *operation, int create)
+{
+    const shadow_control *control = find_control(s->controls, s->control_size, operation, hash_string(operation));
+    if (control == NULL || control->operation == NULL)
+        return NULL;
+    uint32_t hash = entry_hash(control, session);
+    shadow_entry *entry = find_entry(s->slots, s->size, control, session, hash);
+    if (entry->control != NULL || !create)
+        return entry->control != NULL ? entry : NULL;
+    if ((s->count + 1) * 2 > s->size)
+    {
+        size_t count;
+        shadow_entry *slots = move_slots(s->slots, s->size, s->size * 2, NULL, 0, NULL, &count);
+        if (slots == NULL)
+            return NULL;
+        free_slots(s->slots, s->size);
+        s->slots = slots;
+        s->size *= 2;
+        entry = find_entry(s->slots, s->size, control, session, hash);
+    }
+    entry->control = control;
+    entry->session = session;
+    entry->hash = hash;
+    s->count++;
+    return entry;
+}
+
+// 记下新状态
+static void set_state(device_shadow *s, shadow_entry *entry, const cJSON *parameters, double now)
+{
+    cJSON_Delete(entry->state);
+    entry->state = scratch_keep(parameters);
+    entry->last_run_ms = now;
+    entry->changed = ++s->version;
+    s->executed++;
+}
+
+// 取出一条到期的指令；和当前状态相同就丢弃并返回 NULL。调用时持有锁
+static cJSON *take_pending(device_shadow *s, shadow_entry *entry)
+{
+    cJSON *command = entry->pending;
+    const cJSON *parameters = cJSON_GetObjectItemCaseSensitive(command, "parameters");
+    entry->pending = NULL;
+    s->held--;
+    if (entry->state != NULL && cJSON_Compare(parameters, entry->state, 1))
+    {
+        s->duplicates++;
+        cJSON_Delete(command);
+        return NULL;
+    }
+    set_state(s, entry, parameters, now_ms());
+    return command;
+}
+
+// 立即执行窗口里等待的指令，all 为 0 时只执行 session 的。调用时持有锁，执行时释放
+static void flush_pending(device_shadow *s, int all, uint64_t session)
+{
+    for (size_t i = 0; s->held > 0 && i < s->size; i++)
+    {
+        shadow_entry *entry = &s->slots[i];
+        if (entry->control == NULL || entry->pending == NULL || (!all && entry->session != session))
+            continue;
+        dispatch_handler handler = entry->handler;
+        void *handler_userdata = entry->handler_userdata;
+        double received_ms = entry->received_ms;
+        cJSON *command = take_pending(s, entry);
+        if (command != NULL)
+        {
+            // 执行时表可能扩容，从头再找
+            pthread_mutex_unlock(&s->lock);
+            s->execute(command, handler, handler_userdata, received_ms, s->userdata);
+            pthread_mutex_lock(&s->lock);
+            i = (size_t)-1;
+        }
+    }
+}
+
+static void *flush_main(void *arg)
+{
+    device_shadow *s = arg;
+    pthread_mutex_lock(&s->lock);
+    while (!s->stopping)
+    {
+        double now = now_ms();
+        double next = 0;
+        shadow_entry *due = NULL;
+        for (size_t i = 0; s->held > 0 && i < s->size && due == NULL; i++)
+        {
+            shadow_entry *entry = &s->slots[i];
+            if (entry->control == NULL || entry->pending == NULL)
+                continue;
+            double deadline = entry->last_run_ms + s->window_ms;
+            if (deadline <= now)
+                due = entry;
+            else if (next == 0 || deadline < next)
+                next = deadline;
+        }
+        if (due != NULL)
+        {
+            dispatch_handler handler = due->handler;
+            void *handler_userdata = due->handler_userdata;
+            double received_ms = due->received_ms;
+            cJSON *command = take_pending(s, due);
+            if (command != NULL)
+            {
+                // 交给线程池时队列可能满了要等，不能拿着锁
+                pthread_mutex_unlock(&s->lock);
+                s->execute(command, handler, handler_userdata, received_ms, s->userdata);
+                pthread_mutex_lock(&s->lock);
+            }
+            continue;
+        }
+        if (next == 0)
+        {
+            pthread_cond_wait(&s->wake, &s->lock);
+            continue;
+        }
+        struct timespec until;
+        until.tv_sec = (time_t)(next / 1000);
+        until.tv_nsec = (long)((next - until.tv_sec * 1000.0) * 1000000.0);
+        pthread_cond_timedwait(&s->wake, &s->lock, &until);
+    }
+    pthread_mutex_unlock(&s->lock);
+    return NULL;
+}
+
+int shadow_init(device_shadow *s, const cJSON *definitions, double window_ms, shadow_execute execute, void *userdata)
+{
+    memset(s, 0, sizeof(*s));
+    // 失败时锁也是可用的，查询函数照常返回"未知"
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&s->wake, &attr);
+    pthread_condattr_destroy(&attr);
+    s->controls = build_controls(definitions, &s->control_size, &s->control_count);
+    s->size = 16;
+    s->slots = s->controls != NULL ? calloc(s->size, sizeof(shadow_entry)) : NULL;
+    if (s->slots == NULL)
+    {
+        free(s->controls);
+        s->controls = NULL;
+        s->control_size = 0;
+        s->size = 0;
+        return -1;
+    }
+    s->window_ms = execute != NULL && window_ms > 0 ? window_ms : 0;
+    s->execute = execute;
+    s->userdata = userdata;
+    if (s->window_ms > 0)
+    {
+        if (pthread_create(&s->thread, NULL, flush_main, s) == 0)
+            s->running = 1;
+        else
+            s->window_ms = 0; // 没有线程就只去重
+    }
+    return 0;
+}
+
+int shadow_load(device_shadow *s, const cJSON *definitions)
+{
+    pthread_mutex_lock(&s->lock);
+    size_t control_size, control_count, count;
+    size_t size = s->size > 0 ? s->size : 16; // 初始化失败过时还没有表
+    shadow_control *controls = build_controls(definitions, &control_size, &control_count);
+    shadow_entry *slots = controls != NULL ? move_slots(s->slots, s->size, size, controls, control_size, NULL, &count)
+                                           : NULL;
+    if (slots == NULL)
+    {
+        if (controls != NULL)
+            free_controls(controls, control_size);
+        pthread_mutex_unlock(&s->lock);
+        return -1;
+    }
+    // 删掉的设备，窗口里等待的指令也不再执行
+    s->held = 0;
+    for (size_t i = 0; i < size; i++)
+    {
+        if (slots[i].control != NULL && slots[i].pending != NULL)
+            s->held++;
+    }
+    free_slots(s->slots, s->size);
+    free_controls(s->controls, s->control_size);
+    s->controls = controls;
+    s->control_size = control_size;
+    s->control_count = control_count;
+    s->slots = slots;
+    s->size = size;
+    s->count = count;
+    s->loaded = ++s->version;
+    pthread_mutex_unlock(&s->lock);
+    return 0;
+}
+
+void shadow_free(device_shadow *s)
+{
+    if (s->slots == NULL)
+        return;
+    pthread_mutex_lock(&s->lock);
+    if (s->running)
+    {
+        s->stopping = 1;
+        pthread_cond_signal(&s->wake);
+        pthread_mutex_unlock(&s->lock);
+        pthread_join(s->thread, NULL);
+        pthread_mutex_lock(&s->lock);
+    }
+    flush_pending(s, 1, 0);
+    pthread_mutex_unlock(&s->lock);
+    free_slots(s->slots, s->size);
+    free_controls(s->controls, s->control_size);
+    s->slots = NULL;
+    s->controls = NULL;
+    pthread_cond_destroy(&s->wake);
+    pthread_mutex_destroy(&s->lock);
+}
+
+void shadow_forget(device_shadow *s, uint64_t session)
+{
+    if (s->slots == NULL)
+        return;
+    pthread_mutex_lock(&s->lock);
+    flush_pending(s, 0, session);
+    size_t count;
+    shadow_entry *slots = move_slots(s->slots, s->size, s->size, NULL, 0, &session, &count);
+    if (slots != NULL)
+    {
+        free_slots(s->slots, s->size);
+        s->slots = slots;
+        s->count = count;
+    }
+    pthread_mutex_unlock(&s->lock);
+}
+
+shadow_action shadow_offer(device_shadow *s, uint64_t session, const cJSON *command, dispatch_handler handler,
+                           void *handler_userdata, int hold)
+{
+    const char *operation = cJSON_GetStringValue(cJSON_GetObjectItemCaseSensitive(command, "operation"));
+    const cJSON *parameters = cJSON_GetObjectItemCaseSensitive(command, "parameters");
+    if (operation == NULL || s->slots == NULL)
+        return SHADOW_EXECUTE;
+
+    pthread_mutex_lock(&s->lock);
+    shadow_entry *entry = lookup(s, session, operation, 1);
+    if (entry == NULL)
+    {
+        pthread_mutex_unlock(&s->lock);
+        return SHADOW_EXECUTE; // 不在定义里（不该发生）或内存不够，不跟踪
+    }
+    s->commands++;
+    double now = now_ms();
+
+    if (entry->pending != NULL)
+    {
+        const cJSON *waiting = cJSON_GetObjectItemCaseSensitive(entry->pending, "parameters");
+        if (hold && cJSON_Compare(parameters, waiting, 1))
+        {
+            s->duplicates++;
+            pthread_mutex_unlock(&s->lock);
+            return SHADOW_DUPLICATE;
+        }
+        // 后来的指令取代窗口里的
+        cJSON_Delete(entry->pending);
+        entry->pending = NULL;
+        s->coalesced++;
+        if (hold)
+        {
+            entry->pending = scratch_keep(command);
+            entry->handler = handler;
+            entry->handler_userdata = handler_userdata;
+            entry->received_ms = now;
+            if (entry->pending != NULL)
+            {
+                pthread_mutex_unlock(&s->lock);
+                return SHADOW_HELD;
+            }
+        }
+        s->held--;
+    }
+
+    if (entry->state != NULL && cJSON_Compare(parameters, entry->state, 1))
+    {
+        s->duplicates++;
+        pthread_mutex_unlock(&s->lock);
+        return SHADOW_DUPLICATE;
+    }
+    if (hold && s->window_ms > 0 && now - entry->last_run_ms < s->window_ms)
+    {
+        entry->pending = scratch_keep(command);
+        if (entry->pending != NULL)
+        {
+            entry->handler = handler;
+            entry->handler_userdata = handler_userdata;
+            entry->received_ms = now;
+            s->held++;
+            pthread_cond_signal(&s->wake);
+            pthread_mutex_unlock(&s->lock);
+            return SHADOW_HELD;
+        }
+    }
+    set_state(s, entry, parameters, now);
+    pthread_mutex_unlock(&s->lock);
+    return SHADOW_EXECUTE;
+}
+
+unsigned long shadow_version(device_shadow *s, uint64_t session)
+{
+    pthread_mutex_lock(&s->lock);
+    unsigned long version = s->loaded;
+    // 按定义逐个查这个会话的项，不扫整张表
+    for (size_t i = 0; s->count > 0 && i < s->control_size; i++)
+    {
+        const shadow_control *control = &s->controls[i];
+        if (control->operation == NULL)
+            continue;
+        const shadow_entry *entry = find_entry(s->slots, s->size, control, session, entry_hash(control, session));
+        if (entry->control != NULL && entry->changed > version)
+            version = entry->changed;
+    }
+    pthread_mutex_unlock(&s->lock);
+    return version;
+}
+
+// "Lighting status=on"，字符串参数不加引号；写不下返回 -1
+static int format_entry(const shadow_entry *entry, char *buf, size_t size)
+{
+    size_t len = snprintf(buf, size, "%s", entry->control->device);
+    const cJSON *parameter;
+    cJSON_ArrayForEach(parameter, entry->state)
+    {
+        if (len >= size)
+            break;
+        if (cJSON_IsString(parameter))
+        {
+            len += snprintf(buf + len, size - len, " %s=%s", parameter->string, parameter->valuestring);
+            continue;
+        }
+        char *value = cJSON_PrintUnformatted(parameter);
+        len += snprintf(buf + len, size - len, " %s=%s", parameter->string, value != NULL ? value : "?");
+        cJSON_free(value);
+    }
+    return len < size ? (int)len : -1;
+}
+
+size_t shadow_summary(device_shadow *s, uint64_t session, char *buf, size_t size)
+{
+    static const char separator[] = "；";
+    size_t len = 0;
+    char item[256];
+
+    if (size == 0)
+        return 0;
+    buf[0] = '\0';
+    pthread_mutex_lock(&s->lock);
+    for (size_t i = 0; s->count > 0 && i < s->control_size; i++)
+    {
+        const shadow_control *control = &s->controls[i];
+        if (control->operation == NULL)
+            continue;
+        const shadow_entry *entry = find_entry(s->slots, s->size, control, session, entry_hash(control, session));
+        if (entry->control == NULL || entry->state == NULL)
+            continue;
+        int n = format_entry(entry, item, sizeof(item));
+        size_t need = (len > 0 ? sizeof(separator) - 1 : 0) + (n > 0 ? (size_t)n : 0);
+        if (n < 0 || len + need >= size)
+            continue;
+        len += snprintf(buf + len, size - len, "%s%s", len > 0 ? separator : "", item);
+    }
+    pthread_mutex_unlock(&s->lock);
+    return len;
+}
+
+int shadow_describe(device_shadow *s, uint64_t session, const char *operation, char *buf, size_t size)
+{
+    int result = -1;
+    pthread_mutex_lock(&s->lock);
+    shadow_entry *entry = s->slots != NULL ? lookup(s, session, operation, 0) : NULL;
+    if (entry != NULL && entry->state != NULL)
+    {
+        result = format_entry(entry, buf, size) < 0 ? -1 : 0;
+        if (result == 0)
+            s->answered++;
+    }
+    pthread_mutex_unlock(&s->lock);
+    return result;
+}
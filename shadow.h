@@ -0,0 +1,104 @@
+#ifndef SHADOW_H
+#define SHADOW_H
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <cJSON.h>
+#include "dispatch.h"
+
+// 设备状态影子
+// 每个会话的每个 operation 一项（按会话和 operation 查的开放寻址哈希表，用到时才加），记住最后一次下发的参数。
+// 各个会话（终端是 0，网关按连接）控制的是各自的设备，状态、去重和合并窗口互不影响；合并窗口共用一个后台线程。
+// 和当前状态相同的指令直接丢弃，不再交给线程池。
+// 合并窗口：同一设备上一条指令执行后的窗口内再来的指令先留着，后来的覆盖先到的，
+// 窗口结束时由后台线程把最后一条和当前状态比较，不同才执行。连续开关只执行第一条和最终状态，单独的指令不增加延迟。
+// 已知的状态可以压缩成一行摘要附在用户消息后面，"灯开着吗" 这样的问题可以直接在本地回答。
+// 记住的状态和留着的指令用 scratch_keep 复制到堆上，调用方传进来的指令可以在每轮的临时内存里。
+
+typedef enum shadow_action
+{
+    SHADOW_EXECUTE = 0, // 状态有变化，由调用方立即执行
+    SHADOW_DUPLICATE,   // 和当前状态（或窗口里等待的指令）相同，丢弃
+    SHADOW_HELD,        // 留在合并窗口里，到时由 execute 回调执行
+} shadow_action;
+
+// 窗口到期的指令：command 的所有权交给回调；received_ms 是这条指令到达的时间
+typedef void (*shadow_execute)(cJSON *command, dispatch_handler handler, void *handler_userdata,
+                               double received_ms, void *userdata);
+
+// dev_ctrl.json 里的一项
+typedef struct shadow_control
+{
+    char *operation;          // NULL 表示空槽
+    uint64_t hash;
+    char *device;             // controls 里的名字，用于摘要
+} shadow_control;
+
+typedef struct shadow_entry
+{
+    const shadow_control *control; // NULL 表示空槽
+    uint64_t session;
+    uint32_t hash;            // 会话和 operation 一起算
+    cJSON *state;             // 最后下发的 parameters，NULL 表示未知
+    unsigned long changed;    // 状态最后一次变化时的版本
+    double last_run_ms;       // 最后一次执行的时间，合并窗口从这里算起
+
+    cJSON *pending;           // 窗口里等待的指令
+    dispatch_handler handler;
+    void *handler_userdata;
+    double received_ms;
+} shadow_entry;
+
+typedef struct device_shadow
+{
+    shadow_control *controls;
+    size_t control_size;      // 2 的幂
+    size_t control_count;
+    shadow_entry *slots;
+    size_t size;              // 2 的幂
+    size_t count;
+    double window_ms;         // 0 表示不合并，只去重
+    shadow_execute execute;
+    void *userdata;
+    unsigned long version;    // 任何会话的状态每变一次加一
+    unsigned long loaded;     // 最后一次热更新时的版本
+
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_t thread;
+    int running;
+    int stopping;
+    size_t held;              // 窗口里等待的指令数
+
+    // 统计
+    unsigned long commands;
+    unsigned long executed;
+    unsigned long duplicates; // 和当前状态相同而丢弃
+    unsigned long coalesced;  // 被窗口里后来的指令覆盖
+    unsigned long answered;   // 在本地回答的状态查询
+} device_shadow;
+
+// definitions 是 dev_ctrl.json 解析后的对象（dispatcher 的 controls）。
+// window_ms > 0 时启动合并窗口的后台线程。失败返回 -1
+int shadow_init(device_shadow *s, const cJSON *definitions, double window_ms, shadow_execute execute, void *userdata);
+// 定义热更新后重建表，仍然存在的 operation 保留状态和等待的指令；失败返回 -1，原表不变
+int shadow_load(device_shadow *s, const cJSON *definitions);
+// 停止后台线程，窗口里还没执行的指令立即交给 execute
+void shadow_free(device_shadow *s);
+// 会话结束：窗口里它还没执行的指令立即交给 execute，然后删掉它的所有项
+void shadow_forget(device_shadow *s, uint64_t session);
+
+// session 的一条已通过参数检查的指令。hold 为 0 时不进合并窗口（调用方要等结果，比如工具调用），
+// 窗口里同一设备等待的指令被它取代
+shadow_action shadow_offer(device_shadow *s, uint64_t session, const cJSON *command, dispatch_handler handler,
+                           void *handler_userdata, int hold);
+
+// session 的状态版本，它的设备状态变了或定义热更新后变大
+unsigned long shadow_version(device_shadow *s, uint64_t session);
+// session 已知状态的摘要，如 "Lighting status=on；NuclearFusion status=start"，写不下的项省略。
+// 返回长度，没有已知状态时返回 0
+size_t shadow_summary(device_shadow *s, uint64_t session, char *buf, size_t size);
+// session 一个设备的状态，如 "Lighting status=on"；状态未知返回 -1
+int shadow_describe(device_shadow *s, uint64_t session, const char *operation, char *buf, size_t size);
+
+#endif
@@ -1,81 +1,188 @@
-#include <stdio.h>
-#include <stdlib.h>
-#include <cJSON.h>
-
-void process_control_command(cJSON *json) {
-    // 获取 "operation"
-    cJSON *operation = cJSON_GetObjectItemCaseSensitive(json, "operation");
-    if (!cJSON_IsString(operation) || (operation->valuestring == NULL)) {
-        printf("Operation missing or incorrect format\n");
-        return;
-    }
-
-    // 获取 "parameters"
-    cJSON *parameters = cJSON_GetObjectItemCaseSensitive(json, "parameters");
-    if (!cJSON_IsObject(parameters)) {
-        printf("Parameters missing or incorrect format\n");
-        return;
-    }
-    cJSON *status = cJSON_GetObjectItemCaseSensitive(parameters, "status");
-    if (!cJSON_IsString(status) || (status->valuestring == NULL)) {
-        printf("Status missing or incorrect format\n");
-        return;
-    }
-
-    // 根据不同的 "operation" 执行不同的逻辑
-    if (strcmp(operation->valuestring, "activateFusion") == 0) {
-        // 处理 activateFusion 操作
-        printf("Activating Fusion, Status: %s\n", status->valuestring);
-    } else if (strcmp(operation->valuestring, "switchLight") == 0) {
-        // 处理 switchLight 操作
-        printf("Switching Light, Status: %s\n", status->valuestring);
-    } else {
-        // 未知操作
-        printf("Unknown operation: %s\n", operation->valuestring);
-    }
-}
-
-void process_dialog(cJSON *json) {
-    // 获取 "message"
-    cJSON *message = cJSON_GetObjectItemCaseSensitive(json, "message");
-    if (cJSON_IsString(message) && (message->valuestring != NULL)) {
-        printf("Message: %s\n", message->valuestring);
-    } else {
-        printf("Message missing or incorrect format\n");
-    }
-}
-
-int main() {
-    // 新的 JSON 字符串示例，可以是对话也可以是控制指令
-    char *jsonStrings[] = {
-        "{\"type\": \"控制指令\", \"operation\": \"switchLight\", \"parameters\": {\"status\": \"on\"}}",
-        "{\"type\": \"控制指令\", \"operation\": \"activateFusion\", \"parameters\": {\"status\": \"start\"}}",
-        "{\"type\": \"对话\", \"message\": \"您好，我是贾维斯，钢铁侠控制中心。我在这里帮助您控制设备和进行日常交流。\"}"
-    };
-
-    for (int i = 0; i < sizeof(jsonStrings) / sizeof(jsonStrings[0]); i++) {
-        cJSON *json = cJSON_Parse(jsonStrings[i]);
-        if (json == NULL) {
-            const char *error_ptr = cJSON_GetErrorPtr();
-            if (error_ptr != NULL) {
-                fprintf(stderr, "解析错误之前: %s\n", error_ptr);
-            }
-            continue;
-        }
-
-        cJSON *type = cJSON_GetObjectItemCaseSensitive(json, "type");
-        if (cJSON_IsString(type) && (type->valuestring != NULL)) {
-            if (strcmp(type->valuestring, "控制指令") == 0) {
-                process_control_command(json);
-            } else if (strcmp(type->valuestring, "对话") == 0) {
-                process_dialog(json);
-            } else {
-                printf("Unknown type: %s\n", type->valuestring);
-            }
-        }
-
-        cJSON_Delete(json);
-    }
-
-    return 0;
-}
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cJSON.h>
+#include "dispatch.h"
+#include "workers.h"
+#include "config.h"
+#include "util.h"
+// gcc -o test test.c dispatch.c workers.c config.c -lcjson -lpthread -I/usr/include/cjson/
+
+#define SYNTHETIC_COMMANDS 2000
+#define SYNTHETIC_BATCH 8
+#define SYNTHETIC_DEVICE_US 200 // 模拟设备动作耗时
+
+static const char *command_status(const cJSON *json) {
+    const cJSON *parameters = cJSON_GetObjectItemCaseSensitive(json, "parameters");
+    const char *status = cJSON_GetStringValue(cJSON_GetObjectItemCaseSensitive(parameters, "status"));
+    return status != NULL ? status : "";
+}
+
+static void switch_light(const cJSON *json, void *userdata) {
+    printf("Switching Light, Status: %s\n", command_status(json));
+}
+
+static void activate_fusion(const cJSON *json, void *userdata) {
+    printf("Activating Fusion, Status: %s\n", command_status(json));
+}
+
+void process_control_command(const cJSON *json, void *userdata) {
+    // 参数已经按 dev_ctrl.json 里的定义检查过
+    dispatch_command(userdata, json);
+}
+
+void process_dialog(const cJSON *json, void *userdata) {
+    // 获取 "message"
+    cJSON *message = cJSON_GetObjectItemCaseSensitive(json, "message");
+    if (cJSON_IsString(message) && (message->valuestring != NULL)) {
+        printf("Message: %s\n", message->valuestring);
+    } else {
+        printf("Message missing or incorrect format\n");
+    }
+}
+
+// 模拟设备：每个 operation 一个，检查同一设备的指令是否按顺序执行
+struct synthetic_device {
+    atomic_int last_seq;
+    atomic_int out_of_order;
+};
+
+static void synthetic_handler(const cJSON *json, void *userdata) {
+    struct synthetic_device *device = userdata;
+    int seq = (int)cJSON_GetNumberValue(cJSON_GetObjectItemCaseSensitive(json, "seq"));
+    usleep(SYNTHETIC_DEVICE_US);
+    if (seq < atomic_exchange(&device->last_seq, seq)) {
+        atomic_fetch_add(&device->out_of_order, 1);
+    }
+}
+
+// 测量线程池的吞吐量和排队延迟
+static void benchmark_workers(dispatcher *commands, int ordered) {
+    static const char *operations[] = {"switchLight", "activateFusion"};
+    struct synthetic_device devices[2];
+    worker_pool pool;
+
+    for (int i = 0; i < 2; i++) {
+        atomic_init(&devices[i].last_seq, -1);
+        atomic_init(&devices[i].out_of_order, 0);
+        dispatcher_register_operation(commands, operations[i], synthetic_handler, &devices[i]);
+    }
+    if (worker_pool_init(&pool, 4, ordered) != 0) {
+        return;
+    }
+
+    double start = now_ms();
+    for (int seq = 0; seq < SYNTHETIC_COMMANDS; seq += SYNTHETIC_BATCH) {
+        command_batch *batch = command_batch_new(SYNTHETIC_BATCH);
+        for (int i = 0; i < SYNTHETIC_BATCH; i++) {
+            cJSON *command = cJSON_CreateObject();
+            cJSON_AddStringToObject(command, "operation", operations[(seq + i) % 2]);
+            cJSON_AddStringToObject(cJSON_AddObjectToObject(command, "parameters"), "status", "on");
+            cJSON_AddNumberToObject(command, "seq", seq + i);
+            dispatch_handler handler;
+            void *userdata;
+            dispatch_resolve(commands, command, &handler, &userdata);
+            worker_pool_submit(&pool, batch, i, handler, userdata, command);
+        }
+    }
+    worker_pool_wait(&pool);
+    double elapsed = now_ms() - start;
+
+    printf("%s: %d commands in %.1fms (%.0f/s), queue wait avg %.3fms max %.3fms, out of order %d\n",
+           ordered ? "ordered" : "unordered", SYNTHETIC_COMMANDS, elapsed, SYNTHETIC_COMMANDS * 1000.0 / elapsed,
+           pool.wait_us_total / 1000.0 / pool.completed, pool.wait_us_max / 1000.0,
+           atomic_load(&devices[0].out_of_order) + atomic_load(&devices[1].out_of_order));
+    worker_pool_shutdown(&pool); // 顺便释放完成的批次
+}
+
+static int write_file(const char *path, int flags, const char *text) {
+    int fd = open(path, O_WRONLY | flags, 0644);
+    if (fd < 0) {
+        return -1;
+    }
+    ssize_t n = write(fd, text, strlen(text));
+    close(fd);
+    return n == (ssize_t)strlen(text) ? 0 : -1;
+}
+
+// 编辑器原地改写 Prompt.txt（截断再写，文件变短）：比较的应该是上次加载的内容，不是改写后的文件
+static int test_prompt_rewrite(void) {
+    char path[] = "/tmp/prompt-test-XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        perror("mkstemp");
+        return 1;
+    }
+    close(fd);
+
+    // 旧内容超过一页，新内容只有几行，以前 mmap 时读旧内容会 SIGBUS
+    char old_text[8192] = "你是贾维斯。\n回答要简短。\n";
+    size_t len = strlen(old_text);
+    while (len + 32 < sizeof(old_text)) {
+        len += snprintf(old_text + len, sizeof(old_text) - len, "旧规则 %zu\n", len);
+    }
+    const char *new_text = "你是贾维斯。\n只用中文回答。\n";
+
+    config_file old, updated;
+    int failed = 1;
+    if (write_file(path, O_TRUNC, old_text) == 0 && config_load(&old, path) == 0) {
+        if (write_file(path, O_TRUNC, new_text) == 0 && config_load(&updated, path) == 0) {
+            char *delta = config_prompt_delta(&old, &updated);
+            failed = delta == NULL || strstr(delta, "新增：只用中文回答。\n") == NULL ||
+                     strstr(delta, "不再适用：回答要简短。\n") == NULL || strstr(delta, "不再适用：旧规则") == NULL ||
+                     strstr(delta, "你是贾维斯") != NULL;
+            if (failed) {
+                fprintf(stderr, "Prompt rewrite delta wrong:\n%s\n", delta != NULL ? delta : "(null)");
+            }
+            free(delta);
+            config_unload(&updated);
+        }
+        config_unload(&old);
+    }
+    unlink(path);
+    printf("Prompt rewrite in place: %s\n", failed ? "FAILED" : "ok");
+    return failed;
+}
+
+int main() {
+    dispatcher commands;
+    if (dispatcher_init(&commands, "./dev_ctrl.json") != 0) {
+        return 1;
+    }
+    dispatcher_register_type(&commands, "控制指令", process_control_command, &commands);
+    dispatcher_register_type(&commands, "对话", process_dialog, NULL);
+    dispatcher_register_operation(&commands, "switchLight", switch_light, NULL);
+    dispatcher_register_operation(&commands, "activateFusion", activate_fusion, NULL);
+
+    // 新的 JSON 字符串示例，可以是对话也可以是控制指令
+    char *jsonStrings[] = {
+        "{\"type\": \"控制指令\", \"operation\": \"switchLight\", \"parameters\": {\"status\": \"on\"}}",
+        "{\"type\": \"控制指令\", \"operation\": \"activateFusion\", \"parameters\": {\"status\": \"start\"}}",
+        "{\"type\": \"控制指令\", \"operation\": \"switchLight\", \"parameters\": {\"status\": 1}}",
+        "{\"type\": \"控制指令\", \"operation\": \"openDoor\", \"parameters\": {\"status\": \"open\"}}",
+        "{\"type\": \"对话\", \"message\": \"您好，我是贾维斯，钢铁侠控制中心。我在这里帮助您控制设备和进行日常交流。\"}"
+    };
+
+    for (int i = 0; i < sizeof(jsonStrings) / sizeof(jsonStrings[0]); i++) {
+        cJSON *json = cJSON_Parse(jsonStrings[i]);
+        if (json == NULL) {
+            const char *error_ptr = cJSON_GetErrorPtr();
+            if (error_ptr != NULL) {
+                fprintf(stderr, "解析错误之前: %s\n", error_ptr);
+            }
+            continue;
+        }
+
+        dispatch_reply(&commands, json);
+        cJSON_Delete(json);
+    }
+
+    benchmark_workers(&commands, 1);
+    benchmark_workers(&commands, 0);
+
+    dispatcher_free(&commands);
+    return test_prompt_rewrite();
+}
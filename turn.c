@@ -0,0 +1,410 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "turn.h"
+#include "response.h"
+#include "log.h"
+#include "util.h"
+
+#define trace(fmt, args...) log_at(LOG_TRACE, fmt, ##args)
+
+void turn_init(turn_engine *e, dispatcher *commands, worker_pool *workers, device_shadow *shadow, metrics *m,
+               scratch_arena *scratch)
+{
+    memset(e, 0, sizeof(*e));
+    e->commands = commands;
+    e->workers = workers;
+    e->shadow = shadow;
+    e->metrics = m;
+    e->scratch = scratch;
+}
+
+void turn_free(turn_engine *e)
+{
+    free(e->request_fields[0]);
+    free(e->request_fields[1]);
+    e->request_fields[0] = e->request_fields[1] = NULL;
+}
+
+// format 为 NULL 时不要求结构化输出，tools 为 NULL 时不声明工具
+static void set_request_fields(turn_engine *e, const char *format, const char *tools)
+{
+    for (int stream = 0; stream < 2; stream++)
+    {
+        const char *stream_field = stream ? ",\"stream\":true" : "";
+        free(e->request_fields[stream]);
+        size_t len = strlen(stream_field) + (format != NULL ? strlen(format) : 0) + (tools != NULL ? strlen(tools) : 0) + 64;
+        e->request_fields[stream] = malloc(len);
+        if (e->request_fields[stream] == NULL)
+            continue;
+        int n = snprintf(e->request_fields[stream], len, "%s", stream_field);
+        if (format != NULL)
+            n += snprintf(e->request_fields[stream] + n, len - n, ",\"response_format\":%s", format);
+        if (tools != NULL)
+            snprintf(e->request_fields[stream] + n, len - n, ",\"tools\":%s,\"parallel_tool_calls\":true", tools);
+    }
+}
+
+// --json-schema：回复 Schema 由 dev_ctrl.json 生成，设备定义变了请求也跟着变
+static char *reply_schema_format(const dispatcher *d)
+{
+    cJSON *format = cJSON_CreateObject();
+    cJSON_AddStringToObject(format, "type", "json_schema");
+    cJSON *json_schema = cJSON_AddObjectToObject(format, "json_schema");
+    cJSON_AddStringToObject(json_schema, "name", "jarvis_reply");
+    cJSON_AddTrueToObject(json_schema, "strict");
+    cJSON_AddItemToObject(json_schema, "schema", dispatcher_reply_schema(d, "对话", "控制指令"));
+    char *text = cJSON_PrintUnformatted(format);
+    cJSON_Delete(format);
+    return text;
+}
+
+void build_request_fields(turn_engine *e, int json_mode, int tool_mode)
+{
+    char *schema_format = json_mode == 2 ? reply_schema_format(e->commands) : NULL;
+    char *tools = NULL;
+    if (tool_mode)
+    {
+        cJSON *declared = dispatcher_tools(e->commands);
+        tools = cJSON_PrintUnformatted(declared);
+        cJSON_Delete(declared);
+    }
+    set_request_fields(e,
+                       schema_format != NULL ? schema_format
+                       : json_mode           ? "{\"type\":\"json_object\"}"
+                                             : NULL,
+                       tools);
+    cJSON_free(schema_format);
+    cJSON_free(tools);
+}
+
+const char *create_json_payload(turn_engine *e, payload_builder *payload, History *history, int stream)
+{
+    double start = now_ms();
+    const char *json_payload = payload_build(payload, history, e->request_fields[stream ? 1 : 0]);
+    metrics_observe_ms(e->metrics, METRIC_PAYLOAD_BUILD, now_ms() - start);
+    return json_payload;
+}
+
+cJSON *reply_body(cJSON *json)
+{
+    cJSON *reply = cJSON_GetObjectItemCaseSensitive(json, DISPATCH_REPLY_KEY);
+    return reply != NULL && cJSON_GetObjectItemCaseSensitive(json, "type") == NULL ? reply : json;
+}
+
+void process_reply(turn_engine *e, cJSON *json)
+{
+    json = reply_body(json);
+    if (cJSON_IsArray(json))
+    {
+        cJSON *item;
+        cJSON_ArrayForEach(item, json)
+        {
+            dispatch_reply(e->commands, item);
+        }
+        return;
+    }
+    dispatch_reply(e->commands, json);
+}
+
+// 指令从收到到执行完的耗时（含在合并窗口里的等待）
+struct actuation
+{
+    dispatch_handler handler;
+    void *userdata;
+    metrics *metrics;
+    double received_ms;
+};
+
+static void actuate(const cJSON *json, void *userdata)
+{
+    struct actuation *a = userdata;
+    a->handler(json, a->userdata);
+    metrics_observe_ms(a->metrics, METRIC_ACTUATION, now_ms() - a->received_ms);
+    free(a);
+}
+
+// 把 batch 的第 index 条指令交给线程池，执行完记下执行延迟；command 的所有权转给线程池
+static void submit_command(turn_engine *e, command_batch *batch, int index, cJSON *command, dispatch_handler handler,
+                           void *userdata, double received_ms)
+{
+    struct actuation *a = malloc(sizeof(*a));
+    if (a == NULL)
+    {
+        worker_pool_submit(e->workers, batch, index, handler, userdata, command);
+        return;
+    }
+    a->handler = handler;
+    a->userdata = userdata;
+    a->metrics = e->metrics;
+    a->received_ms = received_ms;
+    worker_pool_submit(e->workers, batch, index, actuate, a, command);
+}
+
+void execute_held_command(cJSON *command, dispatch_handler handler, void *handler_userdata, double received_ms,
+                          void *userdata)
+{
+    command_batch *batch = command_batch_new(1);
+    if (batch == NULL)
+    {
+        cJSON_Delete(command);
+        return;
+    }
+    submit_command(userdata, batch, 0, command, handler, handler_userdata, received_ms);
+}
+
+// 先在当前线程检查参数，再和设备状态影子比较：状态没变的丢弃，窗口内的留给影子合并，
+// 其余作为一个批次交给线程池并行执行，聊天不用等设备动作完成
+void process_control_command(const cJSON *json, void *userdata)
+{
+    turn_engine *e = userdata;
+    const cJSON *list = cJSON_GetObjectItemCaseSensitive(json, "commands");
+    int total = cJSON_IsArray(list) ? cJSON_GetArraySize(list) : 1;
+    struct accepted_command
+    {
+        const cJSON *command;
+        dispatch_handler handler;
+        void *userdata;
+    } *accepted = cJSON_malloc(total * sizeof(*accepted)); // 和回复一起在每轮的临时内存里
+    int count = 0;
+    double received_ms = now_ms();
+    if (accepted == NULL)
+    {
+        fprintf(stderr, "Memory allocation failed\n");
+        return;
+    }
+
+    for (int i = 0; i < total; i++)
+    {
+        const cJSON *command = cJSON_IsArray(list) ? cJSON_GetArrayItem(list, i) : json;
+        if (dispatch_resolve(e->commands, command, &accepted[count].handler, &accepted[count].userdata) == DISPATCH_OK &&
+            shadow_offer(e->shadow, e->session, command, accepted[count].handler, accepted[count].userdata, 1) ==
+                SHADOW_EXECUTE)
+        {
+            accepted[count++].command = command;
+        }
+    }
+    command_batch *batch = count > 0 ? command_batch_new(count) : NULL;
+    for (int i = 0; batch != NULL && i < count; i++)
+    {
+        submit_command(e, batch, i, scratch_keep(accepted[i].command), accepted[i].handler, accepted[i].userdata,
+                       received_ms);
+    }
+    cJSON_free(accepted);
+}
+
+void collect_command_results(turn_engine *e, History *history, int report, const command_batch *keep)
+{
+    command_batch *batch;
+    while ((batch = worker_pool_completed(e->workers)) != NULL)
+    {
+        if (batch == keep)
+            continue;
+        char text[2048];
+        size_t len = snprintf(text, sizeof(text), "设备执行结果：");
+        for (int i = 0; i < batch->count && len < sizeof(text); i++)
+        {
+            len += snprintf(text + len, sizeof(text) - len, "%s %s 已执行（%.1fms）；",
+                            batch->results[i].operation, batch->results[i].parameters, batch->results[i].run_ms);
+        }
+        if (report && history != NULL)
+        {
+            add_message(history, ROLE_SYSTEM, text);
+        }
+        command_batch_free(batch);
+    }
+}
+
+void handle_reply(turn_engine *e, History *history, response_cache *cache, uint64_t cache_key_value,
+                  char *ai_response, size_t content_len)
+{
+    double start = now_ms();
+    size_t json_len = content_len;
+    char *json_text = response_unfence(ai_response, &json_len);
+    if (json_text != NULL)
+    {
+        e->stats.fenced++;
+    }
+    else
+    {
+        // 跳过前导空白，看是不是 JSON 模式的回复
+        json_text = ai_response;
+        while (json_len > 0 && (*json_text == ' ' || *json_text == '\n' || *json_text == '\r' || *json_text == '\t'))
+        {
+            json_text++;
+            json_len--;
+        }
+        if (json_len > 0 && (*json_text == '{' || *json_text == '['))
+        {
+            e->stats.structured++;
+        }
+        else
+        {
+            json_text = NULL;
+        }
+    }
+
+    scratch_begin(e->scratch);
+    cJSON *json = json_text != NULL ? cJSON_ParseWithLength(json_text, json_len) : NULL;
+    if (json_text != NULL && json == NULL)
+    {
+        const char *error_ptr = cJSON_GetErrorPtr();
+        if (error_ptr != NULL)
+        {
+            fprintf(stderr, "解析错误之前: %s\n", error_ptr);
+        }
+        e->stats.malformed++;
+    }
+    double parsed = now_ms();
+    metrics_observe_ms(e->metrics, METRIC_PARSE, parsed - start);
+
+    if (json_text != NULL)
+    {
+        trace("AI: %s\n", json_text);
+        add_message(history, ROLE_ASSISTANT, json_text);
+        if (cache_key_value && json != NULL)
+            cache_store(cache, cache_key_value, json_text);
+        if (json != NULL)
+        {
+            double dispatch_start = now_ms();
+            process_reply(e, json);
+            metrics_observe_ms(e->metrics, METRIC_DISPATCH, now_ms() - dispatch_start);
+            cJSON_Delete(json);
+        }
+    }
+    else
+    {
+        e->stats.text++;
+        printf("AI: %s\n", ai_response);
+        add_message(history, ROLE_ASSISTANT, ai_response);
+        if (cache_key_value)
+            cache_store(cache, cache_key_value, ai_response);
+    }
+    scratch_end(e->scratch);
+}
+
+static void add_tool_result(History *history, const char *id, const char *content)
+{
+    cJSON *message = cJSON_CreateObject();
+    cJSON_AddStringToObject(message, "role", "tool");
+    cJSON_AddStringToObject(message, "tool_call_id", id);
+    cJSON_AddStringToObject(message, "content", content);
+    char *text = cJSON_PrintUnformatted(message);
+    if (text != NULL)
+        add_raw_message(history, ROLE_TOOL, text);
+    cJSON_free(text);
+    cJSON_Delete(message);
+}
+
+// 合格的调用作为一个批次在线程池里并行执行，全部完成后再逐个写 tool 消息
+int run_tool_calls(turn_engine *e, History *history, const char *tool_calls, size_t len, int report)
+{
+    scratch_begin(e->scratch);
+    cJSON *calls = cJSON_ParseWithLength(tool_calls, len);
+    int total = cJSON_GetArraySize(calls);
+    if (!cJSON_IsArray(calls) || total == 0)
+    {
+        cJSON_Delete(calls);
+        scratch_end(e->scratch);
+        return -1;
+    }
+
+    struct pending_call
+    {
+        const char *id;
+        cJSON *command;     // {"operation":name,"parameters":arguments}
+        const char *error;  // 没能执行的原因
+        dispatch_handler handler;
+        void *userdata;
+        int slot;           // 在批次中的位置
+    } *pending = cJSON_malloc(total * sizeof(*pending));
+    if (pending == NULL)
+    {
+        cJSON_Delete(calls);
+        scratch_end(e->scratch);
+        return -1;
+    }
+    memset(pending, 0, total * sizeof(*pending));
+
+    int accepted = 0;
+    double received_ms = now_ms();
+    for (int i = 0; i < total; i++)
+    {
+        const cJSON *call = cJSON_GetArrayItem(calls, i);
+        const cJSON *function = cJSON_GetObjectItemCaseSensitive(call, "function");
+        const char *name = cJSON_GetStringValue(cJSON_GetObjectItemCaseSensitive(function, "name"));
+        const char *arguments = cJSON_GetStringValue(cJSON_GetObjectItemCaseSensitive(function, "arguments"));
+        pending[i].id = cJSON_GetStringValue(cJSON_GetObjectItemCaseSensitive(call, "id"));
+        pending[i].slot = -1;
+        cJSON *parameters = arguments != NULL ? cJSON_Parse(arguments) : NULL;
+        if (name == NULL || parameters == NULL)
+        {
+            cJSON_Delete(parameters);
+            pending[i].error = "调用格式错误";
+            continue;
+        }
+        pending[i].command = cJSON_CreateObject();
+        cJSON_AddStringToObject(pending[i].command, "operation", name);
+        cJSON_AddItemToObject(pending[i].command, "parameters", parameters);
+        dispatch_result result =
+            dispatch_resolve(e->commands, pending[i].command, &pending[i].handler, &pending[i].userdata);
+        if (result != DISPATCH_OK)
+            pending[i].error = result == DISPATCH_UNKNOWN ? "没有这个设备操作" : "参数不符合定义";
+        else if (shadow_offer(e->shadow, e->session, pending[i].command, pending[i].handler, pending[i].userdata,
+                              0) == SHADOW_DUPLICATE)
+            pending[i].error = "设备已经是这个状态";
+        else
+            pending[i].slot = accepted++;
+    }
+
+    command_batch *batch = accepted > 0 ? command_batch_new(accepted) : NULL;
+    for (int i = 0; i < total; i++)
+    {
+        if (pending[i].slot >= 0 && batch != NULL)
+        {
+            // 指令在临时内存里，线程池拿的是堆上的副本
+            submit_command(e, batch, pending[i].slot, scratch_keep(pending[i].command), pending[i].handler,
+                           pending[i].userdata, received_ms);
+        }
+    }
+    if (batch != NULL)
+    {
+        worker_pool_wait(e->workers);
+        collect_command_results(e, history, report, batch);
+    }
+
+    // 模型的回复原样记入历史，tool 消息紧跟在它后面（之前汇总的执行结果不能插在中间）
+    char *reply = cJSON_malloc(len + 64);
+    if (reply != NULL)
+    {
+        snprintf(reply, len + 64, "{\"role\":\"assistant\",\"content\":null,\"tool_calls\":%.*s}", (int)len, tool_calls);
+        add_raw_message(history, ROLE_ASSISTANT, reply);
+        cJSON_free(reply);
+    }
+
+    for (int i = 0; i < total; i++)
+    {
+        char text[512];
+        const char *id = pending[i].id != NULL ? pending[i].id : "";
+        if (pending[i].slot >= 0 && batch != NULL)
+        {
+            const command_result *r = &batch->results[pending[i].slot];
+            snprintf(text, sizeof(text), "已执行 %s %s", r->operation, r->parameters);
+            e->stats.tool_calls++;
+        }
+        else
+        {
+            snprintf(text, sizeof(text), "未执行：%s", pending[i].error != NULL ? pending[i].error : "内存不足");
+            e->stats.tool_rejected++;
+        }
+        add_tool_result(history, id, text);
+        cJSON_Delete(pending[i].command);
+    }
+    e->stats.tool_rounds++;
+    if (batch != NULL)
+        command_batch_free(batch);
+    cJSON_free(pending);
+    cJSON_Delete(calls);
+    scratch_end(e->scratch);
+    return total;
+}
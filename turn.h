@@ -0,0 +1,88 @@
+#ifndef TURN_H
+#define TURN_H
+#include <stddef.h>
+#include <stdint.h>
+#include <cJSON.h>
+#include "history.h"
+#include "payload.h"
+#include "cache.h"
+#include "dispatch.h"
+#include "workers.h"
+#include "shadow.h"
+#include "metrics.h"
+#include "scratch.h"
+
+// 一轮对话里请求之外的部分，chat 和 bench 共用这一份实现：
+// 用附加字段（response_format、tools）生成请求体；回复原地取出，按 JSON 模式、```json 包裹、纯文本三条路径解析，
+// 按 "type" 分发；控制指令先和设备状态影子比较，再作为一个批次交给线程池；工具调用执行完把结果记入历史。
+// 每条回复的 cJSON 树都在 scratch 里，处理完整体清空。
+//
+// "控制指令" 的处理函数是 process_control_command，注册时 userdata 传 turn_engine；
+// "对话" 和各个 operation 的处理函数由调用方注册（chat 输出到终端，bench 只计数）。
+
+// 一轮对话里最多的工具调用往返次数
+#define TOOL_MAX_ROUNDS 4
+
+// 回复走了哪条解析路径，以及工具调用的统计
+typedef struct turn_stats
+{
+    unsigned long structured; // JSON 模式：content 本身就是 JSON
+    unsigned long fenced;     // 旧格式：```json 包裹
+    unsigned long text;       // 纯文本
+    unsigned long malformed;  // 看起来是 JSON 但解析失败
+    unsigned long tool_rounds;   // 带工具调用的回复
+    unsigned long tool_calls;    // 执行的调用
+    unsigned long tool_rejected; // 未知函数或参数不符合定义，把错误返回给模型
+} turn_stats;
+
+typedef struct turn_engine
+{
+    dispatcher *commands;   // 回复按 type、控制指令按 operation 分发
+    worker_pool *workers;   // 控制指令在这里执行
+    device_shadow *shadow;  // 去重和合并指令
+    metrics *metrics;       // 解析、分发、执行的耗时
+    scratch_arena *scratch; // 每条回复的临时内存
+    char *request_fields[2]; // 请求体末尾的附加字段，[0] 非流式，[1] 流式
+    uint64_t session;       // 正在处理的回复属于哪个会话（终端是 0），指令按会话和设备去重
+    turn_stats stats;
+} turn_engine;
+
+// 各个模块由调用方初始化，这里只记下来
+void turn_init(turn_engine *e, dispatcher *commands, worker_pool *workers, device_shadow *shadow, metrics *m,
+               scratch_arena *scratch);
+void turn_free(turn_engine *e);
+
+// 按 json_mode（1: json_object，2: 附带按 dev_ctrl.json 生成的回复 Schema）和 tool_mode 生成附加字段；
+// Schema 和工具都来自 commands，设备定义变了要重新调用
+void build_request_fields(turn_engine *e, int json_mode, int tool_mode);
+
+// 生成请求体：历史消息由 payload 构建器增量序列化，这里只补充本轮的附加字段。
+// 返回的字符串属于 payload，下一轮之前有效
+const char *create_json_payload(turn_engine *e, payload_builder *payload, History *history, int stream);
+
+// 按 "type" 分发解析好的回复；回复是数组时逐个分发，--json-schema 的 {"reply": ...} 先取出里面的回复
+void process_reply(turn_engine *e, cJSON *json);
+// --json-schema 的回复包在 {"reply": ...} 里，返回里面的回复；其他格式原样返回
+cJSON *reply_body(cJSON *json);
+
+// "控制指令" 的处理函数（userdata 是 turn_engine）：一条回复可以只带一条指令，也可以在 "commands" 数组里带多条
+void process_control_command(const cJSON *json, void *userdata);
+
+// 状态影子的回调（userdata 是 turn_engine）：合并窗口到期的指令单独作为一个批次执行
+void execute_held_command(cJSON *command, dispatch_handler handler, void *handler_userdata, double received_ms,
+                          void *userdata);
+
+// 处理一条非流式回复（content 位于接收缓冲区内，会被原地修改），记入历史；
+// cache_key_value 不为 0 时写入 cache
+void handle_reply(turn_engine *e, History *history, response_cache *cache, uint64_t cache_key_value,
+                  char *ai_response, size_t content_len);
+
+// 执行一条回复里的全部工具调用（tool_calls 是回复里的原始数组），每个调用一条 tool 消息记入历史，
+// 调用方再发一次请求把结果交给模型。返回调用数，出错返回 -1
+int run_tool_calls(turn_engine *e, History *history, const char *tool_calls, size_t len, int report);
+
+// 取走执行完的批次，report 时汇总成一条消息记入历史（history 可以为 NULL）；
+// keep 是调用方自己处理的批次，不汇总也不释放
+void collect_command_results(turn_engine *e, History *history, int report, const command_batch *keep);
+
+#endif
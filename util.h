@@ -0,0 +1,43 @@
+#ifndef UTIL_H
+#define UTIL_H
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+// 各模块共用的小函数，只有头文件，不用改编译命令
+
+// 单调时钟，毫秒
+static inline double now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+// FNV-1a 64 位哈希，可以分段累加：hash_bytes(hash_bytes(HASH_INIT, a, n), b, m)
+#define HASH_INIT 0xcbf29ce484222325ULL
+
+static inline uint64_t hash_bytes(uint64_t hash, const void *data, size_t len)
+{
+    const unsigned char *p = data;
+    for (size_t i = 0; i < len; i++)
+    {
+        hash ^= p[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+// 以 '\0' 结尾的字符串，用于按名字查表
+static inline uint64_t hash_string(const char *s)
+{
+    uint64_t hash = HASH_INIT;
+    for (const unsigned char *p = (const unsigned char *)s; *p; p++)
+    {
+        hash ^= *p;
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+#endif
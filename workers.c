@@ -0,0 +1,300 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include "workers.h"
+#include "util.h"
+
+static void queue_init(job_queue *queue)
+{
+    for (size_t i = 0; i < WORKER_QUEUE_SIZE; i++)
+    {
+        atomic_init(&queue->slots[i].sequence, i);
+    }
+    atomic_init(&queue->enqueue_pos, 0);
+    atomic_init(&queue->dequeue_pos, 0);
+    sem_init(&queue->items, 0, 0);
+}
+
+// 槽位的序号等于写入位置时可写，等于写入位置 + 1 时可读；满了返回 -1
+static int queue_push(job_queue *queue, const worker_job *job)
+{
+    size_t pos = atomic_load_explicit(&queue->enqueue_pos, memory_order_relaxed);
+    job_slot *slot;
+    for (;;)
+    {
+        slot = &queue->slots[pos & (WORKER_QUEUE_SIZE - 1)];
+        size_t sequence = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+        intptr_t diff = (intptr_t)sequence - (intptr_t)pos;
+        if (diff == 0)
+        {
+            if (atomic_compare_exchange_weak_explicit(&queue->enqueue_pos, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed))
+                break;
+        }
+        else if (diff < 0)
+        {
+            return -1;
+        }
+        else
+        {
+            pos = atomic_load_explicit(&queue->enqueue_pos, memory_order_relaxed);
+        }
+    }
+    slot->job = *job;
+    atomic_store_explicit(&slot->sequence, pos + 1, memory_order_release);
+    sem_post(&queue->items);
+    return 0;
+}
+
+static int queue_pop(job_queue *queue, worker_job *job)
+{
+    size_t pos = atomic_load_explicit(&queue->dequeue_pos, memory_order_relaxed);
+    job_slot *slot;
+    for (;;)
+    {
+        slot = &queue->slots[pos & (WORKER_QUEUE_SIZE - 1)];
+        size_t sequence = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+        intptr_t diff = (intptr_t)sequence - (intptr_t)(pos + 1);
+        if (diff == 0)
+        {
+            if (atomic_compare_exchange_weak_explicit(&queue->dequeue_pos, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed))
+                break;
+        }
+        else if (diff < 0)
+        {
+            return -1;
+        }
+        else
+        {
+            pos = atomic_load_explicit(&queue->dequeue_pos, memory_order_relaxed);
+        }
+    }
+    *job = slot->job;
+    atomic_store_explicit(&slot->sequence, pos + WORKER_QUEUE_SIZE, memory_order_release);
+    return 0;
+}
+
+static void finish_batch(worker_pool *pool, command_batch *batch)
+{
+    pthread_mutex_lock(&pool->lock);
+    batch->next = NULL;
+    if (pool->done_tail != NULL)
+        pool->done_tail->next = batch;
+    else
+        pool->done_head = batch;
+    pool->done_tail = batch;
+    pthread_mutex_unlock(&pool->lock);
+    uint64_t one = 1;
+    if (write(pool->notify_fd, &one, sizeof(one)) < 0)
+        perror("write eventfd");
+}
+
+static void run_job(worker_pool *pool, worker_job *job)
+{
+    double start = now_ms();
+    job->handler(job->command, job->userdata);
+    double end = now_ms();
+
+    command_result *result = &job->batch->results[job->index];
+    result->wait_ms = start - job->enqueued_ms;
+    result->run_ms = end - start;
+    cJSON_Delete(job->command);
+
+    unsigned long long wait_us = (unsigned long long)(result->wait_ms * 1000.0);
+    atomic_fetch_add(&pool->wait_us_total, wait_us);
+    unsigned long long max = atomic_load(&pool->wait_us_max);
+    while (wait_us > max && !atomic_compare_exchange_weak(&pool->wait_us_max, &max, wait_us))
+        ;
+
+    if (atomic_fetch_sub(&job->batch->pending, 1) == 1)
+    {
+        finish_batch(pool, job->batch);
+    }
+    atomic_fetch_add(&pool->completed, 1);
+    pthread_mutex_lock(&pool->lock);
+    pthread_cond_broadcast(&pool->idle);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+struct worker_arg
+{
+    worker_pool *pool;
+    job_queue *queue;
+};
+
+static void *worker_main(void *arg)
+{
+    worker_pool *pool = ((struct worker_arg *)arg)->pool;
+    job_queue *queue = ((struct worker_arg *)arg)->queue;
+    free(arg);
+
+    for (;;)
+    {
+        worker_job job;
+        sem_wait(&queue->items);
+        while (queue_pop(queue, &job) != 0)
+            sched_yield(); // 序号已经发布但写入还没完成，稍等
+        if (job.handler == NULL)
+            break;
+        run_job(pool, &job);
+    }
+    return NULL;
+}
+
+int worker_pool_init(worker_pool *pool, int threads, int ordered)
+{
+    memset(pool, 0, sizeof(*pool));
+    pool->threads = calloc(threads, sizeof(pthread_t));
+    pool->queues = calloc(threads, sizeof(job_queue));
+    if (pool->threads == NULL || pool->queues == NULL)
+    {
+        fprintf(stderr, "Memory allocation failed\n");
+        free(pool->threads);
+        free(pool->queues);
+        return -1;
+    }
+    pool->ordered = ordered;
+    pool->notify_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->idle, NULL);
+
+    for (int i = 0; i < threads; i++)
+    {
+        queue_init(&pool->queues[i]);
+        struct worker_arg *arg = malloc(sizeof(*arg));
+        if (arg == NULL)
+            break;
+        arg->pool = pool;
+        arg->queue = &pool->queues[i];
+        if (pthread_create(&pool->threads[i], NULL, worker_main, arg) != 0)
+        {
+            free(arg);
+            break;
+        }
+        pool->count++;
+    }
+    if (pool->count == 0)
+    {
+        fprintf(stderr, "Failed to start worker threads\n");
+        worker_pool_shutdown(pool);
+        return -1;
+    }
+    return 0;
+}
+
+void worker_pool_shutdown(worker_pool *pool)
+{
+    worker_job stop = {0};
+    for (int i = 0; i < pool->count; i++)
+    {
+        while (queue_push(&pool->queues[i], &stop) != 0)
+            sched_yield();
+    }
+    for (int i = 0; i < pool->count; i++)
+    {
+        pthread_join(pool->threads[i], NULL);
+    }
+    for (int i = 0; i < pool->count; i++)
+    {
+        sem_destroy(&pool->queues[i].items);
+    }
+    command_batch *batch;
+    while ((batch = worker_pool_completed(pool)) != NULL)
+    {
+        command_batch_free(batch);
+    }
+    pthread_cond_destroy(&pool->idle);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->threads);
+    free(pool->queues);
+    close(pool->notify_fd);
+    pool->notify_fd = -1;
+    pool->threads = NULL;
+    pool->queues = NULL;
+    pool->count = 0;
+}
+
+command_batch *command_batch_new(int count)
+{
+    command_batch *batch = calloc(1, sizeof(command_batch));
+    if (batch == NULL)
+    {
+        return NULL;
+    }
+    batch->results = calloc(count, sizeof(command_result));
+    if (batch->results == NULL)
+    {
+        free(batch);
+        return NULL;
+    }
+    batch->count = count;
+    atomic_init(&batch->pending, count);
+    return batch;
+}
+
+void command_batch_free(command_batch *batch)
+{
+    free(batch->results);
+    free(batch);
+}
+
+// 按设备名哈希决定进哪个队列
+static unsigned int device_queue(const worker_pool *pool, const char *operation)
+{
+    return (unsigned int)(hash_string(operation) % pool->count);
+}
+
+void worker_pool_submit(worker_pool *pool, command_batch *batch, int index,
+                        dispatch_handler handler, void *userdata, cJSON *command)
+{
+    const char *operation = cJSON_GetStringValue(cJSON_GetObjectItemCaseSensitive(command, "operation"));
+    char *parameters = cJSON_PrintUnformatted(cJSON_GetObjectItemCaseSensitive(command, "parameters"));
+    command_result *result = &batch->results[index];
+    snprintf(result->operation, sizeof(result->operation), "%s", operation != NULL ? operation : "");
+    snprintf(result->parameters, sizeof(result->parameters), "%s", parameters != NULL ? parameters : "");
+    cJSON_free(parameters);
+
+    unsigned int queue = pool->ordered && operation != NULL
+                             ? device_queue(pool, operation)
+                             : atomic_fetch_add(&pool->next_queue, 1) % pool->count;
+    worker_job job = {handler, userdata, command, batch, index, now_ms()};
+    atomic_fetch_add(&pool->submitted, 1);
+    while (queue_push(&pool->queues[queue], &job) != 0)
+    {
+        sched_yield(); // 队列满了，等线程腾出位置
+    }
+}
+
+command_batch *worker_pool_completed(worker_pool *pool)
+{
+    uint64_t count;
+    if (read(pool->notify_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+        perror("read eventfd");
+    pthread_mutex_lock(&pool->lock);
+    command_batch *batch = pool->done_head;
+    if (batch != NULL)
+    {
+        pool->done_head = batch->next;
+        if (pool->done_head == NULL)
+            pool->done_tail = NULL;
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return batch;
+}
+
+void worker_pool_wait(worker_pool *pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    while (atomic_load(&pool->completed) < atomic_load(&pool->submitted))
+    {
+        pthread_cond_wait(&pool->idle, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
@@ -0,0 +1,95 @@
+#ifndef WORKERS_H
+#define WORKERS_H
+#include <stddef.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <cJSON.h>
+#include "dispatch.h"
+
+// 控制指令的执行线程池
+// 固定数量的工作线程，每个线程有自己的有界无锁队列（多生产者多消费者的环形队列，按序号同步）。
+// 按设备排序时同一个 operation 总是进同一个队列，同一设备的指令按提交顺序执行；
+// 否则轮流分给各个线程。一次回复里的多条指令组成一个批次，全部执行完后放进完成列表，
+// 由聊天主循环取走，可以汇总成一条消息告诉模型；事件循环可以监视 notify_fd 及时得知。
+
+#define WORKER_QUEUE_SIZE 256 // 每个队列的容量，必须是 2 的幂
+
+typedef struct command_result
+{
+    char operation[64];
+    char parameters[192];
+    double wait_ms; // 排队时间
+    double run_ms;  // 执行时间
+} command_result;
+
+typedef struct command_batch
+{
+    atomic_int pending;
+    int count;
+    command_result *results;
+    struct command_batch *next;
+} command_batch;
+
+typedef struct worker_job
+{
+    dispatch_handler handler; // NULL 表示让线程退出
+    void *userdata;
+    cJSON *command;           // 由线程执行完后释放
+    command_batch *batch;
+    int index;
+    double enqueued_ms;
+} worker_job;
+
+typedef struct job_slot
+{
+    atomic_size_t sequence;
+    worker_job job;
+} job_slot;
+
+typedef struct job_queue
+{
+    job_slot slots[WORKER_QUEUE_SIZE];
+    atomic_size_t enqueue_pos;
+    atomic_size_t dequeue_pos;
+    sem_t items; // 空闲时线程在这里睡眠，不空转
+} job_queue;
+
+typedef struct worker_pool
+{
+    pthread_t *threads;
+    job_queue *queues;
+    int count;
+    int ordered;             // 同一设备的指令保持顺序
+    atomic_uint next_queue;  // 不排序时轮流分配
+
+    pthread_mutex_t lock;    // 保护完成列表
+    pthread_cond_t idle;
+    command_batch *done_head;
+    command_batch *done_tail;
+    int notify_fd;           // eventfd，有批次完成时可读，供事件循环监视
+
+    // 统计
+    atomic_ulong submitted;
+    atomic_ulong completed;
+    atomic_ullong wait_us_total;
+    atomic_ullong wait_us_max;
+} worker_pool;
+
+int worker_pool_init(worker_pool *pool, int threads, int ordered);
+// 等队列里已有的指令执行完再退出
+void worker_pool_shutdown(worker_pool *pool);
+
+command_batch *command_batch_new(int count);
+void command_batch_free(command_batch *batch);
+
+// 把 batch 的第 index 条指令交给线程池，command 的所有权转给线程池。队列满时等待
+void worker_pool_submit(worker_pool *pool, command_batch *batch, int index,
+                        dispatch_handler handler, void *userdata, cJSON *command);
+
+// 取出一个已全部执行完的批次，没有则返回 NULL
+command_batch *worker_pool_completed(worker_pool *pool);
+// 等待所有已提交的指令执行完
+void worker_pool_wait(worker_pool *pool);
+
+#endif